@@ -0,0 +1,433 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include "fat.h"
+#include "host_fat.h"
+#include "internal_flash.hpp"
+#include "msc_disk.h"
+#include "sim.h"
+#include "storage_backend.h"
+#include "usb_host.h"
+
+/**
+ * Projects how long the internal flash lasts under a given use of the
+ * drive. The firmware's storage path runs against the emulated chip, as
+ * in msc_bench, with a desktop (see host_fat.h) copying files on and
+ * deleting the oldest ones to make room, day after simulated day:
+ *
+ *   endurance
+ *   endurance --days 1825 --files 50 --size 4096-1048576 --sessions 4 --eject 0.25
+ *   endurance --csv wear.csv
+ *
+ * --days       how long to simulate
+ * --files      files copied onto the drive per day
+ * --size       range of file sizes, log-uniform, so small files are as
+ *              common as large ones per doubling
+ * --sessions   times per day the drive is plugged in; the day's files are
+ *              split between them
+ * --idle       minutes it is left plugged in after the copies, during
+ *              which the firmware's idle housekeeping runs
+ * --eject      fraction of sessions that end with an eject rather than
+ *              the cable being pulled
+ * --fill       the oldest files are deleted to keep the volume below this
+ *              fraction of its clusters
+ * --windows    copy as Explorer does instead of Linux cp
+ * --budget     erase cycles a sector is rated for (100k for the W25Q16JV)
+ * --csv        write every sector's count and rate to a file as well
+ *
+ * Only the time the drive is plugged in is simulated, so a year takes
+ * seconds. The erases of each 4kb sector are counted (sim::FlashStats)
+ * and reported by what the sector holds: the Fat16::Layout sections,
+ * then the snapshot spares and map log, then the integrity log. Labels
+ * assume logical and physical units line up, which they do as long as no
+ * snapshot is taken. The wear rate is taken from the second half of the
+ * run, once the volume has filled up and deletes are part of every day,
+ * and extrapolated to the budget.
+ */
+
+static constexpr double SECONDS_PER_DAY = 24 * 60 * 60;
+static constexpr double DAYS_PER_MONTH = 365.25 / 12;
+
+// How often main.cpp's idle hooks run once the drive is idle, in seconds
+static constexpr double SCRUB_INTERVAL = 60;
+static constexpr double MAINTENANCE_DELAY = 2;
+
+// Heat map shades, from no erases to the most any sector had
+static const char SHADES[] = " .:-=+*#%@";
+static constexpr uint32_t MAP_WIDTH = 64;
+
+struct Workload {
+	uint32_t days = 365;
+	uint32_t files = 20;
+	uint32_t min_size = 4 * 1024;
+	uint32_t max_size = 256 * 1024;
+	uint32_t sessions = 2;
+	uint32_t idle_minutes = 30;
+	double eject = 1.0;
+	double fill = 0.75;
+	HostFat::Style style = HostFat::LINUX;
+	uint32_t budget = 100000;
+	uint32_t seed = 1;
+};
+
+/**
+ * What a run of sectors of the partition holds.
+ */
+struct Region {
+	const char* name;
+	uint32_t first;  // Sector of the partition
+	uint32_t count;
+};
+
+struct Wear {
+	std::vector<uint64_t> erases;  // Per sector of the partition, since formatting
+	std::vector<double> per_day;   // Over the second half of the run
+	uint32_t copies = 0;
+	uint32_t failed_copies = 0;
+	uint32_t deleted = 0;
+	uint32_t ejects = 0;
+	uint32_t pulls = 0;
+	uint64_t bytes_copied = 0;
+	uint64_t bytes_programmed = 0; // Since formatting
+	uint32_t opened = 0;          // IntegrityDevice open records
+	uint32_t deferred_opens = 0;  // ... that did not cost a program of their own
+};
+
+static std::vector<Region> Regions(const Fat16::Layout& layout) {
+	uint32_t unit = FLASH_SECTOR_SIZE;
+	uint32_t volume = storage_snapshots().GetGeometry().size / unit;
+	uint32_t integrity = storage_integrity().GetGeometry().size / unit;
+
+	std::vector<Region> regions = {
+		{ "boot", layout.boot / unit, (layout.fat - layout.boot) / unit },
+		{ "fat", layout.fat / unit, (layout.root - layout.fat) / unit },
+		{ "root", layout.root / unit, (layout.journal - layout.root) / unit },
+		{ "journal", layout.journal / unit, layout.journal_size / unit },
+		{ "data", layout.data / unit, volume - layout.data / unit },
+		{ "snapshot", volume, integrity - volume },
+		{ "integrity", integrity, InternalFlash::PARTITION_SECTORS - integrity }
+	};
+
+	regions.erase(std::remove_if(regions.begin(), regions.end(), [](const Region& r) {
+		return r.count == 0;
+	}), regions.end());
+	return regions;
+}
+
+static const Region& RegionOf(const std::vector<Region>& regions, uint32_t sector) {
+	for (const Region& r : regions) {
+		if (sector >= r.first && sector < r.first + r.count)
+			return r;
+	}
+	return regions.back();
+}
+
+/**
+ * Erases per sector of the partition so far.
+ */
+static std::vector<uint64_t> PartitionErases() {
+	const std::vector<uint32_t>& all = sim::Stats().sector_erases;
+	uint32_t first = InternalFlash::PARTITION_START / FLASH_SECTOR_SIZE;
+	return std::vector<uint64_t>(all.begin() + first, all.begin() + first + InternalFlash::PARTITION_SECTORS);
+}
+
+/**
+ * The drive sits plugged in and untouched for `seconds`: staged writes are
+ * committed, then the idle hooks main.cpp registers run on their schedule
+ * once the host has been quiet long enough.
+ */
+static void Unattended(UsbHost& usb, double seconds) {
+	double end = sim::Now() + seconds * 1e6;
+	usb.Idle();
+
+	sim::Advance(MAINTENANCE_DELAY * 1e6);
+	while (msc_disk_maintenance());
+	while (msc_disk_check());
+
+	while (sim::Now() + SCRUB_INTERVAL * 1e6 <= end) {
+		sim::Advance(SCRUB_INTERVAL * 1e6);
+		msc_disk_scrub();
+	}
+
+	if (sim::Now() < end)
+		sim::Advance(end - sim::Now());
+}
+
+static Wear Run(const Workload& w, std::vector<Region>& regions) {
+	sim::Reset();
+	UsbHost usb;
+	usb.PowerOn(true);
+	usb.Idle();
+
+	Fat16* fs = msc_disk_begin_local_read(0, 0);
+	regions = Regions(fs->GetLayout());
+	uint32_t capacity = (uint32_t) ((fs->GetLastCluster() - Fat16::FIRST_CLUSTER + 1) * w.fill);
+
+	// Formatting is not part of the workload
+	std::vector<uint64_t> formatted = PartitionErases();
+	uint64_t formatted_bytes = sim::Stats().bytes_programmed;
+	IntegrityDevice::Stats integrity = storage_integrity().GetStats();
+	std::vector<uint64_t> halfway;
+
+	std::mt19937 random(w.seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	double log_min = log((double) w.min_size);
+	double log_max = log((double) std::max(w.max_size, w.min_size));
+
+	struct File {
+		char name[9];
+		uint32_t clusters;
+	};
+	std::deque<File> files;
+	uint32_t used = 0;
+	uint32_t next_name = 0;
+
+	Wear wear;
+	bool powered = true;
+	for (uint32_t day = 0; day < w.days; day++) {
+		if (day == w.days / 2)
+			halfway = PartitionErases();
+
+		for (uint32_t session = 0; session < w.sessions; session++) {
+			double session_end = sim::Now() + SECONDS_PER_DAY / w.sessions * 1e6;
+			if (!powered)
+				usb.PowerOn(false);
+			powered = true;
+
+			HostFat host(usb, w.style);
+			host.Mount();
+
+			uint32_t count = w.files * (session + 1) / w.sessions - w.files * session / w.sessions;
+			for (uint32_t i = 0; i < count; i++) {
+				uint32_t size = (uint32_t) exp(log_min + (log_max - log_min) * uniform(random));
+				uint32_t clusters = std::max<uint32_t>(1, (size + HostFat::CLUSTER_BYTES - 1) / HostFat::CLUSTER_BYTES);
+
+				// One entry is the volume label
+				while (!files.empty() && (used + clusters > capacity || files.size() + 2 > HostFat::ROOT_ENTRIES)) {
+					host.DeleteFile(files.front().name, "BIN");
+					used -= files.front().clusters;
+					files.pop_front();
+					wear.deleted++;
+				}
+
+				File file;
+				snprintf(file.name, sizeof(file.name), "F%07u", next_name++ % 10000000);
+				file.clusters = clusters;
+				if (clusters > capacity || !host.CopyFile(file.name, "BIN", size, next_name)) {
+					wear.failed_copies++;
+					continue;
+				}
+
+				files.push_back(file);
+				used += clusters;
+				wear.copies++;
+				wear.bytes_copied += size;
+			}
+
+			host.Sync();
+			Unattended(usb, w.idle_minutes * 60.0);
+
+			if (uniform(random) < w.eject) {
+				usb.Eject();
+				wear.ejects++;
+			}
+			else {
+				wear.pulls++;
+			}
+			powered = false;
+
+			if (sim::Now() < session_end)
+				sim::Advance(session_end - sim::Now());
+		}
+
+		if ((day + 1) % 365 == 0 || day + 1 == w.days) {
+			std::vector<uint64_t> now = PartitionErases();
+			uint32_t worst = 0;
+			for (uint32_t s = 0; s < now.size(); s++) {
+				if (now[s] - formatted[s] > now[worst] - formatted[worst])
+					worst = s;
+			}
+			printf("day %5u: worst sector %3u (%s) %llu erases, %llu in all\n", day + 1, worst,
+					RegionOf(regions, worst).name, (unsigned long long) (now[worst] - formatted[worst]),
+					(unsigned long long) (sim::Stats().sectors_erased));
+		}
+	}
+
+	wear.bytes_programmed = sim::Stats().bytes_programmed - formatted_bytes;
+	wear.opened = storage_integrity().GetStats().opened - integrity.opened;
+	wear.deferred_opens = storage_integrity().GetStats().deferred - integrity.deferred;
+
+	std::vector<uint64_t> end = PartitionErases();
+	if (halfway.empty())
+		halfway = formatted;
+
+	double half_days = w.days - w.days / 2;
+	for (uint32_t s = 0; s < end.size(); s++) {
+		wear.erases.push_back(end[s] - formatted[s]);
+		wear.per_day.push_back((end[s] - halfway[s]) / half_days);
+	}
+	return wear;
+}
+
+/**
+ * Days until `sector` reaches the budget, from the start of the run, or
+ * infinity if it is not being worn.
+ */
+static double Lifetime(const Workload& w, const Wear& wear, uint32_t sector) {
+	if (wear.per_day[sector] <= 0)
+		return INFINITY;
+
+	double left = (double) w.budget - (double) wear.erases[sector];
+	return w.days + left / wear.per_day[sector];
+}
+
+static std::string FormatLifetime(double days) {
+	char text[64];
+	if (isinf(days))
+		snprintf(text, sizeof(text), "never");
+	else
+		snprintf(text, sizeof(text), "%.1f months (%.1f years)", days / DAYS_PER_MONTH, days / 365.25);
+	return text;
+}
+
+/**
+ * One row of shades per region, MAP_WIDTH sectors to a line, on a log
+ * scale so the data region's few erases still show next to the FAT's.
+ */
+static void PrintHeatMap(const std::vector<Region>& regions, const Wear& wear) {
+	uint64_t most = *std::max_element(wear.erases.begin(), wear.erases.end());
+	printf("\nerases per 4kb sector, '%c' none to '%c' %llu:\n", SHADES[0], SHADES[sizeof(SHADES) - 2],
+			(unsigned long long) most);
+
+	for (const Region& r : regions) {
+		for (uint32_t line = 0; line < r.count; line += MAP_WIDTH) {
+			std::string shades;
+			for (uint32_t s = r.first + line; s < r.first + std::min(r.count, line + MAP_WIDTH); s++) {
+				uint32_t shade = 0;
+				if (wear.erases[s] > 0 && most > 0)
+					shade = 1 + (uint32_t) ((sizeof(SHADES) - 3) * log(1.0 + wear.erases[s]) / log(1.0 + most));
+				shades += SHADES[shade];
+			}
+			printf("%-10s %3u |%s|\n", line == 0 ? r.name : "", r.first + line, shades.c_str());
+		}
+	}
+}
+
+static void PrintRegions(const Workload& w, const std::vector<Region>& regions, const Wear& wear) {
+	printf("\n%-10s %7s %10s %10s %10s  %s\n", "region", "sectors", "erases", "worst", "worst/day", "worst reaches budget");
+	for (const Region& r : regions) {
+		uint64_t total = 0;
+		uint32_t worst = r.first;
+		for (uint32_t s = r.first; s < r.first + r.count; s++) {
+			total += wear.erases[s];
+			if (wear.per_day[s] > wear.per_day[worst] || (wear.per_day[s] == wear.per_day[worst] && wear.erases[s] > wear.erases[worst]))
+				worst = s;
+		}
+		printf("%-10s %7u %10llu %10llu %10.2f  %s\n", r.name, r.count, (unsigned long long) total,
+				(unsigned long long) wear.erases[worst], wear.per_day[worst], FormatLifetime(Lifetime(w, wear, worst)).c_str());
+	}
+}
+
+static bool WriteCsv(const std::string& path, const std::vector<Region>& regions, const Wear& wear) {
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	file << "sector,flash_offset,region,erases,erases_per_day\n";
+	for (uint32_t s = 0; s < wear.erases.size(); s++) {
+		char line[128];
+		snprintf(line, sizeof(line), "%u,0x%06x,%s,%llu,%.4f\n", s, InternalFlash::PARTITION_START + s * FLASH_SECTOR_SIZE,
+				RegionOf(regions, s).name, (unsigned long long) wear.erases[s], wear.per_day[s]);
+		file << line;
+	}
+	return bool(file);
+}
+
+static bool ParseSize(const char* text, Workload& w) {
+	char* end;
+	w.min_size = (uint32_t) strtoul(text, &end, 0);
+	w.max_size = *end == '-' ? (uint32_t) strtoul(end + 1, &end, 0) : w.min_size;
+	return *end == 0 && w.min_size > 0 && w.max_size >= w.min_size;
+}
+
+int main(int argc, char** argv) {
+	Workload w;
+	std::string csv;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool ok = true;
+		if (arg == "--days" && i + 1 < argc)
+			w.days = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--files" && i + 1 < argc)
+			w.files = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--size" && i + 1 < argc)
+			ok = ParseSize(argv[++i], w);
+		else if (arg == "--sessions" && i + 1 < argc)
+			w.sessions = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--idle" && i + 1 < argc)
+			w.idle_minutes = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--eject" && i + 1 < argc)
+			w.eject = strtod(argv[++i], nullptr);
+		else if (arg == "--fill" && i + 1 < argc)
+			w.fill = strtod(argv[++i], nullptr);
+		else if (arg == "--windows")
+			w.style = HostFat::WINDOWS;
+		else if (arg == "--budget" && i + 1 < argc)
+			w.budget = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--seed" && i + 1 < argc)
+			w.seed = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--csv" && i + 1 < argc)
+			csv = argv[++i];
+		else
+			ok = false;
+
+		if (!ok || w.days == 0 || w.sessions == 0 || w.fill <= 0 || w.fill > 1) {
+			fprintf(stderr, "usage: %s [--days N] [--files N] [--size MIN-MAX] [--sessions N] [--idle MINUTES] [--eject FRACTION] [--fill FRACTION] [--windows] [--budget CYCLES] [--seed N] [--csv FILE]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	printf("%u days of %u files a day, %u-%u bytes, over %u sessions with %u minutes idle, %.0f%% ejected, %s\n",
+			w.days, w.files, w.min_size, w.max_size, w.sessions, w.idle_minutes, w.eject * 100,
+			w.style == HostFat::LINUX ? "Linux cp" : "Explorer");
+
+	std::vector<Region> regions;
+	Wear wear = Run(w, regions);
+
+	PrintHeatMap(regions, wear);
+	PrintRegions(w, regions, wear);
+
+	uint32_t worst = 0;
+	for (uint32_t s = 0; s < wear.per_day.size(); s++) {
+		if (wear.per_day[s] > wear.per_day[worst])
+			worst = s;
+	}
+
+	// What keeping units open across partial writes costs, see integrity_device.h
+	uint32_t open_programs = wear.opened - wear.deferred_opens;
+	uint32_t page = storage_integrity().GetGeometry().program_size;
+	printf("\nintegrity: %u open records, %u rode on a page programmed anyway, %u cost a %u byte program (%.1f%% of the %.1f mb programmed)\n",
+			wear.opened, wear.deferred_opens, open_programs, page,
+			wear.bytes_programmed > 0 ? 100.0 * open_programs * page / wear.bytes_programmed : 0.0,
+			wear.bytes_programmed / (1024.0 * 1024.0));
+	printf("copied %.1f mb in %u files (%u failed), deleted %u; %u ejects, %u pulls\n",
+			wear.bytes_copied / (1024.0 * 1024.0), wear.copies, wear.failed_copies, wear.deleted, wear.ejects, wear.pulls);
+	printf("worst sector %u (%s, flash 0x%06x): %llu erases, %.2f a day, budget of %u reached after %s\n",
+			worst, RegionOf(regions, worst).name, InternalFlash::PARTITION_START + worst * FLASH_SECTOR_SIZE,
+			(unsigned long long) wear.erases[worst], wear.per_day[worst], w.budget,
+			FormatLifetime(Lifetime(w, wear, worst)).c_str());
+
+	if (!csv.empty() && !WriteCsv(csv, regions, wear)) {
+		fprintf(stderr, "Could not write %s\n", csv.c_str());
+		return 1;
+	}
+	return 0;
+}
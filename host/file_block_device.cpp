@@ -0,0 +1,83 @@
+#include "file_block_device.h"
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "sim.h"
+
+FileBlockDevice::FileBlockDevice(const std::string& path, uint32_t size, bool nor)
+	: path(path), size(size), nor(nor) {}
+
+FileBlockDevice::~FileBlockDevice() {
+	if (file)
+		fclose(file);
+}
+
+bool FileBlockDevice::Init() {
+	if (file)
+		return true;
+
+	file = fopen(path.c_str(), "r+b");
+	bool created = file == nullptr;
+	if (created)
+		file = fopen(path.c_str(), "w+b");
+	if (!file)
+		return false;
+
+	if (ftruncate(fileno(file), size) != 0)
+		return false;
+
+	// A new flash part comes erased
+	if (created && nor)
+		return Erase(0, size);
+
+	return true;
+}
+
+BlockDevice::Geometry FileBlockDevice::GetGeometry() const {
+	if (nor)
+		return { size, 4096, 256, true };
+
+	return { size, 512, 512, false };
+}
+
+bool FileBlockDevice::Read(uint32_t addr, void* buffer, uint32_t bufsize) {
+	if (!file || addr + bufsize > size)
+		return false;
+
+	return fseek(file, addr, SEEK_SET) == 0 && fread(buffer, 1, bufsize, file) == bufsize;
+}
+
+bool FileBlockDevice::Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) {
+	if (!file || addr + bufsize > size)
+		return false;
+
+	std::vector<uint8_t> data(buffer, buffer + bufsize);
+	if (nor) {
+		std::vector<uint8_t> current(bufsize);
+		if (!Read(addr, current.data(), bufsize))
+			return false;
+		for (uint32_t i = 0; i < bufsize; i++)
+			data[i] &= current[i];
+	}
+
+	sim::Stats().program_ops++;
+	sim::Stats().bytes_programmed += bufsize;
+	return fseek(file, addr, SEEK_SET) == 0 && fwrite(data.data(), 1, bufsize, file) == bufsize;
+}
+
+bool FileBlockDevice::Erase(uint32_t addr, uint32_t bytes) {
+	if (!nor)
+		return true;
+
+	if (!file || addr + bytes > size)
+		return false;
+
+	std::vector<uint8_t> blank(bytes, 0xFF);
+	sim::Stats().erase_ops++;
+	sim::Stats().sectors_erased += bytes / 4096;
+	return fseek(file, addr, SEEK_SET) == 0 && fwrite(blank.data(), 1, bytes, file) == bytes;
+}
+
+bool FileBlockDevice::Flush() {
+	return file && fflush(file) == 0 && fsync(fileno(file)) == 0;
+}
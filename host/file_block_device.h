@@ -0,0 +1,37 @@
+#pragma once
+#include <stdio.h>
+#include <string>
+#include "block_device.h"
+
+/**
+ * Volume stored in a file on the PC, for host testing. A file of 128mb or
+ * more gets the 1:1 layout and is an ordinary FAT16 image that can be
+ * inspected with mtools or a loop mount.
+ *
+ * By default it behaves like an SD card and overwrites in place. With
+ * `nor` set it behaves like flash instead: 4kb erase units, and
+ * programming can only clear bits.
+ */
+class FileBlockDevice : public BlockDevice {
+public:
+	FileBlockDevice(const std::string& path, uint32_t size, bool nor = false);
+	~FileBlockDevice() override;
+
+	bool Init() override;
+
+	Geometry GetGeometry() const override;
+
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override;
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override;
+
+	bool Erase(uint32_t addr, uint32_t bytes) override;
+
+	bool Flush() override;
+
+private:
+	std::string path;
+	uint32_t size;
+	bool nor;
+	FILE* file = nullptr;
+};
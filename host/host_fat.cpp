@@ -0,0 +1,222 @@
+#include "host_fat.h"
+#include <string.h>
+#include <algorithm>
+
+// Largest single request each OS issues for file data, in blocks.
+static constexpr uint32_t LINUX_MAX_BLOCKS = 240;
+static constexpr uint32_t WINDOWS_MAX_BLOCKS = 128;
+
+HostFat::HostFat(UsbHost& usb, Style style) : usb(usb), style(style) {
+	fat.assign(FAT_SECTORS * trace::BLOCK_SIZE / 2, 0);
+	root.assign(ROOT_ENTRIES, fat::DirectoryEntry());
+	memset(root.data(), 0, root.size() * sizeof(fat::DirectoryEntry));
+	max_cluster = (uint16_t) std::min<uint32_t>(fat.size() - 1, 0xFFEF);
+	clock = 0;
+}
+
+void HostFat::Format() {
+	uint8_t block[trace::BLOCK_SIZE];
+
+	// Keep the device's boot sector, mkfs only rewrites it.
+	usb.Read(0, 1, block);
+	WriteBlocks(0, 1, block);
+
+	std::fill(fat.begin(), fat.end(), 0);
+	fat[0] = 0xFFF8;
+	fat[1] = 0xFFFF;
+
+	std::vector<uint8_t> table(FAT_SECTORS * trace::BLOCK_SIZE);
+	memcpy(table.data(), fat.data(), table.size());
+	WriteBlocks(Fat16::INDEX_FAT_TABLE_1_START, FAT_SECTORS, table.data());
+	WriteBlocks(Fat16::INDEX_FAT_TABLE_2_START, FAT_SECTORS, table.data());
+
+	memset(root.data(), 0, root.size() * sizeof(fat::DirectoryEntry));
+	fat::DirectoryEntryBuilder builder;
+	builder.SetName("PICOWREM", "OTE");
+	builder.SetAttribute(builder.VOLUME_LABEL);
+	builder.SetCreateTime(0, 0, 0, 0);
+	builder.SetCreateDate(1, 1, 2024);
+	builder.SetLastAccessDate(1, 1, 2024);
+	builder.SetUpdateTime(0, 0, 0);
+	builder.SetUpdateDate(1, 1, 2024);
+	builder.SetStartCluster(0);
+	builder.SetFileSize(0);
+	root[0] = builder.Build();
+
+	WriteBlocks(Fat16::INDEX_ROOT_DIRECTORY, ROOT_SECTORS, (const uint8_t*) root.data());
+	dirty_fat.clear();
+	dirty_root.clear();
+}
+
+bool HostFat::Mount() {
+	uint8_t boot[trace::BLOCK_SIZE];
+	if (!usb.Read(0, 1, boot))
+		return false;
+
+	if (!usb.Read(Fat16::INDEX_FAT_TABLE_1_START, FAT_SECTORS, (uint8_t*) fat.data()))
+		return false;
+
+	return usb.Read(Fat16::INDEX_ROOT_DIRECTORY, ROOT_SECTORS, (uint8_t*) root.data());
+}
+
+bool HostFat::CopyFile(const char* name, const char* ext, uint32_t size, uint32_t seed) {
+	uint32_t slot = 0;
+	while (slot < root.size() && root[slot].name[0] != 0 && (uint8_t) root[slot].name[0] != 0xE5)
+		slot++;
+	if (slot == root.size())
+		return false;
+
+	uint32_t clusters = std::max<uint32_t>(1, (size + CLUSTER_BYTES - 1) / CLUSTER_BYTES);
+	std::vector<uint16_t> chain;
+	for (uint16_t c = 2; c <= max_cluster && chain.size() < clusters; c++) {
+		if (fat[c] == 0)
+			chain.push_back(c);
+	}
+	if (chain.size() < clusters)
+		return false;
+
+	for (size_t i = 0; i < chain.size(); i++) {
+		fat[chain[i]] = i + 1 < chain.size() ? chain[i + 1] : 0xFFFF;
+		MarkFatDirty(chain[i]);
+	}
+
+	clock++;
+	fat::DirectoryEntryBuilder builder;
+	builder.SetName(name, ext);
+	builder.SetAttribute(builder.ARCHIVE);
+	builder.SetCreateTime(12, clock / 60 % 60, clock % 60 * 2, 0);
+	builder.SetCreateDate(6, 1, 2024);
+	builder.SetLastAccessDate(6, 1, 2024);
+	builder.SetUpdateTime(12, clock / 60 % 60, clock % 60 * 2);
+	builder.SetUpdateDate(6, 1, 2024);
+	builder.SetStartCluster(0);
+	builder.SetFileSize(0);
+	uint32_t root_sector = slot * sizeof(fat::DirectoryEntry) / trace::BLOCK_SIZE;
+
+	if (style == LINUX) {
+		WriteClusters(chain, size, seed, LINUX_MAX_BLOCKS);
+
+		root[slot] = builder.Build();
+		root[slot].start_cluster = chain[0];
+		root[slot].size = size;
+		dirty_root.insert(root_sector);
+		return true;
+	}
+
+	// Explorer: create the entry, claim the clusters, point the entry at
+	// them, stream the data, then record the final size.
+	root[slot] = builder.Build();
+	WriteRootSector(root_sector);
+
+	for (uint32_t sector : dirty_fat)
+		WriteFatSector(sector);
+	dirty_fat.clear();
+
+	root[slot].start_cluster = chain[0];
+	WriteRootSector(root_sector);
+
+	WriteClusters(chain, size, seed, WINDOWS_MAX_BLOCKS);
+
+	root[slot].size = size;
+	WriteRootSector(root_sector);
+
+	// The access date is bumped by the next read of the file (thumbnailing,
+	// AV scan), which lands as one more directory write.
+	builder.SetLastAccessDate(6, 2, 2024);
+	root[slot].last_access_date = builder.Build().last_access_date;
+	WriteRootSector(root_sector);
+	return true;
+}
+
+bool HostFat::DeleteFile(const char* name, const char* ext) {
+	uint32_t slot = 0;
+	while (slot < root.size() && root[slot].name[0] != 0 &&
+			(memcmp(root[slot].name, name, 8) != 0 || memcmp(root[slot].extension, ext, 3) != 0))
+		slot++;
+	if (slot == root.size() || root[slot].name[0] == 0)
+		return false;
+
+	uint16_t cluster = root[slot].start_cluster;
+	while (cluster >= 2 && cluster <= max_cluster) {
+		uint16_t next = fat[cluster];
+		fat[cluster] = 0;
+		MarkFatDirty(cluster);
+		cluster = next;
+	}
+
+	root[slot].name[0] = (char) 0xE5;
+	uint32_t root_sector = slot * sizeof(fat::DirectoryEntry) / trace::BLOCK_SIZE;
+	dirty_root.insert(root_sector);
+
+	if (style == WINDOWS)
+		Sync();
+	return true;
+}
+
+void HostFat::Sync() {
+	for (uint32_t sector : dirty_fat)
+		WriteFatSector(sector);
+	for (uint32_t sector : dirty_root)
+		WriteRootSector(sector);
+
+	dirty_fat.clear();
+	dirty_root.clear();
+}
+
+uint32_t HostFat::UsedClusters() const {
+	uint32_t used = 0;
+	for (uint16_t c = 2; c <= max_cluster; c++)
+		used += fat[c] != 0;
+	return used;
+}
+
+bool HostFat::WriteBlocks(uint32_t lba, uint32_t blocks, const uint8_t* data, const std::string& payload) {
+	return usb.Write(lba, blocks, data, payload);
+}
+
+/**
+ * FAT sectors go out one at a time to each copy, as both OSes do.
+ */
+void HostFat::WriteFatSector(uint32_t sector) {
+	const uint8_t* data = (const uint8_t*) fat.data() + sector * trace::BLOCK_SIZE;
+	WriteBlocks(Fat16::INDEX_FAT_TABLE_1_START + sector, 1, data);
+	WriteBlocks(Fat16::INDEX_FAT_TABLE_2_START + sector, 1, data);
+}
+
+void HostFat::WriteRootSector(uint32_t sector) {
+	const uint8_t* data = (const uint8_t*) root.data() + sector * trace::BLOCK_SIZE;
+	WriteBlocks(Fat16::INDEX_ROOT_DIRECTORY + sector, 1, data);
+}
+
+/**
+ * Write the file's clusters, merging runs of consecutive clusters into
+ * requests of at most `max_blocks`. The tail of the last cluster is zero.
+ */
+void HostFat::WriteClusters(const std::vector<uint16_t>& chain, uint32_t size, uint32_t seed, uint32_t max_blocks) {
+	size_t i = 0;
+	while (i < chain.size()) {
+		size_t run = 1;
+		while (i + run < chain.size() && chain[i + run] == chain[i] + run &&
+				(run + 1) * Fat16::DISK_CLUSTER_SIZE <= max_blocks)
+			run++;
+
+		std::vector<uint8_t> data(run * CLUSTER_BYTES, 0);
+		std::string payload;
+		for (size_t j = 0; j < run; j++) {
+			uint32_t offset = (i + j) * CLUSTER_BYTES;
+			uint32_t used = offset < size ? std::min(size - offset, CLUSTER_BYTES) : 0;
+			uint32_t cluster_seed = seed * 4099 + (uint32_t) (i + j) + 1;
+
+			trace::PrngFill(data.data() + j * CLUSTER_BYTES, used, cluster_seed);
+			if (!payload.empty())
+				payload += " ";
+			if (used)
+				payload += trace::EncodePrng(used, cluster_seed);
+			if (used < CLUSTER_BYTES)
+				payload += std::string(used ? " " : "") + "f" + std::to_string(CLUSTER_BYTES - used) + ":00";
+		}
+
+		WriteBlocks(ClusterToLBA(chain[i]), run * Fat16::DISK_CLUSTER_SIZE, data.data(), payload);
+		i += run;
+	}
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <stdint.h>
+#include <set>
+#include <vector>
+#include "fat.h"
+#include "fat_standard.hpp"
+#include "usb_host.h"
+
+/**
+ * A small model of what a desktop FAT16 driver sends down the wire, used
+ * to generate the benchmark traces: LINUX writes data in large requests
+ * and the FAT and directory on sync, WINDOWS writes the directory entry
+ * first and again with the final size. The layout is the device's own.
+ */
+class HostFat {
+public:
+	enum Style {
+		LINUX,
+		WINDOWS
+	};
+
+	static constexpr uint32_t FAT_SECTORS = Fat16::INDEX_FAT_TABLE_2_START - Fat16::INDEX_FAT_TABLE_1_START;
+	static constexpr uint32_t ROOT_SECTORS = Fat16::INDEX_DATA_STARTS - Fat16::INDEX_ROOT_DIRECTORY;
+	static constexpr uint32_t ROOT_ENTRIES = ROOT_SECTORS * trace::BLOCK_SIZE / sizeof(fat::DirectoryEntry);
+	static constexpr uint32_t CLUSTER_BYTES = Fat16::DISK_CLUSTER_SIZE * trace::BLOCK_SIZE;
+
+public:
+	HostFat(UsbHost& usb, Style style);
+
+	/**
+	 * mkfs.vfat -F 16 with the device's geometry: boot sector, both FATs
+	 * and the root directory are written out in full.
+	 */
+	void Format();
+
+	/**
+	 * Read the boot sector, FAT #1 and the root directory.
+	 */
+	bool Mount();
+
+	/**
+	 * Create a file `name`.`ext` (8.3, space padded) with `size` bytes of
+	 * pseudo-random content derived from `seed`.
+	 */
+	bool CopyFile(const char* name, const char* ext, uint32_t size, uint32_t seed);
+
+	/**
+	 * Delete the file `name`.`ext`: its entry is marked deleted and its
+	 * clusters freed, written out right away (Windows) or on Sync()
+	 * (Linux). Returns false if there is no such file.
+	 */
+	bool DeleteFile(const char* name, const char* ext);
+
+	/**
+	 * Flush metadata the OS is still holding (Linux only).
+	 */
+	void Sync();
+
+	/**
+	 * Number of data clusters currently in use.
+	 */
+	uint32_t UsedClusters() const;
+
+private:
+	static uint32_t ClusterToLBA(uint16_t cluster) {
+		return Fat16::INDEX_DATA_STARTS + (cluster - 2) * Fat16::DISK_CLUSTER_SIZE;
+	}
+
+	bool WriteBlocks(uint32_t lba, uint32_t blocks, const uint8_t* data, const std::string& payload = "");
+
+	void WriteFatSector(uint32_t sector);
+
+	void WriteRootSector(uint32_t sector);
+
+	void WriteClusters(const std::vector<uint16_t>& chain, uint32_t size, uint32_t seed, uint32_t max_blocks);
+
+	void MarkFatDirty(uint16_t cluster) {
+		dirty_fat.insert(cluster * 2 / trace::BLOCK_SIZE);
+	}
+
+private:
+	UsbHost& usb;
+	Style style;
+	std::vector<uint16_t> fat;
+	std::vector<fat::DirectoryEntry> root;
+	std::set<uint32_t> dirty_fat;
+	std::set<uint32_t> dirty_root;
+	uint16_t max_cluster;
+	uint16_t clock;
+};
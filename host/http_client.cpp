@@ -0,0 +1,98 @@
+#include "http_client.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "sim.h"
+#include "bulk_ingest.h"
+#include "http_server.h"
+#include "msc_disk.h"
+
+// Passes of the main loop with nothing to do before the client gives up,
+// like a browser timing out
+static constexpr int MAX_IDLE_PASSES = 1000;
+
+HttpClient::HttpClient() {
+	http_server_begin();
+}
+
+bool HttpClient::Request(const std::string& method, const std::string& path, const std::string& range, Response& response) {
+	response = Response();
+
+	std::string request = method + " " + path + " HTTP/1.1\r\nHost: pico\r\n";
+	if (!range.empty())
+		request += "Range: " + range + "\r\n";
+	request += "Connection: close\r\n\r\n";
+
+	counters.commands++;
+	link_us = std::max(link_us, (double) sim::Now());
+	Transfer(sim::Cost().wifi_request_us);
+	WaitForLink();
+
+	int connection = sim::TcpConnect(HTTP_SERVER_PORT);
+	if (connection < 0) {
+		counters.failed++;
+		return false;
+	}
+	sim::TcpSend(connection, request.data(), request.size());
+
+	std::vector<uint8_t> raw;
+	int idle = 0;
+	while (!sim::TcpClosed(connection)) {
+		size_t got = sim::TcpReceive(connection, raw);
+		if (got == 0) {
+			if (!Background() && ++idle > MAX_IDLE_PASSES)
+				break;
+			continue;
+		}
+
+		Transfer(sim::Cost().wifi_us_per_byte * got);
+		WaitForLink();
+		idle = 0;
+
+		if (between_fn != nullptr)
+			between_fn(between_arg);
+	}
+
+	response.reset = sim::TcpWasReset(connection);
+	bool closed = sim::TcpClosed(connection);
+	sim::TcpClose(connection);
+
+	const char* text = (const char*) raw.data();
+	const uint8_t* blank = raw.size() >= 4 ? (const uint8_t*) memmem(text, raw.size(), "\r\n\r\n", 4) : nullptr;
+	if (!closed || response.reset || blank == nullptr || raw.size() < 12 || memcmp(text, "HTTP/1.", 7) != 0) {
+		counters.failed++;
+		return false;
+	}
+
+	response.status = atoi(text + 9);
+	response.headers.assign(text, (const char*) blank);
+	response.body.assign(blank + 4, (const uint8_t*) raw.data() + raw.size());
+	counters.bytes_read += response.body.size();
+	return true;
+}
+
+void HttpClient::Transfer(double us) {
+	link_us = std::max(link_us, (double) sim::Now()) + us;
+	counters.usb_us += us;
+}
+
+void HttpClient::WaitForLink() {
+	while (sim::Now() < link_us && Background());
+
+	if (sim::Now() < link_us)
+		sim::Advance(link_us - sim::Now());
+}
+
+bool HttpClient::Background() {
+	// The cyw43 is serviced from the main loop too, so flash work that
+	// holds the core holds the link
+	double busy_before = sim::Stats().busy_us;
+	bool did_work = msc_disk_task();
+	did_work = bulk_ingest_task() || did_work;
+	did_work = http_server_task() || did_work;
+
+	if (sim::Cost().flash_stalls_usb)
+		link_us += sim::Stats().busy_us - busy_before;
+
+	return did_work;
+}
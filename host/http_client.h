@@ -0,0 +1,74 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "usb_host.h"
+
+/**
+ * The client end of the firmware's HTTP file server (see http_server.h),
+ * over the simulator's TCP loopback instead of Wi-Fi. Like UsbHost it has
+ * its own timeline for the link: every byte that comes back occupies it
+ * for CostModel::wifi_us_per_byte, and the device runs meanwhile, so the
+ * firmware refills its send buffer while the last one is on the air.
+ */
+class HttpClient {
+public:
+	struct Response {
+		int status = 0;
+		std::string headers;       // Everything before the blank line
+		std::vector<uint8_t> body;
+		bool reset = false;        // The server reset the connection
+	};
+
+	/**
+	 * Same as UsbHost's, with usb_us the time on the Wi-Fi link.
+	 */
+	typedef UsbHost::Counters Counters;
+
+public:
+	/**
+	 * Starts the server, as main() does at boot.
+	 */
+	HttpClient();
+
+	/**
+	 * Send `method` for `path`, with a Range header if `range` is not
+	 * empty, and read the response until the server closes. False if the
+	 * connection was refused or reset, or no status line came back.
+	 */
+	bool Request(const std::string& method, const std::string& path, const std::string& range, Response& response);
+
+	/**
+	 * Called after every part of a response arrives, e.g. to have the USB
+	 * host write to the volume in the middle of a download.
+	 */
+	void SetBetween(void (*between)(void*), void* arg) {
+		between_fn = between;
+		between_arg = arg;
+	}
+
+	const Counters& GetCounters() const {
+		return counters;
+	}
+
+	void SetCounters(const Counters& value) {
+		counters = value;
+	}
+
+private:
+	void Transfer(double us);
+
+	void WaitForLink();
+
+	/**
+	 * One pass of the firmware's main loop after tud_task(). Returns true
+	 * if it did any work.
+	 */
+	bool Background();
+
+private:
+	Counters counters;
+	double link_us = 0;
+	void (*between_fn)(void*) = nullptr;
+	void* between_arg = nullptr;
+};
@@ -0,0 +1,1582 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <memory>
+#include <vector>
+#include "access_times.h"
+#include "append_log.h"
+#include "bench_format.h"
+#include "directory_index.h"
+#include "fat.h"
+#include "fat_cursor.hpp"
+#include "file_block_device.h"
+#include "file_map.h"
+#include "flash_session.h"
+#include "host_fat.h"
+#include "http_client.h"
+#include "msc_disk.h"
+#include "read_ahead.h"
+#include "sim.h"
+#include "sim_backend.h"
+#include "trace.h"
+#include "tusb.h"
+#include "usb_host.h"
+#include "write_queue.hpp"
+
+/**
+ * Replays READ10/WRITE10 traces through the firmware's MSC callbacks
+ * against the emulated flash and reports what the storage path cost:
+ *
+ *   msc_bench TRACE...
+ *   msc_bench --compare bench/baseline.txt TRACE...
+ *   msc_bench --write-baseline bench/baseline.txt TRACE...
+ *   msc_bench --generate bench/traces
+ *   msc_bench --overlap TRACE...
+ *   msc_bench --durable-ack TRACE...
+ *   msc_bench --image disk.img TRACE...
+ *   msc_bench --per-call TRACE...
+ *   msc_bench --ingest 409600
+ *   msc_bench --http 409600
+ *   msc_bench --readahead 200000
+ *   msc_bench --append 4096
+ *   msc_bench --lookup 1440
+ *   msc_bench --sustained 409600
+ *   msc_bench --mtp 409600
+ *   msc_bench --map 409600
+ *   msc_bench --atime 200
+ *   msc_bench --slice 2000 TRACE...
+ *   msc_bench --sustained 200000 --latency-target 500
+ *   msc_bench --cost flash_bench.log TRACE...
+ *
+ * TRACE... are trace files, e.g. the checked-in bench/traces/NAME.trace.
+ *
+ * --overlap models a backing store that does not stall the USB controller
+ * while busy, so flash work can overlap transfers (see sim::CostModel).
+ * --durable-ack acknowledges WRITE10 only once its data is written rather
+ * than staged (see write_queue.hpp), so nothing overlaps.
+ * --image serves the volume from a 128mb file instead of the emulated
+ * internal flash; afterwards it is a plain FAT16 image of the last trace.
+ * --per-call gives every flash erase and program its own exit from XIP,
+ * the way the SDK calls do, instead of batching them (see FlashSession).
+ * --ingest puts one file of that many bytes on the volume three ways:
+ * Linux cp and Explorer through mass storage, and the bulk ingest
+ * interface (see bulk_ingest.h).
+ * --http copies one file of that many bytes onto the volume and reads it
+ * back over USB and from the HTTP server (see http_server.h), in full and
+ * by range. On the HTTP rows usb_ms is time on the Wi-Fi link.
+ * --readahead reads one file of that many bytes back over USB from a
+ * volume where it went into every other cluster, with each readahead mode
+ * (see read_ahead.h), and notes each one's hit rate and READ10 latency.
+ * A file too large for that is cut down to what fits.
+ * --append has the firmware append that many 32 byte records to a file,
+ * as an ordinary file and as an append log (see append_log.h), and notes
+ * the record rate each one sustains.
+ * --lookup has the firmware make a subdirectory of that many files and
+ * look each one up, through the directory index (see directory_index.h)
+ * and by reading through the directory.
+ * --sustained copies a file of that many bytes over one that was just
+ * deleted, so every cluster has to be erased, once with erases run whole,
+ * once cut into slices (see flash_session.h) and once erased ahead, and
+ * notes the WRITE10 latencies and interrupts-off stretches of each, and
+ * whether p99 WRITE10 latency is within --latency-target (500 ms unless
+ * given).
+ * --mtp copies one file of that many bytes onto the volume, reads it back
+ * and deletes it, through mass storage and over MTP (see mtp_responder.h).
+ * --map has the firmware read a file of that many bytes through a sector
+ * buffer and in place (see file_map.h), and notes what each one cost in
+ * RAM, how fragmented files map, and what pinning a map does.
+ * --atime has a host read small files that many times, bumping each one's
+ * access date as it goes, once for each AccessTimes policy, and notes how
+ * many dates were kept in RAM and how many survive a pull.
+ * --slice sets the slice budget in microseconds, 0 for none.
+ * --cost takes the flash timings from what the flash_bench firmware
+ * printed for a real chip (see src/flash_bench.cpp) instead of the
+ * datasheet's.
+ *
+ * Each trace starts from a freshly formatted device (GPIO17 held at power
+ * on). A regression is anything more than TOLERANCE worse than baseline.
+ */
+
+static constexpr double TOLERANCE = 0.05;
+
+struct Result {
+	std::string name;
+	uint64_t commands = 0;
+	uint64_t failed = 0;
+	double read_kb = 0;
+	double write_kb = 0;
+	uint64_t erases = 0;      // 4kb sectors
+	double programmed_kb = 0;
+	double amplification = 0; // Bytes programmed per byte the host wrote
+	double device_ms = 0;     // Flash busy + XIP reads
+	double usb_ms = 0;
+	double mb_per_s = 0;      // Host payload over total elapsed time
+	uint32_t bad_blocks = 0;  // Blocks that do not read back as last written
+	uint64_t xip_exits = 0;   // Interrupts-off sections spent on flash
+	double irq_ms = 0;        // Longest of them
+};
+
+static const char* HEADER = BENCH_HEADER;
+
+static std::string Format(const Result& r) {
+	char line[256];
+	snprintf(line, sizeof(line), BENCH_ROW_FORMAT,
+			r.name.c_str(), (unsigned long long) r.commands, (unsigned long long) r.failed,
+			r.read_kb, r.write_kb, (unsigned long long) r.erases, r.programmed_kb,
+			r.amplification, r.device_ms, r.usb_ms, r.mb_per_s, r.bad_blocks,
+			(unsigned long long) r.xip_exits, r.irq_ms);
+	return line;
+}
+
+static bool Parse(const std::string& line, Result& r) {
+	std::istringstream in(line);
+	return bool(in >> r.name >> r.commands >> r.failed >> r.read_kb >> r.write_kb >> r.erases
+			>> r.programmed_kb >> r.amplification >> r.device_ms >> r.usb_ms >> r.mb_per_s >> r.bad_blocks
+			>> r.xip_exits >> r.irq_ms);
+}
+
+/**
+ * What the run since `before` and `start_us` cost, with the host done at
+ * `end_us`.
+ */
+static Result Summarize(const std::string& name, const UsbHost::Counters& c, const sim::FlashStats& before,
+		uint64_t start_us, uint64_t end_us) {
+	const sim::FlashStats& after = sim::Stats();
+
+	Result r;
+	r.name = name;
+	r.commands = c.commands;
+	r.failed = c.failed;
+	r.read_kb = c.bytes_read / 1024.0;
+	r.write_kb = c.bytes_written / 1024.0;
+	r.erases = after.sectors_erased - before.sectors_erased;
+	r.programmed_kb = (after.bytes_programmed - before.bytes_programmed) / 1024.0;
+	r.amplification = c.bytes_written ? double(after.bytes_programmed - before.bytes_programmed) / c.bytes_written : 0;
+	r.device_ms = (after.busy_us - before.busy_us + after.read_us - before.read_us) / 1000.0;
+	r.usb_ms = c.usb_us / 1000.0;
+	r.xip_exits = after.xip_exits - before.xip_exits;
+	r.irq_ms = FlashSession::GetStats().max_irq_off_us / 1000.0;
+
+	double elapsed_s = (end_us - start_us) / 1e6;
+	r.mb_per_s = elapsed_s > 0 ? (c.bytes_read + c.bytes_written) / elapsed_s / 1e6 : 0;
+	return r;
+}
+
+/**
+ * Whether block `lba` reads back as the host last wrote it after a power
+ * cycle. Access dates AccessTimes kept in RAM are lost to one on purpose,
+ * so root directory entries may have the stored ones instead.
+ */
+static bool ReadsBack(uint32_t lba, const uint8_t* actual, const uint8_t* expected) {
+	if (memcmp(actual, expected, trace::BLOCK_SIZE) == 0)
+		return true;
+
+	if (ACCESS_TIMES == ACCESS_TIMES_WRITE || lba < Fat16::INDEX_ROOT_DIRECTORY || lba >= Fat16::INDEX_DATA_STARTS)
+		return false;
+
+	const fat::DirectoryEntry* read = (const fat::DirectoryEntry*) actual;
+	const fat::DirectoryEntry* written = (const fat::DirectoryEntry*) expected;
+	for (uint32_t i = 0; i < AccessTimes::ENTRIES_PER_SECTOR; i++) {
+		if (!AccessTimes::OnlyTimes(read[i], written[i]))
+			return false;
+	}
+
+	return true;
+}
+
+static Result Replay(const trace::Trace& t) {
+	sim::Reset();
+	UsbHost usb;
+	usb.PowerOn(true);
+	usb.SetCounters(UsbHost::Counters());
+
+	sim::FlashStats before = sim::Stats();
+	FlashSession::GetStats() = FlashSession::Stats();
+	uint64_t start_us = sim::Now();
+
+	// Last data written to each block, to check reads against afterwards.
+	std::map<uint32_t, std::vector<uint8_t>> expected;
+
+	for (const trace::Command& cmd : t.commands) {
+		usb.Run(cmd);
+
+		if (cmd.op == 'W') {
+			std::vector<uint8_t> data;
+			trace::Decode(cmd.payload, data);
+			for (uint32_t i = 0; i < cmd.blocks; i++)
+				expected[cmd.lba + i].assign(data.begin() + i * trace::BLOCK_SIZE, data.begin() + (i + 1) * trace::BLOCK_SIZE);
+		}
+	}
+
+	// Host-visible time ends with the last status; whatever the device
+	// still has staged is committed afterwards, off the clock.
+	uint64_t end_us = sim::Now();
+	usb.Idle();
+
+	Result r = Summarize(t.name, usb.GetCounters(), before, start_us, end_us);
+
+	// Check what survives a power cycle, not what is cached in RAM
+	usb.PowerOn(false);
+
+	uint8_t block[trace::BLOCK_SIZE];
+	for (const auto& [lba, data] : expected) {
+		if (!usb.Read(lba, 1, block) || !ReadsBack(lba, block, data.data()))
+			r.bad_blocks++;
+	}
+
+	return r;
+}
+
+//--------------------------------------------------------------------+
+// Trace generation
+//--------------------------------------------------------------------+
+
+static trace::Trace Generate(const std::string& name, const std::vector<std::string>& comments,
+		void (*workload)(UsbHost&)) {
+	trace::Trace t;
+	t.name = name;
+	t.comments.push_back(" Generated by `msc_bench --generate` with host/host_fat.cpp.");
+	for (const std::string& comment : comments)
+		t.comments.push_back(" " + comment);
+
+	sim::Reset();
+	UsbHost usb;
+	usb.PowerOn(true);
+	usb.Record(&t);
+	workload(usb);
+	usb.Record(nullptr);
+	usb.Idle();
+	return t;
+}
+
+static void LinuxMkfsCp(UsbHost& usb) {
+	HostFat host(usb, HostFat::LINUX);
+	host.Mount();
+	host.Format();
+	host.Mount();
+	host.CopyFile("FIRMWARE", "BIN", 120000, 1);
+	host.CopyFile("SAMPLES ", "CSV", 200000, 2);
+	host.CopyFile("NOTES   ", "TXT", 40000, 3);
+	host.Sync();
+}
+
+static void WindowsExplorerCopy(UsbHost& usb) {
+	HostFat host(usb, HostFat::WINDOWS);
+	host.Mount();
+	host.CopyFile("CAPTURE ", "WAV", 300000, 4);
+	host.CopyFile("REPORT  ", "PDF", 90000, 5);
+}
+
+static void SmallFiles(UsbHost& usb) {
+	HostFat host(usb, HostFat::WINDOWS);
+	host.Mount();
+
+	uint32_t state = 6;
+	char name[9];
+	for (int i = 0; i < 48; i++) {
+		state = state * 1103515245 + 12345;
+		snprintf(name, sizeof(name), "LOG%05d", i);
+		host.CopyFile(name, "TXT", 200 + (state >> 16) % 6000, 100 + i);
+	}
+}
+
+static bool GenerateAll(const std::string& dir) {
+	std::vector<trace::Trace> traces = {
+		Generate("linux_mkfs_cp", {
+				"mkfs.vfat -F 16 with the device geometry, mount, cp three files",
+				"(120000, 200000 and 40000 bytes), sync."}, LinuxMkfsCp),
+		Generate("windows_explorer_copy", {
+				"Explorer drag-and-drop of a 300000 and a 90000 byte file onto",
+				"the factory-formatted volume, including the access date update."}, WindowsExplorerCopy),
+		Generate("small_files", {
+				"Explorer copy of 48 files between 200 and 6200 bytes, one",
+				"directory entry, FAT #1, FAT #2 and data write each."}, SmallFiles),
+	};
+
+	for (const trace::Trace& t : traces) {
+		std::string path = dir + "/" + t.name + ".trace";
+		if (!trace::Save(path, t)) {
+			fprintf(stderr, "Could not write %s\n", path.c_str());
+			return false;
+		}
+		printf("Wrote %s (%zu commands)\n", path.c_str(), t.commands.size());
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------+
+// Bulk ingest
+//--------------------------------------------------------------------+
+
+enum UploadPath {
+	UPLOAD_LINUX_CP,
+	UPLOAD_WINDOWS_COPY,
+	UPLOAD_INGEST
+};
+
+/**
+ * The contents HostFat::CopyFile gives a file of `size` bytes from `seed`.
+ */
+static std::vector<uint8_t> FileContents(uint32_t size, uint32_t seed) {
+	std::vector<uint8_t> data(size);
+	for (uint32_t offset = 0; offset < size; offset += HostFat::CLUSTER_BYTES) {
+		uint32_t cluster = offset / HostFat::CLUSTER_BYTES;
+		trace::PrngFill(data.data() + offset, std::min(size - offset, HostFat::CLUSTER_BYTES), seed * 4099 + cluster + 1);
+	}
+	return data;
+}
+
+/**
+ * Read the root directory and FAT the way a host does on mount, and find
+ * the file `name` (8.3, space padded) in it.
+ */
+static bool FindFile(UsbHost& usb, const char name[11], fat::DirectoryEntry& entry, std::vector<uint16_t>& fat) {
+	// The media change the ingest reported goes to a TEST UNIT READY poll,
+	// as it would on a host, instead of failing the first read
+	tud_msc_test_unit_ready_cb(0);
+
+	std::vector<fat::DirectoryEntry> root(HostFat::ROOT_ENTRIES);
+	fat.resize(HostFat::FAT_SECTORS * trace::BLOCK_SIZE / 2);
+	if (!usb.Read(Fat16::INDEX_ROOT_DIRECTORY, HostFat::ROOT_SECTORS, (uint8_t*) root.data()) ||
+			!usb.Read(Fat16::INDEX_FAT_TABLE_1_START, HostFat::FAT_SECTORS, (uint8_t*) fat.data()))
+		return false;
+
+	for (const fat::DirectoryEntry& e : root) {
+		if (e.name[0] == 0)
+			break;
+		if (memcmp(e.name, name, 11) == 0) {
+			entry = e;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Blocks of `data` that `actual`, from `offset` into the file, does not
+ * match; whatever is missing counts as well.
+ */
+static uint32_t CountBad(const std::vector<uint8_t>& actual, const std::vector<uint8_t>& data,
+		uint32_t offset, uint32_t length) {
+	uint32_t bad = 0;
+	for (uint32_t b = 0; b < length; b += trace::BLOCK_SIZE) {
+		uint32_t len = std::min(trace::BLOCK_SIZE, length - b);
+		bad += b + len > actual.size() || memcmp(actual.data() + b, data.data() + offset + b, len) != 0;
+	}
+	return bad;
+}
+
+/**
+ * Blocks of the file that do not read back as `data`, reading it cluster
+ * by cluster along the chain in `fat` like a host would.
+ */
+static uint32_t ReadFile(UsbHost& usb, const fat::DirectoryEntry& entry, const std::vector<uint16_t>& fat,
+		const std::vector<uint8_t>& data) {
+	uint32_t size = (uint32_t) data.size();
+	uint32_t bad = 0;
+	uint16_t cluster = entry.start_cluster;
+	std::vector<uint8_t> buffer(HostFat::CLUSTER_BYTES);
+	for (uint32_t offset = 0; offset < size; offset += HostFat::CLUSTER_BYTES) {
+		uint32_t lba = Fat16::INDEX_DATA_STARTS + (cluster - 2) * Fat16::DISK_CLUSTER_SIZE;
+		if (cluster < 2 || cluster >= fat.size() || !usb.Read(lba, Fat16::DISK_CLUSTER_SIZE, buffer.data()))
+			return bad + (size - offset + trace::BLOCK_SIZE - 1) / trace::BLOCK_SIZE;
+
+		for (uint32_t b = 0; b < HostFat::CLUSTER_BYTES && offset + b < size; b += trace::BLOCK_SIZE) {
+			uint32_t len = std::min(trace::BLOCK_SIZE, size - offset - b);
+			bad += memcmp(buffer.data() + b, data.data() + offset + b, len) != 0;
+		}
+
+		cluster = fat[cluster];
+	}
+
+	return bad;
+}
+
+/**
+ * Blocks of the file `name` that do not read back as `data`, going by its
+ * directory entry and FAT chain.
+ */
+static uint32_t CheckFile(UsbHost& usb, const char name[11], const std::vector<uint8_t>& data) {
+	uint32_t blocks = ((uint32_t) data.size() + trace::BLOCK_SIZE - 1) / trace::BLOCK_SIZE;
+
+	fat::DirectoryEntry entry;
+	std::vector<uint16_t> fat;
+	if (!FindFile(usb, name, entry, fat) || entry.size != data.size())
+		return blocks;
+
+	return ReadFile(usb, entry, fat, data);
+}
+
+/**
+ * Put one file of `size` bytes on a freshly formatted device, through
+ * mass storage the way a desktop would or over the ingest interface.
+ */
+static Result Upload(const std::string& name, UploadPath path, uint32_t size) {
+	static const char FILE_NAME[] = "BULKLOADBIN";
+	std::vector<uint8_t> data = FileContents(size, 7);
+
+	sim::Reset();
+	UsbHost usb;
+	usb.PowerOn(true);
+
+	// A desktop has the volume mounted before the copy starts
+	HostFat host(usb, path == UPLOAD_WINDOWS_COPY ? HostFat::WINDOWS : HostFat::LINUX);
+	if (path != UPLOAD_INGEST)
+		host.Mount();
+	usb.SetCounters(UsbHost::Counters());
+
+	sim::FlashStats before = sim::Stats();
+	FlashSession::GetStats() = FlashSession::Stats();
+	uint64_t start_us = sim::Now();
+
+	if (path == UPLOAD_INGEST) {
+		uint16_t cluster;
+		usb.Ingest(FILE_NAME, data.data(), size, cluster);
+	}
+	else {
+		host.CopyFile("BULKLOAD", "BIN", size, 7);
+		host.Sync();
+	}
+
+	uint64_t end_us = sim::Now();
+	usb.Idle();
+
+	Result r = Summarize(name, usb.GetCounters(), before, start_us, end_us);
+	usb.PowerOn(false);
+	r.bad_blocks = CheckFile(usb, FILE_NAME, data);
+	return r;
+}
+
+//--------------------------------------------------------------------+
+// Downloads
+//--------------------------------------------------------------------+
+
+/**
+ * Copy a file of `size` bytes onto a fresh device through mass storage,
+ * then read it back three ways: over USB as a host with the volume mounted
+ * would, and over the HTTP server in full and a middle half by range.
+ */
+static std::vector<Result> Download(uint32_t size) {
+	static const char FILE_NAME[] = "BULKLOADBIN";
+	std::vector<uint8_t> data = FileContents(size, 7);
+	std::vector<Result> results;
+
+	sim::Reset();
+	UsbHost usb;
+	usb.PowerOn(true);
+	HostFat host(usb, HostFat::LINUX);
+	host.Mount();
+	host.CopyFile("BULKLOAD", "BIN", size, 7);
+	host.Sync();
+	usb.Idle();
+
+	// The FAT and directory are cached from mounting, so only the file's
+	// clusters are on the clock
+	fat::DirectoryEntry entry;
+	std::vector<uint16_t> fat;
+	FindFile(usb, FILE_NAME, entry, fat);
+
+	usb.SetCounters(UsbHost::Counters());
+	sim::FlashStats before = sim::Stats();
+	FlashSession::GetStats() = FlashSession::Stats();
+	uint64_t start_us = sim::Now();
+	uint32_t bad = ReadFile(usb, entry, fat, data);
+	results.push_back(Summarize("download_usb", usb.GetCounters(), before, start_us, sim::Now()));
+	results.back().bad_blocks = bad;
+
+	HttpClient http;
+	struct Range {
+		const char* name;
+		uint32_t first;
+		uint32_t length;
+		int status;
+	};
+	const Range ranges[] = {
+		{ "download_http", 0, size, 200 },
+		{ "download_http_range", size / 4, size / 2, 206 },
+	};
+
+	for (const Range& range : ranges) {
+		std::string header;
+		if (range.status == 206)
+			header = "bytes=" + std::to_string(range.first) + "-" + std::to_string(range.first + range.length - 1);
+
+		http.SetCounters(HttpClient::Counters());
+		before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		start_us = sim::Now();
+
+		HttpClient::Response response;
+		bool ok = http.Request("GET", "/bulkload.bin", header, response) && response.status == range.status;
+		Result r = Summarize(range.name, http.GetCounters(), before, start_us, sim::Now());
+		r.failed += !ok && http.GetCounters().failed == 0;
+		r.bad_blocks = CountBad(response.body, data, range.first, range.length);
+		results.push_back(r);
+	}
+
+	return results;
+}
+
+//--------------------------------------------------------------------+
+// Readahead
+//--------------------------------------------------------------------+
+
+/**
+ * Put a file of `size` bytes on a fresh device into every other cluster,
+ * in the holes left by deleting every other one of a run of one cluster
+ * files, then read it back over USB once with each readahead mode. What
+ * each mode hit and how long a READ10 took goes into `notes`.
+ */
+static std::vector<Result> Fragmented(uint32_t size, std::vector<std::string>& notes) {
+	static const char FILE_NAME[] = "BULKLOADBIN";
+	std::vector<Result> results;
+
+	sim::Reset();
+	UsbHost usb;
+	usb.PowerOn(true);
+
+	HostFat host(usb, HostFat::LINUX);
+	host.Mount();
+
+	// Twice the file has to fit next to the sample files
+	uint32_t clusters = msc_disk_begin_local_read(0, 0)->GetLastCluster() + 1 - Fat16::FIRST_CLUSTER;
+	uint32_t largest = (clusters - host.UsedClusters()) / 2 * HostFat::CLUSTER_BYTES;
+	if (size > largest) {
+		fprintf(stderr, "--readahead %u: twice the file has to fit on the device, using %u\n",
+				(unsigned) size, (unsigned) largest);
+		size = largest;
+	}
+
+	std::vector<uint8_t> data = FileContents(size, 7);
+	uint32_t holes = (size + HostFat::CLUSTER_BYTES - 1) / HostFat::CLUSTER_BYTES;
+
+	char name[9];
+	for (uint32_t i = 0; i < 2 * holes; i++) {
+		snprintf(name, sizeof(name), "PAD%05u", (unsigned) (i % 100000));
+		host.CopyFile(name, "DAT", HostFat::CLUSTER_BYTES, 200 + i);
+	}
+	for (uint32_t i = 0; i < 2 * holes; i += 2) {
+		snprintf(name, sizeof(name), "PAD%05u", (unsigned) (i % 100000));
+		host.DeleteFile(name, "DAT");
+	}
+	host.CopyFile("BULKLOAD", "BIN", size, 7);
+	host.Sync();
+	usb.Idle();
+
+	struct Mode {
+		const char* name;
+		ReadAhead::Mode mode;
+	};
+	const Mode modes[] = {
+		{ "fragmented_read_off", ReadAhead::MODE_OFF },
+		{ "fragmented_read_lba", ReadAhead::MODE_SEQUENTIAL },
+		{ "fragmented_read_chain", ReadAhead::MODE_CHAIN },
+	};
+
+	ReadAhead& read_ahead = msc_disk_read_ahead();
+	for (const Mode& mode : modes) {
+		read_ahead.SetMode(mode.mode);
+
+		// Mounting reads the FAT, which is where the chain is learned from
+		fat::DirectoryEntry entry;
+		std::vector<uint16_t> fat;
+		FindFile(usb, FILE_NAME, entry, fat);
+
+		read_ahead.ResetStats();
+		usb.SetCounters(UsbHost::Counters());
+		sim::FlashStats before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		uint64_t start_us = sim::Now();
+		uint32_t bad = ReadFile(usb, entry, fat, data);
+		uint64_t end_us = sim::Now();
+
+		results.push_back(Summarize(mode.name, usb.GetCounters(), before, start_us, end_us));
+		results.back().bad_blocks = bad;
+
+		const ReadAhead::Stats& stats = read_ahead.GetStats();
+		char note[160];
+		snprintf(note, sizeof(note), "# %-24s %4u/%u reads hit (%5.1f%%), %u read ahead, %u wasted, %u FAT sectors, %.0f us a READ10",
+				mode.name, (unsigned) stats.hits, (unsigned) stats.reads, stats.reads ? 100.0 * stats.hits / stats.reads : 0.0,
+				(unsigned) stats.prefetches, (unsigned) stats.wasted, (unsigned) stats.fat_reads,
+				usb.GetCounters().commands ? double(end_us - start_us) / usb.GetCounters().commands : 0.0);
+		notes.push_back(note);
+	}
+
+	read_ahead.SetMode(ReadAhead::MODE_CHAIN);
+	return results;
+}
+
+//--------------------------------------------------------------------+
+// Append log
+//--------------------------------------------------------------------+
+
+static constexpr uint32_t RECORD_SIZE = 32;
+
+/**
+ * What the firmware appends: `records` sensor records.
+ */
+static std::vector<uint8_t> Records(uint32_t records) {
+	std::vector<uint8_t> data(records * RECORD_SIZE);
+	for (uint32_t i = 0; i < records; i++)
+		trace::PrngFill(data.data() + i * RECORD_SIZE, RECORD_SIZE, i + 1);
+	return data;
+}
+
+/**
+ * Append `data` a record at a time to an ordinary file: the sector the
+ * record lands in, a FAT sector for every new cluster and the directory
+ * entry are all rewritten each time.
+ */
+static bool AppendFile(const char name[11], const std::vector<uint8_t>& data) {
+	Fat16* fs = msc_disk_begin_local_write();
+	FatCursor fat_cursor;
+	std::vector<uint8_t> root(trace::BLOCK_SIZE);
+	std::vector<uint8_t> sector(trace::BLOCK_SIZE);
+
+	if (fs->GetBlock(Fat16::INDEX_ROOT_DIRECTORY, root.data(), trace::BLOCK_SIZE) < 0)
+		return false;
+
+	fat::DirectoryEntry* entries = (fat::DirectoryEntry*) root.data();
+	uint32_t slot = 0;
+	while (slot < trace::BLOCK_SIZE / sizeof(fat::DirectoryEntry) && entries[slot].name[0] != 0)
+		slot++;
+	if (slot == trace::BLOCK_SIZE / sizeof(fat::DirectoryEntry))
+		return false;
+
+	fat::DirectoryEntryBuilder builder;
+	builder.SetName(std::string(name, 8), std::string(name + 8, 3));
+	builder.SetAttribute(builder.ARCHIVE);
+	entries[slot] = builder.Build();
+
+	uint16_t cluster = 0;
+	for (uint32_t offset = 0; offset < data.size(); offset += RECORD_SIZE) {
+		if (offset % HostFat::CLUSTER_BYTES == 0) {
+			uint16_t next;
+			if (!fat_cursor.FindFreeRun(*fs, 1, next) || !fat_cursor.Set(*fs, next, FatCursor::END_OF_CHAIN) ||
+					(cluster != 0 && !fat_cursor.Set(*fs, cluster, next)) || !fat_cursor.Store(*fs))
+				return false;
+			if (cluster == 0)
+				entries[slot].start_cluster = next;
+			cluster = next;
+		}
+
+		uint32_t lba = Fat16::ClusterToLBA(cluster) + offset % HostFat::CLUSTER_BYTES / trace::BLOCK_SIZE;
+		if (offset % trace::BLOCK_SIZE == 0)
+			memset(sector.data(), 0, trace::BLOCK_SIZE);
+		else if (fs->GetBlock(lba, sector.data(), trace::BLOCK_SIZE) < 0)
+			return false;
+
+		memcpy(sector.data() + offset % trace::BLOCK_SIZE, data.data() + offset, RECORD_SIZE);
+		entries[slot].size = offset + RECORD_SIZE;
+		if (fs->WriteBlock(lba, sector.data(), trace::BLOCK_SIZE) < 0 ||
+				fs->WriteBlock(Fat16::INDEX_ROOT_DIRECTORY, root.data(), trace::BLOCK_SIZE) < 0)
+			return false;
+	}
+
+	msc_disk_media_changed();
+	return true;
+}
+
+/**
+ * Append `records` records to a file on a fresh device, once as an
+ * ordinary file and once as an append log (see append_log.h), and read
+ * each back over USB after a power cycle. mb/s is over the time the
+ * device was busy, which is what limits the record rate; that rate and
+ * what creating the log cost go into `notes`.
+ */
+static std::vector<Result> Append(uint32_t records, std::vector<std::string>& notes) {
+	static const char FILE_NAME[] = "SENSORS LOG";
+	std::vector<uint8_t> data = Records(records);
+	std::vector<Result> results;
+
+	const char* names[] = { "append_file", "append_log" };
+	for (const char* name : names) {
+		bool log = strcmp(name, "append_log") == 0;
+		sim::Reset();
+		UsbHost usb;
+		usb.PowerOn(true);
+		tud_msc_test_unit_ready_cb(0);
+
+		std::vector<uint8_t> expected = data;
+		sim::FlashStats created = sim::Stats();
+		if (log) {
+			uint32_t clusters = (uint32_t) (data.size() + HostFat::CLUSTER_BYTES - 1) / HostFat::CLUSTER_BYTES + 2;
+			if (!append_log_open(FILE_NAME, clusters)) {
+				fprintf(stderr, "--append %u: could not create the log\n", (unsigned) records);
+				return results;
+			}
+		}
+
+		UsbHost::Counters c;
+		sim::FlashStats before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		bool ok = true;
+		if (log) {
+			for (uint32_t offset = 0; offset < data.size(); offset += RECORD_SIZE)
+				ok = append_log_write(data.data() + offset, RECORD_SIZE) == RECORD_SIZE && ok;
+			ok = append_log_flush() && ok;
+
+			// Flushing pads the last page out
+			expected.resize(append_log_size(), APPEND_LOG_PAD);
+			append_log_close();
+		}
+		else {
+			ok = AppendFile(FILE_NAME, data);
+		}
+
+		const sim::FlashStats& after = sim::Stats();
+		double device_us = after.busy_us - before.busy_us + after.read_us - before.read_us;
+		c.commands = records;
+		c.failed = !ok;
+		c.bytes_written = data.size();
+		results.push_back(Summarize(name, c, before, 0, (uint64_t) device_us));
+
+		// Until the firmware opens it again, the log shows the whole run
+		usb.PowerOn(false);
+		if (log && !append_log_open(FILE_NAME, 0))
+			results.back().failed++;
+
+		fat::DirectoryEntry entry;
+		std::vector<uint16_t> fat;
+		if (!FindFile(usb, FILE_NAME, entry, fat) || entry.size != expected.size())
+			results.back().failed++;
+		results.back().bad_blocks = ReadFile(usb, entry, fat, expected);
+		append_log_close();
+
+		char note[160];
+		snprintf(note, sizeof(note), "# %-24s %7.0f records/s, %llu erases creating it",
+				name, device_us > 0 ? records / (device_us / 1e6) : 0.0,
+				(unsigned long long) (before.sectors_erased - created.sectors_erased));
+		notes.push_back(note);
+	}
+
+	return results;
+}
+
+//--------------------------------------------------------------------+
+// Directory lookups
+//--------------------------------------------------------------------+
+
+/**
+ * Have the firmware make a subdirectory of `files` empty files, then look
+ * every one of them up, through the directory index and by looking
+ * through the directory. Sectors read per lookup go into `notes`.
+ */
+static std::vector<Result> Lookup(uint32_t files, std::vector<std::string>& notes) {
+	std::vector<Result> results;
+
+	sim::Reset();
+	UsbHost usb;
+	usb.PowerOn(true);
+	tud_msc_test_unit_ready_cb(0);
+
+	Fat16* fs = msc_disk_begin_local_write();
+	DirectoryIndex& directories = msc_disk_directories();
+	uint16_t dir;
+	if (!directories.MakeDirectory(*fs, DirectoryIndex::ROOT, "CAPTURE    ", dir)) {
+		fprintf(stderr, "--lookup %u: could not make the directory\n", (unsigned) files);
+		return results;
+	}
+
+	std::vector<uint8_t> sector(trace::BLOCK_SIZE);
+	for (uint32_t i = 0; i < files; i++) {
+		fat::DirectoryEntryBuilder builder;
+		char name[12];
+		snprintf(name, sizeof(name), "M%07uCSV", (unsigned) (i % 10000000));
+		builder.SetName(std::string(name, 8), std::string(name + 8, 3));
+		builder.SetAttribute(builder.ARCHIVE);
+
+		DirectoryIndex::Slot slot;
+		if (!directories.FindFree(*fs, dir, slot) || !slot.IsValid() ||
+				fs->GetBlock(slot.lba, sector.data(), trace::BLOCK_SIZE) < 0) {
+			fprintf(stderr, "--lookup %u: no room for file %u\n", (unsigned) files, (unsigned) i);
+			return results;
+		}
+
+		((fat::DirectoryEntry*) sector.data())[slot.index] = builder.Build();
+		fs->WriteBlock(slot.lba, sector.data(), trace::BLOCK_SIZE);
+	}
+	msc_disk_media_changed();
+
+	const char* names[] = { "dir_lookup_scan", "dir_lookup_index" };
+	for (const char* name : names) {
+		directories.SetEnabled(strcmp(name, "dir_lookup_index") == 0);
+		directories.ResetStats();
+
+		UsbHost::Counters c;
+		sim::FlashStats before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		for (uint32_t i = 0; i < files; i++) {
+			char file[12];
+			snprintf(file, sizeof(file), "M%07uCSV", (unsigned) (i % 10000000));
+
+			DirectoryIndex::Slot slot;
+			fat::DirectoryEntry entry;
+			c.commands++;
+			if (!directories.Find(*fs, dir, file, slot, entry) || !slot.IsValid())
+				c.failed++;
+		}
+
+		const sim::FlashStats& after = sim::Stats();
+		double device_us = after.busy_us - before.busy_us + after.read_us - before.read_us;
+		results.push_back(Summarize(name, c, before, 0, (uint64_t) device_us));
+
+		const DirectoryIndex::Stats& stats = directories.GetStats();
+		char note[160];
+		snprintf(note, sizeof(note), "# %-24s %u lookups in %u entries, %.1f sectors read each, %.1f us each",
+				name, (unsigned) stats.lookups, (unsigned) files, stats.lookups ? double(stats.sectors_read) / stats.lookups : 0.0,
+				stats.lookups ? device_us / stats.lookups : 0.0);
+		notes.push_back(note);
+	}
+
+	directories.SetEnabled(true);
+	return results;
+}
+
+//--------------------------------------------------------------------+
+// Latency under a sustained copy
+//--------------------------------------------------------------------+
+
+/**
+ * Counts of `values` by power of two, from below `first` up, as
+ * "<first:n <2*first:n ..." in `unit`; empty buckets before the first
+ * value and past the last are left out.
+ */
+static std::string Histogram(const std::vector<double>& values, double first, const char* unit) {
+	std::vector<uint32_t> counts;
+	for (double value : values) {
+		size_t bucket = 0;
+		for (double limit = first; value >= limit; limit *= 2)
+			bucket++;
+		if (counts.size() <= bucket)
+			counts.resize(bucket + 1, 0);
+		counts[bucket]++;
+	}
+
+	std::string text;
+	double limit = first;
+	for (uint32_t count : counts) {
+		if (count > 0 || !text.empty()) {
+			char bucket[48];
+			snprintf(bucket, sizeof(bucket), " <%g%s:%u", limit, unit, (unsigned) count);
+			text += bucket;
+		}
+		limit *= 2;
+	}
+	return text;
+}
+
+/**
+ * Copy a file of `size` bytes onto clusters that another file just left,
+ * so every one of them has to be erased, with each erase run whole and
+ * cut into slices of the slice budget (see FlashSession), and once more
+ * after the host has paused long enough for the idle hooks to erase the
+ * freed clusters ahead (Fat16::PreErase). The latency of every WRITE10,
+ * checked against `target_ms` at p99, and the length of every stretch
+ * with interrupts off go into `notes`.
+ */
+static std::vector<Result> Sustained(uint32_t size, double target_ms, std::vector<std::string>& notes) {
+	static const char FILE_NAME[] = "SUSTAIN BIN";
+	uint32_t budget = FlashSession::GetSliceBudget();
+	std::vector<Result> results;
+
+	for (uint32_t run = 0; run < 3; run++) {
+		static const char* const NAMES[] = { "sustained_whole", "sustained_sliced", "sustained_pre_erased" };
+		std::string name = NAMES[run];
+		uint32_t slice = run == 0 ? 0 : budget;
+		FlashSession::SetSliceBudget(slice);
+
+		sim::Reset();
+		UsbHost usb;
+		usb.PowerOn(true);
+		HostFat host(usb, HostFat::LINUX);
+		host.Mount();
+		host.CopyFile("SUSTAIN ", "BIN", size, 1);
+		host.Sync();
+		host.DeleteFile("SUSTAIN ", "BIN");
+		host.Sync();
+		usb.Idle();
+		if (run == 2) {
+			// Quiet for long enough that main.cpp runs its idle hooks
+			sim::Advance(2e6);
+			while (msc_disk_maintenance())
+				usb.Idle();
+		}
+
+		usb.SetCounters(UsbHost::Counters());
+		sim::FlashStats before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		std::vector<double> latencies;
+		usb.LogLatencies(&latencies);
+		uint64_t start_us = sim::Now();
+
+		host.CopyFile("SUSTAIN ", "BIN", size, 2);
+		host.Sync();
+
+		uint64_t end_us = sim::Now();
+		usb.LogLatencies(nullptr);
+		usb.Idle();
+
+		Result r = Summarize(name, usb.GetCounters(), before, start_us, end_us);
+		const FlashSession::Stats& stats = FlashSession::GetStats();
+		// Bucket i of the session stats holds stretches from 2^(i-1)us
+		std::vector<double> irq_off;
+		for (uint32_t i = 0; i < FlashSession::IRQ_OFF_BUCKETS; i++)
+			irq_off.insert(irq_off.end(), stats.irq_off[i], i == 0 ? 0.0 : double(1u << (i - 1)));
+
+		for (double& latency : latencies)
+			latency /= 1000.0;
+		std::vector<double> sorted = latencies;
+		std::sort(sorted.begin(), sorted.end());
+		char note[256];
+		if (!sorted.empty()) {
+			double p99 = sorted[sorted.size() * 99 / 100];
+			snprintf(note, sizeof(note), "# %-24s %u commands, p50 %.1f ms, p99 %.1f ms, max %.1f ms, target %g ms %s:%s",
+					name.c_str(), (unsigned) sorted.size(), sorted[sorted.size() / 2], p99, sorted.back(),
+					target_ms, p99 <= target_ms ? "met" : "MISSED", Histogram(latencies, 1.0, "ms").c_str());
+			notes.push_back(note);
+		}
+
+		snprintf(note, sizeof(note), "# %-24s interrupts off %u times, max %.2f ms, %u erases suspended, budget %s:%s",
+				name.c_str(), (unsigned) stats.sessions, stats.max_irq_off_us / 1000.0, (unsigned) stats.suspends,
+				slice == 0 ? "none" : stats.max_irq_off_us <= slice ? "met" : "MISSED",
+				Histogram(irq_off, 1.0, "us").c_str());
+		notes.push_back(note);
+
+		usb.PowerOn(false);
+		r.bad_blocks = CheckFile(usb, FILE_NAME, FileContents(size, 2));
+		results.push_back(r);
+	}
+
+	FlashSession::SetSliceBudget(budget);
+	return results;
+}
+
+//--------------------------------------------------------------------+
+// Reading files in place
+//--------------------------------------------------------------------+
+
+/**
+ * Have the firmware read a file of `size` bytes the host copied onto a
+ * fresh device, once a sector at a time into a buffer the way the HTTP
+ * server does and once in place through a FileMap (see file_map.h). The
+ * consumer's own reads of the spans are charged at the XIP rate, so
+ * device_ms compares like with like. What each cost in RAM, how a file in
+ * every other cluster maps, and what a host write does to a pin go into
+ * `notes`.
+ */
+static std::vector<Result> Mapped(uint32_t size, std::vector<std::string>& notes) {
+	static const char FILE_NAME[] = "BULKLOADBIN";
+	std::vector<uint8_t> data = FileContents(size, 7);
+	std::vector<Result> results;
+
+	sim::Reset();
+	UsbHost usb;
+	usb.PowerOn(true);
+	HostFat host(usb, HostFat::LINUX);
+	host.Mount();
+	host.CopyFile("BULKLOAD", "BIN", size, 7);
+	host.Sync();
+	usb.Idle();
+
+	fat::DirectoryEntry entry;
+	std::vector<uint16_t> fat;
+	if (!FindFile(usb, FILE_NAME, entry, fat)) {
+		fprintf(stderr, "--map %u: the file did not make it onto the device\n", (unsigned) size);
+		return results;
+	}
+
+	// Through a sector buffer, chain from the host's FAT
+	UsbHost::Counters c;
+	sim::FlashStats before = sim::Stats();
+	FlashSession::GetStats() = FlashSession::Stats();
+	std::vector<uint8_t> contents;
+	std::vector<uint8_t> sector(trace::BLOCK_SIZE);
+	uint16_t cluster = entry.start_cluster;
+	for (uint32_t offset = 0; offset < size; offset += trace::BLOCK_SIZE) {
+		if (offset > 0 && offset % HostFat::CLUSTER_BYTES == 0)
+			cluster = fat[cluster];
+
+		uint32_t lba = Fat16::ClusterToLBA(cluster) + offset % HostFat::CLUSTER_BYTES / trace::BLOCK_SIZE;
+		Fat16* fs = msc_disk_begin_local_read(lba, trace::BLOCK_SIZE);
+		c.commands++;
+		if (fs->GetBlock(lba, sector.data(), trace::BLOCK_SIZE) < 0)
+			c.failed++;
+
+		uint32_t length = std::min(trace::BLOCK_SIZE, size - offset);
+		contents.insert(contents.end(), sector.begin(), sector.begin() + length);
+		c.bytes_read += length;
+	}
+
+	const sim::FlashStats& after = sim::Stats();
+	double device_us = after.busy_us - before.busy_us + after.read_us - before.read_us;
+	results.push_back(Summarize("map_read_copy", c, before, 0, (uint64_t) device_us));
+	results.back().bad_blocks = CountBad(contents, data, 0, size);
+	uint32_t sectors = (uint32_t) c.commands;
+
+	// In place
+	c = UsbHost::Counters();
+	before = sim::Stats();
+	FlashSession::GetStats() = FlashSession::Stats();
+	FileMap map;
+	c.commands++;
+	if (!map.Map(entry.start_cluster, entry.size))
+		c.failed++;
+
+	contents.clear();
+	for (uint32_t i = 0; i < map.GetSpanCount(); i++) {
+		const FileMap::Span& span = map.GetSpan(i);
+		contents.insert(contents.end(), span.data, span.data + span.length);
+		sim::Stats().read_us += span.length * sim::Cost().xip_read_us_per_byte;
+		c.bytes_read += span.length;
+	}
+
+	const sim::FlashStats& mapped = sim::Stats();
+	device_us = mapped.busy_us - before.busy_us + mapped.read_us - before.read_us;
+	results.push_back(Summarize("map_read_xip", c, before, 0, (uint64_t) device_us));
+	results.back().bad_blocks = CountBad(contents, data, 0, size);
+
+	char note[160];
+	snprintf(note, sizeof(note), "# %-24s %u sector reads, %u bytes of buffer, %u bytes copied",
+			"map_read_copy", (unsigned) sectors, (unsigned) trace::BLOCK_SIZE, (unsigned) size);
+	notes.push_back(note);
+	snprintf(note, sizeof(note), "# %-24s %u span(s), %u bytes of buffer, 0 bytes copied",
+			"map_read_xip", (unsigned) map.GetSpanCount(), (unsigned) sizeof(FileMap));
+	notes.push_back(note);
+
+	// A host write to a pinned file goes through even when a busy reply
+	// would be retried without the main loop running, as on the device,
+	// and ends the pin
+	std::vector<uint8_t> block(trace::BLOCK_SIZE, 0x5A);
+	std::vector<uint8_t> readback(trace::BLOCK_SIZE);
+	uint32_t lba = Fat16::ClusterToLBA(entry.start_cluster);
+	bool pinned = map.Pin();
+	tud_msc_test_unit_ready_cb(0);
+	usb.SetBackgroundOnBusy(false);
+	bool written = usb.Write(lba, 1, block.data());
+	usb.SetBackgroundOnBusy(true);
+	bool still_pinned = map.IsPinned();
+	map.Unpin();
+	usb.Idle();
+	bool landed = usb.Read(lba, 1, readback.data()) && readback == block;
+	snprintf(note, sizeof(note), "# %-24s pinned %s, host write without retries done %s, landed %s, pin ended %s, stale after %s",
+			"map_pin", pinned ? "yes" : "no", written ? "yes" : "no", landed ? "yes" : "no",
+			still_pinned ? "no" : "yes", map.IsValid() ? "no" : "yes");
+	notes.push_back(note);
+
+	// The same file in every other cluster of a fresh device is a span per
+	// cluster, and too many of them past MAX_SPANS
+	for (uint32_t clusters : { (uint32_t) FileMap::MAX_SPANS, (uint32_t) FileMap::MAX_SPANS + 1 }) {
+		sim::Reset();
+		usb.PowerOn(true);
+		HostFat fragmented(usb, HostFat::LINUX);
+		fragmented.Mount();
+
+		char name[9];
+		for (uint32_t i = 0; i < 2 * clusters; i++) {
+			snprintf(name, sizeof(name), "PAD%05u", (unsigned) (i % 100000));
+			fragmented.CopyFile(name, "DAT", HostFat::CLUSTER_BYTES, 200 + i);
+		}
+		for (uint32_t i = 0; i < 2 * clusters; i += 2) {
+			snprintf(name, sizeof(name), "PAD%05u", (unsigned) (i % 100000));
+			fragmented.DeleteFile(name, "DAT");
+		}
+		fragmented.CopyFile("BULKLOAD", "BIN", clusters * HostFat::CLUSTER_BYTES, 7);
+		fragmented.Sync();
+		usb.Idle();
+
+		bool found = FindFile(usb, FILE_NAME, entry, fat);
+		bool ok = found && map.Map(entry.start_cluster, entry.size);
+		snprintf(note, sizeof(note), "# %-24s %u clusters in every other one: %s",
+				"map_fragmented", (unsigned) clusters,
+				ok ? (std::to_string(map.GetSpanCount()) + " spans").c_str() : "not mapped, read it instead");
+		notes.push_back(note);
+	}
+
+	return results;
+}
+
+//--------------------------------------------------------------------+
+// Access dates
+//--------------------------------------------------------------------+
+
+/**
+ * A host that bumps a file's last access date each time it reads it, as
+ * Windows does, over FILES small files on a fresh device: `reads` reads,
+ * then the drive sits idle and is pulled. Once for each AccessTimes
+ * policy. The row is the reads and the idle time after them; how many
+ * dates were kept in RAM, written or dropped, and how many survived the
+ * pull, go into `notes`.
+ */
+static std::vector<Result> AccessDates(uint32_t reads, std::vector<std::string>& notes) {
+	static constexpr uint32_t FILES = 8;
+	struct Policy {
+		const char* name;
+		uint32_t policy;
+	};
+	const Policy policies[] = {
+		{ "atime_write", ACCESS_TIMES_WRITE },
+		{ "atime_lazy", ACCESS_TIMES_LAZY },
+		{ "atime_drop", ACCESS_TIMES_DROP }
+	};
+
+	std::vector<Result> results;
+	for (const Policy& policy : policies) {
+		sim::Reset();
+		UsbHost usb;
+		usb.PowerOn(true);
+		HostFat host(usb, HostFat::WINDOWS);
+		host.Mount();
+
+		char name[9];
+		for (uint32_t i = 0; i < FILES; i++) {
+			snprintf(name, sizeof(name), "FILE%04u", (unsigned) i);
+			host.CopyFile(name, "TXT", 1000, 300 + i);
+		}
+		host.Sync();
+		usb.Idle();
+		while (msc_disk_maintenance());
+
+		// The files all land in the first root directory sector
+		std::vector<uint8_t> sector(trace::BLOCK_SIZE);
+		fat::DirectoryEntry* entries = (fat::DirectoryEntry*) sector.data();
+		std::vector<uint32_t> files;
+		usb.Read(Fat16::INDEX_ROOT_DIRECTORY, 1, sector.data());
+		for (uint32_t i = 0; i < AccessTimes::ENTRIES_PER_SECTOR; i++) {
+			if (memcmp(entries[i].name, "FILE", 4) == 0)
+				files.push_back(i);
+		}
+
+		std::vector<uint8_t> original = sector;
+		const fat::DirectoryEntry* original_entries = (const fat::DirectoryEntry*) original.data();
+
+		AccessTimes& times = msc_disk_begin_local_write()->GetAccessTimes();
+		times.SetPolicy(policy.policy);
+		times.GetStats() = AccessTimes::Stats();
+		usb.SetCounters(UsbHost::Counters());
+		sim::FlashStats before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		uint64_t start_us = sim::Now();
+
+		std::vector<uint8_t> data(2 * trace::BLOCK_SIZE);
+		std::vector<uint16_t> last_dates(AccessTimes::ENTRIES_PER_SECTOR);
+		for (uint32_t n = 0; n < reads && !files.empty(); n++) {
+			fat::DirectoryEntry& entry = entries[files[n % files.size()]];
+			usb.Read(Fat16::ClusterToLBA(entry.start_cluster), 2, data.data());
+
+			// A day later each time
+			entry.last_access_date = (uint16_t) (((45 + n / 336) << 9) | ((1 + n / 28 % 12) << 5) | (1 + n % 28));
+			last_dates[files[n % files.size()]] = entry.last_access_date;
+			usb.Write(Fat16::INDEX_ROOT_DIRECTORY, 1, sector.data());
+		}
+
+		uint64_t end_us = sim::Now();
+		usb.Idle();
+		while (msc_disk_maintenance());
+
+		Result r = Summarize(policy.name, usb.GetCounters(), before, start_us, end_us);
+		AccessTimes::Stats stats = times.GetStats();
+
+		usb.PowerOn(false);
+		usb.Read(Fat16::INDEX_ROOT_DIRECTORY, 1, sector.data());
+		uint32_t survived = 0;
+		for (uint32_t i : files) {
+			survived += entries[i].last_access_date == last_dates[i];
+			r.bad_blocks += !AccessTimes::OnlyTimes(original_entries[i], entries[i]);
+		}
+		results.push_back(r);
+
+		char note[160];
+		snprintf(note, sizeof(note), "# %-24s %u sectors kept in RAM, %u written for their dates, %u dropped; %u of %u dates survive a pull",
+				policy.name, (unsigned) stats.absorbed, (unsigned) stats.persisted, (unsigned) stats.dropped,
+				(unsigned) survived, (unsigned) files.size());
+		notes.push_back(note);
+	}
+
+	return results;
+}
+
+//--------------------------------------------------------------------+
+// MTP
+//--------------------------------------------------------------------+
+
+static constexpr uint16_t MTP_OPEN_SESSION = 0x1002;
+static constexpr uint16_t MTP_GET_OBJECT = 0x1009;
+static constexpr uint16_t MTP_DELETE_OBJECT = 0x100B;
+static constexpr uint16_t MTP_SEND_OBJECT_INFO = 0x100C;
+static constexpr uint16_t MTP_SEND_OBJECT = 0x100D;
+static constexpr int MTP_OK = 0x2001;
+
+/**
+ * The ObjectInfo dataset an initiator sends ahead of a file `name` of
+ * `size` bytes: the fixed fields, the filename as a PTP string, and empty
+ * dates and keywords.
+ */
+static std::vector<uint8_t> ObjectInfo(const char* name, uint32_t size) {
+	std::vector<uint8_t> info(52, 0);
+	uint32_t storage = 0x00010001;
+	uint16_t format = 0x3000;
+	memcpy(info.data(), &storage, 4);
+	memcpy(info.data() + 4, &format, 2);
+	memcpy(info.data() + 8, &size, 4);
+
+	info.push_back((uint8_t) (strlen(name) + 1));
+	for (const char* c = name; ; c++) {
+		info.push_back((uint8_t) *c);
+		info.push_back(0);
+		if (*c == 0)
+			break;
+	}
+
+	info.insert(info.end(), { 0, 0, 0 });
+	return info;
+}
+
+/**
+ * Copy a file of `size` bytes onto a fresh device, read it back and delete
+ * it, once through mass storage the way Linux does and once over MTP (see
+ * mtp_responder.h).
+ */
+static std::vector<Result> MtpCompare(uint32_t size) {
+	static const char FILE_NAME[] = "BULKLOADBIN";
+	std::vector<uint8_t> data = FileContents(size, 7);
+	std::vector<Result> results;
+
+	for (bool mtp : { false, true }) {
+		sim::Reset();
+		UsbHost usb;
+		usb.PowerOn(true);
+		HostFat host(usb, HostFat::LINUX);
+		uint32_t handle = 0;
+		if (mtp)
+			usb.Mtp(MTP_OPEN_SESSION, { 1 });
+		else
+			host.Mount();
+
+		// Copy
+		usb.SetCounters(UsbHost::Counters());
+		sim::FlashStats before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		uint64_t start_us = sim::Now();
+
+		if (mtp) {
+			std::vector<uint8_t> info = ObjectInfo("BULKLOAD.BIN", size);
+			std::vector<uint32_t> response;
+			if (usb.Mtp(MTP_SEND_OBJECT_INFO, { 0x00010001, 0xFFFFFFFF }, &info, nullptr, &response) == MTP_OK &&
+					response.size() == 3) {
+				handle = response[2];
+				usb.Mtp(MTP_SEND_OBJECT, {}, &data);
+			}
+		}
+		else {
+			host.CopyFile("BULKLOAD", "BIN", size, 7);
+			host.Sync();
+		}
+
+		uint64_t end_us = sim::Now();
+		usb.Idle();
+		Result r = Summarize(mtp ? "copy_mtp" : "copy_msc", usb.GetCounters(), before, start_us, end_us);
+
+		// Checked through mass storage either way, with the FAT and root
+		// directory read outside the clock
+		fat::DirectoryEntry entry;
+		std::vector<uint16_t> fat;
+		r.bad_blocks = CheckFile(usb, FILE_NAME, data);
+		results.push_back(r);
+		FindFile(usb, FILE_NAME, entry, fat);
+
+		// Read
+		usb.SetCounters(UsbHost::Counters());
+		before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		start_us = sim::Now();
+
+		uint32_t bad;
+		if (mtp) {
+			std::vector<uint8_t> contents;
+			usb.Mtp(MTP_GET_OBJECT, { handle }, nullptr, &contents);
+			bad = CountBad(contents, data, 0, size);
+		}
+		else
+			bad = ReadFile(usb, entry, fat, data);
+
+		results.push_back(Summarize(mtp ? "read_mtp" : "read_msc", usb.GetCounters(), before, start_us, sim::Now()));
+		results.back().bad_blocks = bad;
+
+		// Delete
+		usb.SetCounters(UsbHost::Counters());
+		before = sim::Stats();
+		FlashSession::GetStats() = FlashSession::Stats();
+		start_us = sim::Now();
+
+		if (mtp)
+			usb.Mtp(MTP_DELETE_OBJECT, { handle, 0 });
+		else {
+			host.DeleteFile("BULKLOAD", "BIN");
+			host.Sync();
+		}
+
+		end_us = sim::Now();
+		usb.Idle();
+		r = Summarize(mtp ? "delete_mtp" : "delete_msc", usb.GetCounters(), before, start_us, end_us);
+
+		// Gone, as a host mounting the volume again sees it
+		r.bad_blocks = FindFile(usb, FILE_NAME, entry, fat) ? 1 : 0;
+		results.push_back(r);
+	}
+
+	// copy, read and delete side by side
+	std::vector<Result> ordered;
+	for (size_t i = 0; i < 3; i++) {
+		ordered.push_back(results[i]);
+		ordered.push_back(results[i + 3]);
+	}
+	return ordered;
+}
+
+//--------------------------------------------------------------------+
+// Baseline
+//--------------------------------------------------------------------+
+
+static bool Compare(const std::string& path, const std::vector<Result>& results) {
+	std::ifstream file(path);
+	if (!file) {
+		fprintf(stderr, "Could not read %s\n", path.c_str());
+		return false;
+	}
+
+	std::map<std::string, Result> baseline;
+	std::string line;
+	while (std::getline(file, line)) {
+		Result r;
+		if (!line.empty() && line[0] != '#' && Parse(line, r))
+			baseline[r.name] = r;
+	}
+
+	bool ok = true;
+	for (const Result& r : results) {
+		auto it = baseline.find(r.name);
+		if (it == baseline.end()) {
+			printf("%-26s no baseline\n", r.name.c_str());
+			continue;
+		}
+
+		const Result& b = it->second;
+		std::vector<std::string> worse;
+		if (r.erases > b.erases * (1 + TOLERANCE))
+			worse.push_back("erases");
+		if (r.programmed_kb > b.programmed_kb * (1 + TOLERANCE))
+			worse.push_back("prog_kb");
+		if (r.device_ms > b.device_ms * (1 + TOLERANCE))
+			worse.push_back("device_ms");
+		if (r.mb_per_s < b.mb_per_s * (1 - TOLERANCE))
+			worse.push_back("mb/s");
+		if (r.failed > b.failed)
+			worse.push_back("fail");
+		if (r.bad_blocks > b.bad_blocks)
+			worse.push_back("bad");
+		if (r.xip_exits > b.xip_exits * (1 + TOLERANCE))
+			worse.push_back("exits");
+		if (r.irq_ms > b.irq_ms * (1 + TOLERANCE))
+			worse.push_back("irq_ms");
+
+		if (worse.empty()) {
+			printf("%-26s ok\n", r.name.c_str());
+			continue;
+		}
+
+		ok = false;
+		printf("%-26s REGRESSION:", r.name.c_str());
+		for (const std::string& w : worse)
+			printf(" %s", w.c_str());
+		printf("\n");
+	}
+
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	std::string compare;
+	std::string write_baseline;
+	std::vector<std::string> paths;
+	std::unique_ptr<FileBlockDevice> image;
+	uint32_t ingest_size = 0;
+	uint32_t http_size = 0;
+	uint32_t readahead_size = 0;
+	uint32_t append_records = 0;
+	uint32_t lookup_files = 0;
+	uint32_t sustained_size = 0;
+	double latency_target_ms = 500.0;
+	uint32_t mtp_size = 0;
+	uint32_t map_size = 0;
+	uint32_t atime_reads = 0;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--generate" && i + 1 < argc)
+			return GenerateAll(argv[++i]) ? 0 : 1;
+		else if (arg == "--compare" && i + 1 < argc)
+			compare = argv[++i];
+		else if (arg == "--write-baseline" && i + 1 < argc)
+			write_baseline = argv[++i];
+		else if (arg == "--overlap")
+			sim::Cost().flash_stalls_usb = false;
+		else if (arg == "--durable-ack")
+			msc_disk_write_queue().SetEarlyAck(false);
+		else if (arg == "--per-call")
+			FlashSession::SetBatching(false);
+		else if (arg == "--image" && i + 1 < argc) {
+			image.reset(new FileBlockDevice(argv[++i], Fat16::DISK_BLOCK_NUM * Fat16::DISK_BLOCK_SIZE));
+			sim::UseBackend(image.get());
+		}
+		else if (arg == "--ingest" && i + 1 < argc)
+			ingest_size = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--http" && i + 1 < argc)
+			http_size = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--readahead" && i + 1 < argc)
+			readahead_size = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--append" && i + 1 < argc)
+			append_records = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--lookup" && i + 1 < argc)
+			lookup_files = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--sustained" && i + 1 < argc)
+			sustained_size = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--mtp" && i + 1 < argc)
+			mtp_size = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--map" && i + 1 < argc)
+			map_size = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--atime" && i + 1 < argc)
+			atime_reads = (uint32_t) strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--latency-target" && i + 1 < argc)
+			latency_target_ms = strtod(argv[++i], nullptr);
+		else if (arg == "--slice" && i + 1 < argc)
+			FlashSession::SetSliceBudget((uint32_t) strtoul(argv[++i], nullptr, 0));
+		else if (arg == "--cost" && i + 1 < argc) {
+			if (!sim::LoadCost(argv[++i])) {
+				fprintf(stderr, "No cost figures in %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (arg[0] == '-') {
+			fprintf(stderr, "usage: %s [--generate DIR] [--compare FILE] [--write-baseline FILE] [--overlap] [--durable-ack] [--per-call] [--image FILE] [--ingest BYTES] [--http BYTES] [--readahead BYTES] [--append RECORDS] [--lookup FILES] [--sustained BYTES] [--latency-target MS] [--mtp BYTES] [--map BYTES] [--atime READS] [--slice US] [--cost FILE] TRACE...\n", argv[0]);
+			return 2;
+		}
+		else
+			paths.push_back(arg);
+	}
+
+	std::vector<Result> results;
+	printf("%s\n", HEADER);
+	for (const std::string& path : paths) {
+		trace::Trace t;
+		if (!trace::Load(path, t)) {
+			fprintf(stderr, "Could not load %s\n", path.c_str());
+			return 1;
+		}
+
+		results.push_back(Replay(t));
+		printf("%s\n", Format(results.back()).c_str());
+	}
+
+	if (ingest_size > 0) {
+		results.push_back(Upload("upload_linux_cp", UPLOAD_LINUX_CP, ingest_size));
+		results.push_back(Upload("upload_windows_copy", UPLOAD_WINDOWS_COPY, ingest_size));
+		results.push_back(Upload("upload_ingest", UPLOAD_INGEST, ingest_size));
+		for (size_t i = results.size() - 3; i < results.size(); i++)
+			printf("%s\n", Format(results[i]).c_str());
+	}
+
+	if (http_size > 0) {
+		for (const Result& r : Download(http_size)) {
+			results.push_back(r);
+			printf("%s\n", Format(r).c_str());
+		}
+	}
+
+	if (mtp_size > 0) {
+		for (const Result& r : MtpCompare(mtp_size)) {
+			results.push_back(r);
+			printf("%s\n", Format(r).c_str());
+		}
+	}
+
+	if (map_size > 0) {
+		std::vector<std::string> notes;
+		for (const Result& r : Mapped(map_size, notes)) {
+			results.push_back(r);
+			printf("%s\n", Format(r).c_str());
+		}
+		for (const std::string& note : notes)
+			printf("%s\n", note.c_str());
+	}
+
+	if (atime_reads > 0) {
+		std::vector<std::string> notes;
+		for (const Result& r : AccessDates(atime_reads, notes)) {
+			results.push_back(r);
+			printf("%s\n", Format(r).c_str());
+		}
+		for (const std::string& note : notes)
+			printf("%s\n", note.c_str());
+	}
+
+	if (readahead_size > 0) {
+		std::vector<std::string> notes;
+		for (const Result& r : Fragmented(readahead_size, notes)) {
+			results.push_back(r);
+			printf("%s\n", Format(r).c_str());
+		}
+		for (const std::string& note : notes)
+			printf("%s\n", note.c_str());
+	}
+
+	if (append_records > 0) {
+		std::vector<std::string> notes;
+		for (const Result& r : Append(append_records, notes)) {
+			results.push_back(r);
+			printf("%s\n", Format(r).c_str());
+		}
+		for (const std::string& note : notes)
+			printf("%s\n", note.c_str());
+	}
+
+	if (lookup_files > 0) {
+		std::vector<std::string> notes;
+		for (const Result& r : Lookup(lookup_files, notes)) {
+			results.push_back(r);
+			printf("%s\n", Format(r).c_str());
+		}
+		for (const std::string& note : notes)
+			printf("%s\n", note.c_str());
+	}
+
+	if (sustained_size > 0) {
+		std::vector<std::string> notes;
+		for (const Result& r : Sustained(sustained_size, latency_target_ms, notes)) {
+			results.push_back(r);
+			printf("%s\n", Format(r).c_str());
+		}
+		for (const std::string& note : notes)
+			printf("%s\n", note.c_str());
+	}
+
+	if (!write_baseline.empty()) {
+		std::ofstream file(write_baseline);
+		file << "# msc_bench baseline, regenerate with --write-baseline after an intended change.\n";
+		file << HEADER << "\n";
+		for (const Result& r : results)
+			file << Format(r) << "\n";
+	}
+
+	if (!compare.empty())
+		return Compare(compare, results) ? 0 : 1;
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+#pragma once
+#include "pico/time.h"
+
+static inline void board_init(void) {}
+static inline uint32_t board_millis(void) { return (uint32_t) (time_us_64() / 1000); }
@@ -0,0 +1,29 @@
+#pragma once
+#include "pico.h"
+
+// Subset of TinyUSB's SCSI definitions used by src/msc_disk.cpp.
+enum {
+	SCSI_CMD_TEST_UNIT_READY = 0x00,
+	SCSI_CMD_REQUEST_SENSE = 0x03,
+	SCSI_CMD_INQUIRY = 0x12,
+	SCSI_CMD_MODE_SELECT_6 = 0x15,
+	SCSI_CMD_MODE_SENSE_6 = 0x1A,
+	SCSI_CMD_START_STOP_UNIT = 0x1B,
+	SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL = 0x1E,
+	SCSI_CMD_READ_CAPACITY_10 = 0x25,
+	SCSI_CMD_READ_FORMAT_CAPACITY = 0x23,
+	SCSI_CMD_READ_10 = 0x28,
+	SCSI_CMD_WRITE_10 = 0x2A,
+};
+
+enum {
+	SCSI_SENSE_NONE = 0x00,
+	SCSI_SENSE_RECOVERED_ERROR = 0x01,
+	SCSI_SENSE_NOT_READY = 0x02,
+	SCSI_SENSE_MEDIUM_ERROR = 0x03,
+	SCSI_SENSE_HARDWARE_ERROR = 0x04,
+	SCSI_SENSE_ILLEGAL_REQUEST = 0x05,
+	SCSI_SENSE_UNIT_ATTENTION = 0x06,
+	SCSI_SENSE_DATA_PROTECT = 0x07,
+	SCSI_SENSE_ABORTED_COMMAND = 0x0b,
+};
@@ -0,0 +1,20 @@
+#pragma once
+#include "pico.h"
+
+#define GPIO_IN false
+#define GPIO_OUT true
+
+enum gpio_function { GPIO_FUNC_SPI = 1, GPIO_FUNC_UART = 2 };
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_pull_up(uint gpio);
+bool gpio_get(uint gpio);
+void gpio_put(uint gpio, bool value);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+#ifdef __cplusplus
+}
+#endif
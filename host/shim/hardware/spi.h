@@ -0,0 +1,20 @@
+#pragma once
+// Host stand-in for hardware/spi.h. Declarations only: the SPI backends are
+// compiled on the host to keep them building, but nothing drives a bus.
+#include "pico.h"
+
+typedef struct spi_inst spi_inst_t;
+#define spi0 ((spi_inst_t *) 0)
+#define spi1 ((spi_inst_t *) 1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uint spi_init(spi_inst_t *spi, uint baudrate);
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate);
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len);
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len);
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+#include "pico.h"
+
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void) status; }
+static inline void __wfe(void) {}
+static inline void __wfi(void) {}
+static inline void __sev(void) {}
@@ -0,0 +1,15 @@
+#pragma once
+// Host stand-in for lwIP's error codes, see host/sim_net.cpp
+#include <stdint.h>
+
+typedef int8_t err_t;
+
+#define ERR_OK    0
+#define ERR_MEM  -1
+#define ERR_BUF  -2
+#define ERR_VAL  -6
+#define ERR_USE  -8
+#define ERR_CONN -11
+#define ERR_ABRT -13
+#define ERR_RST  -14
+#define ERR_CLSD -15
@@ -0,0 +1,14 @@
+#pragma once
+// Host stand-in for lwIP's addresses. The loopback only has the one host,
+// so an address is just a placeholder.
+#include <stdint.h>
+
+typedef struct ip_addr {
+	uint32_t addr;
+} ip_addr_t;
+
+#define IPADDR_TYPE_V4  0U
+#define IPADDR_TYPE_ANY 46U
+
+#define IP_ADDR_ANY ((const ip_addr_t*) 0)
+#define IP_ANY_TYPE ((const ip_addr_t*) 0)
@@ -0,0 +1,22 @@
+#pragma once
+// Host stand-in for lwIP's packet buffers, as the raw TCP API hands them
+// to a receive callback
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pbuf {
+	struct pbuf* next;
+	void* payload;
+	uint16_t tot_len; // This one and the rest of the chain
+	uint16_t len;
+};
+
+uint8_t pbuf_free(struct pbuf* p);
+uint16_t pbuf_copy_partial(const struct pbuf* p, void* dataptr, uint16_t len, uint16_t offset);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+// Host stand-in for lwIP's raw TCP API. Only what the firmware calls is
+// provided; host/sim_net.cpp connects it to a loopback the simulator
+// drives (see sim::TcpConnect), so the firmware side runs unmodified.
+#include <stdint.h>
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+
+// As in the firmware's lwipopts.h
+#define TCP_MSS     1460
+#define TCP_SND_BUF (8 * TCP_MSS)
+
+#define TCP_WRITE_FLAG_COPY 0x01
+#define TCP_WRITE_FLAG_MORE 0x02
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tcp_pcb;
+
+typedef err_t (*tcp_accept_fn)(void* arg, struct tcp_pcb* newpcb, err_t err);
+typedef err_t (*tcp_recv_fn)(void* arg, struct tcp_pcb* tpcb, struct pbuf* p, err_t err);
+typedef err_t (*tcp_sent_fn)(void* arg, struct tcp_pcb* tpcb, uint16_t len);
+typedef err_t (*tcp_poll_fn)(void* arg, struct tcp_pcb* tpcb);
+typedef void (*tcp_err_fn)(void* arg, err_t err);
+
+struct tcp_pcb* tcp_new_ip_type(uint8_t type);
+err_t tcp_bind(struct tcp_pcb* pcb, const ip_addr_t* ipaddr, uint16_t port);
+struct tcp_pcb* tcp_listen_with_backlog(struct tcp_pcb* pcb, uint8_t backlog);
+void tcp_accept(struct tcp_pcb* pcb, tcp_accept_fn accept);
+
+void tcp_arg(struct tcp_pcb* pcb, void* arg);
+void tcp_recv(struct tcp_pcb* pcb, tcp_recv_fn recv);
+void tcp_sent(struct tcp_pcb* pcb, tcp_sent_fn sent);
+void tcp_err(struct tcp_pcb* pcb, tcp_err_fn err);
+void tcp_poll(struct tcp_pcb* pcb, tcp_poll_fn poll, uint8_t interval);
+
+err_t tcp_write(struct tcp_pcb* pcb, const void* dataptr, uint16_t len, uint8_t apiflags);
+err_t tcp_output(struct tcp_pcb* pcb);
+uint16_t tcp_sndbuf(const struct tcp_pcb* pcb);
+void tcp_recved(struct tcp_pcb* pcb, uint16_t len);
+err_t tcp_close(struct tcp_pcb* pcb);
+void tcp_abort(struct tcp_pcb* pcb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define tcp_listen(pcb) tcp_listen_with_backlog(pcb, 0xff)
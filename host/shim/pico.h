@@ -0,0 +1,31 @@
+#pragma once
+// Host stand-in for the pico-sdk base header. Only what the storage code
+// touches is provided; flash lives in an emulated array instead of at
+// 0x10000000.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned int uint;
+
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+#endif
+
+#define PICO_ON_DEVICE 0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uintptr_t sim_flash_base(void);
+#ifdef __cplusplus
+}
+#endif
+
+#define XIP_BASE (sim_flash_base())
+#define XIP_NOCACHE_NOALLOC_BASE (sim_flash_base())
+
+#define __not_in_flash_func(func) func
+#define __no_inline_not_in_flash_func(func) func
+#define __time_critical_func(func) func
@@ -0,0 +1,7 @@
+#pragma once
+#include "pico.h"
+
+#define CYW43_WL_GPIO_LED_PIN 0
+
+static inline int cyw43_arch_init(void) { return 0; }
+static inline void cyw43_arch_gpio_put(uint wl_gpio, bool value) { (void) wl_gpio; (void) value; }
@@ -0,0 +1,5 @@
+#pragma once
+#include "pico.h"
+#include "pico/time.h"
+#include "hardware/gpio.h"
+#include "hardware/uart.h"
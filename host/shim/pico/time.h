@@ -0,0 +1,23 @@
+#pragma once
+// Host stand-in for pico/time.h. Time is simulated: it only moves when the
+// emulated flash or USB link spends it, or when firmware sleeps.
+#include "pico.h"
+
+typedef uint64_t absolute_time_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uint64_t time_us_64(void);
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp);
+#ifdef __cplusplus
+}
+#endif
+
+static inline uint32_t time_us_32(void) { return (uint32_t) time_us_64(); }
+static inline absolute_time_t get_absolute_time(void) { return time_us_64(); }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t) (t / 1000); }
+static inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
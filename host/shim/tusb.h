@@ -0,0 +1,36 @@
+#pragma once
+// Host stand-in for TinyUSB. The simulator calls the tud_msc_*_cb callbacks
+// directly, the way usbd/msc_device.c would, and records the sense data.
+// The vendor class reads and writes FIFOs the simulator fills and drains.
+#include "pico.h"
+#include "class/msc/msc.h"
+
+#define OPT_MCU_RP2040 1900
+#define CFG_TUSB_MCU OPT_MCU_RP2040
+#include "tusb_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
+void tud_task(void);
+
+bool tud_vendor_mounted(void);
+uint32_t tud_vendor_available(void);
+uint32_t tud_vendor_read(void* buffer, uint32_t bufsize);
+uint32_t tud_vendor_write(const void* buffer, uint32_t bufsize);
+uint32_t tud_vendor_write_flush(void);
+bool tusb_init(void);
+
+// Application callbacks, as declared by class/msc/msc_device.h
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]);
+bool tud_msc_test_unit_ready_cb(uint8_t lun);
+void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size);
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject);
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize);
+bool tud_msc_is_writable_cb(uint8_t lun);
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize);
+#ifdef __cplusplus
+}
+#endif
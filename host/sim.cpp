@@ -0,0 +1,409 @@
+#include "sim.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <hardware/flash.h>
+#include "flash_session.h"
+#include "sniff_crc.h"
+#include <hardware/gpio.h>
+#include <pico/time.h>
+#include "tusb.h"
+#include "mtp_usb.h"
+
+namespace sim {
+
+static uint8_t flash[PICO_FLASH_SIZE_BYTES];
+static CostModel cost;
+static FlashStats stats;
+static double now_us = 0;
+static bool pins[32];
+static Sense sense;
+static std::deque<uint8_t> vendor_rx;
+static std::deque<uint8_t> vendor_tx;
+static std::deque<uint8_t> mtp_rx;
+static std::deque<uint8_t> mtp_tx;
+
+// sim_net.cpp
+void TcpResetAll();
+
+void Reset() {
+	memset(flash, 0xFF, sizeof(flash));
+	stats = FlashStats();
+	stats.sector_erases.assign(sizeof(flash) / FLASH_SECTOR_SIZE, 0);
+	now_us = 0;
+	for (bool& pin : pins)
+		pin = true;
+	sense = Sense();
+	vendor_rx.clear();
+	vendor_tx.clear();
+	mtp_rx.clear();
+	mtp_tx.clear();
+	TcpResetAll();
+}
+
+CostModel& Cost() {
+	return cost;
+}
+
+FlashStats& Stats() {
+	return stats;
+}
+
+bool LoadCost(const char* path) {
+	static const struct {
+		const char* name;
+		double CostModel::* field;
+	} FIELDS[] = {
+		{ "erase_sector_us", &CostModel::erase_sector_us },
+		{ "program_page_us", &CostModel::program_page_us },
+		{ "flash_op_us", &CostModel::flash_op_us },
+		{ "erase_suspend_us", &CostModel::erase_suspend_us },
+		{ "xip_read_us_per_byte", &CostModel::xip_read_us_per_byte },
+		{ "usb_command_us", &CostModel::usb_command_us },
+		{ "usb_us_per_byte", &CostModel::usb_us_per_byte },
+	};
+
+	FILE* file = fopen(path, "r");
+	if (file == nullptr)
+		return false;
+
+	uint32_t found = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), file) != nullptr) {
+		char name[64];
+		double value;
+		if (sscanf(line, "# cost %63s %lf", name, &value) != 2)
+			continue;
+
+		for (const auto& f : FIELDS) {
+			if (strcmp(name, f.name) == 0) {
+				cost.*f.field = value;
+				found++;
+			}
+		}
+	}
+
+	fclose(file);
+	return found > 0;
+}
+
+uint8_t* Flash() {
+	return flash;
+}
+
+size_t FlashSize() {
+	return sizeof(flash);
+}
+
+uint64_t Now() {
+	return (uint64_t) now_us;
+}
+
+void Advance(double us) {
+	now_us += us;
+}
+
+void SetPin(unsigned pin, bool level) {
+	pins[pin % 32] = level;
+}
+
+Sense& LastSense() {
+	return sense;
+}
+
+std::deque<uint8_t>& VendorRx() {
+	return vendor_rx;
+}
+
+std::deque<uint8_t>& VendorTx() {
+	return vendor_tx;
+}
+
+std::deque<uint8_t>& MtpRx() {
+	return mtp_rx;
+}
+
+std::deque<uint8_t>& MtpTx() {
+	return mtp_tx;
+}
+
+static void Busy(double us) {
+	stats.busy_us += us;
+	now_us += us;
+}
+
+}
+
+//--------------------------------------------------------------------+
+// pico-sdk
+//--------------------------------------------------------------------+
+
+extern "C" uintptr_t sim_flash_base(void) {
+	return (uintptr_t) sim::flash;
+}
+
+/**
+ * Set `sectors` sectors from `flash_offs` to 0xFF and count them, once
+ * the chip is done with them.
+ */
+static void sim_erased(uint32_t flash_offs, size_t sectors) {
+	memset(sim::flash + flash_offs, 0xFF, sectors * FLASH_SECTOR_SIZE);
+
+	for (size_t i = 0; i < sectors; i++)
+		sim::stats.sector_erases[flash_offs / FLASH_SECTOR_SIZE + i]++;
+	sim::stats.sectors_erased += sectors;
+}
+
+/**
+ * Same contract as the SDK: offset and count are sector aligned, and the
+ * whole range is set to 0xFF.
+ */
+static void sim_erase(uint32_t flash_offs, size_t count) {
+	assert(flash_offs % FLASH_SECTOR_SIZE == 0);
+	assert(count % FLASH_SECTOR_SIZE == 0);
+	assert(flash_offs + count <= sizeof(sim::flash));
+
+	size_t sectors = count / FLASH_SECTOR_SIZE;
+	sim_erased(flash_offs, sectors);
+	sim::stats.erase_ops++;
+	sim::Busy(sim::cost.erase_sector_us * sectors);
+}
+
+/**
+ * Same contract as the SDK: offset and count are page aligned. NOR flash
+ * can only clear bits, so programming is an AND with what is already there.
+ */
+static void sim_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+	assert(flash_offs % FLASH_PAGE_SIZE == 0);
+	assert(count % FLASH_PAGE_SIZE == 0);
+	assert(flash_offs + count <= sizeof(sim::flash));
+
+	for (size_t i = 0; i < count; i++)
+		sim::flash[flash_offs + i] &= data[i];
+
+	sim::stats.program_ops++;
+	sim::stats.bytes_programmed += count;
+	sim::Busy(sim::cost.program_page_us * (count / FLASH_PAGE_SIZE));
+}
+
+/**
+ * Leaving and re-entering XIP, paid once per call into the flash.
+ */
+static void sim_xip_exit() {
+	sim::stats.xip_exits++;
+	sim::Busy(sim::cost.flash_op_us);
+}
+
+extern "C" void flash_range_erase(uint32_t flash_offs, size_t count) {
+	sim_xip_exit();
+	sim_erase(flash_offs, count);
+}
+
+extern "C" void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+	sim_xip_exit();
+	sim_program(flash_offs, data, count);
+}
+
+void flash_session_execute(const FlashSession::Op* ops, size_t count) {
+	sim_xip_exit();
+
+	for (size_t i = 0; i < count; i++) {
+		if (ops[i].data == nullptr)
+			sim_erase(ops[i].offset, ops[i].count);
+		else
+			sim_program(ops[i].offset, ops[i].data, ops[i].count);
+	}
+}
+
+/**
+ * The model charges by the sector whatever the command.
+ */
+void flash_session_erase_blocks(uint32_t offset, uint32_t count, uint32_t block_size, uint8_t block_command) {
+	(void) block_size;
+	(void) block_command;
+	sim_xip_exit();
+	sim_erase(offset, count);
+}
+
+/**
+ * The erase takes as long in slices as in one go; each suspend adds
+ * tSUS. What the sector reads back as in between is undefined, and
+ * PicoFlash never reads it, so it changes once the erase is done.
+ */
+bool flash_session_erase_slice(uint32_t offset, bool resume, uint32_t budget_us) {
+	static double left_us = 0;
+
+	assert(offset % FLASH_SECTOR_SIZE == 0);
+	assert(offset + FLASH_SECTOR_SIZE <= sizeof(sim::flash));
+
+	sim_xip_exit();
+	if (!resume) {
+		left_us = sim::cost.erase_sector_us;
+		sim::stats.erase_ops++;
+	}
+
+	double run_us = std::min(left_us, (double) budget_us);
+	sim::Busy(run_us);
+	left_us -= run_us;
+
+	if (left_us > 0) {
+		sim::Busy(sim::cost.erase_suspend_us);
+		return false;
+	}
+
+	sim_erased(offset, 1);
+	return true;
+}
+
+/**
+ * What the DMA sniffer does in CRC32R mode, a bit at a time. Every read of
+ * the volume out of XIP comes through here, so this is where it is
+ * charged; copies of RAM are free.
+ */
+uint32_t sniff_crc(const void* src, uint32_t bytes, uint32_t crc) {
+	const uint8_t* data = (const uint8_t*) src;
+	if (data >= sim::flash && data < sim::flash + sizeof(sim::flash)) {
+		double us = sim::cost.xip_read_us_per_byte * bytes;
+		sim::stats.bytes_read += bytes;
+		sim::stats.read_us += us;
+		sim::now_us += us;
+	}
+
+	for (uint32_t i = 0; i < bytes; i++) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+	}
+
+	return crc;
+}
+
+uint32_t sniff_copy(void* dst, const void* src, uint32_t bytes, uint32_t crc) {
+	memcpy(dst, src, bytes);
+	return sniff_crc(src, bytes, crc);
+}
+
+extern "C" uint64_t time_us_64(void) {
+	return sim::Now();
+}
+
+extern "C" void sleep_us(uint64_t us) {
+	sim::Advance((double) us);
+}
+
+extern "C" void sleep_ms(uint32_t ms) {
+	sim::Advance(ms * 1000.0);
+}
+
+/**
+ * Nothing raises events on the host, so this always sleeps to the timeout.
+ */
+extern "C" bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp) {
+	if (timeout_timestamp > sim::Now())
+		sim::Advance((double) (timeout_timestamp - sim::Now()));
+	return true;
+}
+
+extern "C" void gpio_init(uint gpio) {
+	(void) gpio;
+}
+
+extern "C" void gpio_set_dir(uint gpio, bool out) {
+	(void) gpio;
+	(void) out;
+}
+
+extern "C" void gpio_pull_up(uint gpio) {
+	(void) gpio;
+}
+
+extern "C" bool gpio_get(uint gpio) {
+	return sim::pins[gpio % 32];
+}
+
+extern "C" void gpio_put(uint gpio, bool value) {
+	sim::pins[gpio % 32] = value;
+}
+
+extern "C" void gpio_set_function(uint gpio, enum gpio_function fn) {
+	(void) gpio;
+	(void) fn;
+}
+
+//--------------------------------------------------------------------+
+// TinyUSB
+//--------------------------------------------------------------------+
+
+extern "C" bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier) {
+	(void) lun;
+	sim::sense.key = sense_key;
+	sim::sense.asc = add_sense_code;
+	sim::sense.ascq = add_sense_qualifier;
+	return true;
+}
+
+extern "C" bool tud_vendor_mounted(void) {
+	return true;
+}
+
+extern "C" uint32_t tud_vendor_available(void) {
+	return (uint32_t) sim::vendor_rx.size();
+}
+
+extern "C" uint32_t tud_vendor_read(void* buffer, uint32_t bufsize) {
+	uint32_t count = std::min<uint32_t>(bufsize, (uint32_t) sim::vendor_rx.size());
+	std::copy(sim::vendor_rx.begin(), sim::vendor_rx.begin() + count, (uint8_t*) buffer);
+	sim::vendor_rx.erase(sim::vendor_rx.begin(), sim::vendor_rx.begin() + count);
+	return count;
+}
+
+extern "C" uint32_t tud_vendor_write(const void* buffer, uint32_t bufsize) {
+	const uint8_t* data = (const uint8_t*) buffer;
+	sim::vendor_tx.insert(sim::vendor_tx.end(), data, data + bufsize);
+	return bufsize;
+}
+
+extern "C" uint32_t tud_vendor_write_flush(void) {
+	return 0;
+}
+
+bool mtp_usb_mounted() {
+	return true;
+}
+
+uint32_t mtp_usb_available() {
+	return (uint32_t) sim::mtp_rx.size();
+}
+
+uint32_t mtp_usb_read(void* buffer, uint32_t bufsize) {
+	uint32_t count = std::min<uint32_t>(bufsize, (uint32_t) sim::mtp_rx.size());
+	std::copy(sim::mtp_rx.begin(), sim::mtp_rx.begin() + count, (uint8_t*) buffer);
+	sim::mtp_rx.erase(sim::mtp_rx.begin(), sim::mtp_rx.begin() + count);
+	return count;
+}
+
+uint32_t mtp_usb_write_available() {
+	return MTP_USB_TX_BUFSIZE - std::min<uint32_t>(MTP_USB_TX_BUFSIZE, (uint32_t) sim::mtp_tx.size());
+}
+
+uint32_t mtp_usb_write(const void* buffer, uint32_t bufsize) {
+	const uint8_t* data = (const uint8_t*) buffer;
+	uint32_t count = std::min(bufsize, mtp_usb_write_available());
+	sim::mtp_tx.insert(sim::mtp_tx.end(), data, data + count);
+	return count;
+}
+
+void mtp_usb_end_container() {
+}
+
+bool mtp_usb_take_reset() {
+	return false;
+}
+
+extern "C" void tud_task(void) {
+}
+
+extern "C" bool tusb_init(void) {
+	return true;
+}
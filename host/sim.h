@@ -0,0 +1,146 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+/**
+ * Host simulator for the storage path. The pico-sdk calls the firmware
+ * makes (flash_range_erase, flash_range_program, XIP reads, gpio, time)
+ * land here instead of on the RP2040, so src/fat.cpp and src/msc_disk.cpp
+ * run unmodified on a PC against an emulated 2mb flash chip.
+ *
+ * Time is simulated. Every flash operation advances the clock by what the
+ * cost model says the real chip would take, so time_us_64() inside the
+ * firmware reads back modeled device time.
+ */
+namespace sim {
+
+/**
+ * Typical timings for the W25Q16JV on the Pico W, in microseconds. Erase
+ * and program come from the datasheet "typ" column; the USB figures are
+ * what a full-speed bulk pipe achieves with 64 byte packets.
+ */
+struct CostModel {
+	double erase_sector_us = 45000.0;    // 4kb sector erase
+	double program_page_us = 400.0;      // 256 byte page program
+	double flash_op_us = 20.0;           // Interrupts off, XIP exit/re-entry, cache flush
+	double erase_suspend_us = 20.0;      // tSUS, stopping an erase that is cut into slices
+	double xip_read_us_per_byte = 0.05;  // ~20mb/s through the XIP cache
+	double usb_command_us = 1000.0;      // CBW + CSW, one frame each
+	double usb_us_per_byte = 1.0;        // ~1mb/s of bulk payload
+	double wifi_request_us = 4000.0;     // TCP handshake and request, two round trips
+	double wifi_us_per_byte = 0.8;       // ~1.2mb/s of TCP payload through the cyw43
+
+	// The internal flash runs with XIP off and interrupts disabled, so
+	// while it is busy the USB controller is not serviced and the link
+	// stalls. A backing store that leaves the core free would clear this.
+	bool flash_stalls_usb = true;
+};
+
+struct FlashStats {
+	uint64_t erase_ops = 0;      // flash_range_erase calls
+	uint64_t sectors_erased = 0;
+	uint64_t program_ops = 0;    // flash_range_program calls
+	uint64_t bytes_programmed = 0;
+	uint64_t xip_exits = 0;      // Times the flash left XIP for any of the above
+	double busy_us = 0;          // Modeled time the chip was busy
+	uint64_t bytes_read = 0;     // Through XIP, by the firmware
+	double read_us = 0;          // Modeled time spent on those reads
+	std::vector<uint32_t> sector_erases; // Per 4kb sector, for wear
+};
+
+/**
+ * Fill the emulated chip with 0xFF (a blank, erased part), zero the stats
+ * and the clock, and release the GPIO17 reset jumper. Open TCP
+ * connections are reset; listeners stay.
+ */
+void Reset();
+
+CostModel& Cost();
+FlashStats& Stats();
+
+/**
+ * Take the cost model's figures from the "# cost NAME VALUE" lines in
+ * `path`, as the flash_bench firmware prints them for a real chip. Fields
+ * it does not name keep their values. False if it cannot be read or names
+ * none.
+ */
+bool LoadCost(const char* path);
+
+uint8_t* Flash();
+size_t FlashSize();
+
+/**
+ * Simulated clock. Advance() is used by the harness to account for time
+ * spent on the USB side of a transfer.
+ */
+uint64_t Now();
+void Advance(double us);
+
+/**
+ * Level seen by gpio_get() on `pin`. Pins float high (pull-ups) unless
+ * driven low here, e.g. holding GPIO17 low formats the volume.
+ */
+void SetPin(unsigned pin, bool level);
+
+/**
+ * Last sense data set by the firmware through tud_msc_set_sense().
+ */
+struct Sense {
+	uint8_t key = 0;
+	uint8_t asc = 0;
+	uint8_t ascq = 0;
+};
+
+Sense& LastSense();
+
+/**
+ * The vendor interface's FIFOs as TinyUSB keeps them: `VendorRx` is what
+ * the host sent and the firmware has not read yet, at most
+ * CFG_TUD_VENDOR_RX_BUFSIZE, and `VendorTx` what the firmware wrote back.
+ */
+std::deque<uint8_t>& VendorRx();
+std::deque<uint8_t>& VendorTx();
+
+/**
+ * The MTP interface's pipes (see mtp_usb.h) the same way: `MtpRx` holds
+ * at most MTP_USB_RX_BUFSIZE and `MtpTx` MTP_USB_TX_BUFSIZE. Containers
+ * are read off by their length, so there are no packets to end them.
+ */
+std::deque<uint8_t>& MtpRx();
+std::deque<uint8_t>& MtpTx();
+
+/**
+ * The other end of the firmware's lwIP raw TCP calls (shim/lwip/tcp.h), a
+ * loopback with one client instead of a network. TcpConnect() goes to
+ * whatever listens on `port` and returns a handle, or -1 if nothing
+ * accepted it. What the client sends arrives in the firmware's receive
+ * callback a segment at a time; what the firmware writes can be read once
+ * it called tcp_output(), and reading it acknowledges it, so the send
+ * buffer only drains as fast as the client reads.
+ */
+int TcpConnect(uint16_t port);
+void TcpSend(int connection, const void* data, size_t length);
+size_t TcpReceive(int connection, std::vector<uint8_t>& out);
+
+/**
+ * Whether the firmware closed the connection, and everything it sent
+ * has been read; or reset it, which throws away what was not read.
+ */
+bool TcpClosed(int connection);
+bool TcpWasReset(int connection);
+
+/**
+ * Close the client end and forget the handle. A connection the firmware
+ * has not closed by then is reset.
+ */
+void TcpClose(int connection);
+
+/**
+ * lwIP's coarse timer, every half second: calls the poll callbacks that
+ * are due.
+ */
+void TcpTick();
+
+}
@@ -0,0 +1,49 @@
+#include "sim_backend.h"
+#include <memory>
+#include "internal_flash.hpp"
+#include "storage_backend.h"
+
+// Host replacement for src/storage_backend.cpp, where the choice is made
+// at build time instead.
+static InternalFlash internal_flash;
+static IntegrityDevice internal_integrity(internal_flash, INTEGRITY_CHECKS, INTEGRITY_VERIFY_READS);
+static std::unique_ptr<SnapshotDevice> internal_snapshots(
+	new SnapshotDevice(internal_integrity, SNAPSHOT_SPARE_UNITS));
+
+// Other devices are passed through as they are, so a file image keeps
+// the 1:1 layout
+static std::unique_ptr<IntegrityDevice> other_integrity;
+static std::unique_ptr<SnapshotDevice> other;
+static IntegrityDevice* selected_integrity = &internal_integrity;
+static SnapshotDevice* selected = internal_snapshots.get();
+
+namespace sim {
+
+void UseBackend(BlockDevice* device) {
+	other.reset();
+	other_integrity.reset(device ? new IntegrityDevice(*device, false) : nullptr);
+	other.reset(device ? new SnapshotDevice(*other_integrity, 0) : nullptr);
+	selected_integrity = device ? other_integrity.get() : &internal_integrity;
+	selected = device ? other.get() : internal_snapshots.get();
+}
+
+void UseSnapshotSpares(uint32_t units) {
+	bool internal = selected == internal_snapshots.get();
+	internal_snapshots.reset(new SnapshotDevice(internal_integrity, units));
+	if (internal)
+		selected = internal_snapshots.get();
+}
+
+}
+
+BlockDevice& storage_backend() {
+	return *selected;
+}
+
+SnapshotDevice& storage_snapshots() {
+	return *selected;
+}
+
+IntegrityDevice& storage_integrity() {
+	return *selected_integrity;
+}
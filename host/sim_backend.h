@@ -0,0 +1,20 @@
+#pragma once
+#include "block_device.h"
+
+namespace sim {
+
+/**
+ * Pick what storage_backend() hands the firmware on its next power on.
+ * nullptr selects the internal flash, backed by the emulated chip and
+ * with snapshots. Other devices are used without snapshots.
+ */
+void UseBackend(BlockDevice* device);
+
+/**
+ * Rebuild the internal flash's snapshot layer with `units` spare units
+ * instead of SNAPSHOT_SPARE_UNITS, from the next power on. The volume
+ * shrinks to make room, so the flash wants formatting afterwards.
+ */
+void UseSnapshotSpares(uint32_t units);
+
+}
@@ -0,0 +1,321 @@
+#include "sim.h"
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include "lwip/tcp.h"
+
+/**
+ * lwIP's raw TCP API on a loopback, see sim::TcpConnect. A pcb is either a
+ * listener or one end of a connection; the client end is just the
+ * handle's state here. Callbacks are made the way lwIP makes them: an
+ * err callback when the connection is reset or aborted (after which the
+ * pcb is gone), a NULL pbuf when the client closes.
+ */
+struct tcp_pcb {
+	void* arg = nullptr;
+	tcp_accept_fn accept = nullptr;
+	tcp_recv_fn recv = nullptr;
+	tcp_sent_fn sent = nullptr;
+	tcp_err_fn err = nullptr;
+	tcp_poll_fn poll = nullptr;
+	uint8_t poll_interval = 0;
+	uint8_t poll_ticks = 0;
+
+	uint16_t port = 0;
+	bool listening = false;
+	int connection = -1;
+
+	uint32_t unsent = 0;        // Written, not yet output
+	uint32_t unacked = 0;       // Output, not yet read by the client
+};
+
+namespace sim {
+
+struct Connection {
+	tcp_pcb* pcb = nullptr;     // Until the firmware closes or aborts it
+	std::vector<uint8_t> to_client;
+	uint32_t visible = 0;       // Bytes of to_client the firmware output
+	bool closed = false;
+	bool reset = false;
+};
+
+static std::map<uint16_t, tcp_pcb*> listeners;
+static std::map<int, Connection> connections;
+static int next_connection = 0;
+
+/**
+ * The firmware is done with the pcb.
+ */
+static void Release(tcp_pcb* pcb) {
+	auto it = connections.find(pcb->connection);
+	if (it != connections.end())
+		it->second.pcb = nullptr;
+	delete pcb;
+}
+
+int TcpConnect(uint16_t port) {
+	auto listener = listeners.find(port);
+	if (listener == listeners.end() || listener->second->accept == nullptr)
+		return -1;
+
+	int id = next_connection++;
+	tcp_pcb* pcb = new tcp_pcb();
+	pcb->port = port;
+	pcb->connection = id;
+	connections[id].pcb = pcb;
+
+	if (listener->second->accept(listener->second->arg, pcb, ERR_OK) != ERR_OK) {
+		if (connections[id].pcb != nullptr)
+			Release(pcb);
+		connections.erase(id);
+		return -1;
+	}
+
+	return id;
+}
+
+void TcpSend(int connection, const void* data, size_t length) {
+	const uint8_t* bytes = (const uint8_t*) data;
+
+	// A segment at a time, as it would come off the wire
+	for (size_t done = 0; done < length; done += TCP_MSS) {
+		Connection& c = connections[connection];
+		if (c.pcb == nullptr || c.pcb->recv == nullptr)
+			return;
+
+		uint16_t chunk = (uint16_t) std::min<size_t>(length - done, TCP_MSS);
+		pbuf* p = new pbuf();
+		p->payload = new uint8_t[chunk];
+		memcpy(p->payload, bytes + done, chunk);
+		p->len = p->tot_len = chunk;
+		c.pcb->recv(c.pcb->arg, c.pcb, p, ERR_OK);
+	}
+}
+
+size_t TcpReceive(int connection, std::vector<uint8_t>& out) {
+	Connection& c = connections[connection];
+	if (c.reset || c.visible == 0)
+		return 0;
+
+	uint32_t length = c.visible;
+	out.insert(out.end(), c.to_client.begin(), c.to_client.begin() + length);
+	c.to_client.erase(c.to_client.begin(), c.to_client.begin() + length);
+	c.visible = 0;
+
+	// The acknowledgement frees the firmware's send buffer
+	if (c.pcb != nullptr) {
+		c.pcb->unacked -= length;
+		if (c.pcb->sent != nullptr)
+			c.pcb->sent(c.pcb->arg, c.pcb, (uint16_t) std::min<uint32_t>(length, 0xFFFF));
+	}
+
+	return length;
+}
+
+bool TcpClosed(int connection) {
+	const Connection& c = connections[connection];
+	return c.reset || (c.closed && c.to_client.empty());
+}
+
+bool TcpWasReset(int connection) {
+	return connections[connection].reset;
+}
+
+void TcpClose(int connection) {
+	Connection& c = connections[connection];
+	if (c.pcb != nullptr && c.pcb->recv != nullptr)
+		c.pcb->recv(c.pcb->arg, c.pcb, nullptr, ERR_OK);
+
+	// Anything the firmware still sends is answered with a reset
+	tcp_pcb* pcb = c.pcb;
+	connections.erase(connection);
+	if (pcb != nullptr) {
+		tcp_err_fn err = pcb->err;
+		void* arg = pcb->arg;
+		delete pcb;
+		if (err != nullptr)
+			err(arg, ERR_RST);
+	}
+}
+
+void TcpTick() {
+	std::vector<tcp_pcb*> due;
+	for (auto& [id, c] : connections) {
+		if (c.pcb != nullptr && c.pcb->poll != nullptr && ++c.pcb->poll_ticks >= c.pcb->poll_interval) {
+			c.pcb->poll_ticks = 0;
+			due.push_back(c.pcb);
+		}
+	}
+
+	// A callback may abort its own pcb, but no other
+	for (tcp_pcb* pcb : due)
+		pcb->poll(pcb->arg, pcb);
+}
+
+void TcpResetAll() {
+	for (auto& [id, c] : connections) {
+		tcp_pcb* pcb = c.pcb;
+		if (pcb == nullptr)
+			continue;
+
+		c.pcb = nullptr;
+		if (pcb->err != nullptr)
+			pcb->err(pcb->arg, ERR_RST);
+		delete pcb;
+	}
+
+	connections.clear();
+}
+
+}
+
+//--------------------------------------------------------------------+
+// lwIP raw API
+//--------------------------------------------------------------------+
+
+static sim::Connection* connection_of(tcp_pcb* pcb) {
+	auto it = sim::connections.find(pcb->connection);
+	return it == sim::connections.end() ? nullptr : &it->second;
+}
+
+extern "C" {
+
+tcp_pcb* tcp_new_ip_type(uint8_t type) {
+	(void) type;
+	return new tcp_pcb();
+}
+
+err_t tcp_bind(tcp_pcb* pcb, const ip_addr_t* ipaddr, uint16_t port) {
+	(void) ipaddr;
+	if (sim::listeners.count(port))
+		return ERR_USE;
+
+	pcb->port = port;
+	return ERR_OK;
+}
+
+tcp_pcb* tcp_listen_with_backlog(tcp_pcb* pcb, uint8_t backlog) {
+	(void) backlog;
+	pcb->listening = true;
+	sim::listeners[pcb->port] = pcb;
+	return pcb;
+}
+
+void tcp_accept(tcp_pcb* pcb, tcp_accept_fn accept) {
+	pcb->accept = accept;
+}
+
+void tcp_arg(tcp_pcb* pcb, void* arg) {
+	pcb->arg = arg;
+}
+
+void tcp_recv(tcp_pcb* pcb, tcp_recv_fn recv) {
+	pcb->recv = recv;
+}
+
+void tcp_sent(tcp_pcb* pcb, tcp_sent_fn sent) {
+	pcb->sent = sent;
+}
+
+void tcp_err(tcp_pcb* pcb, tcp_err_fn err) {
+	pcb->err = err;
+}
+
+void tcp_poll(tcp_pcb* pcb, tcp_poll_fn poll, uint8_t interval) {
+	pcb->poll = poll;
+	pcb->poll_interval = interval;
+}
+
+err_t tcp_write(tcp_pcb* pcb, const void* dataptr, uint16_t len, uint8_t apiflags) {
+	(void) apiflags;
+	sim::Connection* c = connection_of(pcb);
+	if (c == nullptr || c->closed)
+		return ERR_CONN;
+	if (len > tcp_sndbuf(pcb))
+		return ERR_MEM;
+
+	// Copied whether or not TCP_WRITE_FLAG_COPY asks for it
+	const uint8_t* bytes = (const uint8_t*) dataptr;
+	c->to_client.insert(c->to_client.end(), bytes, bytes + len);
+	pcb->unsent += len;
+	return ERR_OK;
+}
+
+err_t tcp_output(tcp_pcb* pcb) {
+	sim::Connection* c = connection_of(pcb);
+	if (c != nullptr)
+		c->visible += pcb->unsent;
+	pcb->unacked += pcb->unsent;
+	pcb->unsent = 0;
+	return ERR_OK;
+}
+
+uint16_t tcp_sndbuf(const tcp_pcb* pcb) {
+	return (uint16_t) (TCP_SND_BUF - pcb->unsent - pcb->unacked);
+}
+
+void tcp_recved(tcp_pcb* pcb, uint16_t len) {
+	(void) pcb;
+	(void) len;
+}
+
+err_t tcp_close(tcp_pcb* pcb) {
+	if (pcb->listening) {
+		sim::listeners.erase(pcb->port);
+		delete pcb;
+		return ERR_OK;
+	}
+
+	// Whatever is still unsent goes out with the FIN
+	tcp_output(pcb);
+	sim::Connection* c = connection_of(pcb);
+	if (c != nullptr)
+		c->closed = true;
+	sim::Release(pcb);
+	return ERR_OK;
+}
+
+void tcp_abort(tcp_pcb* pcb) {
+	sim::Connection* c = connection_of(pcb);
+	if (c != nullptr) {
+		c->reset = true;
+		c->to_client.clear();
+		c->visible = 0;
+	}
+
+	tcp_err_fn err = pcb->err;
+	void* arg = pcb->arg;
+	sim::Release(pcb);
+	if (err != nullptr)
+		err(arg, ERR_ABRT);
+}
+
+uint8_t pbuf_free(pbuf* p) {
+	uint8_t count = 0;
+	while (p != nullptr) {
+		pbuf* next = p->next;
+		delete[] (uint8_t*) p->payload;
+		delete p;
+		p = next;
+		count++;
+	}
+	return count;
+}
+
+uint16_t pbuf_copy_partial(const pbuf* p, void* dataptr, uint16_t len, uint16_t offset) {
+	uint16_t copied = 0;
+	for (; p != nullptr && copied < len; p = p->next) {
+		if (offset >= p->len) {
+			offset -= p->len;
+			continue;
+		}
+
+		uint16_t chunk = std::min<uint16_t>(p->len - offset, len - copied);
+		memcpy((uint8_t*) dataptr + copied, (const uint8_t*) p->payload + offset, chunk);
+		copied += chunk;
+		offset = 0;
+	}
+	return copied;
+}
+
+}
@@ -0,0 +1,289 @@
+// Checks of what the storage layers are meant to survive: a torn or
+// out of range journal page, a power cycle in the middle of a snapshot,
+// and an append log's tally. Run with
+//
+//   ctest --test-dir build-host
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "tusb.h"
+#include "append_log.h"
+#include "metadata_journal.h"
+#include "msc_disk.h"
+#include "sim.h"
+#include "snapshot_device.h"
+#include "usb_host.h"
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+			return false; \
+		} \
+	} while (0)
+
+/**
+ * NOR flash in RAM: programming only clears bits, and a power cycle is
+ * building the layer above it again from the same memory.
+ */
+class NorDisk : public BlockDevice {
+public:
+	static constexpr uint32_t ERASE_SIZE = 4096;
+	static constexpr uint32_t PAGE_SIZE = 256;
+
+public:
+	NorDisk(uint32_t size) : memory(size, 0xFF) {}
+
+	Geometry GetGeometry() const override {
+		return { (uint32_t) memory.size(), ERASE_SIZE, PAGE_SIZE, true };
+	}
+
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override {
+		if (addr + bufsize > memory.size())
+			return false;
+
+		memcpy(buffer, memory.data() + addr, bufsize);
+		return true;
+	}
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override {
+		if (addr + bufsize > memory.size() || addr % PAGE_SIZE != 0 || bufsize % PAGE_SIZE != 0)
+			return false;
+
+		for (uint32_t i = 0; i < bufsize; i++)
+			memory[addr + i] &= buffer[i];
+		return true;
+	}
+
+	bool Erase(uint32_t addr, uint32_t bytes) override {
+		if (addr + bytes > memory.size() || addr % ERASE_SIZE != 0 || bytes % ERASE_SIZE != 0)
+			return false;
+
+		memset(memory.data() + addr, 0xFF, bytes);
+		return true;
+	}
+
+	uint8_t* Data() {
+		return memory.data();
+	}
+
+private:
+	std::vector<uint8_t> memory;
+};
+
+// Journaled blocks at the start of the disk, the log after them
+static constexpr uint32_t JOURNAL_END = 2 * NorDisk::ERASE_SIZE;
+static constexpr uint32_t JOURNAL_LOG = JOURNAL_END;
+static constexpr uint32_t JOURNAL_LOG_SIZE = MetadataJournal::LOG_UNITS * NorDisk::ERASE_SIZE;
+
+/**
+ * A 512 byte block that is `base` apart from 16 bytes of `mark` at the
+ * start, so a write of it over another such block is one small record.
+ */
+static std::vector<uint8_t> Block(uint8_t base, uint8_t mark) {
+	std::vector<uint8_t> block(512, base);
+	memset(block.data(), mark, 16);
+	return block;
+}
+
+static bool ReadsAs(MetadataJournal& journal, uint32_t addr, const std::vector<uint8_t>& expected) {
+	std::vector<uint8_t> data(expected.size());
+	return journal.Read(addr, data.data(), (uint32_t) data.size()) && data == expected;
+}
+
+/**
+ * Power goes halfway through programming a record page: the records
+ * before it still apply, the torn one is skipped, and the log carries on
+ * after it.
+ */
+static bool TornJournalPage() {
+	NorDisk disk(JOURNAL_END + JOURNAL_LOG_SIZE);
+	MetadataJournal journal(disk);
+	CHECK(journal.Attach(0, JOURNAL_END, JOURNAL_LOG, JOURNAL_LOG_SIZE));
+	CHECK(journal.Write(0, Block(0xFF, 0x11).data(), 512));
+	CHECK(journal.Write(0, Block(0xFF, 0x22).data(), 512));
+	CHECK(journal.GetUsed() == 2 * MetadataJournal::RECORD_SIZE);
+
+	// The second page got its header but not the rest
+	uint32_t torn = JOURNAL_LOG + MetadataJournal::RECORD_SIZE;
+	memset(disk.Data() + torn + 16, 0xFF, MetadataJournal::RECORD_SIZE - 16);
+
+	MetadataJournal after(disk);
+	CHECK(after.Attach(0, JOURNAL_END, JOURNAL_LOG, JOURNAL_LOG_SIZE));
+	CHECK(ReadsAs(after, 0, Block(0xFF, 0x11)));
+	CHECK(after.GetUsed() == 2 * MetadataJournal::RECORD_SIZE);
+
+	CHECK(after.Write(0, Block(0xFF, 0x33).data(), 512));
+	MetadataJournal again(disk);
+	CHECK(again.Attach(0, JOURNAL_END, JOURNAL_LOG, JOURNAL_LOG_SIZE));
+	CHECK(ReadsAs(again, 0, Block(0xFF, 0x33)));
+	return true;
+}
+
+/**
+ * A record whose checksum is fine but which names a block outside the
+ * journaled range, as after the layout changed under it, is not applied,
+ * and nothing is programmed over it until the log is compacted.
+ */
+static bool BadJournalExtent() {
+	NorDisk disk(JOURNAL_END + JOURNAL_LOG_SIZE);
+	MetadataJournal journal(disk);
+	CHECK(journal.Attach(0, JOURNAL_END, JOURNAL_LOG, JOURNAL_LOG_SIZE));
+	CHECK(journal.Write(NorDisk::ERASE_SIZE, Block(0xFF, 0x11).data(), 512));
+
+	MetadataJournal narrower(disk);
+	CHECK(narrower.Attach(0, NorDisk::ERASE_SIZE, JOURNAL_LOG, JOURNAL_LOG_SIZE));
+	CHECK(narrower.GetUsed() == JOURNAL_LOG_SIZE);
+	CHECK(narrower.WantsCompaction());
+	CHECK(ReadsAs(narrower, NorDisk::ERASE_SIZE, Block(0xFF, 0xFF)));
+
+	CHECK(narrower.Write(0, Block(0xFF, 0x22).data(), 512));
+	MetadataJournal after(disk);
+	CHECK(after.Attach(0, NorDisk::ERASE_SIZE, JOURNAL_LOG, JOURNAL_LOG_SIZE));
+	CHECK(ReadsAs(after, 0, Block(0xFF, 0x22)));
+	return true;
+}
+
+static constexpr uint32_t SNAPSHOT_UNITS = 32;
+static constexpr uint32_t SNAPSHOT_SPARES = 4;
+
+static bool WriteUnit(BlockDevice& device, uint32_t unit, uint8_t value) {
+	std::vector<uint8_t> data(SnapshotDevice::UNIT_SIZE, value);
+	return device.Write(unit * SnapshotDevice::UNIT_SIZE, data.data(), (uint32_t) data.size());
+}
+
+static bool UnitIs(BlockDevice& device, uint32_t unit, uint8_t value) {
+	std::vector<uint8_t> data(SnapshotDevice::UNIT_SIZE);
+	if (!device.Read(unit * SnapshotDevice::UNIT_SIZE, data.data(), (uint32_t) data.size()))
+		return false;
+
+	return data == std::vector<uint8_t>(data.size(), value);
+}
+
+/**
+ * The remap tables come back from the map log after a power cycle, past
+ * enough records for a checkpoint, and a rollback after it still finds
+ * the frozen units.
+ */
+static bool SnapshotReplay() {
+	NorDisk disk(SNAPSHOT_UNITS * SnapshotDevice::UNIT_SIZE);
+	{
+		SnapshotDevice snapshots(disk, SNAPSHOT_SPARES);
+		CHECK(snapshots.Init() && snapshots.IsEnabled());
+		CHECK(WriteUnit(snapshots, 1, 0));
+		for (uint32_t i = 1; i <= SnapshotDevice::RECORDS_PER_UNIT / 2; i++) {
+			CHECK(snapshots.Take());
+			CHECK(WriteUnit(snapshots, 1, (uint8_t) i));
+			CHECK(snapshots.Drop());
+		}
+
+		CHECK(snapshots.Take());
+		CHECK(WriteUnit(snapshots, 1, 0xAA));
+	}
+
+	SnapshotDevice after(disk, SNAPSHOT_SPARES);
+	CHECK(after.Init());
+	CHECK(after.HasSnapshot());
+	CHECK(UnitIs(after, 1, 0xAA));
+	CHECK(after.Rollback());
+	CHECK(UnitIs(after, 1, (uint8_t) (SnapshotDevice::RECORDS_PER_UNIT / 2)));
+
+	SnapshotDevice again(disk, SNAPSHOT_SPARES);
+	CHECK(again.Init());
+	CHECK(UnitIs(again, 1, (uint8_t) (SnapshotDevice::RECORDS_PER_UNIT / 2)));
+	return true;
+}
+
+/**
+ * A snapshot that runs out of spare units is dropped instead of failing
+ * the write, and says so after a power cycle too.
+ */
+static bool SnapshotLost() {
+	NorDisk disk(SNAPSHOT_UNITS * SnapshotDevice::UNIT_SIZE);
+	{
+		SnapshotDevice snapshots(disk, SNAPSHOT_SPARES);
+		CHECK(snapshots.Init());
+		CHECK(snapshots.Take());
+		for (uint32_t unit = 0; unit <= SNAPSHOT_SPARES; unit++)
+			CHECK(WriteUnit(snapshots, unit, 0x55));
+		CHECK(!snapshots.HasSnapshot() && snapshots.WasLost());
+	}
+
+	SnapshotDevice after(disk, SNAPSHOT_SPARES);
+	CHECK(after.Init());
+	CHECK(!after.HasSnapshot() && after.WasLost());
+	for (uint32_t unit = 0; unit <= SNAPSHOT_SPARES; unit++)
+		CHECK(UnitIs(after, unit, 0x55));
+	return true;
+}
+
+/**
+ * Append `pages` flash pages worth of records.
+ */
+static bool AppendPages(uint32_t pages) {
+	std::vector<uint8_t> page(NorDisk::PAGE_SIZE, 0x5A);
+	for (uint32_t i = 0; i < pages; i++) {
+		if (append_log_write(page.data(), (uint32_t) page.size()) != page.size())
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * The size an append log reopens with comes from the tally alone, on
+ * either side of where one tally page hands over to the next.
+ */
+static bool AppendTally() {
+	static const char NAME[] = "TALLY   LOG";
+	const uint32_t sizes[] = { APPEND_LOG_TALLY_PROGRAMS, APPEND_LOG_TALLY_PROGRAMS + 1 };
+	for (uint32_t pages : sizes) {
+		sim::Reset();
+		UsbHost usb;
+		usb.PowerOn(true);
+		tud_msc_test_unit_ready_cb(0);
+
+		CHECK(append_log_open(NAME, 10));
+		CHECK(AppendPages(pages));
+		append_log_close();
+
+		usb.PowerOn(false);
+		CHECK(append_log_open(NAME, 0));
+		CHECK(append_log_size() == pages * NorDisk::PAGE_SIZE);
+
+		// And it carries on counting from there
+		CHECK(AppendPages(pages));
+		append_log_close();
+
+		usb.PowerOn(false);
+		CHECK(append_log_open(NAME, 0));
+		CHECK(append_log_size() == 2 * pages * NorDisk::PAGE_SIZE);
+		append_log_close();
+	}
+
+	return true;
+}
+
+int main() {
+	struct Test {
+		const char* name;
+		bool (*run)();
+	};
+
+	const Test tests[] = {
+		{ "torn_journal_page", TornJournalPage },
+		{ "bad_journal_extent", BadJournalExtent },
+		{ "snapshot_replay", SnapshotReplay },
+		{ "snapshot_lost", SnapshotLost },
+		{ "append_tally", AppendTally },
+	};
+
+	int failed = 0;
+	for (const Test& test : tests) {
+		bool ok = test.run();
+		printf("%-24s %s\n", test.name, ok ? "ok" : "FAILED");
+		failed += !ok;
+	}
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+namespace trace {
+
+// Runs shorter than this stay inside a literal segment.
+static constexpr size_t MIN_FILL_RUN = 8;
+
+bool Load(const std::string& path, Trace& out) {
+	std::ifstream file(path);
+	if (!file)
+		return false;
+
+	out = Trace();
+	std::string line;
+	size_t line_num = 0;
+	while (std::getline(file, line)) {
+		line_num++;
+		if (line.empty())
+			continue;
+
+		if (line[0] == '#') {
+			out.comments.push_back(line.substr(1));
+			continue;
+		}
+
+		std::istringstream in(line);
+		std::string op;
+		in >> op;
+
+		if (op == "name") {
+			in >> out.name;
+			continue;
+		}
+
+		Command cmd;
+		if ((op != "R" && op != "W") || !(in >> cmd.lba >> cmd.blocks)) {
+			fprintf(stderr, "%s:%zu: malformed command\n", path.c_str(), line_num);
+			return false;
+		}
+
+		cmd.op = op[0];
+		if (cmd.op == 'W') {
+			std::getline(in, cmd.payload);
+			size_t start = cmd.payload.find_first_not_of(' ');
+			cmd.payload = start == std::string::npos ? "" : cmd.payload.substr(start);
+
+			std::vector<uint8_t> data;
+			if (!Decode(cmd.payload, data) || data.size() != cmd.blocks * BLOCK_SIZE) {
+				fprintf(stderr, "%s:%zu: payload does not cover %u blocks\n", path.c_str(), line_num, cmd.blocks);
+				return false;
+			}
+		}
+
+		out.commands.push_back(cmd);
+	}
+
+	return true;
+}
+
+bool Save(const std::string& path, const Trace& trace) {
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	for (const std::string& comment : trace.comments)
+		file << "#" << comment << "\n";
+	file << "name " << trace.name << "\n";
+
+	for (const Command& cmd : trace.commands) {
+		file << cmd.op << " " << cmd.lba << " " << cmd.blocks;
+		if (cmd.op == 'W')
+			file << " " << cmd.payload;
+		file << "\n";
+	}
+
+	return bool(file);
+}
+
+std::string Encode(const uint8_t* data, size_t size) {
+	std::string out;
+	char hex[4];
+	size_t i = 0;
+	bool in_literal = false;
+
+	while (i < size) {
+		size_t run = 1;
+		while (i + run < size && data[i + run] == data[i])
+			run++;
+
+		if (run >= MIN_FILL_RUN) {
+			if (!out.empty())
+				out += " ";
+			snprintf(hex, sizeof(hex), "%02x", data[i]);
+			out += "f" + std::to_string(run) + ":" + hex;
+			in_literal = false;
+			i += run;
+			continue;
+		}
+
+		if (!in_literal) {
+			if (!out.empty())
+				out += " ";
+			out += "x";
+			in_literal = true;
+		}
+
+		for (size_t j = 0; j < run; j++) {
+			snprintf(hex, sizeof(hex), "%02x", data[i + j]);
+			out += hex;
+		}
+		i += run;
+	}
+
+	return out;
+}
+
+std::string EncodePrng(size_t size, uint32_t seed) {
+	return "p" + std::to_string(size) + ":" + std::to_string(seed);
+}
+
+bool Decode(const std::string& payload, std::vector<uint8_t>& out) {
+	out.clear();
+	std::istringstream in(payload);
+	std::string seg;
+
+	while (in >> seg) {
+		if (seg[0] == 'x') {
+			if (seg.size() % 2 != 1)
+				return false;
+			for (size_t i = 1; i < seg.size(); i += 2)
+				out.push_back((uint8_t) strtoul(seg.substr(i, 2).c_str(), nullptr, 16));
+		}
+		else if (seg[0] == 'f' || seg[0] == 'p') {
+			size_t colon = seg.find(':');
+			if (colon == std::string::npos)
+				return false;
+
+			size_t count = strtoul(seg.substr(1, colon - 1).c_str(), nullptr, 10);
+			size_t start = out.size();
+			out.resize(start + count);
+
+			if (seg[0] == 'f')
+				memset(out.data() + start, (int) strtoul(seg.substr(colon + 1).c_str(), nullptr, 16), count);
+			else
+				PrngFill(out.data() + start, count, (uint32_t) strtoul(seg.substr(colon + 1).c_str(), nullptr, 10));
+		}
+		else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void PrngFill(uint8_t* data, size_t size, uint32_t seed) {
+	uint32_t state = seed ? seed : 0x9E3779B9;
+	for (size_t i = 0; i < size; i++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		data[i] = (uint8_t) state;
+	}
+}
+
+}
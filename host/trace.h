@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * The READ10/WRITE10 commands a host sent, in order, as text:
+ * `R <lba> <blocks>` or `W <lba> <blocks> <payload>`, plus `name` and `#`
+ * lines. A payload is segments covering blocks * 512 bytes: `x<hex>`
+ * literal bytes, `f<count>:<byte>` a fill, `p<count>:<seed>` xorshift32
+ * bytes for file contents.
+ */
+namespace trace {
+
+constexpr uint32_t BLOCK_SIZE = 512;
+
+struct Command {
+	char op;             // 'R' or 'W'
+	uint32_t lba;
+	uint32_t blocks;
+	std::string payload; // Encoded, only for 'W'
+};
+
+struct Trace {
+	std::string name;
+	std::vector<std::string> comments;
+	std::vector<Command> commands;
+};
+
+bool Load(const std::string& path, Trace& out);
+bool Save(const std::string& path, const Trace& trace);
+
+/**
+ * Encode raw bytes as literal and fill segments.
+ */
+std::string Encode(const uint8_t* data, size_t size);
+
+/**
+ * Encode `size` pseudo-random bytes, see PrngFill().
+ */
+std::string EncodePrng(size_t size, uint32_t seed);
+
+/**
+ * Expand a payload back into bytes. Returns false if it is malformed.
+ */
+bool Decode(const std::string& payload, std::vector<uint8_t>& out);
+
+void PrngFill(uint8_t* data, size_t size, uint32_t seed);
+
+}
@@ -0,0 +1,425 @@
+#include "usb_host.h"
+#include <string.h>
+#include <algorithm>
+#include "sim.h"
+#include "fat.h"
+#include "bulk_ingest.h"
+#include "http_server.h"
+#include "msc_disk.h"
+#include "mtp_responder.h"
+#include "mtp_usb.h"
+#include "startup.h"
+#include "tusb.h"
+
+// Owned by src/msc_disk.cpp
+extern Fat16* fat_fs;
+
+// How often a chunk may be refused (callback returns 0) while the device
+// has nothing else to do before the command is failed, like a host timing
+// out.
+static constexpr int MAX_BUSY_RETRIES = 1000;
+
+// How often main() polls the GPIO17 reset jumper, and how many polls
+// PowerOn() waits for it to be taken
+static constexpr double JUMPER_POLL_US = 50 * 1000;
+static constexpr int MAX_JUMPER_POLLS = 10;
+
+void UsbHost::PowerOn(bool format) {
+	// Built in place by msc_disk.cpp, see open_volume()
+	if (fat_fs != nullptr)
+		fat_fs->~Fat16();
+	fat_fs = nullptr;
+	link_us = sim::Now();
+
+	// What main() does before tusb_init()
+	startup_begin();
+	msc_disk_begin();
+	startup_mark(STARTUP_USB);
+
+	uint32_t block_count;
+	uint16_t block_size;
+	tud_msc_capacity_cb(0, &block_count, &block_size);
+	if (!format)
+		return;
+
+	// The jumper is only looked at from the main loop, debounced over a
+	// few polls, and the host is then told the medium changed
+	sim::SetPin(17, false);
+	for (int poll = 0; poll < MAX_JUMPER_POLLS && !msc_disk_reset_task(); poll++)
+		sim::Advance(JUMPER_POLL_US);
+	sim::SetPin(17, true);
+	tud_msc_test_unit_ready_cb(0);
+}
+
+bool UsbHost::Read(uint32_t lba, uint32_t blocks, uint8_t* out) {
+	if (recording)
+		recording->commands.push_back({'R', lba, blocks, ""});
+
+	uint32_t total = blocks * trace::BLOCK_SIZE;
+	uint32_t done = 0;
+	int busy = 0;
+	double start_us = std::max(link_us, (double) sim::Now());
+
+	counters.commands++;
+	Transfer(sim::Cost().usb_command_us / 2);
+	WaitForLink();
+
+	while (done < total) {
+		uint32_t chunk = std::min<uint32_t>(total - done, CFG_TUD_MSC_EP_BUFSIZE);
+		int32_t got = tud_msc_read10_cb(0, lba + done / trace::BLOCK_SIZE, done % trace::BLOCK_SIZE, out + done, chunk);
+
+		if (got < 0) {
+			counters.failed++;
+			return false;
+		}
+
+		if (got == 0) {
+			if (!(background_on_busy && Background()) && ++busy > MAX_BUSY_RETRIES) {
+				counters.failed++;
+				return false;
+			}
+			continue;
+		}
+
+		// TinyUSB only asks for the next chunk once this one is sent.
+		Transfer(sim::Cost().usb_us_per_byte * got);
+		WaitForLink();
+		done += (uint32_t) got;
+	}
+
+	Transfer(sim::Cost().usb_command_us / 2);
+	WaitForLink();
+	counters.bytes_read += total;
+	Finished(start_us);
+	return true;
+}
+
+bool UsbHost::Write(uint32_t lba, uint32_t blocks, const uint8_t* data, const std::string& payload) {
+	uint32_t total = blocks * trace::BLOCK_SIZE;
+
+	if (recording)
+		recording->commands.push_back({'W', lba, blocks, payload.empty() ? trace::Encode(data, total) : payload});
+
+	// TinyUSB receives into its own buffer, which the callback may modify.
+	std::vector<uint8_t> ep_buf(CFG_TUD_MSC_EP_BUFSIZE);
+	uint32_t done = 0;
+	uint32_t chunk_start = 0;
+	int busy = 0;
+	double start_us = std::max(link_us, (double) sim::Now());
+
+	counters.commands++;
+	Transfer(sim::Cost().usb_command_us / 2);
+
+	uint32_t chunk = std::min<uint32_t>(total, CFG_TUD_MSC_EP_BUFSIZE);
+	memcpy(ep_buf.data(), data, chunk);
+	Transfer(sim::Cost().usb_us_per_byte * chunk);
+
+	while (done < total) {
+		WaitForLink();
+
+		uint32_t offset = done - chunk_start;
+		int32_t got = tud_msc_write10_cb(0, lba + done / trace::BLOCK_SIZE, done % trace::BLOCK_SIZE,
+				ep_buf.data() + offset, chunk - offset);
+
+		if (got < 0) {
+			counters.failed++;
+			return false;
+		}
+
+		if (got == 0) {
+			if (!(background_on_busy && Background()) && ++busy > MAX_BUSY_RETRIES) {
+				counters.failed++;
+				return false;
+			}
+			continue;
+		}
+
+		done += (uint32_t) got;
+
+		// Chunk fully taken: TinyUSB queues the next OUT transfer before the
+		// main loop gets a chance to run.
+		if (done == chunk_start + chunk && done < total) {
+			chunk_start = done;
+			chunk = std::min<uint32_t>(total - done, CFG_TUD_MSC_EP_BUFSIZE);
+			memcpy(ep_buf.data(), data + done, chunk);
+			Transfer(sim::Cost().usb_us_per_byte * chunk);
+		}
+
+		Background();
+	}
+
+	Transfer(sim::Cost().usb_command_us / 2);
+	WaitForLink();
+	counters.bytes_written += total;
+	Finished(start_us);
+	return true;
+}
+
+int UsbHost::Ingest(const char name[11], const uint8_t* data, uint32_t length, uint16_t& cluster) {
+	IngestHeader header;
+	header.magic = INGEST_HEADER_MAGIC;
+	memcpy(header.name, name, sizeof(header.name));
+	header.attributes = 0x20; // Archive
+	header.length = length;
+	header.time = 0;
+	header.date = (44 << 9) | (6 << 5) | 1; // 2024-06-01
+
+	counters.commands++;
+	Transfer(sim::Cost().usb_us_per_byte * sizeof(header));
+	WaitForLink();
+	const uint8_t* bytes = (const uint8_t*) &header;
+	sim::VendorRx().insert(sim::VendorRx().end(), bytes, bytes + sizeof(header));
+
+	int status = WaitForReply(cluster);
+	if (status != INGEST_ACCEPTED) {
+		counters.failed++;
+		return status;
+	}
+
+	// The endpoint NAKs while the FIFO is full, so only what fits goes out
+	uint32_t sent = 0;
+	int busy = 0;
+	while (sent < length) {
+		uint32_t room = CFG_TUD_VENDOR_RX_BUFSIZE - (uint32_t) sim::VendorRx().size();
+		if (room == 0) {
+			if (!Background() && ++busy > MAX_BUSY_RETRIES) {
+				counters.failed++;
+				return -1;
+			}
+			continue;
+		}
+
+		uint32_t chunk = std::min(room, length - sent);
+		Transfer(sim::Cost().usb_us_per_byte * chunk);
+		WaitForLink();
+		sim::VendorRx().insert(sim::VendorRx().end(), data + sent, data + sent + chunk);
+		sent += chunk;
+	}
+
+	status = WaitForReply(cluster);
+	if (status != INGEST_OK) {
+		counters.failed++;
+		return status;
+	}
+
+	counters.bytes_written += length;
+	return status;
+}
+
+int UsbHost::WaitForReply(uint16_t& cluster) {
+	int busy = 0;
+	while (sim::VendorTx().size() < sizeof(IngestReply)) {
+		if (!Background() && ++busy > MAX_BUSY_RETRIES)
+			return -1;
+	}
+
+	IngestReply reply;
+	uint8_t* bytes = (uint8_t*) &reply;
+	std::copy(sim::VendorTx().begin(), sim::VendorTx().begin() + sizeof(reply), bytes);
+	sim::VendorTx().erase(sim::VendorTx().begin(), sim::VendorTx().begin() + sizeof(reply));
+
+	// The host polls the IN pipe; the reply takes a frame to come back
+	Transfer(sim::Cost().usb_command_us / 2);
+	WaitForLink();
+
+	if (reply.magic != INGEST_REPLY_MAGIC)
+		return -1;
+
+	cluster = reply.start_cluster;
+	return reply.status;
+}
+
+int UsbHost::Mtp(uint16_t code, const std::vector<uint32_t>& params, const std::vector<uint8_t>* out,
+		std::vector<uint8_t>* in, std::vector<uint32_t>* response) {
+	uint32_t transaction = ++mtp_transaction;
+	auto container = [&](uint16_t type, uint32_t length) {
+		std::vector<uint8_t> c(12);
+		uint32_t total = 12 + length;
+		memcpy(c.data(), &total, 4);
+		memcpy(c.data() + 4, &type, 2);
+		memcpy(c.data() + 6, &code, 2);
+		memcpy(c.data() + 8, &transaction, 4);
+		return c;
+	};
+
+	// The command goes out in a frame of its own, like a CBW
+	counters.commands++;
+	Transfer(sim::Cost().usb_command_us / 2);
+	WaitForLink();
+	std::vector<uint8_t> command = container(1, 4 * (uint32_t) params.size());
+	for (uint32_t param : params)
+		command.insert(command.end(), (uint8_t*) &param, (uint8_t*) &param + 4);
+	sim::MtpRx().insert(sim::MtpRx().end(), command.begin(), command.end());
+
+	if (out != nullptr) {
+		std::vector<uint8_t> data = container(2, (uint32_t) out->size());
+		data.insert(data.end(), out->begin(), out->end());
+		if (!MtpSend(data)) {
+			counters.failed++;
+			return -1;
+		}
+		counters.bytes_written += out->size();
+	}
+
+	std::vector<uint8_t> reply;
+	while (true) {
+		if (!MtpReceive(reply)) {
+			counters.failed++;
+			return -1;
+		}
+
+		uint16_t type;
+		memcpy(&type, reply.data() + 4, 2);
+		if (type != 2)
+			break;
+
+		if (in != nullptr)
+			in->assign(reply.begin() + 12, reply.end());
+		counters.bytes_read += reply.size() - 12;
+	}
+
+	uint16_t status;
+	memcpy(&status, reply.data() + 6, 2);
+	if (response != nullptr) {
+		response->clear();
+		for (size_t offset = 12; offset + 4 <= reply.size(); offset += 4) {
+			uint32_t param;
+			memcpy(&param, reply.data() + offset, 4);
+			response->push_back(param);
+		}
+	}
+
+	if (status != 0x2001)
+		counters.failed++;
+	return status;
+}
+
+bool UsbHost::MtpSend(const std::vector<uint8_t>& container) {
+	// The endpoint NAKs while the FIFO is full, so only what fits goes out
+	uint32_t sent = 0;
+	uint32_t length = (uint32_t) container.size();
+	int busy = 0;
+	while (sent < length) {
+		uint32_t room = MTP_USB_RX_BUFSIZE - std::min<uint32_t>(MTP_USB_RX_BUFSIZE, (uint32_t) sim::MtpRx().size());
+		if (room == 0) {
+			if (!Background() && ++busy > MAX_BUSY_RETRIES)
+				return false;
+			continue;
+		}
+
+		uint32_t chunk = std::min(room, length - sent);
+		Transfer(sim::Cost().usb_us_per_byte * chunk);
+		WaitForLink();
+		sim::MtpRx().insert(sim::MtpRx().end(), container.begin() + sent, container.begin() + sent + chunk);
+		sent += chunk;
+	}
+
+	return true;
+}
+
+bool UsbHost::MtpReceive(std::vector<uint8_t>& container) {
+	std::deque<uint8_t>& tx = sim::MtpTx();
+	int busy = 0;
+	while (tx.size() < 12) {
+		if (!Background() && ++busy > MAX_BUSY_RETRIES)
+			return false;
+	}
+
+	uint32_t length;
+	uint16_t type;
+	container.assign(tx.begin(), tx.begin() + 12);
+	tx.erase(tx.begin(), tx.begin() + 12);
+	memcpy(&length, container.data(), 4);
+	memcpy(&type, container.data() + 4, 2);
+	if (length < 12)
+		return false;
+
+	// A response comes back in a frame, like a CSW
+	bool data = type == 2;
+	Transfer(data ? sim::Cost().usb_us_per_byte * 12 : sim::Cost().usb_command_us / 2);
+	WaitForLink();
+
+	while (container.size() < length) {
+		if (tx.empty()) {
+			if (!Background() && ++busy > MAX_BUSY_RETRIES)
+				return false;
+			continue;
+		}
+
+		uint32_t chunk = std::min<uint32_t>(length - (uint32_t) container.size(), (uint32_t) tx.size());
+		container.insert(container.end(), tx.begin(), tx.begin() + chunk);
+		tx.erase(tx.begin(), tx.begin() + chunk);
+		if (data) {
+			Transfer(sim::Cost().usb_us_per_byte * chunk);
+			WaitForLink();
+		}
+	}
+
+	return true;
+}
+
+void UsbHost::Idle() {
+	while (Background());
+}
+
+bool UsbHost::Eject() {
+	// Traces only hold READ10/WRITE10, so this is not recorded
+	counters.commands++;
+	Transfer(sim::Cost().usb_command_us / 2);
+	WaitForLink();
+
+	// Drains and compacts inside the callback, so the status waits on it
+	double busy_before = sim::Stats().busy_us;
+	bool ok = tud_msc_start_stop_cb(0, 0, false, true);
+	if (sim::Cost().flash_stalls_usb)
+		link_us += sim::Stats().busy_us - busy_before;
+
+	Transfer(sim::Cost().usb_command_us / 2);
+	WaitForLink();
+	if (!ok)
+		counters.failed++;
+	return ok;
+}
+
+bool UsbHost::Run(const trace::Command& cmd) {
+	if (cmd.op == 'R') {
+		std::vector<uint8_t> buffer(cmd.blocks * trace::BLOCK_SIZE);
+		return Read(cmd.lba, cmd.blocks, buffer.data());
+	}
+
+	std::vector<uint8_t> data;
+	if (!trace::Decode(cmd.payload, data))
+		return false;
+
+	return Write(cmd.lba, cmd.blocks, data.data(), cmd.payload);
+}
+
+void UsbHost::Transfer(double us) {
+	link_us = std::max(link_us, (double) sim::Now()) + us;
+	counters.usb_us += us;
+}
+
+void UsbHost::WaitForLink() {
+	while (sim::Now() < link_us && Background());
+
+	if (sim::Now() < link_us)
+		sim::Advance(link_us - sim::Now());
+}
+
+void UsbHost::Finished(double start_us) {
+	if (latencies)
+		latencies->push_back(std::max(link_us, (double) sim::Now()) - start_us);
+}
+
+bool UsbHost::Background() {
+	double busy_before = sim::Stats().busy_us;
+	bool did_work = msc_disk_task();
+	did_work = bulk_ingest_task() || did_work;
+	did_work = http_server_task() || did_work;
+	did_work = mtp_responder_task() || did_work;
+
+	if (sim::Cost().flash_stalls_usb)
+		link_us += sim::Stats().busy_us - busy_before;
+
+	return did_work;
+}
@@ -0,0 +1,160 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "trace.h"
+
+/**
+ * The host end of the USB mass storage link. Commands are split into
+ * CFG_TUD_MSC_EP_BUFSIZE chunks the way TinyUSB hands them over, and the
+ * link keeps its own timeline, so a chunk staged by the firmware lets the
+ * next one start while the main loop commits it.
+ */
+class UsbHost {
+public:
+	struct Counters {
+		uint64_t commands = 0;
+		uint64_t failed = 0;
+		uint64_t bytes_read = 0;
+		uint64_t bytes_written = 0;
+		double usb_us = 0;
+	};
+
+public:
+	UsbHost() = default;
+
+	/**
+	 * Power cycle the device: mount the volume again the way main() does
+	 * and ask for its capacity, optionally with the GPIO17 reset jumper
+	 * held until the volume is formatted.
+	 */
+	void PowerOn(bool format);
+
+	bool Read(uint32_t lba, uint32_t blocks, uint8_t* out);
+
+	/**
+	 * `payload` is what gets recorded for this write; by default the data
+	 * is encoded as literal and fill segments.
+	 */
+	bool Write(uint32_t lba, uint32_t blocks, const uint8_t* data, const std::string& payload = "");
+
+	/**
+	 * Upload a file over the bulk ingest interface the way tools/ingest.py
+	 * does (see bulk_ingest.h): header, wait for the go-ahead, stream the
+	 * contents as fast as the device's receive FIFO drains, wait for the
+	 * final status. `name` is 8.3 and space padded. Returns the status,
+	 * with the start cluster in `cluster`.
+	 */
+	int Ingest(const char name[11], const uint8_t* data, uint32_t length, uint16_t& cluster);
+
+	/**
+	 * One MTP transaction the way an initiator runs it (see
+	 * mtp_responder.h): the command with `params`, `out` as the data phase
+	 * if given, whatever data phase comes back into `in` if given, and the
+	 * response. Returns the response code, with its parameters in
+	 * `response` if given, or -1 if the device never answers.
+	 */
+	int Mtp(uint16_t code, const std::vector<uint32_t>& params, const std::vector<uint8_t>* out = nullptr,
+			std::vector<uint8_t>* in = nullptr, std::vector<uint32_t>* response = nullptr);
+
+	/**
+	 * Let the firmware's main loop run until it has no background work
+	 * left, e.g. staged writes still to be committed.
+	 */
+	void Idle();
+
+	/**
+	 * Safely remove the drive: START STOP UNIT with LoEj set and Start
+	 * clear, which has the firmware fold its journal and flush. It stays
+	 * unready until the next PowerOn().
+	 */
+	bool Eject();
+
+	/**
+	 * Replay one recorded command.
+	 */
+	bool Run(const trace::Command& cmd);
+
+	/**
+	 * Record every command issued from now on into `trace`. Pass nullptr
+	 * to stop recording.
+	 */
+	void Record(trace::Trace* trace) {
+		recording = trace;
+	}
+
+	/**
+	 * Append how long each READ10/WRITE10 from now on takes to `log`, in
+	 * microseconds from the command going out to its status coming back.
+	 * Pass nullptr to stop.
+	 */
+	void LogLatencies(std::vector<double>* log) {
+		latencies = log;
+	}
+
+	const Counters& GetCounters() const {
+		return counters;
+	}
+
+	void SetCounters(const Counters& value) {
+		counters = value;
+	}
+
+	/**
+	 * Whether the main loop gets to run between the retries of a READ10
+	 * or WRITE10 chunk the firmware reported busy for (returned 0).
+	 * Without an RTOS TinyUSB asks again from within the same tud_task(),
+	 * so on the device it does not; the default is kinder.
+	 */
+	void SetBackgroundOnBusy(bool value) {
+		background_on_busy = value;
+	}
+
+private:
+	/**
+	 * Occupy the link for `us` once it is free.
+	 */
+	void Transfer(double us);
+
+	/**
+	 * Run the device until the link is free, e.g. until the data it is
+	 * waiting on has arrived.
+	 */
+	void WaitForLink();
+
+	/**
+	 * One pass of the firmware's main loop after tud_task(). Returns true
+	 * if it did any work.
+	 */
+	bool Background();
+
+	/**
+	 * Run the device until it has answered on the vendor interface.
+	 * Returns the status, or -1 if it never does.
+	 */
+	int WaitForReply(uint16_t& cluster);
+
+	/**
+	 * Hand one MTP container to the device, as fast as its receive FIFO
+	 * drains.
+	 */
+	bool MtpSend(const std::vector<uint8_t>& container);
+
+	/**
+	 * Take the next container the device sends, as it comes. A data phase
+	 * is timed by the byte; a response takes a frame, like a CSW.
+	 */
+	bool MtpReceive(std::vector<uint8_t>& container);
+
+	/**
+	 * A command that went out at `start_us` has had its status.
+	 */
+	void Finished(double start_us);
+
+private:
+	trace::Trace* recording = nullptr;
+	std::vector<double>* latencies = nullptr;
+	Counters counters;
+	double link_us = 0; // When the USB link is next free
+	uint32_t mtp_transaction = 0;
+	bool background_on_busy = true;
+};
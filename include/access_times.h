@@ -0,0 +1,106 @@
+#pragma once
+#include "stdint.h"
+#include "stddef.h"
+#include "fat_standard.hpp"
+
+// What happens to directory timestamps nobody needs on flash, see
+// AccessTimes
+#define ACCESS_TIMES_WRITE 0 // Written like any other change
+#define ACCESS_TIMES_LAZY  1 // Kept in RAM, written once the host goes quiet
+#define ACCESS_TIMES_DROP  2 // Kept in RAM until it fills, never written
+
+#ifndef ACCESS_TIMES
+#define ACCESS_TIMES ACCESS_TIMES_LAZY
+#endif
+
+
+/**
+ * Keeps access and creation date changes to the root directory in RAM, so
+ * reading files does not write to flash. Fat16::WriteBlock hands each root
+ * directory sector to Absorb(); one where only those dates changed is not
+ * written, and GetBlock lays the kept dates back over. ACCESS_TIMES picks
+ * whether they are written later, when the host goes quiet, or never.
+ */
+class AccessTimes {
+public:
+	enum CONFIG {
+		MAX_ENTRIES = 64,
+		ENTRIES_PER_SECTOR = 512 / sizeof(fat::DirectoryEntry),
+		FIRST_FIELD = offsetof(fat::DirectoryEntry, create_time_ms),
+		FIELD_BYTES = offsetof(fat::DirectoryEntry, last_access_date) + 2 - FIRST_FIELD
+	};
+
+	struct Stats {
+		uint32_t absorbed = 0;  // Sectors that were not written
+		uint32_t persisted = 0; // Written for their kept dates: idle, eject or full
+		uint32_t dropped = 0;   // Changes lost to a full table
+	};
+
+public:
+	/**
+	 * Take `data`, the new contents of root directory sector `sector`, if
+	 * it only differs from `stored` in timestamps. Returns false if it has
+	 * to be written, and then forgets what was kept for the sector.
+	 */
+	bool Absorb(uint32_t sector, const uint8_t* stored, const uint8_t* data);
+
+	/**
+	 * Lay what is kept for root directory sector `sector` over the first
+	 * `length` bytes of it.
+	 */
+	void Apply(uint32_t sector, uint8_t* data, uint32_t length) const;
+
+	/**
+	 * The lowest sector anything is kept for, so it can be written. False
+	 * if nothing is.
+	 */
+	bool FirstHeld(uint32_t& sector) const;
+
+	/**
+	 * Forget what is kept for `sector`, once it has been written.
+	 */
+	void Forget(uint32_t sector);
+
+	/**
+	 * Forget everything, after the volume changed underneath.
+	 */
+	void Clear() {
+		count = 0;
+	}
+
+	uint32_t GetCount() const {
+		return count;
+	}
+
+	uint32_t GetPolicy() const {
+		return policy;
+	}
+
+	void SetPolicy(uint32_t value) {
+		policy = value;
+		Clear();
+	}
+
+	Stats& GetStats() {
+		return stats;
+	}
+
+	/**
+	 * Whether `stored` and `data` differ in nothing but timestamps.
+	 */
+	static bool OnlyTimes(const fat::DirectoryEntry& stored, const fat::DirectoryEntry& data);
+
+private:
+	struct Kept {
+		uint16_t entry; // Number in the root directory
+		uint8_t fields[FIELD_BYTES];
+	};
+
+	Kept* Find(uint16_t entry);
+
+private:
+	Kept kept[MAX_ENTRIES];
+	uint32_t count = 0;
+	uint32_t policy = ACCESS_TIMES;
+	Stats stats;
+};
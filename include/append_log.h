@@ -0,0 +1,72 @@
+#pragma once
+#include "stdint.h"
+
+
+/**
+ * A file the firmware appends records to at a high rate without erasing.
+ * Its clusters are taken and erased up front, each full page of records
+ * is programmed into the next one, and the size is kept as a tally of
+ * cleared bits in the last cluster. Reads see that size through
+ * append_log_patch(). A host write into the run, or deleting the file,
+ * closes the log.
+ */
+
+// What append_log_flush() fills the rest of a page with
+#define APPEND_LOG_PAD 0x00
+
+// Programs a tally page may take between erases, one bit each. NOR parts
+// limit this, and it bounds a log to this many pages per tally page (15
+// of them on 256 byte pages).
+#ifndef APPEND_LOG_TALLY_PROGRAMS
+#define APPEND_LOG_TALLY_PROGRAMS 64
+#endif
+
+/**
+ * Open the log `name` (8.3, space padded), or create it with `clusters`
+ * clusters if there is no file of that name. The last cluster holds the
+ * write pointer. Fails if `name` is an ordinary file, or there is no run
+ * of free clusters that long.
+ */
+bool append_log_open(const char name[11], uint32_t clusters);
+
+/**
+ * Write out what is buffered and stop appending.
+ */
+void append_log_close();
+
+bool append_log_is_open();
+
+/**
+ * Append `length` bytes. Returns how many were taken, fewer once the log
+ * is full or has been closed.
+ */
+uint32_t append_log_write(const void* data, uint32_t length);
+
+/**
+ * Write the page being gathered now, padded out, so what was appended
+ * survives a power cycle.
+ */
+bool append_log_flush();
+
+/**
+ * Bytes appended and written to flash, which is the size the file shows.
+ */
+uint32_t append_log_size();
+
+/**
+ * Bytes that fit in the log.
+ */
+uint32_t append_log_capacity();
+
+/**
+ * Put the log's size into what was read of the root directory, `bufsize`
+ * bytes from `lba`.
+ */
+void append_log_patch(uint32_t lba, void* buffer, uint32_t bufsize);
+
+/**
+ * The host is about to write `bufsize` bytes to `lba`. Keeps the log's
+ * real size in its directory entry, and closes the log if the host deleted
+ * it or writes into its clusters.
+ */
+void append_log_host_write(uint32_t lba, uint8_t* buffer, uint32_t bufsize);
@@ -0,0 +1,9 @@
+#pragma once
+
+// One row of benchmark results, as msc_bench and flash_bench both print
+// them so `msc_bench --compare` can read either. Arguments in column order.
+#define BENCH_HEADER \
+	"# scenario                 cmds  fail  read_kb write_kb erases  prog_kb     wa  device_ms   usb_ms   mb/s   bad  exits  irq_ms"
+
+#define BENCH_ROW_FORMAT \
+	"%-26s %6llu %5llu %8.1f %8.1f %6llu %8.1f %6.2f %10.1f %8.1f %6.3f %5u %6llu %7.1f"
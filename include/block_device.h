@@ -0,0 +1,113 @@
+#pragma once
+#include "stdint.h"
+#include "stddef.h"
+
+
+/**
+ * Storage that Fat16 keeps the volume on. Addresses are in bytes from the
+ * start of the device, not from the start of whatever chip it lives on.
+ *
+ * Devices come in two flavours: NOR flash, where bits can only be cleared
+ * and a whole erase unit has to be set back to 0xFF before it can be
+ * reprogrammed, and block storage (RAM, SD) that simply overwrites.
+ * `Write` hides the difference.
+ */
+class BlockDevice {
+public:
+	// Largest erase unit Modify() can buffer. 4kb covers every SPI NOR part.
+	static constexpr uint32_t MAX_ERASE_SIZE = 4096;
+
+	struct Geometry {
+		uint32_t size;             // Usable bytes
+		uint32_t erase_size;       // Smallest erasable unit
+		uint32_t program_size;     // Program granularity; writes are a multiple
+		bool erase_before_program; // NOR: only 0xFF bytes can be programmed
+	};
+
+public:
+	virtual ~BlockDevice() = default;
+
+	/**
+	 * Bring up the bus and probe the part. Called once by Fat16 before
+	 * anything else.
+	 */
+	virtual bool Init() {
+		return true;
+	}
+
+	virtual Geometry GetGeometry() const = 0;
+
+	virtual bool Read(uint32_t addr, void* buffer, uint32_t bufsize) = 0;
+
+	/**
+	 * Program `bufsize` bytes at `addr`, both a multiple of program_size.
+	 * On NOR the range must have been erased first.
+	 */
+	virtual bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) = 0;
+
+	/**
+	 * Set `bytes` starting at `addr` back to 0xFF, both a multiple of
+	 * erase_size. A no-op on storage that overwrites.
+	 */
+	virtual bool Erase(uint32_t addr, uint32_t bytes) = 0;
+
+	/**
+	 * Read, and also return the CRC32 (see sniff_crc.h) of what was read.
+	 * Devices that copy through the DMA sniffer get it for nothing; by
+	 * default the sniffer goes over the buffer again afterwards.
+	 */
+	virtual bool ReadChecked(uint32_t addr, void* buffer, uint32_t bufsize, uint32_t& crc);
+
+	/**
+	 * Program, and also return the CRC32 of the data programmed.
+	 */
+	virtual bool ProgramChecked(uint32_t addr, const uint8_t* buffer, uint32_t bufsize, uint32_t& crc);
+
+	/**
+	 * CRC32 of `bytes` starting at `addr`, for checking data nobody needs.
+	 */
+	virtual bool Checksum(uint32_t addr, uint32_t bytes, uint32_t& crc);
+
+	/**
+	 * Where `bytes` from `addr` can be read in place, on devices the CPU
+	 * can address directly (XIP flash, RAM), with anything still queued
+	 * for them written first. nullptr if they cannot, e.g. on SPI and SD
+	 * or for a range that is not in one piece underneath.
+	 */
+	virtual const uint8_t* Map(uint32_t addr, uint32_t bytes) {
+		(void) addr;
+		(void) bytes;
+		return nullptr;
+	}
+
+	/**
+	 * Push anything the device is caching out to the medium.
+	 */
+	virtual bool Flush() {
+		return true;
+	}
+
+	/**
+	 * Erase and Program calls between BeginBatch and EndBatch may be held
+	 * back and carried out together at EndBatch, on devices where each
+	 * call has a fixed cost of its own, or finished afterwards from the
+	 * main loop (see PicoFlash::Step). Reads still see everything written
+	 * before them, and Flush() waits for it. Batches nest.
+	 */
+	virtual void BeginBatch() {}
+
+	virtual void EndBatch() {}
+
+	/**
+	 * Write data inside a single erase unit while keeping the amount of
+	 * erase calls to a minimum: nothing happens if the data is already
+	 * there, and only a unit that is not blank gets erased and rewritten.
+	 */
+	virtual bool Modify(uint32_t addr, const uint8_t* buffer, uint32_t bufsize);
+
+	/**
+	 * Write any program_size aligned range, splitting it into Modify calls
+	 * that each stay within one erase unit.
+	 */
+	bool Write(uint32_t addr, const uint8_t* buffer, uint32_t bufsize);
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include "stdint.h"
+
+
+/**
+ * Upload path for loading files in bulk over a vendor-class interface,
+ * built with USB_BULK_INGEST. The host sends an IngestHeader, waits for
+ * INGEST_ACCEPTED, sends the contents and waits for INGEST_OK. The file
+ * goes into one run of free clusters and replaces one of the same name
+ * once it is complete. tools/ingest.py is the host end.
+ */
+
+#define INGEST_HEADER_MAGIC 0x4E495750 // "PWIN"
+#define INGEST_REPLY_MAGIC  0x52495750 // "PWIR"
+
+// How long a file may stall halfway before it is given up on, so a host
+// that went away does not have the rest of its stream taken as a header
+#define INGEST_TIMEOUT_US (2 * 1000 * 1000)
+
+enum IngestStatus {
+	INGEST_OK = 0,
+	INGEST_ACCEPTED = 1,  // Header taken, send the contents
+	INGEST_BAD_HEADER = 2,
+	INGEST_BAD_NAME = 3,  // Not a valid 8.3 name, or a directory or label
+	INGEST_NO_SPACE = 4,  // No run of free clusters long enough
+	INGEST_ROOT_FULL = 5,
+	INGEST_CONFLICT = 6,  // The host claimed the clusters in the meantime
+	INGEST_IO_ERROR = 7,
+	INGEST_NOT_READY = 8
+};
+
+struct __attribute__((packed)) IngestHeader {
+	uint32_t magic;
+	char name[11];     // 8.3, space padded, as in a directory entry
+	uint8_t attributes;
+	uint32_t length;
+	uint16_t time;     // FAT time and date for the directory entry
+	uint16_t date;
+};
+
+struct __attribute__((packed)) IngestReply {
+	uint32_t magic;
+	uint8_t status;        // IngestStatus
+	uint8_t reserved;
+	uint16_t start_cluster;
+};
+
+/**
+ * Move whatever the host has sent along: parse a header, or copy out the
+ * next cluster of contents. Scheduled after tud_task(). Returns true if
+ * there was work to do.
+ */
+bool bulk_ingest_task();
+
+/**
+ * Whether a file is partway through, so housekeeping that erases flash
+ * should wait.
+ */
+bool bulk_ingest_is_busy();
@@ -0,0 +1,224 @@
+#pragma once
+#include "stdint.h"
+#include "fat.h"
+
+
+/**
+ * Finds directory entries without reading the whole directory. The first
+ * lookup in a directory hashes every name in it into the tables, and then
+ * a lookup reads the one sector a name points at. Fat16 passes every write
+ * to Write(), which keeps the index up to date or drops a directory whose
+ * chain changed.
+ */
+class DirectoryIndex {
+public:
+	enum CONFIG {
+		MAX_NAMES = 2048,       // Over all directories indexed, 6 bytes each
+		BUCKETS = 1024,
+		MAX_DIRECTORIES = 8,    // Indexed at once, the one used longest ago goes first
+		DIRECTORY_BUCKETS = BUCKETS / MAX_DIRECTORIES,
+		MAX_CLUSTERS = 16,      // Longest subdirectory indexed, 2048 entries
+		MAX_UNINDEXED = 4,      // Directories remembered as too big to index
+		ENTRIES_PER_SECTOR = Fat16::DISK_BLOCK_SIZE / sizeof(fat::DirectoryEntry),
+		ENTRIES_PER_CLUSTER = Fat16::CLUSTER_BYTES / sizeof(fat::DirectoryEntry),
+		ROOT_ENTRIES = Fat16::ROOT_DIRECTORY_SIZE / sizeof(fat::DirectoryEntry),
+		MAX_ENTRIES = MAX_CLUSTERS * ENTRIES_PER_CLUSTER
+	};
+
+	// The root directory, where a directory's first cluster is asked for
+	static constexpr uint16_t ROOT = 0;
+
+	/**
+	 * Where a directory entry is: entry `index` of sector `lba`. lba 0,
+	 * the boot sector, for none.
+	 */
+	struct Slot {
+		uint32_t lba = 0;
+		uint32_t index = 0;
+
+		bool IsValid() const {
+			return lba != 0;
+		}
+	};
+
+	struct Stats {
+		uint32_t lookups = 0;
+		uint32_t sectors_read = 0;   // Directory sectors read, to index or look through
+		uint32_t indexed = 0;        // Directories read into the index
+		uint32_t dropped = 0;        // Of those, dropped since because their chain changed
+		uint32_t scans = 0;          // Lookups that had to look through the directory
+	};
+
+	static constexpr uint32_t ENTRY_BITS = 11;
+
+	// A name in the table: a hash of it, and where its entry is
+	struct Name {
+		uint16_t hash;
+		uint16_t next;       // In the bucket, or the free list
+		uint16_t where;      // Index into directories << ENTRY_BITS | number in it
+
+		uint32_t Directory() const {
+			return where >> ENTRY_BITS;
+		}
+
+		uint32_t Entry() const {
+			return where & ((1u << ENTRY_BITS) - 1);
+		}
+	};
+
+	struct Directory {
+		bool indexed;
+		uint16_t cluster;            // ROOT for the root directory
+		uint16_t clusters;           // Length of the chain, 0 for the root
+		uint16_t chain[MAX_CLUSTERS];
+		uint32_t last_used;
+		uint8_t free[MAX_ENTRIES / 8]; // A bit set per entry that is free
+	};
+
+	/**
+	 * Where the names are kept, about 17kb.
+	 */
+	struct Tables {
+		uint16_t buckets[BUCKETS];
+		Name names[MAX_NAMES];
+		Directory directories[MAX_DIRECTORIES];
+	};
+
+public:
+	DirectoryIndex(Tables& tables) : buckets(tables.buckets), names(tables.names), directories(tables.directories) {
+		Clear();
+	}
+
+	/**
+	 * The entry named `name` (8.3, space padded) in directory `dir`, in
+	 * `slot` and `entry`. `slot` is left invalid if there is none. False
+	 * if the directory could not be read.
+	 */
+	bool Find(Fat16& fs, uint16_t dir, const char name[11], Slot& slot, fat::DirectoryEntry& entry);
+
+	/**
+	 * A slot for a new entry in `dir`. A subdirectory that is full gets
+	 * another cluster; `slot` is left invalid if the root directory is
+	 * full or the volume is. False if the directory could not be read.
+	 */
+	bool FindFree(Fat16& fs, uint16_t dir, Slot& slot);
+
+	/**
+	 * Where entry number `number` of `dir` is, for walking it in order.
+	 * `slot` is left invalid past the end of the directory.
+	 */
+	bool Locate(Fat16& fs, uint16_t dir, uint32_t number, Slot& slot);
+
+	/**
+	 * Make a subdirectory `name` of `parent`, with its "." and ".."
+	 * entries, and put its first cluster in `cluster`. Fails if the name
+	 * is taken.
+	 */
+	bool MakeDirectory(Fat16& fs, uint16_t parent, const char name[11], uint16_t& cluster);
+
+	/**
+	 * `bufsize` bytes from `lba` were written with `data`.
+	 */
+	void Write(uint32_t lba, const uint8_t* data, uint32_t bufsize);
+
+	/**
+	 * Forget everything, after the volume changed other than through
+	 * Write(): a format, a remount, a failed write.
+	 */
+	void Clear();
+
+	/**
+	 * Off, every lookup looks through the directory, for comparison.
+	 */
+	void SetEnabled(bool value) {
+		enabled = value;
+		Clear();
+	}
+
+	bool IsEnabled() const {
+		return enabled;
+	}
+
+	const Stats& GetStats() const {
+		return stats;
+	}
+
+	void ResetStats() {
+		stats = Stats();
+	}
+
+	/**
+	 * Whether `entry` names a file or directory, rather than being free,
+	 * deleted, "." or "..", a label or part of a long name.
+	 */
+	static bool IsNamed(const fat::DirectoryEntry& entry);
+
+private:
+	static constexpr uint16_t NONE = 0xFFFF;
+
+	/**
+	 * The directory starting at `cluster`, reading it into the index if it
+	 * is not there yet. nullptr if it cannot be indexed.
+	 */
+	Directory* Index(Fat16& fs, uint16_t cluster);
+
+	/**
+	 * Take directory `d` out of the index.
+	 */
+	void Drop(uint32_t d);
+
+	/**
+	 * Index entries from number `first` of directory `d`, one sector of
+	 * them in `data`. False if there was no room for a name.
+	 */
+	bool Learn(uint32_t d, uint32_t first, const uint8_t* data);
+
+	/**
+	 * Take the names of `count` entries from `first` of directory `d` out
+	 * of the table.
+	 */
+	void Forget(uint32_t d, uint32_t first, uint32_t count);
+
+	uint32_t EntryCount(const Directory& directory) const {
+		return directory.cluster == ROOT ? ROOT_ENTRIES : directory.clusters * ENTRIES_PER_CLUSTER;
+	}
+
+	Slot SlotOf(const Directory& directory, uint32_t entry) const;
+
+	/**
+	 * Look through `dir` sector by sector for `name`, and for the first
+	 * free slot if `free_slot` is given.
+	 */
+	bool Scan(Fat16& fs, uint16_t dir, const char* name, Slot& slot, fat::DirectoryEntry& entry, Slot* free_slot);
+
+	/**
+	 * Add a zeroed cluster to the end of subdirectory `dir`, and put its
+	 * first slot in `slot`.
+	 */
+	bool Extend(Fat16& fs, uint16_t dir, Slot& slot);
+
+	/**
+	 * The head of the bucket for `hash` among directory `d`'s own.
+	 */
+	uint16_t& Bucket(uint32_t d, uint16_t hash) {
+		return buckets[d * DIRECTORY_BUCKETS + hash % DIRECTORY_BUCKETS];
+	}
+
+	static uint16_t Hash(uint16_t dir, const char name[11]);
+
+private:
+	bool enabled = true;
+	uint32_t clock = 0;
+
+	uint16_t* buckets;
+	Name* names;
+	Directory* directories;
+	uint16_t free_names;    // Head of the free list
+	uint32_t names_left;
+
+	// Looked through instead of indexed again on every lookup, until Clear()
+	uint16_t unindexed[MAX_UNINDEXED];
+	uint32_t next_unindexed;
+
+	Stats stats;
+};
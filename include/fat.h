@@ -1,8 +1,17 @@
 #pragma once
 #include "stdint.h"
 #include "fat_standard.hpp"
-#include <hardware/flash.h>
+#include "access_times.h"
+#include "block_device.h"
+#include "metadata_journal.h"
 
+// Clusters the host freed that PreErase() remembers, to erase them while
+// the host is quiet so writing them again only programs. 0 turns it off.
+#ifndef PRE_ERASE_CLUSTERS
+#define PRE_ERASE_CLUSTERS 64
+#endif
+
+class DirectoryIndex;
 
 class Fat16 {
 public:
@@ -27,24 +36,38 @@ public:
 	static constexpr uint32_t INDEX_ROOT_DIRECTORY = 0x103;
 	static constexpr uint32_t INDEX_DATA_STARTS = 0x123;
 
-	// Thanks to
-	// https://www.makermatrix.com/blog/read-and-write-data-with-the-pi-pico-onboard-flash/
-	//
-	// Location on Pico flash memory, in bytes. This program is located in
-	// the front of flash, meaning we must store FAT, Root Dir, and DATA
-	// near the back.
-	//
-	// Useful information:
-	// - Sector size is 4kb on Pico flash
-	// - Due to how Flash works, you can't change a 0 to a 1. You'd need to
-	// erase the whole sector, which sets everything to 1.
-	static constexpr uint32_t FLASH_BOOT = (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE * 200);
-	static constexpr uint32_t FLASH_FAT = FLASH_BOOT + FLASH_SECTOR_SIZE;
-	static constexpr uint32_t FLASH_ROOT_DIRECTORY = FLASH_FAT + FLASH_SECTOR_SIZE;
-	static constexpr uint32_t FLASH_DATA_START = FLASH_ROOT_DIRECTORY + 512 * 32;
+	static constexpr uint32_t FAT_TABLE_SECTORS = INDEX_FAT_TABLE_2_START - INDEX_FAT_TABLE_1_START;
+	static constexpr uint32_t ROOT_DIRECTORY_SIZE = (INDEX_DATA_STARTS - INDEX_ROOT_DIRECTORY) * DISK_BLOCK_SIZE;
+	static constexpr uint32_t CLUSTER_BYTES = DISK_CLUSTER_SIZE * DISK_BLOCK_SIZE;
+	static constexpr uint32_t FIRST_CLUSTER = 2; // Entries 0 and 1 of the FAT are reserved
+
+	// Format() leaves these at the end of the boot sector's bootcode, so a
+	// volume some other firmware laid out, e.g. the fixed FLASH_* layout
+	// from before Layout, is recognized when mounted instead of being read
+	// as garbage. Bump LAYOUT_VERSION whenever something moves.
+	static constexpr uint32_t LAYOUT_MAGIC = 0x4C575050; // "PPWL"
+	static constexpr uint32_t LAYOUT_VERSION = 1;
+
+	/**
+	 * Where each section lives on the BlockDevice, in bytes. A device that
+	 * holds all 128mb is a plain 1:1 image; a smaller one shares FAT #2 with
+	 * FAT #1 and stores only the FAT sectors it has clusters for. NOR devices
+	 * also get the metadata journal's erase units.
+	 */
+	struct Layout {
+		uint32_t boot;
+		uint32_t fat;
+		uint32_t fat_blocks;  // FAT sectors backed by the device
+		uint32_t root;
+		uint32_t journal;
+		uint32_t journal_size; // 0 if there is no journal
+		uint32_t data;
+		uint32_t data_blocks; // Data sectors backed by the device
+		bool linear;
+	};
 
 public:
-	Fat16();
+	Fat16(BlockDevice& device);
 
 	constexpr int GetBlockCount() const {
 		return DISK_BLOCK_NUM;
@@ -54,13 +77,185 @@ public:
 		return DISK_BLOCK_SIZE;
 	}
 
+	/**
+	 * Replace the volume with a freshly formatted one.
+	 */
+	bool Format();
+
 	int32_t GetBlock(const uint32_t lba, void* buffer, uint32_t bufsize);
 
 	int32_t WriteBlock(const uint32_t lba, void* buffer, uint32_t bufsize);
 
+	/**
+	 * Whether WriteBlock would take this data. Blocks the device has no
+	 * room for can only be written with zeros.
+	 */
+	bool CheckWrite(const uint32_t lba, const void* buffer, uint32_t bufsize) const;
+
+	/**
+	 * Where `blocks` from `lba` can be read in place, see FileMap. nullptr
+	 * unless they are all stored, one after the other, outside the
+	 * journaled FAT and root directory, on a device that can be mapped
+	 * (BlockDevice::Map).
+	 */
+	const uint8_t* MapBlocks(const uint32_t lba, uint32_t blocks);
+
+	/**
+	 * Make everything written so far durable on the device.
+	 */
+	bool Flush();
+
+	/**
+	 * Housekeeping for when the host has gone quiet: writes the access
+	 * dates AccessTimes kept, and folds the metadata journal into the FAT
+	 * and root directory once it is worth the erases. Returns true if
+	 * there was anything to do.
+	 */
+	bool Idle();
+
+	/**
+	 * Erase one cluster the host freed since it was mounted, if it is
+	 * still free and not blank already, so a WRITE10 that lands on it
+	 * later only programs instead of waiting for the erase. What the host
+	 * deleted reads as 0xFF from then on, as after a TRIM. Returns true if
+	 * there was a cluster left to look at. Only worth calling when the
+	 * host is quiet, one cluster at a time.
+	 */
+	bool PreErase();
+
+	/**
+	 * Clusters PreErase() has erased so far.
+	 */
+	uint32_t GetPreErased() const {
+		return pre_erased;
+	}
+
+	/**
+	 * Fold the metadata journal in now, e.g. before the drive is ejected.
+	 * Access dates kept in RAM are written first, see AccessTimes.
+	 */
+	bool Compact();
+
+	/**
+	 * Read again what is kept in RAM about the device, after it changed
+	 * underneath, e.g. a snapshot was rolled back.
+	 */
+	bool Remount();
+
+	/**
+	 * False if the device could not be brought up, e.g. no SD card.
+	 */
+	bool IsReady() const {
+		return ready;
+	}
+
+	const Layout& GetLayout() const {
+		return layout;
+	}
+
+	/**
+	 * Highest cluster number the device has room for. The FAT goes on
+	 * past it, but those clusters can only ever hold zeros.
+	 */
+	uint32_t GetLastCluster() const;
+
+	static constexpr uint32_t ClusterToLBA(const uint32_t cluster) {
+		return INDEX_DATA_STARTS + (cluster - FIRST_CLUSTER) * DISK_CLUSTER_SIZE;
+	}
+
+	/**
+	 * Free clusters up to GetLastCluster(), or -1 while unknown. A
+	 * VolumeCheck pass counts them; after that every write to FAT #1
+	 * keeps the number up to date, so asking is O(1).
+	 */
+	int32_t GetFreeClusters() const {
+		return free_clusters;
+	}
+
+	void SetFreeClusters(int32_t count) {
+		free_clusters = count;
+	}
+
+	/**
+	 * Changes with every write, and when the volume is set up again, so a
+	 * walk over the FAT and directories spread out over time can tell it
+	 * has to start over.
+	 */
+	static uint32_t GetGeneration() {
+		return generation;
+	}
+
+	BlockDevice& GetDevice() {
+		return device;
+	}
+
+	AccessTimes& GetAccessTimes() {
+		return access_times;
+	}
+
+	/**
+	 * Hand every write from now on to `index` as well, so it stays in step
+	 * with the directories, see DirectoryIndex.
+	 */
+	void SetDirectoryIndex(DirectoryIndex* index);
+
 	constexpr uint32_t LBAToIndex(const uint32_t lba) const;
 
-	constexpr uint32_t LBAToFlash(const uint32_t lba) const;
+	/**
+	 * Device address of `lba` in `addr`. Returns false if the block is
+	 * not stored on the device.
+	 */
+	bool LBAToAddress(const uint32_t lba, uint32_t& addr) const;
+
+private:
+	static Layout ComputeLayout(const BlockDevice::Geometry& geometry);
+
+	/**
+	 * Whether the boot sector on the device carries this firmware's
+	 * layout stamp, see LAYOUT_MAGIC.
+	 */
+	bool HasLayoutStamp();
+
+	/**
+	 * Adjust free_clusters for FAT #1 sector `sector` about to be
+	 * overwritten with `data`, and hand the clusters it frees to
+	 * PreErase().
+	 */
+	void CountFreeChange(uint32_t sector, const uint8_t* data);
+
+	/**
+	 * Drop the clusters among `blocks` from `lba` from what PreErase()
+	 * has left to do, the host is writing them.
+	 */
+	void ForgetPreErase(const uint32_t lba, uint32_t blocks);
+
+	/**
+	 * Offer the root directory sectors among `blocks` from `lba` to
+	 * access_times. Returns a bit per root directory sector it took,
+	 * which are then not written.
+	 */
+	uint32_t AbsorbTimes(const uint32_t lba, const uint8_t* data, uint32_t blocks);
+
+	/**
+	 * Write the root directory sectors access_times has dates for.
+	 */
+	bool PersistTimes();
+
+private:
+	BlockDevice& device;
+	MetadataJournal journal;
+	Layout layout;
+	bool ready;
+	int32_t free_clusters = -1;
+	bool can_pre_erase = false;
+	uint16_t pre_erase[PRE_ERASE_CLUSTERS > 0 ? PRE_ERASE_CLUSTERS : 1];
+	uint32_t pre_erase_count = 0;
+	uint32_t pre_erased = 0;
+	DirectoryIndex* directories = nullptr;
+	AccessTimes access_times;
+
+	// Shared by all instances, so a new one never looks like one already seen
+	static inline uint32_t generation = 0;
 };
 
 
@@ -0,0 +1,146 @@
+#pragma once
+#include "stdint.h"
+#include "string.h"
+#include "fat.h"
+
+
+/**
+ * Reads and changes FAT entries through Fat16 one sector at a time, for
+ * firmware that walks or edits the FAT itself (bulk_ingest, VolumeCheck,
+ * append_log). The sector held is written back, to both copies on a 1:1
+ * layout, when a different one is needed or on Store().
+ *
+ * It does not notice the host writing the FAT; Forget() whatever is held
+ * when that may have happened.
+ */
+class FatCursor {
+public:
+	enum Entry : uint16_t {
+		FREE = 0x0000,
+		BAD = 0xFFF7,
+		END_FIRST = 0xFFF8,   // Any of these ends a chain
+		END_OF_CHAIN = 0xFFFF
+	};
+
+	static constexpr uint32_t ENTRIES_PER_SECTOR = Fat16::DISK_BLOCK_SIZE / 2;
+
+public:
+	FatCursor() = default;
+
+	bool Get(Fat16& fs, uint32_t cluster, uint16_t& value) {
+		if (!Load(fs, cluster))
+			return false;
+
+		memcpy(&value, sector + cluster % ENTRIES_PER_SECTOR * 2, 2);
+		return true;
+	}
+
+	bool Set(Fat16& fs, uint32_t cluster, uint16_t value) {
+		if (!Load(fs, cluster))
+			return false;
+
+		memcpy(sector + cluster % ENTRIES_PER_SECTOR * 2, &value, 2);
+		dirty = true;
+		return true;
+	}
+
+	/**
+	 * Write the sector held back if it was changed.
+	 */
+	bool Store(Fat16& fs) {
+		if (!dirty)
+			return true;
+
+		dirty = false;
+
+		// A packed layout keeps only one copy, see Fat16::Layout
+		for (uint32_t copy = 0; copy < (fs.GetLayout().linear ? 2 : 1); copy++) {
+			uint32_t lba = Fat16::INDEX_FAT_TABLE_1_START + copy * Fat16::FAT_TABLE_SECTORS + index;
+			if (fs.WriteBlock(lba, sector, sizeof(sector)) < 0)
+				return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Drop the sector held, changes and all.
+	 */
+	void Forget() {
+		index = UINT32_MAX;
+		dirty = false;
+	}
+
+	/**
+	 * First run of `count` free clusters the device can store, in `first`.
+	 */
+	bool FindFreeRun(Fat16& fs, uint32_t count, uint16_t& first) {
+		// Counted by VolumeCheck, if it has had a chance yet
+		if (fs.GetFreeClusters() >= 0 && (uint32_t) fs.GetFreeClusters() < count)
+			return false;
+
+		uint32_t last = fs.GetLastCluster();
+		uint32_t run = 0;
+
+		for (uint32_t cluster = Fat16::FIRST_CLUSTER; cluster <= last; cluster++) {
+			uint16_t value;
+			if (!Get(fs, cluster, value))
+				return false;
+
+			run = value == FREE ? run + 1 : 0;
+			if (run == count) {
+				first = (uint16_t) (cluster + 1 - count);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * Free the chain starting at `first`, up to anything that is not a
+	 * cluster of the volume, guarding against a loop in it, and store it.
+	 */
+	bool FreeChain(Fat16& fs, uint32_t first) {
+		uint32_t last = fs.GetLastCluster();
+		uint32_t cluster = first;
+		for (uint32_t steps = 0; cluster >= Fat16::FIRST_CLUSTER && cluster <= last && steps < last; steps++) {
+			uint16_t next;
+			if (!Get(fs, cluster, next) || !Set(fs, cluster, FREE))
+				return false;
+			cluster = next;
+		}
+
+		return Store(fs);
+	}
+
+	/**
+	 * Whether `value` is the last link of a chain.
+	 */
+	static bool IsEnd(uint16_t value) {
+		return value >= END_FIRST;
+	}
+
+private:
+	bool Load(Fat16& fs, uint32_t cluster) {
+		uint32_t wanted = cluster / ENTRIES_PER_SECTOR;
+		if (wanted == index)
+			return true;
+
+		if (!Store(fs))
+			return false;
+
+		index = wanted;
+		if (fs.GetBlock(Fat16::INDEX_FAT_TABLE_1_START + index, sector, sizeof(sector)) < 0) {
+			index = UINT32_MAX;
+			return false;
+		}
+
+		return true;
+	}
+
+private:
+	uint8_t sector[Fat16::DISK_BLOCK_SIZE];
+	uint32_t index = UINT32_MAX;
+	bool dirty = false;
+};
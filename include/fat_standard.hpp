@@ -159,7 +159,7 @@ public:
 		entry.start_cluster = cluster;
 	}
 
-	void SetFileSize(uint16_t size) {
+	void SetFileSize(uint32_t size) {
 		entry.size = size;
 	}
 
@@ -190,6 +190,86 @@ private:
 };
 
 
+// Allowed in a short name besides letters and digits
+#define SHORT_NAME_SPECIAL "$%'-_@~`!(){}^#&"
+
+/**
+ * Whether `name` (8.3, space padded, as in a directory entry) is one this
+ * firmware would write: upper case, no gaps before the padding.
+ */
+inline bool IsValidShortName(const char name[11]) {
+	if (name[0] == ' ' || (uint8_t) name[0] == 0xE5)
+		return false;
+
+	for (int part = 0; part < 2; part++) {
+		int start = part == 0 ? 0 : 8;
+		int end = part == 0 ? 8 : 11;
+		bool padding = false;
+
+		for (int i = start; i < end; i++) {
+			char c = name[i];
+			if (c == ' ') {
+				padding = true;
+				continue;
+			}
+
+			bool allowed = (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != 0 && strchr(SHORT_NAME_SPECIAL, c));
+			if (padding || !allowed)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * "notes.txt" to "NOTES   TXT". False if it cannot be an 8.3 name.
+ */
+inline bool ToShortName(const char* text, uint32_t length, char name[11]) {
+	memset(name, ' ', 11);
+	if (length == 0 || text[0] == '.')
+		return false;
+
+	uint32_t i = 0;
+	uint32_t limit = 8;
+	for (uint32_t p = 0; p < length; p++) {
+		char c = text[p];
+		if (c == '.' && limit == 8) {
+			i = 8;
+			limit = 11;
+			continue;
+		}
+
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+
+		bool allowed = (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != 0 && strchr(SHORT_NAME_SPECIAL, c));
+		if (!allowed || i == limit)
+			return false;
+		name[i++] = c;
+	}
+
+	return true;
+}
+
+/**
+ * "NOTES   TXT" to "NOTES.TXT", returns the length. `out` needs room for
+ * 12 characters; it is not terminated.
+ */
+inline uint32_t FromShortName(const char name[11], char* out) {
+	uint32_t length = 0;
+	for (uint32_t i = 0; i < 8 && name[i] != ' '; i++)
+		out[length++] = name[i];
+
+	if (name[8] != ' ') {
+		out[length++] = '.';
+		for (uint32_t i = 8; i < 11 && name[i] != ' '; i++)
+			out[length++] = name[i];
+	}
+
+	return length;
+}
+
 class RootDirectory {
 public:
 	RootDirectory() {
@@ -0,0 +1,114 @@
+#pragma once
+#include "stdint.h"
+
+
+/**
+ * A file read in place, as spans into the XIP window or a RAM disk, for
+ * firmware that passes its contents on. A fragmented file gets a span per
+ * run of clusters, up to MAX_SPANS. Any write to the file leaves the map
+ * stale, so check IsValid() before use. Pin() keeps background erases off
+ * the spans but cannot hold host writes back: a write ends the pin, and
+ * what was sent has to go again.
+ */
+class FileMap {
+public:
+	enum CONFIG {
+		MAX_SPANS = 8,
+		MAX_MAPS = 4 // Mapped at the same time
+	};
+
+	struct Span {
+		const uint8_t* data;
+		uint32_t length;
+	};
+
+public:
+	FileMap() = default;
+
+	FileMap(const FileMap&) = delete;
+	FileMap& operator=(const FileMap&) = delete;
+
+	~FileMap() {
+		Unmap();
+	}
+
+	/**
+	 * Map `size` bytes of the chain starting at `first_cluster`, as in
+	 * the file's directory entry. Whatever the host has staged for the
+	 * FAT or the file is committed first. Replaces what was mapped before.
+	 */
+	bool Map(uint16_t first_cluster, uint32_t size);
+
+	void Unmap();
+
+	/**
+	 * Mapped, and nothing has written to the file since.
+	 */
+	bool IsValid() const {
+		return mapped && !stale;
+	}
+
+	/**
+	 * Mark the spans in use until Unpin(), or until a write to the file
+	 * ends it. Returns false if the map is not valid, including when a
+	 * write the host had staged for the file turns out to have been the
+	 * last one.
+	 */
+	bool Pin();
+
+	void Unpin() {
+		pinned = false;
+	}
+
+	bool IsPinned() const {
+		return pinned;
+	}
+
+	uint32_t GetSpanCount() const {
+		return span_count;
+	}
+
+	const Span& GetSpan(uint32_t index) const {
+		return spans[index];
+	}
+
+	uint32_t GetSize() const {
+		return size;
+	}
+
+	/**
+	 * `blocks` from `lba` were written, or are about to be: maps with any
+	 * of them go stale and lose their pin. Called by Fat16::WriteBlock and for writes that go
+	 * around it (msc_disk_invalidate).
+	 */
+	static void Invalidate(uint32_t lba, uint32_t blocks);
+
+	/**
+	 * The whole volume changed, e.g. it was formatted or rolled back.
+	 */
+	static void InvalidateAll();
+
+	/**
+	 * Whether a pinned map has any of `blocks` from `lba`.
+	 */
+	static bool Holds(uint32_t lba, uint32_t blocks);
+
+private:
+	bool Overlaps(uint32_t lba, uint32_t blocks) const;
+
+	/**
+	 * Take a slot in `maps`, if this map does not have one yet.
+	 */
+	bool Register();
+
+private:
+	Span spans[MAX_SPANS];
+	uint32_t span_lbas[MAX_SPANS]; // First block of each span
+	uint32_t span_count = 0;
+	uint32_t size = 0;
+	bool mapped = false;
+	bool stale = false;
+	bool pinned = false;
+
+	static inline FileMap* maps[MAX_MAPS] = {};
+};
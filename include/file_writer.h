@@ -0,0 +1,127 @@
+#pragma once
+#include "stdint.h"
+#include "directory_index.h"
+#include "fat.h"
+#include "fat_cursor.hpp"
+
+
+/**
+ * Puts a whole file on the volume for the firmware's upload paths: the
+ * contents go into one run of free clusters, a cluster per write, and the
+ * FAT and directory entry are written once it is complete. The chain is
+ * written before the entry points at it, so a power cut leaves at most
+ * lost clusters.
+ */
+class FileWriter {
+public:
+	enum Status {
+		WRITE_OK,
+		WRITE_BAD_NAME,        // Not a valid 8.3 name, or a directory or label has it
+		WRITE_NO_SPACE,        // No run of free clusters long enough
+		WRITE_DIRECTORY_FULL,
+		WRITE_CONFLICT,        // The host claimed the clusters in the meantime
+		WRITE_IO_ERROR,
+		WRITE_NOT_READY
+	};
+
+public:
+	/**
+	 * `buffer` holds one cluster, Fat16::CLUSTER_BYTES.
+	 */
+	FileWriter(uint8_t* buffer) : buffer(buffer) {}
+
+	/**
+	 * Start a file `name` (8.3, space padded) of `length` bytes in
+	 * directory `dir`, and find the clusters for it. The directory entry
+	 * it is going to take is in GetSlot().
+	 */
+	Status Begin(uint16_t dir, const char name[11], uint8_t attributes, uint32_t length, uint16_t time, uint16_t date);
+
+	/**
+	 * Where the next contents go, with how many bytes fit there before the
+	 * cluster has to be stored in `room`.
+	 */
+	uint8_t* Space(uint32_t& room) {
+		uint32_t left = length - received;
+		room = Fat16::CLUSTER_BYTES - fill < left ? Fat16::CLUSTER_BYTES - fill : left;
+		return buffer + fill;
+	}
+
+	/**
+	 * `bytes` went in at Space().
+	 */
+	void Filled(uint32_t bytes) {
+		fill += bytes;
+		received += bytes;
+	}
+
+	/**
+	 * The cluster buffer is full, or holds the end of the file.
+	 */
+	bool IsClusterReady() const {
+		return fill == Fat16::CLUSTER_BYTES || (fill > 0 && received == length);
+	}
+
+	/**
+	 * Write the cluster buffered out, zero padded if it is the last one.
+	 */
+	bool StoreCluster();
+
+	/**
+	 * Let the cluster buffered go unwritten, for contents that still have
+	 * to be taken after the file could no longer be stored.
+	 */
+	void DropCluster() {
+		fill = 0;
+	}
+
+	/**
+	 * Chain the clusters and write the directory entry, once every byte
+	 * has been stored.
+	 */
+	Status Finish();
+
+	bool IsComplete() const {
+		return received == length;
+	}
+
+	uint32_t GetReceived() const {
+		return received;
+	}
+
+	uint32_t GetLength() const {
+		return length;
+	}
+
+	uint16_t GetFirstCluster() const {
+		return first_cluster;
+	}
+
+	const DirectoryIndex::Slot& GetSlot() const {
+		return slot;
+	}
+
+private:
+	/**
+	 * The slot in `dir` holding `name` in `found`, a copy of it in `match`,
+	 * and if there is none, the slot free for a new entry in `free_slot`.
+	 * Either is left invalid if there is none.
+	 */
+	bool FindEntry(Fat16& fs, DirectoryIndex::Slot& found, fat::DirectoryEntry& match, DirectoryIndex::Slot& free_slot);
+
+private:
+	uint8_t* buffer;
+	FatCursor fat_cursor;
+
+	uint16_t dir = DirectoryIndex::ROOT;
+	char name[11] = {};
+	uint8_t attributes = 0;
+	uint16_t time = 0;
+	uint16_t date = 0;
+	uint32_t length = 0;
+
+	uint16_t first_cluster = 0;
+	uint32_t received = 0;
+	uint32_t fill = 0;           // Bytes in the cluster buffer
+	DirectoryIndex::Slot slot;
+};
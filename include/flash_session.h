@@ -0,0 +1,137 @@
+#pragma once
+#include "stdint.h"
+#include "stddef.h"
+#include <hardware/flash.h>
+
+// Longest stretch, in microseconds, a session may keep interrupts off
+// before it is cut into slices. 0 runs every session in one go.
+#ifndef FLASH_SLICE_US
+#define FLASH_SLICE_US 4000
+#endif
+
+// Whether the flash chip can suspend an erase in progress (75h/7Ah, as
+// the W25Q16JV on the Pico can). Without it an erase is one slice.
+#ifndef FLASH_ERASE_SUSPEND
+#define FLASH_ERASE_SUSPEND 1
+#endif
+
+/**
+ * Erase and program operations on the Pico's own flash carried out in one
+ * critical section, so XIP is exited and the cache flushed once for all of
+ * them. A session holds at most one sector erase. With a slice budget set,
+ * Step() runs it in slices that each fit the budget, suspending the erase
+ * in between, so the main loop runs while it is in progress.
+ */
+class FlashSession {
+public:
+	enum CONFIG {
+		MAX_OPS = 32,
+		ARENA_SIZE = FLASH_SECTOR_SIZE + 4 * FLASH_PAGE_SIZE,
+		PAGE_PROGRAM_US = 400, // W25Q16JV typical, to plan slices with
+		SUSPEND_US = 50,       // Suspending an erase (tSUS) and XIP re-entry
+		IRQ_OFF_BUCKETS = 18   // Stretches under 1us, 2us, 4us ... 65ms, and longer
+	};
+
+	struct Op {
+		uint32_t offset;     // From the start of flash
+		const uint8_t* data; // nullptr for an erase
+		uint32_t count;
+	};
+
+	struct Stats {
+		uint32_t sessions = 0;        // Critical sections: XIP exits
+		uint32_t ops = 0;
+		uint64_t irq_off_us = 0;      // Total time with interrupts disabled
+		uint32_t max_irq_off_us = 0;  // Longest single stretch
+		uint32_t suspends = 0;        // Erases suspended at the end of a slice
+		uint32_t irq_off[IRQ_OFF_BUCKETS] = {}; // Stretches by length, see IRQ_OFF_BUCKETS
+	};
+
+public:
+	FlashSession() = default;
+
+	/**
+	 * Queue an erase of `count` bytes at sector aligned `offset`.
+	 */
+	void Erase(uint32_t offset, uint32_t count);
+
+	/**
+	 * Queue programming `count` bytes at page aligned `offset`. Returns
+	 * the sniffer CRC32 of the data, taken while it is copied in.
+	 */
+	uint32_t Program(uint32_t offset, const uint8_t* data, uint32_t count);
+
+	/**
+	 * Carry out everything queued so far.
+	 */
+	void Run();
+
+	/**
+	 * Carry out one slice of what is queued, or all of it without a
+	 * slice budget. Returns true if there is more to do.
+	 */
+	bool Step();
+
+	bool Empty() const {
+		return op_count == 0;
+	}
+
+	static Stats& GetStats();
+
+	static void SetBatching(bool enabled);
+
+	static void SetSliceBudget(uint32_t us);
+
+	static uint32_t GetSliceBudget();
+
+private:
+	void Execute(const Op* first, size_t count);
+
+	/**
+	 * One critical section of at most the slice budget, from op `next` on.
+	 */
+	void Slice();
+
+	/**
+	 * Forget the ops, once they have all been carried out.
+	 */
+	void Reset();
+
+private:
+	Op ops[MAX_OPS];
+	uint32_t op_count = 0;
+	uint8_t arena[ARENA_SIZE];
+	uint32_t arena_used = 0;
+	bool erase_queued = false;
+
+	// How far slices have got: ops before `next` are done, a program at
+	// `next` is cut down to what is left of it, and `suspended` is set if
+	// it is an erase that was started.
+	uint32_t next = 0;
+	bool suspended = false;
+};
+
+/**
+ * Run `ops` back to back with XIP off. Interrupts must already be
+ * disabled, and the ops and their data must be in RAM. On the device this
+ * runs from RAM and calls the boot ROM directly; the host simulator has
+ * its own.
+ */
+void flash_session_execute(const FlashSession::Op* ops, size_t count);
+
+/**
+ * Erase `count` bytes at sector aligned `offset`, in blocks of
+ * `block_size` with `block_command` (e.g. 32kb with 52h) where they line
+ * up and in sectors elsewhere. The firmware only ever erases sectors; this
+ * is for timing the chip (flash_bench). Same conditions as
+ * flash_session_execute().
+ */
+void flash_session_erase_blocks(uint32_t offset, uint32_t count, uint32_t block_size, uint8_t block_command);
+
+/**
+ * Erase the sector at `offset`, or resume the erase of it that was
+ * suspended if `resume`, and wait up to `budget_us` for it to finish. If
+ * it has not by then it is suspended, so XIP works again. Returns true
+ * once the sector is erased. Same conditions as flash_session_execute().
+ */
+bool flash_session_erase_slice(uint32_t offset, bool resume, uint32_t budget_us);
@@ -0,0 +1,31 @@
+#pragma once
+#include "stdint.h"
+
+#define HTTP_SERVER_PORT 80
+
+
+/**
+ * Read-only HTTP/1.0 file server for the volume over Wi-Fi, on lwIP's raw
+ * TCP API. `GET /` and `GET /DIR/` list a directory, `GET /NAME.EXT`
+ * sends a file, with Range supported, and HEAD is accepted too. Files are
+ * read a sector at a time. A download whose file is replaced or cut
+ * shorter is reset.
+ */
+
+/**
+ * Listen on HTTP_SERVER_PORT. Safe to call again.
+ */
+bool http_server_begin();
+
+/**
+ * Answer a request that is complete, or send the next few sectors of a
+ * response. Scheduled after msc_disk_task(). Returns true if there was
+ * work to do.
+ */
+bool http_server_task();
+
+/**
+ * Whether a response is partway, so housekeeping that erases flash should
+ * wait.
+ */
+bool http_server_is_busy();
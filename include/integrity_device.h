@@ -0,0 +1,179 @@
+#pragma once
+#include "stdint.h"
+#include "block_device.h"
+
+
+/**
+ * CRC32 of every UNIT_SIZE unit, taken by the DMA sniffer during copies
+ * that happen anyway (see sniff_crc.h), so data that changed on the medium
+ * is noticed. A whole-unit write seals the unit and a whole-unit read
+ * checks it; partly written units wait for Scrub(). A mismatch counts in
+ * GetCorruptReads(). Opens and seals go to a record log in the last
+ * META_UNITS units, each log page programmed once.
+ */
+class IntegrityDevice : public BlockDevice {
+public:
+	enum CONFIG {
+		UNIT_SIZE = 4096,
+		RECORDS_PER_UNIT = UNIT_SIZE / 8,
+		META_UNITS = 2,
+		MAX_UNITS = RECORDS_PER_UNIT * 3 / 4, // A checkpoint leaves room in its log unit
+		MAX_PROGRAM_SIZE = 512,
+		OPEN_AHEAD = 16 // Units after one that is opened, opened along with it
+	};
+
+	struct Record {
+		uint8_t type;
+		uint8_t check;   // Makes the bytes of the record sum to 0xFF
+		uint16_t unit;
+		uint32_t crc;
+	};
+
+	struct Stats {
+		uint32_t verified = 0;  // Whole unit reads checked
+		uint32_t scrubbed = 0;  // Units checked or sealed by Scrub()
+		uint32_t corrupt = 0;   // Units found not to match
+		uint32_t opened = 0;    // Open records logged
+		uint32_t deferred = 0;  // ... that went on a page programmed anyway instead of one of their own
+	};
+
+public:
+	/**
+	 * `enabled` false passes everything straight through, as does a
+	 * device too large for the table.
+	 */
+	IntegrityDevice(BlockDevice& inner, bool enabled, bool verify_reads = true);
+
+	bool Init() override;
+
+	Geometry GetGeometry() const override;
+
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override;
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override;
+
+	bool Erase(uint32_t addr, uint32_t bytes) override;
+
+	/**
+	 * Not for a range with a corrupt unit in it, so the caller reads it
+	 * instead and gets the error. What is mapped is not checked against
+	 * its CRC the way a whole unit read is; Scrub() still gets to it.
+	 */
+	const uint8_t* Map(uint32_t addr, uint32_t bytes) override;
+
+	bool Flush() override;
+
+	void BeginBatch() override {
+		inner.BeginBatch();
+	}
+
+	void EndBatch() override {
+		inner.EndBatch();
+	}
+
+	/**
+	 * Check the next unit, or seal it if it is open. Returns false once a
+	 * whole pass over the device is done, true while there is more to go.
+	 */
+	bool Scrub();
+
+	/**
+	 * Checking reads costs nothing on the internal flash, but a CRC in
+	 * software on other devices.
+	 */
+	void SetVerifyReads(bool enabled) {
+		verify_reads = enabled;
+	}
+
+	bool IsEnabled() const {
+		return enabled;
+	}
+
+	/**
+	 * Reads so far that returned data from a corrupt unit.
+	 */
+	uint32_t GetCorruptReads() const {
+		return corrupt_reads;
+	}
+
+	const Stats& GetStats() const {
+		return stats;
+	}
+
+private:
+	enum RecordType {
+		RECORD_HEADER = 1, // First in a log unit: crc holds the generation
+		RECORD_OPEN = 2,   // Contents about to change, nothing to check
+		RECORD_SEAL = 3    // Contents match crc
+	};
+
+	enum UnitFlags {
+		UNIT_SEALED = 1,
+		UNIT_CORRUPT = 2
+	};
+
+	static constexpr uint16_t HEADER_MAGIC = 0x4943; // "IC"
+
+	/**
+	 * Log that `unit` is about to change, if it is sealed.
+	 */
+	bool Open(uint32_t unit);
+
+	/**
+	 * Whether the current log page has a seal of `unit` that is not on the
+	 * medium yet.
+	 */
+	bool IsSealPending(uint32_t unit) const;
+
+	bool Seal(uint32_t unit, uint32_t crc);
+
+	void MarkCorrupt(uint32_t unit);
+
+	void Apply(const Record& record);
+
+	/**
+	 * Add a record to the current log page. A deferred one is written with
+	 * the next record that is not, or when the page is full.
+	 */
+	bool Append(uint8_t type, uint16_t unit, uint32_t crc, bool defer);
+
+	bool WritePage();
+
+	bool ProgramPage(uint32_t meta_unit, uint32_t slot, const uint8_t* data);
+
+	bool Checkpoint();
+
+	bool Load();
+
+	bool ClearUnit(uint32_t unit);
+
+	uint32_t MetaUnit(uint32_t index) const {
+		return units + index;
+	}
+
+	static Record MakeRecord(uint8_t type, uint16_t unit, uint32_t crc);
+
+	static bool IsValid(const Record& record);
+
+private:
+	BlockDevice& inner;
+	Geometry geometry;
+	bool requested;
+	bool enabled = false;
+	bool verify_reads;
+	uint32_t units = 0;       // Covered by the table, in front of the log
+
+	uint32_t crcs[MAX_UNITS];
+	uint8_t flags[MAX_UNITS];
+
+	uint32_t meta_index = 0;  // Which of the META_UNITS is being appended to
+	uint32_t meta_slot = 0;   // Next free record in it
+	uint32_t generation = 0;
+	uint8_t page[MAX_PROGRAM_SIZE]; // The log page meta_slot is on
+	bool page_dirty = false;
+	uint32_t written_slot = 0; // Records before it are on the medium
+
+	uint32_t scrub_next = 0;
+	uint32_t corrupt_reads = 0;
+	Stats stats;
+};
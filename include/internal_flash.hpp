@@ -0,0 +1,78 @@
+#pragma once
+#include "block_device.h"
+#include "pico_flash.hpp"
+#include <hardware/flash.h>
+
+
+/**
+ * The Pico's own QSPI flash. This program is located in the front of
+ * flash, so the volume gets the last PARTITION_SECTORS sectors.
+ *
+ * Thanks to
+ * https://www.makermatrix.com/blog/read-and-write-data-with-the-pi-pico-onboard-flash/
+ *
+ * Useful information:
+ * - Sector size is 4kb on Pico flash
+ * - Due to how Flash works, you can't change a 0 to a 1. You'd need to
+ * erase the whole sector, which sets everything to 1.
+ */
+class InternalFlash : public BlockDevice {
+public:
+	static constexpr uint32_t PARTITION_SECTORS = 200;
+	static constexpr uint32_t PARTITION_START = PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE * PARTITION_SECTORS;
+
+public:
+	InternalFlash() = default;
+
+	Geometry GetGeometry() const override {
+		return { FLASH_SECTOR_SIZE * PARTITION_SECTORS, FLASH_SECTOR_SIZE, FLASH_PAGE_SIZE, true };
+	}
+
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override {
+		PicoFlash::Read(PARTITION_START + addr, buffer, bufsize);
+		return true;
+	}
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override {
+		PicoFlash::Program(PARTITION_START + addr, buffer, bufsize);
+		return true;
+	}
+
+	bool Erase(uint32_t addr, uint32_t bytes) override {
+		PicoFlash::Erase(PARTITION_START + addr, bytes / FLASH_SECTOR_SIZE);
+		return true;
+	}
+
+	bool ReadChecked(uint32_t addr, void* buffer, uint32_t bufsize, uint32_t& crc) override {
+		crc = PicoFlash::Read(PARTITION_START + addr, buffer, bufsize);
+		return true;
+	}
+
+	bool ProgramChecked(uint32_t addr, const uint8_t* buffer, uint32_t bufsize, uint32_t& crc) override {
+		crc = PicoFlash::Program(PARTITION_START + addr, buffer, bufsize);
+		return true;
+	}
+
+	bool Checksum(uint32_t addr, uint32_t bytes, uint32_t& crc) override {
+		crc = PicoFlash::Checksum(PARTITION_START + addr, bytes);
+		return true;
+	}
+
+	const uint8_t* Map(uint32_t addr, uint32_t bytes) override {
+		(void) bytes;
+		return PicoFlash::Map(PARTITION_START + addr);
+	}
+
+	bool Flush() override {
+		PicoFlash::Finish();
+		return true;
+	}
+
+	void BeginBatch() override {
+		PicoFlash::BeginSession();
+	}
+
+	void EndBatch() override {
+		PicoFlash::EndSession();
+	}
+};
@@ -0,0 +1,150 @@
+#pragma once
+#include "stdint.h"
+#include "block_device.h"
+
+
+/**
+ * Keeps small changes to the FAT and root directory out of the erase path.
+ * The changed bytes are appended as records to a pre-erased log, laid over
+ * the base sectors on read, and folded into them by Compact() when the log
+ * fills or the drive is idle. A torn or bad record is skipped; a power
+ * loss while Compact() rewrites a unit loses what no record holds.
+ */
+class MetadataJournal {
+public:
+	enum CONFIG {
+		RECORD_SIZE = 256,  // One page on every NOR part we support
+		LOG_UNITS = 8,      // Erase units set aside for the log
+		MAX_EXTENTS = 256,  // Pending extents tracked in RAM
+		MERGE_GAP = 8       // Unchanged bytes worth rewriting to save an extent
+	};
+
+	static constexpr uint32_t RECORD_MAGIC = 0x4C444D4A; // "JMDL"
+
+	struct Header {
+		uint32_t magic;
+		uint16_t used;     // Bytes of extents after the header
+		uint16_t checksum; // Fletcher-16 of those bytes
+	};
+
+	struct Extent {
+		uint32_t addr;     // Block address on the device
+		uint16_t offset;   // Into that block
+		uint16_t length;
+	};
+
+public:
+	MetadataJournal(BlockDevice& device);
+
+	/**
+	 * Journal writes to blocks in [start, end) using the log at
+	 * [log, log + log_size), and pick up whatever an earlier run left in
+	 * the log. A log_size of 0 turns the journal off and everything goes
+	 * straight to the device.
+	 */
+	bool Attach(uint32_t start, uint32_t end, uint32_t log, uint32_t log_size);
+
+	bool IsActive() const {
+		return log_size != 0;
+	}
+
+	/**
+	 * Read from the device with any pending records applied.
+	 */
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize);
+
+	/**
+	 * Write blocks, logging the changed bytes of journaled ones and
+	 * passing the rest through to BlockDevice::Write.
+	 */
+	bool Write(uint32_t addr, const uint8_t* buffer, uint32_t bufsize);
+
+	/**
+	 * The device's BlockDevice::Map, for blocks outside the journaled
+	 * range only: what a journaled block reads as is not in one place.
+	 */
+	const uint8_t* Map(uint32_t addr, uint32_t bytes);
+
+	/**
+	 * Fold every pending record into the base sectors and erase the log.
+	 */
+	bool Compact();
+
+	/**
+	 * Attach without reading the log, and erase whatever is in it, e.g.
+	 * before formatting a volume whose log area was never one.
+	 */
+	bool Reset(uint32_t start, uint32_t end, uint32_t log, uint32_t log_size);
+
+	/**
+	 * Whether the log is full enough that an idle compaction is worth its
+	 * erases.
+	 */
+	bool WantsCompaction() const {
+		return IsActive() && (write_offset * 2 >= log_size || extent_count * 2 >= MAX_EXTENTS);
+	}
+
+	uint32_t GetUsed() const {
+		return write_offset;
+	}
+
+private:
+	struct Pending {
+		uint32_t addr;
+		uint32_t data;  // Where the extent's bytes are in the log
+		uint16_t offset;
+		uint16_t length;
+	};
+
+	bool Covers(uint32_t addr) const {
+		return IsActive() && addr >= start && addr < end;
+	}
+
+	/**
+	 * Lay pending extents for blocks in [addr, addr + bufsize) over buffer.
+	 */
+	bool Overlay(uint32_t addr, uint8_t* buffer, uint32_t bufsize);
+
+	/**
+	 * Log the bytes of `block` (one journaled block at addr) that differ
+	 * from what a read returns now. Returns false if the log or the
+	 * extent table is out of room.
+	 */
+	bool LogBlock(uint32_t addr, const uint8_t* block);
+
+	/**
+	 * Add an extent to the page being built, programming it first if the
+	 * extent will not fit.
+	 */
+	bool Append(uint32_t addr, uint16_t offset, const uint8_t* data, uint16_t length);
+
+	/**
+	 * Program the page being built. If that fails, its extents are
+	 * dropped and the log counts as full, see Scan().
+	 */
+	bool ProgramPage();
+
+	/**
+	 * Rewrite the base units that pending extents touch, leaving the log.
+	 */
+	bool Fold();
+
+	bool Scan();
+
+	static uint16_t Checksum(const uint8_t* data, uint32_t size);
+
+private:
+	BlockDevice& device;
+	uint32_t start = 0;
+	uint32_t end = 0;
+	uint32_t log = 0;
+	uint32_t log_size = 0;
+	uint32_t write_offset = 0; // Next free page, from the start of the log
+
+	uint8_t page[RECORD_SIZE];
+	uint32_t page_used = 0;    // Extent bytes in `page`, 0 if none
+	uint32_t page_first = 0;   // First entry of `extents` that lives in `page`
+
+	Pending extents[MAX_EXTENTS];
+	uint32_t extent_count = 0;
+};
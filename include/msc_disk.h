@@ -0,0 +1,116 @@
+#pragma once
+#include "stdint.h"
+
+class DirectoryIndex;
+class Fat16;
+class ReadAhead;
+class WriteQueue;
+
+/**
+ * Mount the volume and set the GPIO17 reset jumper up, at power on before
+ * tusb_init(), so the first READ CAPACITY has nothing left to wait for.
+ * Whether the jumper is on is only looked at later, by
+ * msc_disk_reset_task().
+ */
+void msc_disk_begin();
+
+/**
+ * Commit one staged WRITE10 chunk to flash, if any. Scheduled right after
+ * tud_task(). Returns true if there was work to do.
+ */
+bool msc_disk_task();
+
+/**
+ * Whether the host has left the drive alone long enough for housekeeping
+ * that erases flash: nothing staged and no READ10/WRITE10 for a while.
+ */
+bool msc_disk_is_idle();
+
+/**
+ * Background storage maintenance, e.g. compacting the metadata journal,
+ * then erasing a cluster the host freed (Fat16::PreErase). Only worth calling when msc_disk_is_idle(). Returns true if there was
+ * work to do.
+ */
+bool msc_disk_maintenance();
+
+/**
+ * Check or seal the next unit of the backend against its CRC32. Only worth
+ * calling when msc_disk_is_idle(). Returns true until a pass over the
+ * whole device is done.
+ */
+bool msc_disk_scrub();
+
+/**
+ * Carry the background volume check on for a step, see VolumeCheck. Only
+ * worth calling when msc_disk_is_idle(). Repairs are made only if the host
+ * has not written since power on or its last eject. Returns true until the
+ * pass is done.
+ */
+bool msc_disk_check();
+
+/**
+ * Call before firmware changes the volume itself. Commits whatever the host
+ * has staged, so the two writers never interleave, and returns the volume.
+ */
+Fat16* msc_disk_begin_local_write();
+
+/**
+ * Call before firmware reads `bytes` from `lba` itself. Commits whatever
+ * the host has staged for those blocks, the way READ10 does, so the read
+ * sees the host's last write. Returns the volume.
+ */
+Fat16* msc_disk_begin_local_read(uint32_t lba, uint32_t bytes);
+
+/**
+ * Call after firmware changed `bytes` from `lba` on the device without
+ * going through Fat16::WriteBlock, e.g. programming a page of the append
+ * log, so nothing cached of them is handed out.
+ */
+void msc_disk_invalidate(uint32_t lba, uint32_t bytes);
+
+/**
+ * Call after firmware changed the volume. The host is told the medium may
+ * have changed on its next command and re-reads the FAT and directories,
+ * instead of having to be unplugged.
+ */
+void msc_disk_media_changed();
+
+/**
+ * The readahead behind READ10, for its mode and hit rate.
+ */
+ReadAhead& msc_disk_read_ahead();
+
+/**
+ * Where WRITE10 data waits to be committed, e.g. to turn early
+ * acknowledgement off.
+ */
+WriteQueue& msc_disk_write_queue();
+
+/**
+ * Where the firmware looks up directory entries on the volume. Use it
+ * after msc_disk_begin_local_read() or _write(), so what the host has
+ * staged is in.
+ */
+DirectoryIndex& msc_disk_directories();
+
+/**
+ * Poll the GPIO17 reset jumper. Shorting it, or having it on at power on,
+ * formats the volume and tells the host. Returns true if it did.
+ */
+bool msc_disk_reset_task();
+
+/**
+ * Snapshot the volume as the host last wrote it, e.g. before a risky
+ * update. Replaces any snapshot already held.
+ */
+bool msc_disk_take_snapshot();
+
+/**
+ * Put the volume back the way it was at the snapshot and tell the host.
+ */
+bool msc_disk_rollback_snapshot();
+
+/**
+ * Keep the volume as it is and let the snapshot go.
+ */
+bool msc_disk_drop_snapshot();
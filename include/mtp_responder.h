@@ -0,0 +1,30 @@
+#pragma once
+#include "stdint.h"
+
+#define MTP_STORAGE_ID 0x00010001
+
+// Object formats: a file of any kind, and a folder
+#define MTP_FORMAT_UNDEFINED   0x3000
+#define MTP_FORMAT_ASSOCIATION 0x3001
+
+
+/**
+ * The volume over MTP, in place of mass storage in a USB_MTP build. The
+ * host sends and gets whole files and folders, so the firmware places them
+ * (see FileWriter) and writes the metadata itself. A handle is where the
+ * object's directory entry is. Names are 8.3 upper case; others are
+ * refused.
+ */
+
+/**
+ * Move the transaction under way along: take a command, a few sectors of
+ * an upload or a download, or send the response. Scheduled after
+ * tud_task(). Returns true if there was work to do.
+ */
+bool mtp_responder_task();
+
+/**
+ * Whether a transaction is partway through, so housekeeping that erases
+ * flash should wait.
+ */
+bool mtp_responder_is_busy();
@@ -0,0 +1,42 @@
+#pragma once
+#include "stdint.h"
+
+// Bytes the bulk OUT pipe can hold before it NAKs, and the bulk IN one
+// before mtp_usb_write() takes less than it is given
+#define MTP_USB_RX_BUFSIZE 4096
+#define MTP_USB_TX_BUFSIZE 1024
+
+/**
+ * The USB end of the MTP interface (see mtp_responder.h), as an
+ * application class driver that only moves bytes. A container the device
+ * sends is ended by mtp_usb_end_container() before the next one goes out.
+ */
+
+bool mtp_usb_mounted();
+
+/**
+ * Bytes the host has sent that were not read yet.
+ */
+uint32_t mtp_usb_available();
+
+uint32_t mtp_usb_read(void* buffer, uint32_t bufsize);
+
+/**
+ * Room to write, 0 while a container that was ended is still going out.
+ */
+uint32_t mtp_usb_write_available();
+
+uint32_t mtp_usb_write(const void* buffer, uint32_t bufsize);
+
+/**
+ * Everything written since the last call is one container: send the rest
+ * of it.
+ */
+void mtp_usb_end_container();
+
+/**
+ * Whether the host cancelled the transaction or reset the device (class
+ * requests 0x64 and 0x66) since the last call. What either pipe held is
+ * gone by then.
+ */
+bool mtp_usb_take_reset();
@@ -0,0 +1,63 @@
+#pragma once
+#include "block_device.h"
+#include "string.h"
+
+
+/**
+ * Volume kept in SRAM. Contents are lost on power off, but nothing ever
+ * has to be erased, so it is useful for scratch data and for measuring
+ * the rest of the stack without flash in the way.
+ */
+class RamDisk : public BlockDevice {
+public:
+	// Keeps FAT and root directory updates to a single block.
+	static constexpr uint32_t BLOCK_SIZE = 512;
+
+public:
+	/**
+	 * `memory` must stay valid for the lifetime of the disk and be a
+	 * multiple of BLOCK_SIZE.
+	 */
+	RamDisk(uint8_t* memory, uint32_t size) : memory(memory), size(size) {}
+
+	bool Init() override {
+		memset(memory, 0, size);
+		return true;
+	}
+
+	Geometry GetGeometry() const override {
+		return { size, BLOCK_SIZE, BLOCK_SIZE, false };
+	}
+
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override {
+		if (addr + bufsize > size)
+			return false;
+
+		memcpy(buffer, memory + addr, bufsize);
+		return true;
+	}
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override {
+		if (addr + bufsize > size)
+			return false;
+
+		memcpy(memory + addr, buffer, bufsize);
+		return true;
+	}
+
+	bool Erase(uint32_t addr, uint32_t bytes) override {
+		if (addr + bytes > size)
+			return false;
+
+		memset(memory + addr, 0xFF, bytes);
+		return true;
+	}
+
+	const uint8_t* Map(uint32_t addr, uint32_t bytes) override {
+		return addr + bytes <= size ? memory + addr : nullptr;
+	}
+
+private:
+	uint8_t* memory;
+	uint32_t size;
+};
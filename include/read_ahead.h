@@ -0,0 +1,126 @@
+#pragma once
+#include "stdint.h"
+#include "fat.h"
+
+
+/**
+ * Readahead for READ10 that follows the FAT instead of the LBA, since the
+ * next cluster of a file on a fragmented volume is often not the next one
+ * on the disk. FAT sectors passing through fill a cache of next pointers,
+ * and Step() reads the cluster the host will want next from the main loop.
+ * Writes make what is buffered stale, see Invalidate() and Clear().
+ */
+class ReadAhead {
+public:
+	enum CONFIG {
+		NEXT_ENTRIES = 512,                 // Next pointers cached, direct mapped
+		BUFFER_SIZE = Fat16::CLUSTER_BYTES
+	};
+
+	enum Mode {
+		MODE_OFF,
+		MODE_SEQUENTIAL, // The cluster after N on the volume, whatever the FAT says
+		MODE_CHAIN       // next(N) from the FAT
+	};
+
+	struct Stats {
+		uint32_t reads = 0;       // READ10 chunks of the data region
+		uint32_t hits = 0;        // Of those, served from the buffer
+		uint32_t prefetches = 0;  // Clusters read ahead
+		uint32_t wasted = 0;      // Read ahead and dropped without a hit
+		uint32_t fat_reads = 0;   // Next pointers that had to be read
+	};
+
+public:
+	/**
+	 * `buffer` holds the cluster read ahead, BUFFER_SIZE bytes.
+	 */
+	ReadAhead(uint8_t* buffer) : buffer(buffer) {
+		Clear();
+	}
+
+	/**
+	 * READ10 for LUN 0: `bufsize` bytes from `lba`, out of the buffer if
+	 * it holds all of them, else from `fs`. Returns what GetBlock does.
+	 */
+	int32_t Read(Fat16& fs, uint32_t lba, void* out, uint32_t bufsize);
+
+	/**
+	 * The host is writing `data`: drop what it replaces, and learn from
+	 * it if it is part of FAT #1.
+	 */
+	void Write(uint32_t lba, const void* data, uint32_t bufsize);
+
+	/**
+	 * Drop what is buffered of `bufsize` bytes from `lba`, which changed
+	 * without going through Write().
+	 */
+	void Invalidate(uint32_t lba, uint32_t bufsize);
+
+	/**
+	 * Read the cluster scheduled by the last Read(), if any. Only call
+	 * with nothing staged, so what is read is what the host last wrote.
+	 * Returns true if there was work to do.
+	 */
+	bool Step(Fat16& fs);
+
+	/**
+	 * Forget everything: after the firmware changed the volume itself, or
+	 * when reading ahead hit data that failed its checksum, which READ10
+	 * has to find for itself.
+	 */
+	void Clear();
+
+	void SetMode(Mode value) {
+		mode = value;
+		Clear();
+	}
+
+	Mode GetMode() const {
+		return mode;
+	}
+
+	const Stats& GetStats() const {
+		return stats;
+	}
+
+	void ResetStats() {
+		stats = Stats();
+	}
+
+private:
+	/**
+	 * Drop the cluster buffered.
+	 */
+	void Discard();
+
+	/**
+	 * Cache the next pointers in `data`, FAT #1 sectors from `sector` on.
+	 */
+	void Learn(uint32_t sector, const uint8_t* data, uint32_t bufsize);
+
+	bool Lookup(uint32_t cluster, uint16_t& next) const;
+
+	static uint32_t ClusterOf(uint32_t lba) {
+		return (lba - Fat16::INDEX_DATA_STARTS) / Fat16::DISK_CLUSTER_SIZE + Fat16::FIRST_CLUSTER;
+	}
+
+private:
+	struct Link {
+		uint16_t cluster;   // 0 when empty
+		uint16_t next;
+	};
+
+	Mode mode = MODE_CHAIN;
+	uint8_t* buffer;
+	uint32_t buffered = 0;  // Cluster in the buffer, 0 for none
+	bool used = false;      // Whether a read was served from it yet
+
+	// What Step() reads next: cluster `after`'s successor, or `after`
+	// itself when `rest` is set
+	uint32_t after = 0;
+	bool rest = false;
+
+	Link links[NEXT_ENTRIES];
+	Stats stats;
+};
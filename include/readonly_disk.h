@@ -0,0 +1,38 @@
+#pragma once
+#include "stdint.h"
+
+// Set by CMake when the READONLY_LUN option is on
+#ifndef READONLY_LUN
+#define READONLY_LUN 0
+#endif
+
+
+/**
+ * The second LUN: a FAT16 image built from assets/ by tools/mkimage.py
+ * and linked into the firmware's .rodata. Reads are plain copies out of
+ * XIP, so they never wait behind staged writes or journal work on the
+ * writable volume, and the bulky read-mostly files stay out of its
+ * partition.
+ *
+ * The image stops after its last used sector; everything past that up to
+ * the size in its boot sector reads as zeros.
+ */
+class ReadOnlyDisk {
+public:
+	static constexpr uint32_t BLOCK_SIZE = 512;
+
+public:
+	/**
+	 * Whether an image was built in and looks like a FAT volume.
+	 */
+	static bool IsPresent();
+
+	static uint32_t GetBlockCount();
+
+	/**
+	 * Copy the blocks starting at `lba` into `buffer`.
+	 *
+	 * @return Size of bytes read. -1 is returned on error.
+	 */
+	static int32_t GetBlock(uint32_t lba, void* buffer, uint32_t bufsize);
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include "stdint.h"
+
+
+/**
+ * Run-to-completion scheduler for the main loop. Each pass runs every task
+ * that is due, highest priority first, and the core sleeps in WFE when a
+ * pass finds nothing to do. Idle hooks, for long flash work, only run on a
+ * pass where no task did anything and the idle gate is open.
+ */
+class Scheduler {
+public:
+	enum CONFIG {
+		MAX_TASKS = 12,
+		MAX_SLEEP_US = 100 * 1000 // Upper bound on a WFE, in case an event is missed
+	};
+
+	enum Priority {
+		PRIORITY_USB,        // TinyUSB device task
+		PRIORITY_STORAGE,    // Committing what the host wrote
+		PRIORITY_BACKGROUND, // LED, stats
+		PRIORITY_IDLE        // Idle hooks
+	};
+
+	/**
+	 * Returns true if it did work and wants to run again right away.
+	 */
+	typedef bool (*TaskFunction)();
+
+public:
+	Scheduler() = default;
+
+	/**
+	 * Returns false if there is no room for another task.
+	 */
+	bool AddTask(const char* name, TaskFunction run, Priority priority, uint32_t period_us = 0);
+
+	/**
+	 * Maintenance that only runs while the idle gate is open, checked
+	 * every `period_us`.
+	 */
+	bool AddIdleHook(const char* name, TaskFunction run, uint32_t period_us);
+
+	/**
+	 * Idle hooks wait for this to return true. No gate means always open.
+	 */
+	void SetIdleGate(TaskFunction gate) {
+		idle_gate = gate;
+	}
+
+	/**
+	 * One pass over the tasks. Returns true if any of them did work.
+	 */
+	bool RunOnce();
+
+	/**
+	 * Run passes forever, sleeping whenever one comes up empty.
+	 */
+	void Run();
+
+	/**
+	 * Earliest time a periodic task is due, capped to MAX_SLEEP_US from now.
+	 */
+	uint64_t NextDeadline() const;
+
+private:
+	struct Task {
+		const char* name;
+		TaskFunction run;
+		Priority priority;
+		uint32_t period_us;
+		uint64_t next_us; // Due at or after this time
+	};
+
+	Task tasks[MAX_TASKS];
+	uint32_t task_count = 0;
+	TaskFunction idle_gate = nullptr;
+};
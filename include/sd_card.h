@@ -0,0 +1,70 @@
+#pragma once
+#include "block_device.h"
+#include "hardware/spi.h"
+
+
+/**
+ * SD or SDHC card in SPI mode. Cards manage their own erase blocks, so
+ * this is block storage: 512 byte sectors that are simply overwritten.
+ *
+ * A write returns as soon as the card has accepted the data. The card
+ * then programs it on its own while the core goes back to USB; the next
+ * command (or Flush) waits for it to finish.
+ */
+class SdCard : public BlockDevice {
+public:
+	struct Pins {
+		uint sck;
+		uint mosi;
+		uint miso;
+		uint cs;
+	};
+
+	enum CONFIG {
+		SECTOR_SIZE = 512,
+		INIT_BAUDRATE = 400 * 1000
+	};
+
+public:
+	SdCard(spi_inst_t* spi, Pins pins, uint baudrate);
+
+	bool Init() override;
+
+	Geometry GetGeometry() const override {
+		return { size, SECTOR_SIZE, SECTOR_SIZE, false };
+	}
+
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override;
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override;
+
+	bool Erase(uint32_t addr, uint32_t bytes) override {
+		(void) addr;
+		(void) bytes;
+		return true;
+	}
+
+	bool Flush() override;
+
+private:
+	uint8_t Command(uint8_t cmd, uint32_t arg);
+
+	uint8_t AppCommand(uint8_t cmd, uint32_t arg);
+
+	bool ReadData(uint8_t* buffer, uint32_t bufsize);
+
+	bool WaitReady(uint32_t timeout_ms);
+
+	void Select();
+
+	void Deselect();
+
+	uint8_t Transfer(uint8_t byte);
+
+private:
+	spi_inst_t* spi;
+	Pins pins;
+	uint baudrate;
+	uint32_t size = 0;
+	bool block_addressing = false; // SDHC takes sector numbers, SDSC bytes
+};
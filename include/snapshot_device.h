@@ -0,0 +1,189 @@
+#pragma once
+#include "stdint.h"
+#include "block_device.h"
+
+
+/**
+ * Copy-on-write snapshots of a whole BlockDevice, in UNIT_SIZE units. A
+ * remap table says which logical units do not live at their own physical
+ * unit. While a snapshot is held, the first write to a shared unit goes to
+ * one of `spare_units` spare units, and Rollback() and Drop() just swap
+ * tables. A snapshot that runs out of room is dropped and WasLost() says
+ * so. The tables are kept in a record log in the last META_UNITS units.
+ */
+class SnapshotDevice : public BlockDevice {
+public:
+	enum CONFIG {
+		UNIT_SIZE = 4096,
+		RECORDS_PER_UNIT = UNIT_SIZE / 8,
+		META_UNITS = 2,
+		MAX_REMAPS = 240,       // Both tables and a header fit in one log unit
+		MAX_PROGRAM_SIZE = 512
+	};
+
+	static constexpr uint16_t RECORD_MAGIC = 0x5350; // "SP"
+
+	struct Record {
+		uint16_t magic;
+		uint8_t type;
+		uint8_t check;   // Makes the bytes of the record sum to 0xFF
+		uint16_t logical;
+		uint16_t physical;
+	};
+
+public:
+	/**
+	 * `spare_units` of 0 turns snapshots off and passes everything
+	 * straight through.
+	 */
+	SnapshotDevice(BlockDevice& inner, uint32_t spare_units);
+
+	bool Init() override;
+
+	Geometry GetGeometry() const override;
+
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override;
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override;
+
+	bool Erase(uint32_t addr, uint32_t bytes) override;
+
+	/**
+	 * Only where the live table has the units behind the range next to
+	 * each other.
+	 */
+	const uint8_t* Map(uint32_t addr, uint32_t bytes) override;
+
+	bool Flush() override {
+		return inner.Flush();
+	}
+
+	void BeginBatch() override {
+		inner.BeginBatch();
+	}
+
+	void EndBatch() override {
+		inner.EndBatch();
+	}
+
+	/**
+	 * Freeze the volume as it is now. Replaces a snapshot already held.
+	 */
+	bool Take();
+
+	/**
+	 * Go back to the frozen volume. The snapshot is kept, so this can be
+	 * done again later.
+	 */
+	bool Rollback();
+
+	/**
+	 * Keep the volume as it is and free what only the snapshot used.
+	 */
+	bool Drop();
+
+	bool IsEnabled() const {
+		return enabled;
+	}
+
+	bool HasSnapshot() const {
+		return has_snapshot;
+	}
+
+	/**
+	 * Whether the last snapshot taken was dropped because it ran out of
+	 * room rather than on request.
+	 */
+	bool WasLost() const {
+		return lost;
+	}
+
+	/**
+	 * Units written since the snapshot was taken.
+	 */
+	uint32_t GetDivergedUnits() const;
+
+	/**
+	 * Units a snapshot can still diverge by.
+	 */
+	uint32_t GetFreeUnits() const;
+
+private:
+	enum RecordType {
+		RECORD_HEADER = 1,   // First in a log unit: logical/physical hold the generation
+		RECORD_LIVE = 2,     // live[logical] = physical
+		RECORD_FROZEN = 3,   // frozen[logical] = physical, for checkpoints
+		RECORD_SNAPSHOT = 4, // frozen = live
+		RECORD_ROLLBACK = 5, // live = frozen
+		RECORD_DROP = 6      // no snapshot; logical is DROP_LOST if it ran out of room
+	};
+
+	static constexpr uint16_t DROP_LOST = 1;
+
+	struct Remap {
+		uint16_t logical;
+		uint16_t physical;
+	};
+
+	/**
+	 * Logical units that do not live at their own physical unit.
+	 */
+	struct Table {
+		Remap entries[MAX_REMAPS];
+		uint32_t count = 0;
+
+		uint16_t Lookup(uint16_t logical) const;
+
+		/**
+		 * Returns false if the table is full.
+		 */
+		bool Set(uint16_t logical, uint16_t physical);
+
+		bool Uses(uint16_t physical, uint32_t logical_units) const;
+	};
+
+	/**
+	 * Physical unit that `logical` can be written at, copying it away from
+	 * the snapshot first if they still share it. `copy` is false when the
+	 * whole unit is about to be erased anyway.
+	 */
+	bool Writable(uint16_t logical, bool copy, uint16_t& physical);
+
+	bool Allocate(uint16_t& physical) const;
+
+	void Apply(const Record& record);
+
+	bool Append(uint8_t type, uint16_t logical, uint16_t physical);
+
+	bool WriteRecord(uint32_t unit, uint32_t slot, const Record& record);
+
+	bool Checkpoint();
+
+	bool Load();
+
+	bool ClearUnit(uint32_t unit);
+
+	uint32_t MetaUnit(uint32_t index) const {
+		return logical_units + spare_units + index;
+	}
+
+	static Record MakeRecord(uint8_t type, uint16_t logical, uint16_t physical);
+
+	static bool IsValid(const Record& record);
+
+private:
+	BlockDevice& inner;
+	Geometry geometry;
+	uint32_t spare_units;
+	uint32_t logical_units = 0;
+	bool enabled = false;
+
+	Table live;
+	Table frozen;
+	bool has_snapshot = false;
+	bool lost = false;
+
+	uint32_t meta_index = 0; // Which of the META_UNITS is being appended to
+	uint32_t meta_slot = 0;  // Next free record in it
+	uint32_t generation = 0;
+};
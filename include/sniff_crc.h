@@ -0,0 +1,35 @@
+#pragma once
+#include "stdint.h"
+
+// Starting value for a new checksum
+#define SNIFF_CRC_SEED 0xFFFFFFFFu
+
+/**
+ * Copy `bytes` from `src` to `dst` with a DMA channel, and have the DMA
+ * sniffer work out the CRC32 of the data on the way through. Pass the
+ * result back in as `crc` to carry on over the next piece.
+ *
+ * The value is the sniffer's raw accumulator (bit reversed CRC-32, no
+ * final inversion). It is only ever compared with other values from these
+ * two functions.
+ */
+uint32_t sniff_copy(void* dst, const void* src, uint32_t bytes, uint32_t crc = SNIFF_CRC_SEED);
+
+/**
+ * Same as sniff_copy, without keeping the data.
+ */
+uint32_t sniff_crc(const void* src, uint32_t bytes, uint32_t crc = SNIFF_CRC_SEED);
+
+/**
+ * What sniff_crc would give for `bytes` bytes of `value`, worked out by
+ * the compiler, e.g. for an erased unit without reading one at power on.
+ */
+constexpr uint32_t sniff_crc_fill(uint8_t value, uint32_t bytes, uint32_t crc = SNIFF_CRC_SEED) {
+	for (uint32_t i = 0; i < bytes; i++) {
+		crc ^= value;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+	}
+
+	return crc;
+}
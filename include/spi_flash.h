@@ -0,0 +1,59 @@
+#pragma once
+#include "block_device.h"
+#include "hardware/spi.h"
+
+
+/**
+ * External SPI NOR flash (Winbond W25Q family and compatibles) on one of
+ * the RP2040's SPI blocks. Capacity comes from the JEDEC ID, so anything
+ * from a 2mb W25Q16 to a 128mb W25Q01 works; parts above 16mb are
+ * switched to 4-byte addressing.
+ */
+class SpiFlash : public BlockDevice {
+public:
+	struct Pins {
+		uint sck;
+		uint mosi;
+		uint miso;
+		uint cs;
+	};
+
+	enum CONFIG {
+		SECTOR_SIZE = 4096,
+		BLOCK_SIZE = 65536,
+		PAGE_SIZE = 256
+	};
+
+public:
+	SpiFlash(spi_inst_t* spi, Pins pins, uint baudrate);
+
+	bool Init() override;
+
+	Geometry GetGeometry() const override {
+		return { size, SECTOR_SIZE, PAGE_SIZE, true };
+	}
+
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override;
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override;
+
+	bool Erase(uint32_t addr, uint32_t bytes) override;
+
+private:
+	void Select();
+
+	void Deselect();
+
+	void SendCommand(uint8_t cmd, uint32_t addr);
+
+	void WriteEnable();
+
+	bool WaitReady(uint32_t timeout_ms);
+
+private:
+	spi_inst_t* spi;
+	Pins pins;
+	uint baudrate;
+	uint32_t size = 0;
+	bool four_byte = false;
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include "stdint.h"
+
+/**
+ * Milestones on the way from power on to a mounted drive. A host that
+ * sends READ CAPACITY and gets no answer for long enough resets the port,
+ * so main() brings up only what answering it needs before tusb_init(): the
+ * UART and the volume. Checking the reset jumper and the cyw43 come later,
+ * from the main loop.
+ */
+enum StartupPhase {
+	STARTUP_STORAGE,    // Volume mounted
+	STARTUP_USB,        // tusb_init() done, the host can enumerate
+	STARTUP_CAPACITY,   // First READ CAPACITY of the volume answered
+	STARTUP_MOUNTED,    // Host picked a configuration
+	STARTUP_JUMPER,     // GPIO17 settled, and the volume formatted if it was held low
+	STARTUP_RADIO,      // cyw43_arch_init() done, or failed
+	STARTUP_PHASES
+};
+
+/**
+ * Start counting, at the top of main(). Forgets any earlier marks.
+ */
+void startup_begin();
+
+/**
+ * `phase` was reached. Only the first time counts.
+ */
+void startup_mark(StartupPhase phase);
+
+/**
+ * When `phase` was reached, as time_us_64(). 0 if it has not been yet.
+ */
+uint64_t startup_time(StartupPhase phase);
+
+/**
+ * Microseconds from startup_begin() to `phase`, or -1 if not reached.
+ */
+int64_t startup_elapsed_us(StartupPhase phase);
+
+/**
+ * Print how long each phase took from startup_begin(), -1 for any not
+ * reached yet.
+ */
+void startup_report();
@@ -0,0 +1,48 @@
+#pragma once
+#include "block_device.h"
+#include "integrity_device.h"
+#include "snapshot_device.h"
+
+// Units (4kb) set aside so a snapshot can diverge by that much. 0 turns
+// snapshots off and gives the space to the volume. Two more units hold the
+// map log, so on the internal flash's 200 sectors the default 8 cost the
+// volume 5%, and 32 would cost 17%.
+#ifndef SNAPSHOT_SPARE_UNITS
+#define SNAPSHOT_SPARE_UNITS 8
+#endif
+
+// Per unit CRC32 of the backend, kept in a log at its end. 0 turns it off.
+#ifndef INTEGRITY_CHECKS
+#define INTEGRITY_CHECKS 1
+#endif
+
+// Check whole unit reads against their CRC as well as in the background
+// scrub. Free on the internal flash, a software CRC elsewhere.
+#ifndef INTEGRITY_VERIFY_READS
+#define INTEGRITY_VERIFY_READS 1
+#endif
+
+/**
+ * The device the volume lives on, picked at build time with the
+ * STORAGE_BACKEND CMake option:
+ *
+ * INTERNAL_FLASH - Last 200 sectors of the Pico's own flash (default)
+ * RAM            - RAM_DISK_SIZE bytes of SRAM, lost on power off
+ * SPI_FLASH      - SPI NOR chip on STORAGE_SPI_* pins
+ * SD_CARD        - SD card in SPI mode on STORAGE_SPI_* pins
+ *
+ * It is wrapped in storage_integrity() and that in storage_snapshots(), so
+ * this is the outermost device.
+ */
+BlockDevice& storage_backend();
+
+/**
+ * Copy-on-write snapshots of the backend.
+ */
+SnapshotDevice& storage_snapshots();
+
+/**
+ * Checksums of the backend, below the snapshots so they follow the
+ * physical units.
+ */
+IntegrityDevice& storage_integrity();
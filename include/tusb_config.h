@@ -99,7 +99,11 @@
 #define CFG_TUD_CDC               0
 #define CFG_TUD_MSC               1
 #define CFG_TUD_MIDI              0
-#define CFG_TUD_VENDOR            0
+#ifndef USB_BULK_INGEST
+#define USB_BULK_INGEST 0
+#endif
+
+#define CFG_TUD_VENDOR            USB_BULK_INGEST
 
 // HID buffer size Should be sufficient to hold ID (if any) + Data
 #define CFG_TUD_HID_EP_BUFSIZE    16
@@ -108,6 +112,13 @@
 // doesn't work when reading the data clusters.
 #define CFG_TUD_MSC_EP_BUFSIZE 4096
 
+// FIFOs of the bulk ingest interface (see bulk_ingest.h). The receive side
+// holds a whole cluster, so the next one can arrive while the last is
+// written to a backend that leaves interrupts on; once it is full the
+// endpoint NAKs until there is room.
+#define CFG_TUD_VENDOR_RX_BUFSIZE 4096
+#define CFG_TUD_VENDOR_TX_BUFSIZE 64
+
 #ifdef __cplusplus
  }
 #endif
@@ -14,6 +14,15 @@
 	   (((val) <<  8) & 0x00FF0000) | (((val) << 24) & 0xFF000000) )
 
 
+/**
+ * For the storage path's static buffers. They go in RAM the linker reserves
+ * but boot does not clear, grouped so tools/memory_report.py can total
+ * them. Only for buffers that are always written before they are read.
+ */
+#define STORAGE_ARENA __attribute__((section(".uninitialized_data.storage")))
+
+// Longest safe_print message, the rest is cut off
+#define SAFE_PRINT_MAX 128
 
 void safe_print(const char* format, ...);
 
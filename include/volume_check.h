@@ -0,0 +1,147 @@
+#pragma once
+#include "stdint.h"
+#include "fat.h"
+#include "fat_cursor.hpp"
+
+// Whether VolumeCheck may fix what it finds, see msc_disk_check()
+#ifndef VOLUME_CHECK_REPAIR
+#define VOLUME_CHECK_REPAIR 1
+#endif
+
+
+/**
+ * fsck for the volume, a step at a time from the idle loop. A pass walks
+ * every chain and then the FAT, to find cross-links, broken chains, size
+ * mismatches and lost clusters, and with repair on cuts and frees what is
+ * wrong. It also counts the free clusters for Fat16. A write to the volume
+ * starts the pass over.
+ */
+class VolumeCheck {
+public:
+	enum CONFIG {
+		MAX_CLUSTERS = (Fat16::DISK_BLOCK_NUM - Fat16::INDEX_DATA_STARTS) / Fat16::DISK_CLUSTER_SIZE + Fat16::FIRST_CLUSTER,
+		MAX_DEPTH = 8,   // Directories nested deeper are not walked
+		STEP_US = 2000
+	};
+
+	struct Stats {
+		uint32_t passes = 0;          // Complete passes
+		uint32_t restarts = 0;        // Passes started over because the volume changed
+		uint32_t lost_clusters = 0;   // Found by the last complete pass
+		uint32_t cross_links = 0;
+		uint32_t broken_chains = 0;
+		uint32_t size_mismatches = 0;
+		uint32_t repaired = 0;        // Fixes written, over all passes
+	};
+
+public:
+	VolumeCheck() = default;
+
+	/**
+	 * Carry the pass on for about `budget_us`, starting one if the volume
+	 * changed since the last. `repair` false only reports. Returns false
+	 * when there was nothing to do.
+	 */
+	bool Step(Fat16& fs, bool repair, uint32_t budget_us = STEP_US);
+
+	/**
+	 * Whether a pass is partway.
+	 */
+	bool IsRunning() const {
+		return phase != PHASE_IDLE;
+	}
+
+	const Stats& GetStats() const {
+		return stats;
+	}
+
+private:
+	enum Phase {
+		PHASE_IDLE,
+		PHASE_DIRECTORIES, // Next entry of the directory on top of the stack
+		PHASE_CHAIN,       // Next cluster of the entry's chain
+		PHASE_FAT          // Next FAT sector, for lost and free clusters
+	};
+
+	// Where the walk is in a directory. Cluster 0 is the root directory.
+	struct Position {
+		uint16_t cluster;
+		uint16_t entry;     // Within the root, or within `cluster`
+		uint32_t remaining; // Clusters of the chain left, so a loop ends
+	};
+
+	// The chain being claimed, and the entry it belongs to
+	struct Chain {
+		uint32_t entry_lba;
+		uint32_t entry_index;
+		bool directory;
+		uint32_t size;
+		uint16_t first;
+		uint16_t previous;  // 0 while on the first cluster
+		uint16_t current;
+		uint32_t length;
+	};
+
+	void Begin(Fat16& fs);
+
+	bool NextEntry(Fat16& fs);
+
+	bool NextLink(Fat16& fs);
+
+	bool NextFatSector(Fat16& fs);
+
+	/**
+	 * Check the chain just claimed against its entry, and go into it if
+	 * it is a directory.
+	 */
+	bool EndChain(Fat16& fs);
+
+	/**
+	 * End the chain before the cluster it is on.
+	 */
+	bool Cut(Fat16& fs);
+
+	bool LoadDirSector(Fat16& fs, uint32_t lba);
+
+	/**
+	 * Change the entry of the chain being claimed.
+	 */
+	bool WriteEntry(Fat16& fs, uint16_t start_cluster, uint32_t size);
+
+	bool IsOwned(uint32_t cluster) const {
+		return owned[cluster / 32] & (1u << (cluster % 32));
+	}
+
+	void Claim(uint32_t cluster) {
+		owned[cluster / 32] |= 1u << (cluster % 32);
+	}
+
+	static uint32_t ClustersFor(uint32_t size) {
+		return (size + Fat16::CLUSTER_BYTES - 1) / Fat16::CLUSTER_BYTES;
+	}
+
+private:
+	Phase phase = PHASE_IDLE;
+	bool repair = false;
+	bool checked = false;           // A pass has completed on checked_generation
+	uint32_t checked_generation = 0;
+	uint32_t generation = 0;        // What the pass in progress has seen
+	uint32_t last = 0;              // Fat16::GetLastCluster()
+
+	uint32_t owned[(MAX_CLUSTERS + 31) / 32];
+	bool complete = true;           // Every directory could be walked
+
+	Position stack[MAX_DEPTH];
+	uint32_t depth = 0;
+	uint8_t dir_sector[Fat16::DISK_BLOCK_SIZE];
+	uint32_t dir_sector_lba = UINT32_MAX;
+
+	Chain chain;
+
+	FatCursor fat;
+	uint32_t fat_next = 0;
+	uint32_t free_count = 0;
+
+	Stats found;                    // The pass in progress
+	Stats stats;
+};
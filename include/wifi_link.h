@@ -0,0 +1,27 @@
+#pragma once
+#include "stdint.h"
+
+// How often the link is checked, and how long a join may take before it
+// is started over
+#define WIFI_CHECK_US (1000 * 1000)
+#define WIFI_JOIN_TIMEOUT_US (30 * 1000 * 1000)
+
+
+/**
+ * Station mode on the network the firmware was built for (WIFI_SSID and
+ * WIFI_PASSWORD in CMake), joined in the background so USB comes up
+ * without waiting on it. Needs cyw43_arch_init() first.
+ */
+bool wifi_link_begin();
+
+/**
+ * Service the cyw43 and lwIP (poll mode, nothing runs from interrupts),
+ * log the link coming up and going down, and join again when it drops.
+ * Scheduled on every pass; the chip's interrupt wakes the core.
+ */
+bool wifi_link_task();
+
+/**
+ * Whether the link is up with an address.
+ */
+bool wifi_link_is_up();
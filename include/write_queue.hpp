@@ -0,0 +1,136 @@
+#pragma once
+#include "stdint.h"
+#include "string.h"
+#include "fat.h"
+#include "tusb.h"
+
+// Whether WRITE10 is acknowledged as soon as its data is staged (1), or
+// only once it is on the device (0). See WriteQueue.
+#ifndef MSC_EARLY_ACK
+#define MSC_EARLY_ACK 1
+#endif
+
+/**
+ * Staging area between TinyUSB and the flash. `tud_msc_write10_cb` copies
+ * each chunk in here and returns, and the main loop commits it through
+ * `Fat16::WriteBlock`, so USB and flash overlap. GOOD then only means the
+ * chunk was received, like a drive with its write cache on; SYNCHRONIZE
+ * CACHE and eject wait for the flash, and a later commit failure is
+ * reported on the next command (TakeFailure). SetEarlyAck(false) commits
+ * each chunk before the callback returns.
+ */
+class WriteQueue {
+public:
+	enum CONFIG {
+		STAGING_BUFFERS = 2,
+		STAGING_BUFFER_SIZE = CFG_TUD_MSC_EP_BUFSIZE
+	};
+
+public:
+	WriteQueue() = default;
+
+	/**
+	 * Copy a chunk into a free slot, committing the oldest one to `fs`
+	 * first if every slot is still waiting. Returns false if the chunk is
+	 * larger than a slot.
+	 */
+	bool Push(Fat16& fs, uint32_t lba, const uint8_t* buffer, uint32_t bufsize) {
+		if (bufsize > STAGING_BUFFER_SIZE)
+			return false;
+
+		if (count == STAGING_BUFFERS)
+			CommitOne(fs);
+
+		Slot& slot = slots[(head + count) % STAGING_BUFFERS];
+		slot.lba = lba;
+		slot.size = bufsize;
+		memcpy(slot.data, buffer, bufsize);
+		count++;
+		return true;
+	}
+
+	/**
+	 * Write the oldest staged chunk to `fs`. Returns false if there was
+	 * nothing to do.
+	 */
+	bool CommitOne(Fat16& fs) {
+		if (count == 0)
+			return false;
+
+		Slot& slot = slots[head];
+		if (fs.WriteBlock(slot.lba, slot.data, slot.size) < 0)
+			failed = true;
+		head = (head + 1) % STAGING_BUFFERS;
+		count--;
+		return true;
+	}
+
+	/**
+	 * Commit everything, e.g. before the host is told its data is durable.
+	 */
+	void Drain(Fat16& fs) {
+		while (CommitOne(fs));
+	}
+
+	/**
+	 * Whether any staged chunk touches bytes [lba * 512, lba * 512 + bufsize).
+	 * Such a chunk has to be committed before the read, or the read would
+	 * see data older than what the host already wrote.
+	 */
+	bool Overlaps(uint32_t lba, uint32_t bufsize) const {
+		uint32_t blocks = (bufsize + Fat16::DISK_BLOCK_SIZE - 1) / Fat16::DISK_BLOCK_SIZE;
+
+		for (size_t i = 0; i < count; i++) {
+			const Slot& slot = slots[(head + i) % STAGING_BUFFERS];
+			uint32_t slot_blocks = slot.size / Fat16::DISK_BLOCK_SIZE;
+			if (lba < slot.lba + slot_blocks && slot.lba < lba + blocks)
+				return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * Commit, oldest first, every staged chunk a read of `bufsize` bytes
+	 * from `lba` would otherwise see past.
+	 */
+	void CommitOverlapping(Fat16& fs, uint32_t lba, uint32_t bufsize) {
+		while (Overlaps(lba, bufsize))
+			CommitOne(fs);
+	}
+
+	bool Empty() const {
+		return count == 0;
+	}
+
+	/**
+	 * Whether a commit failed since the last call. The chunk it was for
+	 * is gone.
+	 */
+	bool TakeFailure() {
+		bool was = failed;
+		failed = false;
+		return was;
+	}
+
+	bool IsEarlyAck() const {
+		return early_ack;
+	}
+
+	void SetEarlyAck(bool enabled) {
+		early_ack = enabled;
+	}
+
+private:
+	struct Slot {
+		uint32_t lba;
+		uint32_t size;
+		uint8_t data[STAGING_BUFFER_SIZE];
+	};
+
+	Slot slots[STAGING_BUFFERS];
+	size_t head = 0;
+	size_t count = 0;
+	bool failed = false;
+	bool early_ack = MSC_EARLY_ACK;
+};
@@ -0,0 +1,125 @@
+#include "access_times.h"
+#include "string.h"
+#include <algorithm>
+
+bool AccessTimes::Absorb(uint32_t sector, const uint8_t* stored, const uint8_t* data)
+{
+	if (policy == ACCESS_TIMES_WRITE) {
+		Forget(sector);
+		return false;
+	}
+
+	const fat::DirectoryEntry* before = (const fat::DirectoryEntry*) stored;
+	const fat::DirectoryEntry* after = (const fat::DirectoryEntry*) data;
+
+	uint32_t needed = 0;
+	for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++) {
+		if (!OnlyTimes(before[i], after[i])) {
+			Forget(sector);
+			return false;
+		}
+
+		uint16_t entry = sector * ENTRIES_PER_SECTOR + i;
+		bool same = memcmp(&before[i], &after[i], sizeof(fat::DirectoryEntry)) == 0;
+		needed += !same && Find(entry) == nullptr;
+	}
+
+	if (count + needed > MAX_ENTRIES) {
+		if (policy == ACCESS_TIMES_LAZY) {
+			stats.persisted++;
+			Forget(sector);
+			return false;
+		}
+
+		// Nobody was going to see these on flash anyway
+		stats.dropped++;
+		stats.absorbed++;
+		return true;
+	}
+
+	for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++) {
+		uint16_t entry = sector * ENTRIES_PER_SECTOR + i;
+		Kept* slot = Find(entry);
+
+		// Back to what is stored, nothing to keep
+		if (memcmp(&before[i], &after[i], sizeof(fat::DirectoryEntry)) == 0) {
+			if (slot != nullptr)
+				*slot = kept[--count];
+			continue;
+		}
+
+		if (slot == nullptr) {
+			slot = &kept[count++];
+			slot->entry = entry;
+		}
+		memcpy(slot->fields, (const uint8_t*) &after[i] + FIRST_FIELD, FIELD_BYTES);
+	}
+
+	stats.absorbed++;
+	return true;
+}
+
+void AccessTimes::Apply(uint32_t sector, uint8_t* data, uint32_t length) const
+{
+	for (uint32_t i = 0; i < count; i++) {
+		if (kept[i].entry / ENTRIES_PER_SECTOR != sector)
+			continue;
+
+		uint32_t offset = kept[i].entry % ENTRIES_PER_SECTOR * sizeof(fat::DirectoryEntry) + FIRST_FIELD;
+		if (offset + FIELD_BYTES <= length)
+			memcpy(data + offset, kept[i].fields, FIELD_BYTES);
+	}
+}
+
+bool AccessTimes::FirstHeld(uint32_t& sector) const
+{
+	if (count == 0)
+		return false;
+
+	sector = kept[0].entry / ENTRIES_PER_SECTOR;
+	for (uint32_t i = 1; i < count; i++)
+		sector = std::min<uint32_t>(sector, kept[i].entry / ENTRIES_PER_SECTOR);
+
+	return true;
+}
+
+void AccessTimes::Forget(uint32_t sector)
+{
+	for (uint32_t i = 0; i < count;) {
+		if (kept[i].entry / ENTRIES_PER_SECTOR == sector)
+			kept[i] = kept[--count];
+		else
+			i++;
+	}
+}
+
+/**
+ * Only for entries in use with a short name: in a free one, a long name
+ * piece or the volume label those bytes are something else.
+ */
+bool AccessTimes::OnlyTimes(const fat::DirectoryEntry& stored, const fat::DirectoryEntry& data)
+{
+	const uint8_t* before = (const uint8_t*) &stored;
+	const uint8_t* after = (const uint8_t*) &data;
+
+	if (memcmp(before, after, FIRST_FIELD) != 0 ||
+			memcmp(before + FIRST_FIELD + FIELD_BYTES, after + FIRST_FIELD + FIELD_BYTES,
+				sizeof(fat::DirectoryEntry) - FIRST_FIELD - FIELD_BYTES) != 0)
+		return false;
+
+	if (memcmp(before + FIRST_FIELD, after + FIRST_FIELD, FIELD_BYTES) == 0)
+		return true;
+
+	return stored.name[0] != 0 && (uint8_t) stored.name[0] != 0xE5 &&
+		!(stored.attributes & fat::DirectoryEntryBuilder::VOLUME_LABEL);
+}
+
+AccessTimes::Kept* AccessTimes::Find(uint16_t entry)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		if (kept[i].entry == entry)
+			return &kept[i];
+	}
+
+	return nullptr;
+}
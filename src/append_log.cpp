@@ -0,0 +1,439 @@
+#include "append_log.h"
+#include "directory_index.h"
+#include "fat.h"
+#include "fat_standard.hpp"
+#include "fat_cursor.hpp"
+#include "msc_disk.h"
+#include "util.h"
+#include <string.h>
+#include <algorithm>
+
+#define CLUSTER_BYTES Fat16::CLUSTER_BYTES
+
+// Largest program granularity of any device, see BlockDevice::Geometry
+#define MAX_PAGE_SIZE 512
+
+#define TALLY_MAGIC 0x4C415750 // "PWAL"
+
+/**
+ * First page of the tally cluster. The bits of the pages after it are
+ * cleared one per page of the log written, lowest bit first, the first
+ * `page_bits` of each.
+ */
+struct TallyHeader {
+	uint32_t magic;
+	uint16_t clusters;  // Of the whole run, the tally included
+	uint16_t page_size;
+	uint16_t page_bits;
+	uint16_t reserved;
+};
+
+static bool is_open = false;
+static char log_name[11];
+static uint16_t first_cluster = 0;
+static uint32_t clusters = 0;
+static uint32_t entry_lba = 0;
+static uint32_t entry_index = 0;
+
+static uint32_t page_size = 0;
+static uint32_t page_bits = 0;
+static uint32_t pages_written = 0;
+static uint32_t data_pages = 0;
+
+// Checked against when the volume may have changed under the log
+static uint32_t checked_generation = 0;
+
+// The page being gathered
+static uint8_t page[MAX_PAGE_SIZE] STORAGE_ARENA;
+static uint32_t page_fill = 0;
+
+static uint8_t sector[Fat16::DISK_BLOCK_SIZE] STORAGE_ARENA;
+
+static FatCursor fat_cursor;
+
+/**
+ * Stop appending, without writing what is buffered.
+ */
+static void drop()
+{
+	is_open = false;
+	page_fill = 0;
+}
+
+static uint32_t tally_lba()
+{
+	return Fat16::ClusterToLBA(first_cluster + clusters - 1);
+}
+
+/**
+ * Device address of byte `offset` into the run of blocks from `lba`, which
+ * Fat16 stores in one piece.
+ */
+static bool address_of(Fat16& fs, uint32_t lba, uint32_t offset, uint32_t& addr)
+{
+	if (!fs.LBAToAddress(lba + offset / Fat16::DISK_BLOCK_SIZE, addr))
+		return false;
+
+	addr += offset % Fat16::DISK_BLOCK_SIZE;
+	return true;
+}
+
+/**
+ * Whether `entry` is still the log's, as it was opened.
+ */
+static bool is_log_entry(const fat::DirectoryEntry& entry)
+{
+	return memcmp(entry.name, log_name, 11) == 0 && entry.start_cluster == first_cluster;
+}
+
+/**
+ * Leading cleared bits of the tally, which is the number of pages written.
+ */
+static bool count_tally(Fat16& fs, uint32_t& count)
+{
+	count = 0;
+	for (uint32_t b = 0; b < Fat16::DISK_CLUSTER_SIZE; b++) {
+		if (fs.GetBlock(tally_lba() + b, sector, sizeof(sector)) < 0)
+			return false;
+
+		for (uint32_t offset = b == 0 ? page_size : 0; offset < sizeof(sector); offset += page_size) {
+			for (uint32_t bit = 0; bit < page_bits; bit++) {
+				if (sector[offset + bit / 8] & (1u << (bit % 8)))
+					return true;
+				count++;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Pick up the log `entry` in `slot` left by an earlier run. False if it
+ * is not one.
+ */
+static bool attach(Fat16& fs, const fat::DirectoryEntry& entry, const DirectoryIndex::Slot& slot)
+{
+	uint32_t last = fs.GetLastCluster();
+	uint32_t count = entry.size / CLUSTER_BYTES;
+	if (entry.size % CLUSTER_BYTES != 0 || count < 2 || entry.start_cluster < Fat16::FIRST_CLUSTER ||
+			entry.start_cluster + count - 1 > last)
+		return false;
+
+	first_cluster = entry.start_cluster;
+	clusters = count;
+
+	TallyHeader header;
+	if (fs.GetBlock(tally_lba(), sector, sizeof(sector)) < 0)
+		return false;
+	memcpy(&header, sector, sizeof(header));
+	if (header.magic != TALLY_MAGIC || header.clusters != count || header.page_size != page_size ||
+			header.page_bits != page_bits)
+		return false;
+
+	// The run has to be one chain, in order
+	fat_cursor.Forget();
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t value;
+		uint16_t expected = i + 1 < count ? (uint16_t) (first_cluster + i + 1) : (uint16_t) FatCursor::END_OF_CHAIN;
+		if (!fat_cursor.Get(fs, first_cluster + i, value) || (value != expected && !(i + 1 == count && FatCursor::IsEnd(value))))
+			return false;
+	}
+
+	if (!count_tally(fs, pages_written) || pages_written > data_pages)
+		return false;
+
+	entry_lba = slot.lba;
+	entry_index = slot.index;
+	return true;
+}
+
+/**
+ * Set the run back to 0xFF: erased on flash, overwritten elsewhere.
+ */
+static bool blank_run(Fat16& fs)
+{
+	BlockDevice& device = fs.GetDevice();
+	BlockDevice::Geometry geometry = device.GetGeometry();
+
+	memset(page, 0xFF, page_size);
+	for (uint32_t i = 0; i < clusters; i++) {
+		uint32_t addr;
+		if (!address_of(fs, Fat16::ClusterToLBA(first_cluster + i), 0, addr))
+			return false;
+
+		if (geometry.erase_before_program && addr % geometry.erase_size == 0 && CLUSTER_BYTES % geometry.erase_size == 0) {
+			if (!device.Erase(addr, CLUSTER_BYTES))
+				return false;
+			continue;
+		}
+
+		for (uint32_t offset = 0; offset < CLUSTER_BYTES; offset += page_size) {
+			if (!device.Write(addr + offset, page, page_size))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Erase a run of `count` free clusters, chain it, then point a new entry
+ * in `slot` at it. Power lost in between leaves clusters that nothing
+ * points to, never an entry pointing at free ones.
+ */
+static bool create(Fat16& fs, uint32_t count, const DirectoryIndex::Slot& slot)
+{
+	if (!fat_cursor.FindFreeRun(fs, count, first_cluster))
+		return false;
+
+	clusters = count;
+	if (!blank_run(fs))
+		return false;
+
+	TallyHeader header = { TALLY_MAGIC, (uint16_t) count, (uint16_t) page_size, (uint16_t) page_bits, 0 };
+	memset(page, 0xFF, page_size);
+	memcpy(page, &header, sizeof(header));
+
+	uint32_t addr;
+	if (!address_of(fs, tally_lba(), 0, addr) || !fs.GetDevice().Program(addr, page, page_size))
+		return false;
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t next = i + 1 < count ? (uint16_t) (first_cluster + i + 1) : (uint16_t) FatCursor::END_OF_CHAIN;
+		if (!fat_cursor.Set(fs, first_cluster + i, next))
+			return false;
+	}
+
+	if (!fat_cursor.Store(fs))
+		return false;
+
+	entry_lba = slot.lba;
+	entry_index = slot.index;
+	if (fs.GetBlock(entry_lba, sector, sizeof(sector)) < 0)
+		return false;
+
+	fat::DirectoryEntryBuilder builder;
+	builder.SetName(std::string(log_name, 8), std::string(log_name + 8, 3));
+	builder.SetAttribute(builder.ARCHIVE);
+	builder.SetCreateTime(0, 0, 0, 0);
+	builder.SetCreateDate(1, 1, 2024);
+	builder.SetLastAccessDate(1, 1, 2024);
+	builder.SetUpdateTime(0, 0, 0);
+	builder.SetUpdateDate(1, 1, 2024);
+	builder.SetStartCluster(first_cluster);
+	builder.SetFileSize(count * CLUSTER_BYTES);
+
+	fat::DirectoryEntry* entries = (fat::DirectoryEntry*) sector;
+	entries[entry_index] = builder.Build();
+	if (fs.WriteBlock(entry_lba, sector, sizeof(sector)) < 0)
+		return false;
+
+	pages_written = 0;
+	msc_disk_media_changed();
+	return true;
+}
+
+bool append_log_open(const char name[11], uint32_t count)
+{
+	append_log_close();
+
+	Fat16* fs = msc_disk_begin_local_write();
+	if (!fs->IsReady())
+		return false;
+
+	page_size = fs->GetDevice().GetGeometry().program_size;
+	if (page_size == 0 || page_size > MAX_PAGE_SIZE || Fat16::DISK_BLOCK_SIZE % page_size != 0)
+		return false;
+
+	// The tally has bits in every page but its own header
+	page_bits = std::min<uint32_t>(APPEND_LOG_TALLY_PROGRAMS, page_size * 8);
+	uint32_t tally_bits = (CLUSTER_BYTES / page_size - 1) * page_bits;
+	memcpy(log_name, name, sizeof(log_name));
+	fat_cursor.Forget();
+
+	DirectoryIndex& directories = msc_disk_directories();
+	DirectoryIndex::Slot found, free_slot;
+	fat::DirectoryEntry match;
+	if (!directories.Find(*fs, DirectoryIndex::ROOT, name, found, match))
+		return false;
+
+	if (found.IsValid()) {
+		data_pages = (match.size / CLUSTER_BYTES - 1) * (CLUSTER_BYTES / page_size);
+		if (!attach(*fs, match, found)) {
+			safe_print("%.11s is not an append log\n", name);
+			return false;
+		}
+	}
+	else {
+		data_pages = (count - 1) * (CLUSTER_BYTES / page_size);
+		if (count < 2 || data_pages > tally_bits || !directories.FindFree(*fs, DirectoryIndex::ROOT, free_slot) ||
+				!free_slot.IsValid() || !create(*fs, count, free_slot)) {
+			safe_print("Could not create append log %.11s of %u clusters\n", name, (unsigned) count);
+			return false;
+		}
+	}
+
+	page_fill = 0;
+	checked_generation = Fat16::GetGeneration();
+	is_open = true;
+	safe_print("Append log %.11s at cluster %u, %u of %u bytes used\n", name, (unsigned) first_cluster,
+			(unsigned) append_log_size(), (unsigned) append_log_capacity());
+	return true;
+}
+
+/**
+ * Program the page gathered, then its bit in the tally. A page whose bit
+ * did not make it is written again after a power cycle; only its 0xFF
+ * bytes can still change, so that is harmless.
+ *
+ * Both go to the device rather than through Fat16::WriteBlock. The run is
+ * in the data area, where the journal does not apply; its clusters stay
+ * chained, so the free count is unchanged and PreErase() passes them
+ * over; and it is a file, not a directory, so DirectoryIndex has nothing
+ * of it. The read caches are dropped with msc_disk_invalidate().
+ */
+static bool commit_page()
+{
+	Fat16* fs = msc_disk_begin_local_read(entry_lba, Fat16::DISK_BLOCK_SIZE);
+
+	// Something other than the host changed the volume, e.g. a format
+	if (Fat16::GetGeneration() != checked_generation) {
+		if (fs->GetBlock(entry_lba, sector, sizeof(sector)) < 0 || !is_log_entry(((fat::DirectoryEntry*) sector)[entry_index])) {
+			safe_print("Append log %.11s is gone\n", log_name);
+			drop();
+			return false;
+		}
+		checked_generation = Fat16::GetGeneration();
+	}
+
+	BlockDevice& device = fs->GetDevice();
+	uint32_t lba = Fat16::ClusterToLBA(first_cluster);
+	uint32_t addr;
+	if (!address_of(*fs, lba, pages_written * page_size, addr) || !device.Program(addr, page, page_size))
+		return false;
+	msc_disk_invalidate(lba + pages_written * page_size / Fat16::DISK_BLOCK_SIZE, page_size);
+
+	// Everything but the new bit is programmed as 0xFF, which leaves the
+	// bits cleared before alone
+	uint32_t bit = pages_written % page_bits;
+	uint32_t tally_offset = (1 + pages_written / page_bits) * page_size;
+	uint32_t tally_addr;
+	if (!address_of(*fs, tally_lba(), tally_offset, tally_addr))
+		return false;
+
+	memset(page, 0xFF, page_size);
+	page[bit / 8] &= (uint8_t) ~(1u << (bit % 8));
+	if (!device.Program(tally_addr, page, page_size))
+		return false;
+	msc_disk_invalidate(tally_lba() + tally_offset / Fat16::DISK_BLOCK_SIZE, page_size);
+
+	pages_written++;
+	page_fill = 0;
+	return true;
+}
+
+void append_log_close()
+{
+	if (is_open && page_fill > 0)
+		append_log_flush();
+
+	is_open = false;
+}
+
+bool append_log_is_open()
+{
+	return is_open;
+}
+
+uint32_t append_log_write(const void* data, uint32_t length)
+{
+	const uint8_t* bytes = (const uint8_t*) data;
+	uint32_t taken = 0;
+
+	while (is_open && taken < length && pages_written < data_pages) {
+		uint32_t chunk = std::min(length - taken, page_size - page_fill);
+		memcpy(page + page_fill, bytes + taken, chunk);
+		page_fill += chunk;
+		taken += chunk;
+
+		if (page_fill == page_size && !commit_page()) {
+			safe_print("Append log %.11s failed at byte %u\n", log_name, (unsigned) append_log_size());
+			drop();
+		}
+	}
+
+	return taken;
+}
+
+bool append_log_flush()
+{
+	if (!is_open)
+		return false;
+
+	if (page_fill == 0)
+		return true;
+
+	memset(page + page_fill, APPEND_LOG_PAD, page_size - page_fill);
+	page_fill = page_size;
+	return commit_page();
+}
+
+uint32_t append_log_size()
+{
+	return is_open ? pages_written * page_size : 0;
+}
+
+uint32_t append_log_capacity()
+{
+	return is_open ? data_pages * page_size : 0;
+}
+
+void append_log_patch(uint32_t lba, void* buffer, uint32_t bufsize)
+{
+	if (!is_open || lba > entry_lba || (entry_lba - lba + 1) * Fat16::DISK_BLOCK_SIZE > bufsize)
+		return;
+
+	fat::DirectoryEntry* entries = (fat::DirectoryEntry*) ((uint8_t*) buffer + (entry_lba - lba) * Fat16::DISK_BLOCK_SIZE);
+	if (is_log_entry(entries[entry_index]))
+		entries[entry_index].size = pages_written * page_size;
+}
+
+void append_log_host_write(uint32_t lba, uint8_t* buffer, uint32_t bufsize)
+{
+	if (!is_open)
+		return;
+
+	uint32_t blocks = bufsize / Fat16::DISK_BLOCK_SIZE;
+	uint32_t start = Fat16::ClusterToLBA(first_cluster);
+
+	// The host has its own ideas for the run: the file becomes an ordinary
+	// one, as long as has been appended
+	if (lba < start + clusters * Fat16::DISK_CLUSTER_SIZE && start < lba + blocks) {
+		safe_print("Host wrote into append log %.11s, closing it\n", log_name);
+		drop();
+
+		Fat16* fs = msc_disk_begin_local_write();
+		if (fs->GetBlock(entry_lba, sector, sizeof(sector)) >= 0) {
+			fat::DirectoryEntry& entry = ((fat::DirectoryEntry*) sector)[entry_index];
+			if (is_log_entry(entry)) {
+				entry.size = pages_written * page_size;
+				fs->WriteBlock(entry_lba, sector, sizeof(sector));
+			}
+		}
+		return;
+	}
+
+	if (lba > entry_lba || entry_lba >= lba + blocks)
+		return;
+
+	// What the host read had the appended size in it; on the volume the
+	// entry keeps covering the whole run
+	fat::DirectoryEntry& entry = ((fat::DirectoryEntry*) (buffer + (entry_lba - lba) * Fat16::DISK_BLOCK_SIZE))[entry_index];
+	if (is_log_entry(entry))
+		entry.size = clusters * CLUSTER_BYTES;
+	else {
+		safe_print("Host removed append log %.11s, closing it\n", log_name);
+		drop();
+	}
+}
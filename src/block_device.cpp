@@ -0,0 +1,94 @@
+#include "block_device.h"
+#include "sniff_crc.h"
+#include "string.h"
+#include "util.h"
+
+bool BlockDevice::Modify(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) {
+	Geometry geometry = GetGeometry();
+
+	if (!geometry.erase_before_program)
+		return Program(addr, buffer, bufsize);
+
+	uint32_t unit_addr = addr / geometry.erase_size * geometry.erase_size;
+	uint32_t unit_offset = addr - unit_addr;
+
+	if (geometry.erase_size > MAX_ERASE_SIZE || unit_offset + bufsize > geometry.erase_size) {
+		safe_print("Modify of %d bytes at 0x%X does not fit one erase unit\n", bufsize, addr);
+		return false;
+	}
+
+	// Modify() never nests: no device modifies the one it wraps
+	static uint8_t unit_data[MAX_ERASE_SIZE] STORAGE_ARENA;
+	if (!Read(unit_addr, unit_data, geometry.erase_size))
+		return false;
+
+	if (memcmp(unit_data + unit_offset, buffer, bufsize) == 0)
+		return true;
+
+	bool is_erased = true;
+	for (uint32_t i = unit_offset; i < unit_offset + bufsize; i++) {
+		if (unit_data[i] != 0xFF) {
+			is_erased = false;
+			break;
+		}
+	}
+
+	if (is_erased)
+		return Program(addr, buffer, bufsize);
+
+	memcpy(unit_data + unit_offset, buffer, bufsize);
+	BeginBatch();
+	bool ok = Erase(unit_addr, geometry.erase_size) && Program(unit_addr, unit_data, geometry.erase_size);
+	EndBatch();
+	return ok;
+}
+
+bool BlockDevice::Write(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) {
+	Geometry geometry = GetGeometry();
+	if (!geometry.erase_before_program)
+		return Program(addr, buffer, bufsize);
+
+	uint32_t erase_size = geometry.erase_size;
+
+	while (bufsize > 0) {
+		uint32_t unit_end = (addr / erase_size + 1) * erase_size;
+		uint32_t chunk = unit_end - addr < bufsize ? unit_end - addr : bufsize;
+
+		if (!Modify(addr, buffer, chunk))
+			return false;
+
+		addr += chunk;
+		buffer += chunk;
+		bufsize -= chunk;
+	}
+
+	return true;
+}
+
+bool BlockDevice::ReadChecked(uint32_t addr, void* buffer, uint32_t bufsize, uint32_t& crc) {
+	if (!Read(addr, buffer, bufsize))
+		return false;
+
+	crc = sniff_crc(buffer, bufsize);
+	return true;
+}
+
+bool BlockDevice::ProgramChecked(uint32_t addr, const uint8_t* buffer, uint32_t bufsize, uint32_t& crc) {
+	crc = sniff_crc(buffer, bufsize);
+	return Program(addr, buffer, bufsize);
+}
+
+bool BlockDevice::Checksum(uint32_t addr, uint32_t bytes, uint32_t& crc) {
+	uint8_t chunk[256];
+	crc = SNIFF_CRC_SEED;
+
+	for (uint32_t done = 0; done < bytes; done += sizeof(chunk)) {
+		uint32_t len = bytes - done < sizeof(chunk) ? bytes - done : sizeof(chunk);
+		if (!Read(addr + done, chunk, len))
+			return false;
+
+		crc = sniff_crc(chunk, len, crc);
+	}
+
+	return true;
+}
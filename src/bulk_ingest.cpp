@@ -0,0 +1,174 @@
+#include "bulk_ingest.h"
+#include "tusb.h"
+#include "directory_index.h"
+#include "fat.h"
+#include "fat_standard.hpp"
+#include "file_writer.h"
+#include "pico/time.h"
+#include "util.h"
+
+#define CLUSTER_BYTES Fat16::CLUSTER_BYTES
+
+// What a file may ask for in its directory entry
+#define ATTR_ALLOWED (fat::DirectoryEntryBuilder::READ_ONLY | fat::DirectoryEntryBuilder::HIDDEN | \
+                      fat::DirectoryEntryBuilder::SYSTEM | fat::DirectoryEntryBuilder::ARCHIVE)
+
+enum IngestState {
+	STATE_HEADER,   // Waiting for (the rest of) a header
+	STATE_CONTENTS, // Copying contents into the clusters
+	STATE_DISCARD   // Contents can no longer be stored, but still have to be read
+};
+
+static IngestState state = STATE_HEADER;
+static IngestHeader header;
+static uint32_t header_bytes = 0;
+
+static uint64_t last_rx_us = 0;
+
+// Contents are written a whole cluster at a time, which on flash is one
+// erase unit: one erase and program per 4kb, and nothing read back
+static uint8_t cluster_buffer[CLUSTER_BYTES] STORAGE_ARENA;
+static FileWriter writer(cluster_buffer);
+
+static void reply(uint8_t status, uint16_t cluster)
+{
+	IngestReply r;
+	r.magic = INGEST_REPLY_MAGIC;
+	r.status = status;
+	r.reserved = 0;
+	r.start_cluster = cluster;
+
+	tud_vendor_write(&r, sizeof(r));
+	tud_vendor_write_flush();
+}
+
+static void reset()
+{
+	state = STATE_HEADER;
+	header_bytes = 0;
+	writer.DropCluster();
+}
+
+static uint8_t to_ingest_status(FileWriter::Status status)
+{
+	switch (status) {
+	case FileWriter::WRITE_OK:
+		return INGEST_OK;
+	case FileWriter::WRITE_BAD_NAME:
+		return INGEST_BAD_NAME;
+	case FileWriter::WRITE_NO_SPACE:
+		return INGEST_NO_SPACE;
+	case FileWriter::WRITE_DIRECTORY_FULL:
+		return INGEST_ROOT_FULL;
+	case FileWriter::WRITE_CONFLICT:
+		return INGEST_CONFLICT;
+	case FileWriter::WRITE_NOT_READY:
+		return INGEST_NOT_READY;
+	default:
+		return INGEST_IO_ERROR;
+	}
+}
+
+static uint8_t begin_file()
+{
+	if (header.magic != INGEST_HEADER_MAGIC)
+		return INGEST_BAD_HEADER;
+
+	if (header.attributes & ~ATTR_ALLOWED)
+		return INGEST_BAD_NAME;
+
+	FileWriter::Status status = writer.Begin(DirectoryIndex::ROOT, header.name, header.attributes, header.length,
+			header.time, header.date);
+	if (status != FileWriter::WRITE_OK)
+		return to_ingest_status(status);
+
+	safe_print("Ingest %.11s, %u bytes at cluster %u\n", header.name, (unsigned) header.length,
+			(unsigned) writer.GetFirstCluster());
+	return INGEST_ACCEPTED;
+}
+
+/**
+ * Take contents off the FIFO into the cluster buffer.
+ */
+static void receive_contents()
+{
+	uint32_t room;
+	uint8_t* space = writer.Space(room);
+	writer.Filled(tud_vendor_read(space, room));
+}
+
+/**
+ * Write out a cluster buffer that is full or holds the end of the file,
+ * and finish the file after its last one.
+ */
+static void store_cluster()
+{
+	if (state == STATE_CONTENTS && !writer.StoreCluster()) {
+		safe_print("Ingest failed writing at byte %u\n", (unsigned) writer.GetReceived());
+		state = STATE_DISCARD;
+	}
+	writer.DropCluster();
+
+	if (!writer.IsComplete())
+		return;
+
+	uint8_t status = state == STATE_CONTENTS ? to_ingest_status(writer.Finish()) : (uint8_t) INGEST_IO_ERROR;
+	reply(status, status == INGEST_OK ? writer.GetFirstCluster() : 0);
+	reset();
+}
+
+bool bulk_ingest_task()
+{
+	if (!tud_vendor_mounted()) {
+		reset();
+		return false;
+	}
+
+	// A cluster completed on the last pass is written on this one, so the
+	// FIFO it was taken from refills meanwhile
+	if (state != STATE_HEADER && writer.IsClusterReady()) {
+		store_cluster();
+		return true;
+	}
+
+	if (tud_vendor_available() == 0) {
+		// A host that stops halfway has gone away, or will start over
+		if (bulk_ingest_is_busy() && time_us_64() - last_rx_us > INGEST_TIMEOUT_US) {
+			safe_print("Ingest timed out after %u bytes\n", (unsigned) writer.GetReceived());
+			reset();
+		}
+		return false;
+	}
+
+	last_rx_us = time_us_64();
+
+	if (state != STATE_HEADER) {
+		receive_contents();
+		return true;
+	}
+
+	header_bytes += tud_vendor_read((uint8_t*) &header + header_bytes, sizeof(header) - header_bytes);
+	if (header_bytes < sizeof(header))
+		return true;
+
+	header_bytes = 0;
+
+	uint8_t status = begin_file();
+	reply(status, status == INGEST_ACCEPTED ? writer.GetFirstCluster() : 0);
+	if (status != INGEST_ACCEPTED)
+		return true;
+
+	if (header.length > 0) {
+		state = STATE_CONTENTS;
+		return true;
+	}
+
+	// Nothing to wait for
+	reply(to_ingest_status(writer.Finish()), writer.GetFirstCluster());
+	return true;
+}
+
+bool bulk_ingest_is_busy()
+{
+	return state != STATE_HEADER || header_bytes > 0;
+}
@@ -0,0 +1,502 @@
+#include "directory_index.h"
+#include "fat_cursor.hpp"
+#include "util.h"
+#include <string.h>
+#include <algorithm>
+
+// Directory sectors are read into here, to index or to check a name
+static uint8_t sector[Fat16::DISK_BLOCK_SIZE] STORAGE_ARENA;
+
+// A new directory cluster is built in here
+static uint8_t cluster_buffer[Fat16::CLUSTER_BYTES] STORAGE_ARENA;
+
+static FatCursor fat_cursor;
+
+bool DirectoryIndex::IsNamed(const fat::DirectoryEntry& entry)
+{
+	return entry.name[0] != 0 && (uint8_t) entry.name[0] != 0xE5 && entry.name[0] != '.' &&
+		!(entry.attributes & fat::DirectoryEntryBuilder::VOLUME_LABEL);
+}
+
+uint16_t DirectoryIndex::Hash(uint16_t dir, const char name[11])
+{
+	// FNV-1a, folded to 16 bits
+	uint32_t hash = 2166136261u;
+	hash = (hash ^ (dir & 0xFF)) * 16777619u;
+	hash = (hash ^ (dir >> 8)) * 16777619u;
+	for (int i = 0; i < 11; i++)
+		hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+
+	return (uint16_t) (hash ^ (hash >> 16));
+}
+
+void DirectoryIndex::Clear()
+{
+	for (uint32_t b = 0; b < BUCKETS; b++)
+		buckets[b] = NONE;
+
+	for (uint32_t n = 0; n < MAX_NAMES; n++)
+		names[n].next = n + 1 < MAX_NAMES ? (uint16_t) (n + 1) : NONE;
+	free_names = 0;
+	names_left = MAX_NAMES;
+
+	for (uint32_t d = 0; d < MAX_DIRECTORIES; d++)
+		directories[d].indexed = false;
+
+	for (uint16_t& cluster : unindexed)
+		cluster = NONE;
+	next_unindexed = 0;
+}
+
+DirectoryIndex::Slot DirectoryIndex::SlotOf(const Directory& directory, uint32_t entry) const
+{
+	Slot slot;
+	if (directory.cluster == ROOT)
+		slot.lba = Fat16::INDEX_ROOT_DIRECTORY + entry / ENTRIES_PER_SECTOR;
+	else
+		slot.lba = Fat16::ClusterToLBA(directory.chain[entry / ENTRIES_PER_CLUSTER]) + entry % ENTRIES_PER_CLUSTER / ENTRIES_PER_SECTOR;
+
+	slot.index = entry % ENTRIES_PER_SECTOR;
+	return slot;
+}
+
+bool DirectoryIndex::Learn(uint32_t d, uint32_t first, const uint8_t* data)
+{
+	Directory& directory = directories[d];
+	const fat::DirectoryEntry* entries = (const fat::DirectoryEntry*) data;
+
+	uint32_t named = 0;
+	for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++)
+		named += IsNamed(entries[i]);
+	if (named > names_left)
+		return false;
+
+	for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++) {
+		const fat::DirectoryEntry& entry = entries[i];
+		uint32_t number = first + i;
+		uint8_t bit = (uint8_t) (1u << (number % 8));
+
+		if (entry.name[0] == 0 || (uint8_t) entry.name[0] == 0xE5)
+			directory.free[number / 8] |= bit;
+		else
+			directory.free[number / 8] &= (uint8_t) ~bit;
+
+		if (!IsNamed(entry))
+			continue;
+
+		uint16_t n = free_names;
+		free_names = names[n].next;
+		names_left--;
+
+		uint16_t hash = Hash(directory.cluster, entry.name);
+		uint16_t& bucket = Bucket(d, hash);
+		names[n] = { hash, bucket, (uint16_t) (d << ENTRY_BITS | number) };
+		bucket = n;
+	}
+
+	return true;
+}
+
+void DirectoryIndex::Forget(uint32_t d, uint32_t first, uint32_t count)
+{
+	// Only this directory's own buckets can hold its names
+	for (uint32_t b = 0; b < DIRECTORY_BUCKETS; b++) {
+		uint16_t* link = &buckets[d * DIRECTORY_BUCKETS + b];
+		while (*link != NONE) {
+			Name& name = names[*link];
+			if (name.Entry() < first || name.Entry() >= first + count) {
+				link = &name.next;
+				continue;
+			}
+
+			uint16_t n = *link;
+			*link = name.next;
+			name.next = free_names;
+			free_names = n;
+			names_left++;
+		}
+	}
+}
+
+void DirectoryIndex::Drop(uint32_t d)
+{
+	if (!directories[d].indexed)
+		return;
+
+	Forget(d, 0, MAX_ENTRIES);
+	directories[d].indexed = false;
+}
+
+DirectoryIndex::Directory* DirectoryIndex::Index(Fat16& fs, uint16_t cluster)
+{
+	if (!enabled)
+		return nullptr;
+
+	uint32_t d = 0;
+	for (uint32_t i = 0; i < MAX_DIRECTORIES; i++) {
+		if (directories[i].indexed && directories[i].cluster == cluster) {
+			directories[i].last_used = ++clock;
+			return &directories[i];
+		}
+
+		// Something free, or else the one used longest ago
+		if (directories[d].indexed && (!directories[i].indexed || directories[i].last_used < directories[d].last_used))
+			d = i;
+	}
+
+	for (uint16_t big : unindexed) {
+		if (big == cluster)
+			return nullptr;
+	}
+
+	Drop(d);
+	Directory& directory = directories[d];
+	directory.cluster = cluster;
+	directory.clusters = 0;
+
+	if (cluster != ROOT) {
+		uint32_t last = fs.GetLastCluster();
+		uint16_t next = cluster;
+		fat_cursor.Forget();
+
+		while (!FatCursor::IsEnd(next)) {
+			if (next < Fat16::FIRST_CLUSTER || next > last)
+				return nullptr;
+
+			if (directory.clusters == MAX_CLUSTERS) {
+				unindexed[next_unindexed++ % MAX_UNINDEXED] = cluster;
+				return nullptr;
+			}
+
+			directory.chain[directory.clusters++] = next;
+			if (!fat_cursor.Get(fs, next, next))
+				return nullptr;
+		}
+	}
+
+	memset(directory.free, 0, sizeof(directory.free));
+	uint32_t count = EntryCount(directory);
+	for (uint32_t first = 0; first < count; first += ENTRIES_PER_SECTOR) {
+		if (fs.GetBlock(SlotOf(directory, first).lba, sector, sizeof(sector)) < 0) {
+			Forget(d, 0, first);
+			return nullptr;
+		}
+		stats.sectors_read++;
+
+		// Make room from the directories used longest ago, never this one
+		while (!Learn(d, first, sector)) {
+			uint32_t victim = MAX_DIRECTORIES;
+			for (uint32_t i = 0; i < MAX_DIRECTORIES; i++) {
+				if (i != d && directories[i].indexed && (victim == MAX_DIRECTORIES || directories[i].last_used < directories[victim].last_used))
+					victim = i;
+			}
+
+			if (victim == MAX_DIRECTORIES) {
+				Forget(d, 0, first);
+				unindexed[next_unindexed++ % MAX_UNINDEXED] = cluster;
+				return nullptr;
+			}
+			Drop(victim);
+		}
+	}
+
+	directory.indexed = true;
+	directory.last_used = ++clock;
+	stats.indexed++;
+	return &directory;
+}
+
+bool DirectoryIndex::Scan(Fat16& fs, uint16_t dir, const char* name, Slot& slot, fat::DirectoryEntry& entry, Slot* free_slot)
+{
+	stats.scans++;
+
+	uint32_t last = fs.GetLastCluster();
+	uint16_t cluster = dir;
+	uint32_t sectors = dir == ROOT ? ROOT_ENTRIES / ENTRIES_PER_SECTOR : Fat16::DISK_CLUSTER_SIZE;
+	fat_cursor.Forget();
+
+	for (uint32_t steps = 0; steps <= last; steps++) {
+		if (dir != ROOT && (cluster < Fat16::FIRST_CLUSTER || cluster > last))
+			return true;
+
+		for (uint32_t s = 0; s < sectors; s++) {
+			uint32_t lba = dir == ROOT ? Fat16::INDEX_ROOT_DIRECTORY + s : Fat16::ClusterToLBA(cluster) + s;
+			if (fs.GetBlock(lba, sector, sizeof(sector)) < 0)
+				return false;
+			stats.sectors_read++;
+
+			const fat::DirectoryEntry* entries = (const fat::DirectoryEntry*) sector;
+			for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++) {
+				bool free = entries[i].name[0] == 0 || (uint8_t) entries[i].name[0] == 0xE5;
+				if (free && free_slot != nullptr && !free_slot->IsValid()) {
+					free_slot->lba = lba;
+					free_slot->index = i;
+				}
+
+				// Nothing is in use after the first never-used entry
+				if (entries[i].name[0] == 0)
+					return true;
+
+				if (name != nullptr && IsNamed(entries[i]) && memcmp(entries[i].name, name, 11) == 0) {
+					slot.lba = lba;
+					slot.index = i;
+					entry = entries[i];
+					return true;
+				}
+			}
+		}
+
+		if (dir == ROOT)
+			return true;
+
+		uint16_t next;
+		if (!fat_cursor.Get(fs, cluster, next))
+			return false;
+		if (FatCursor::IsEnd(next))
+			return true;
+		cluster = next;
+	}
+
+	return true;
+}
+
+bool DirectoryIndex::Find(Fat16& fs, uint16_t dir, const char name[11], Slot& slot, fat::DirectoryEntry& entry)
+{
+	stats.lookups++;
+	slot = Slot();
+
+	Directory* directory = Index(fs, dir);
+	if (directory == nullptr)
+		return Scan(fs, dir, name, slot, entry, nullptr);
+
+	// The hash only narrows it down; the entry itself has the name
+	uint32_t d = directory - directories;
+	uint16_t hash = Hash(dir, name);
+	for (uint16_t n = Bucket(d, hash); n != NONE; n = names[n].next) {
+		if (names[n].hash != hash)
+			continue;
+
+		Slot candidate = SlotOf(*directory, names[n].Entry());
+		if (fs.GetBlock(candidate.lba, sector, sizeof(sector)) < 0)
+			return false;
+		stats.sectors_read++;
+
+		const fat::DirectoryEntry& found = ((const fat::DirectoryEntry*) sector)[candidate.index];
+		if (IsNamed(found) && memcmp(found.name, name, 11) == 0) {
+			slot = candidate;
+			entry = found;
+			return true;
+		}
+	}
+
+	return true;
+}
+
+bool DirectoryIndex::FindFree(Fat16& fs, uint16_t dir, Slot& slot)
+{
+	slot = Slot();
+
+	Directory* directory = Index(fs, dir);
+	if (directory != nullptr) {
+		uint32_t count = EntryCount(*directory);
+		for (uint32_t i = 0; i < count / 8; i++) {
+			if (directory->free[i] != 0) {
+				uint32_t bit = 0;
+				while (!(directory->free[i] & (1u << bit)))
+					bit++;
+				slot = SlotOf(*directory, i * 8 + bit);
+				return true;
+			}
+		}
+	}
+	else {
+		Slot found;
+		fat::DirectoryEntry entry;
+		if (!Scan(fs, dir, nullptr, found, entry, &slot))
+			return false;
+		if (slot.IsValid())
+			return true;
+	}
+
+	return dir == ROOT || Extend(fs, dir, slot);
+}
+
+bool DirectoryIndex::Locate(Fat16& fs, uint16_t dir, uint32_t number, Slot& slot)
+{
+	slot = Slot();
+
+	Directory* directory = Index(fs, dir);
+	if (directory != nullptr) {
+		if (number < EntryCount(*directory))
+			slot = SlotOf(*directory, number);
+		return true;
+	}
+
+	if (dir == ROOT) {
+		if (number < ROOT_ENTRIES) {
+			slot.lba = Fat16::INDEX_ROOT_DIRECTORY + number / ENTRIES_PER_SECTOR;
+			slot.index = number % ENTRIES_PER_SECTOR;
+		}
+		return true;
+	}
+
+	uint32_t last = fs.GetLastCluster();
+	uint16_t cluster = dir;
+	fat_cursor.Forget();
+	for (uint32_t i = 0; i < number / ENTRIES_PER_CLUSTER; i++) {
+		if (!fat_cursor.Get(fs, cluster, cluster))
+			return false;
+		if (FatCursor::IsEnd(cluster))
+			return true;
+	}
+
+	if (cluster < Fat16::FIRST_CLUSTER || cluster > last)
+		return true;
+
+	slot.lba = Fat16::ClusterToLBA(cluster) + number % ENTRIES_PER_CLUSTER / ENTRIES_PER_SECTOR;
+	slot.index = number % ENTRIES_PER_SECTOR;
+	return true;
+}
+
+bool DirectoryIndex::Extend(Fat16& fs, uint16_t dir, Slot& slot)
+{
+	uint32_t last = fs.GetLastCluster();
+	uint16_t cluster = dir;
+	fat_cursor.Forget();
+
+	for (uint32_t steps = 0; ; steps++) {
+		uint16_t next;
+		if (steps > last || cluster < Fat16::FIRST_CLUSTER || cluster > last || !fat_cursor.Get(fs, cluster, next))
+			return false;
+		if (FatCursor::IsEnd(next))
+			break;
+		cluster = next;
+	}
+
+	uint16_t added;
+	if (!fat_cursor.FindFreeRun(fs, 1, added))
+		return true;
+
+	// Zeroed before it is chained, so the directory never ends in garbage
+	memset(cluster_buffer, 0, sizeof(cluster_buffer));
+	if (fs.WriteBlock(Fat16::ClusterToLBA(added), cluster_buffer, sizeof(cluster_buffer)) < 0)
+		return false;
+
+	if (!fat_cursor.Set(fs, added, FatCursor::END_OF_CHAIN) || !fat_cursor.Set(fs, cluster, added) || !fat_cursor.Store(fs))
+		return false;
+
+	slot.lba = Fat16::ClusterToLBA(added);
+	slot.index = 0;
+	return true;
+}
+
+bool DirectoryIndex::MakeDirectory(Fat16& fs, uint16_t parent, const char name[11], uint16_t& cluster)
+{
+	Slot slot;
+	fat::DirectoryEntry entry;
+	if (!Find(fs, parent, name, slot, entry) || slot.IsValid())
+		return false;
+
+	if (!FindFree(fs, parent, slot) || !slot.IsValid())
+		return false;
+
+	fat_cursor.Forget();
+	if (!fat_cursor.FindFreeRun(fs, 1, cluster))
+		return false;
+
+	fat::DirectoryEntryBuilder builder;
+	builder.SetAttribute(builder.DIRECTORY);
+	builder.SetCreateTime(0, 0, 0, 0);
+	builder.SetCreateDate(1, 1, 2024);
+	builder.SetLastAccessDate(1, 1, 2024);
+	builder.SetUpdateTime(0, 0, 0);
+	builder.SetUpdateDate(1, 1, 2024);
+	builder.SetFileSize(0);
+
+	// "." is the directory itself, ".." its parent, 0 for the root
+	memset(cluster_buffer, 0, sizeof(cluster_buffer));
+	fat::DirectoryEntry* entries = (fat::DirectoryEntry*) cluster_buffer;
+	builder.SetName(".       ", "   ");
+	builder.SetStartCluster(cluster);
+	entries[0] = builder.Build();
+	builder.SetName("..      ", "   ");
+	builder.SetStartCluster(parent);
+	entries[1] = builder.Build();
+
+	// Contents, then the FAT, then the entry, so power lost in between
+	// leaves a lost cluster, never an entry pointing at garbage
+	if (fs.WriteBlock(Fat16::ClusterToLBA(cluster), cluster_buffer, sizeof(cluster_buffer)) < 0 ||
+			!fat_cursor.Set(fs, cluster, FatCursor::END_OF_CHAIN) || !fat_cursor.Store(fs))
+		return false;
+
+	if (fs.GetBlock(slot.lba, sector, sizeof(sector)) < 0)
+		return false;
+
+	builder.SetName(std::string(name, 8), std::string(name + 8, 3));
+	builder.SetStartCluster(cluster);
+	((fat::DirectoryEntry*) sector)[slot.index] = builder.Build();
+	return fs.WriteBlock(slot.lba, sector, sizeof(sector)) >= 0;
+}
+
+void DirectoryIndex::Write(uint32_t lba, const uint8_t* data, uint32_t bufsize)
+{
+	uint32_t blocks = bufsize / Fat16::DISK_BLOCK_SIZE;
+	bool any = false;
+	for (uint32_t d = 0; d < MAX_DIRECTORIES; d++)
+		any = any || directories[d].indexed;
+	if (!any)
+		return;
+
+	for (uint32_t b = 0; b < blocks; b++) {
+		uint32_t block = lba + b;
+		const uint8_t* block_data = data + b * Fat16::DISK_BLOCK_SIZE;
+
+		for (uint32_t d = 0; d < MAX_DIRECTORIES; d++) {
+			Directory& directory = directories[d];
+			if (!directory.indexed)
+				continue;
+
+			// A chain that changed, longer, shorter or elsewhere, is read
+			// again next time
+			if (block >= Fat16::INDEX_FAT_TABLE_1_START && block < Fat16::INDEX_FAT_TABLE_2_START) {
+				uint32_t fat_sector = block - Fat16::INDEX_FAT_TABLE_1_START;
+				for (uint32_t k = 0; k < directory.clusters; k++) {
+					uint16_t cluster = directory.chain[k];
+					if (cluster / FatCursor::ENTRIES_PER_SECTOR != fat_sector)
+						continue;
+
+					uint16_t value;
+					memcpy(&value, block_data + cluster % FatCursor::ENTRIES_PER_SECTOR * 2, 2);
+					bool same = k + 1 < directory.clusters ? value == directory.chain[k + 1] : FatCursor::IsEnd(value);
+					if (!same) {
+						Drop(d);
+						stats.dropped++;
+						break;
+					}
+				}
+				continue;
+			}
+
+			uint32_t first = MAX_ENTRIES;
+			if (directory.cluster == ROOT && block >= Fat16::INDEX_ROOT_DIRECTORY && block < Fat16::INDEX_DATA_STARTS) {
+				first = (block - Fat16::INDEX_ROOT_DIRECTORY) * ENTRIES_PER_SECTOR;
+			}
+			else if (directory.cluster != ROOT && block >= Fat16::INDEX_DATA_STARTS) {
+				uint32_t cluster = (block - Fat16::INDEX_DATA_STARTS) / Fat16::DISK_CLUSTER_SIZE + Fat16::FIRST_CLUSTER;
+				for (uint32_t k = 0; k < directory.clusters; k++) {
+					if (directory.chain[k] == cluster)
+						first = k * ENTRIES_PER_CLUSTER + (block - Fat16::INDEX_DATA_STARTS) % Fat16::DISK_CLUSTER_SIZE * ENTRIES_PER_SECTOR;
+				}
+			}
+
+			if (first == MAX_ENTRIES)
+				continue;
+
+			Forget(d, first, ENTRIES_PER_SECTOR);
+			if (!Learn(d, first, block_data)) {
+				Drop(d);
+				stats.dropped++;
+			}
+		}
+	}
+}
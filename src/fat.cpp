@@ -1,13 +1,28 @@
 #include "fat.h"
+#include "directory_index.h"
 #include "fat_standard.hpp"
-#include "pico_flash.hpp"
+#include "file_map.h"
 #include "string.h"
 #include "util.h"
 #include "bsp/board.h"
 #include "stdio.h"
+#include "stddef.h"
 #include <string>
 #include <iomanip>
-#include "hardware/gpio.h"
+#include <algorithm>
+
+// Format() builds the volume a cluster at a time in here
+static uint8_t format_buffer[Fat16::CLUSTER_BYTES] STORAGE_ARENA;
+
+// A root directory sector as stored, for AbsorbTimes() and PersistTimes()
+static uint8_t root_sector[Fat16::DISK_BLOCK_SIZE] STORAGE_ARENA;
+
+// Where Format() leaves the layout stamp: magic, version and data address,
+// the last bytes of bootcode
+static constexpr uint32_t LAYOUT_STAMP_SIZE = 3 * sizeof(uint32_t);
+static constexpr uint32_t LAYOUT_STAMP_OFFSET = offsetof(fat::BootSector, bootsign) - LAYOUT_STAMP_SIZE;
+
+static_assert(Fat16::ROOT_DIRECTORY_SIZE / Fat16::DISK_BLOCK_SIZE <= 32, "AbsorbTimes() has a bit per root sector");
 
 #define DATA1 \
  R"(Sed ut perspiciatis unde omnis iste natus error sit voluptatem accusantium doloremque laudantium, totam rem aperiam, eaque ipsa quae ab illo inventore veritatis et)"
@@ -15,8 +30,40 @@
 #define DATA2 \
  R"(I pledge allegiance to my Flag and the Republic for which it stands, one nation, indivisible, with liberty and justice for all.)"
 
-Fat16::Fat16() {
-	fat::BootSector boot;
+Fat16::Fat16(BlockDevice& device) : device(device), journal(device) {
+	ready = device.Init();
+	BlockDevice::Geometry geometry = device.GetGeometry();
+	layout = ComputeLayout(geometry);
+
+	// Only worth it where rewriting means erasing, and only where each
+	// cluster has erase units of its own
+	can_pre_erase = PRE_ERASE_CLUSTERS > 0 && geometry.erase_before_program && geometry.erase_size > 0 &&
+		CLUSTER_BYTES % geometry.erase_size == 0 && layout.data % geometry.erase_size == 0;
+
+	// Blank flash, or a volume laid out differently: there is no telling
+	// where its files are, so start over rather than serve garbage. That
+	// goes for its journal too, so this comes before the log is read.
+	if (ready && !HasLayoutStamp()) {
+		safe_print("No volume with layout version %u found, formatting\n", (unsigned) LAYOUT_VERSION);
+		Format();
+	}
+
+	// The FAT copies and the root directory are what small writes keep
+	// changing
+	Remount();
+}
+
+/**
+* Write a fresh volume: boot sector, empty FAT and root directory with the
+* two sample files. Called when GPIO17 is shorted to ground.
+*/
+bool Fat16::Format() {
+	if (!ready)
+		return false;
+
+	// Built where it is written from, rather than on the stack
+	memset(format_buffer, 0, DISK_BLOCK_SIZE);
+	fat::BootSector& boot = *(fat::BootSector*) format_buffer;
 	boot.boot_jump[0] = 0xEB;
 	boot.boot_jump[1] = 0x3C;
 	boot.boot_jump[2] = 0x90;
@@ -69,20 +116,18 @@ Fat16::Fat16() {
 	for(size_t i = 0; i < type.size(); i++)
 		boot.filesys_type[i] = type[i];
 
-	// Zero out all bootcode, we won't be needing it.
+	// Zero out all bootcode, we won't be needing it. Its tail carries the
+	// layout stamp instead.
 	memset(boot.bootcode, 0, sizeof(boot.bootcode));
+	const uint32_t stamp[] = { LAYOUT_MAGIC, LAYOUT_VERSION, layout.data };
+	memcpy(format_buffer + LAYOUT_STAMP_OFFSET, stamp, LAYOUT_STAMP_SIZE);
 
 	boot.bootsign = uint16_t(0xAA55);
 
 
 
-	fat::FATTable fat_table;
-	fat_table.Set(0, 0xFFF8); // Cluster 0: FAT ID
-	fat_table.Set(1, 0xFFFF); // Cluster 1: Reserved
-	fat_table.Set(2, 0xFFFF); // Cluster 2: HTML Doc
-	fat_table.Set(3, 0xFFFF); // Cluster 3: TXT File
-	
-	fat::RootDirectory root_dir;
+	// Only the first few root entries are used, the rest stay zero
+	fat::DirectoryEntry root_entries[3];
 
 	// The first entry is a special entry that labels the
 	// partition.
@@ -96,7 +141,7 @@ Fat16::Fat16() {
 	builder.SetUpdateDate(0, 0, 1980);
 	builder.SetStartCluster(0);
 	builder.SetFileSize(0);
-	root_dir.PushEntry(builder.Build());
+	root_entries[0] = builder.Build();
 
 	builder.SetName("DATA1   ", "TXT");
 	builder.SetAttribute(builder.ARCHIVE | builder.READ_ONLY);
@@ -107,7 +152,7 @@ Fat16::Fat16() {
 	builder.SetUpdateDate(11, 5, 2013);
 	builder.SetStartCluster(2);
 	builder.SetFileSize(sizeof(DATA1) - 1);
-	root_dir.PushEntry(builder.Build());
+	root_entries[1] = builder.Build();
 
 	builder.SetName("DATA2   ", "TXT");
 	builder.SetAttribute(builder.ARCHIVE | builder.READ_ONLY);
@@ -118,45 +163,58 @@ Fat16::Fat16() {
 	builder.SetUpdateDate(11, 5, 2013);
 	builder.SetStartCluster(3);
 	builder.SetFileSize(sizeof(DATA2) - 1); 
-	root_dir.PushEntry(builder.Build());
-
-	// Shorting this pin manually will reset filesystem
-	gpio_init(17);
-	gpio_set_dir(17, GPIO_IN);
-	gpio_pull_up(17);
-	sleep_ms(50);
-
-	if (gpio_get(17) == 0) {
-		// Boot
-		uint8_t boot_data[512];
-		memcpy(boot_data, &boot, sizeof(boot));
-		PicoFlash::Erase(FLASH_BOOT, 1);
-		PicoFlash::Program(FLASH_BOOT, boot_data, sizeof(boot_data)); 
-
-		// FAT
-		uint8_t fat_data[FLASH_SECTOR_SIZE];
-		memset(fat_data, 0, sizeof(fat_data));
-		memcpy(fat_data, fat_table.GetBytes(), 129 * 2);
-		PicoFlash::Erase(FLASH_FAT, 1);
-		PicoFlash::Program(FLASH_FAT, fat_data, sizeof(fat_data)); 
-
-		// Root
-		PicoFlash::Erase(FLASH_ROOT_DIRECTORY, 4);
-		PicoFlash::Program(FLASH_ROOT_DIRECTORY, (uint8_t*) root_dir.GetBytes(), 512 * 32); 
-
-		// 2 Data files
-		uint8_t data[FLASH_SECTOR_SIZE];
-		memset(data, 0, FLASH_SECTOR_SIZE);
-		memcpy(data, DATA1, sizeof(DATA1));
-		PicoFlash::Erase(FLASH_DATA_START, 1);
-		PicoFlash::Program(FLASH_DATA_START, data, sizeof(data)); 
-
-		uint32_t offset = DISK_CLUSTER_SIZE * DISK_BLOCK_SIZE;
-		memset(data, 0, FLASH_SECTOR_SIZE);
-		memcpy(data, DATA2, sizeof(DATA2));
-		PicoFlash::Erase(FLASH_DATA_START + offset, 1);
-		PicoFlash::Program(FLASH_DATA_START + offset, data, sizeof(data));
+	root_entries[2] = builder.Build();
+
+	// Old journal records would land on top of the fresh FAT and root,
+	// and on a volume laid out differently the log area holds anything
+	journal.Reset(layout.fat, layout.root + ROOT_DIRECTORY_SIZE, layout.journal, layout.journal_size);
+	free_clusters = -1;
+	pre_erase_count = 0;
+	generation++;
+	FileMap::InvalidateAll();
+	access_times.Clear();
+	if (directories != nullptr)
+		directories->Clear();
+
+	// Boot
+	device.Write(layout.boot, format_buffer, DISK_BLOCK_SIZE);
+
+	// FAT, every stored sector of it, a cluster's worth at a time. A
+	// 1:1 layout keeps both copies.
+	uint8_t* data = format_buffer;
+	for (uint32_t copy = 0; copy < (layout.linear ? 2 : 1); copy++) {
+		for (uint32_t i = 0; i < layout.fat_blocks; i += DISK_CLUSTER_SIZE) {
+			memset(data, 0, CLUSTER_BYTES);
+			if (i == 0) {
+				// Cluster 0: FAT ID, 1: reserved, 2 and 3: the sample files
+				const uint16_t first[] = { 0xFFF8, 0xFFFF, 0xFFFF, 0xFFFF };
+				memcpy(data, first, sizeof(first));
+			}
+
+			uint32_t blocks = std::min<uint32_t>(DISK_CLUSTER_SIZE, layout.fat_blocks - i);
+			uint32_t addr = layout.fat + (copy * FAT_TABLE_SECTORS + i) * DISK_BLOCK_SIZE;
+			device.Write(addr, data, blocks * DISK_BLOCK_SIZE);
+		}
 	}
+
+	// Root
+	for (uint32_t offset = 0; offset < ROOT_DIRECTORY_SIZE; offset += CLUSTER_BYTES) {
+		memset(data, 0, CLUSTER_BYTES);
+		if (offset == 0)
+			memcpy(data, root_entries, sizeof(root_entries));
+		device.Write(layout.root + offset, data, CLUSTER_BYTES);
+	}
+
+	// 2 Data files
+	memset(data, 0, CLUSTER_BYTES);
+	memcpy(data, DATA1, sizeof(DATA1));
+	device.Write(layout.data, data, CLUSTER_BYTES);
+
+	memset(data, 0, CLUSTER_BYTES);
+	memcpy(data, DATA2, sizeof(DATA2));
+	device.Write(layout.data + CLUSTER_BYTES, data, CLUSTER_BYTES);
+
+	return true;
 }
 
 /**
@@ -166,35 +224,328 @@ Fat16::Fat16() {
 */ 
 
 /**
-* Return the sector at LBA. This assumes the USB connection is set so that the host
-* only reads in increments of 512.
+* Return the sectors starting at LBA. This assumes the USB connection is set
+* so that the host only reads in increments of 512. Sectors the device does
+* not store read as zeros.
 */
 int32_t Fat16::GetBlock(const uint32_t lba, void* buffer, uint32_t bufsize) {
-	// out of space
-	if ( lba >= DISK_BLOCK_NUM ) return -1;
+	uint32_t blocks = (bufsize + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
 
-	uint32_t index = LBAToIndex(lba);
+	// out of space
+	if ( lba + blocks > DISK_BLOCK_NUM ) return -1;
+
+	uint8_t* out = (uint8_t*) buffer;
+	uint32_t i = 0;
+	while (i < blocks) {
+		uint32_t offset = i * DISK_BLOCK_SIZE;
+		uint32_t addr;
+
+		if (!LBAToAddress(lba + i, addr)) {
+			memset(out + offset, 0, std::min<uint32_t>(DISK_BLOCK_SIZE, bufsize - offset));
+			i++;
+			continue;
+		}
+
+		// Read as many blocks as are next to each other on the device in one go
+		uint32_t run = 1;
+		uint32_t next;
+		while (i + run < blocks && LBAToAddress(lba + i + run, next) && next == addr + run * DISK_BLOCK_SIZE)
+			run++;
+
+		uint32_t len = std::min<uint32_t>(run * DISK_BLOCK_SIZE, bufsize - offset);
+		if (!journal.Read(addr, out + offset, len))
+			return -1;
+
+		// Dates kept in RAM are newer than the stored ones
+		for (uint32_t b = i; b < i + run && lba + b < INDEX_DATA_STARTS; b++) {
+			if (lba + b >= INDEX_ROOT_DIRECTORY) {
+				uint32_t at = b * DISK_BLOCK_SIZE;
+				access_times.Apply(lba + b - INDEX_ROOT_DIRECTORY, out + at, std::min<uint32_t>(DISK_BLOCK_SIZE, bufsize - at));
+			}
+		}
+
+		i += run;
+	}
 
-	// XIP_BASE is to skip the RAM of the Pico
-	memcpy(buffer, (char*)(XIP_BASE + LBAToFlash(lba)), bufsize);
+	// The layout stamp is the firmware's, the host sees plain zeroed bootcode
+	if (lba == INDEX_RESERVED && bufsize >= LAYOUT_STAMP_OFFSET + LAYOUT_STAMP_SIZE)
+		memset(out + LAYOUT_STAMP_OFFSET, 0, LAYOUT_STAMP_SIZE);
 
 	return (int32_t) bufsize;
 }
 
 int32_t Fat16::WriteBlock(const uint32_t lba, void* buffer, uint32_t bufsize) {
-	// out of space
-	if ( lba >= DISK_BLOCK_NUM ) return -1;
+	if (!CheckWrite(lba, buffer, bufsize)) return -1;
 
 	safe_print("-----WRITE COMMENCE-----\n");
 	safe_print("lba: %d\n", (int)lba);
 	safe_print("Bytes written: %d\n", (int)bufsize);
 	safe_print("--------WRITE END-------\n");
-	
-	if (LBAToIndex(lba) != INDEX_RESERVED) {
-		PicoFlash::Modify(LBAToFlash(lba), (uint8_t*)buffer, bufsize);
+
+	uint8_t* data = (uint8_t*) buffer;
+	uint32_t blocks = bufsize / DISK_BLOCK_SIZE;
+	uint32_t i = 0;
+	bool ok = true;
+
+	generation++;
+	FileMap::Invalidate(lba, blocks);
+	if (pre_erase_count > 0 && lba + blocks > INDEX_DATA_STARTS)
+		ForgetPreErase(lba, blocks);
+	if (free_clusters >= 0 || can_pre_erase) {
+		for (uint32_t b = 0; b < blocks; b++) {
+			if (lba + b >= INDEX_FAT_TABLE_1_START && lba + b < INDEX_FAT_TABLE_2_START)
+				CountFreeChange(lba + b - INDEX_FAT_TABLE_1_START, data + b * DISK_BLOCK_SIZE);
+		}
 	}
 
-	return (int32_t) bufsize;
+	// Root directory sectors that only bump timestamps stay in RAM
+	uint32_t absorbed = AbsorbTimes(lba, data, blocks);
+	auto is_absorbed = [&](uint32_t block) {
+		return absorbed != 0 && LBAToIndex(lba + block) == INDEX_ROOT_DIRECTORY &&
+			(absorbed & (1u << (lba + block - INDEX_ROOT_DIRECTORY))) != 0;
+	};
+
+	// Everything this write does to the device goes out with one exit
+	// from XIP where the device supports it
+	device.BeginBatch();
+	while (ok && i < blocks) {
+		uint32_t addr;
+
+		// The boot sector belongs to the device, and CheckWrite has made
+		// sure unstored blocks are only being zeroed.
+		if (LBAToIndex(lba + i) == INDEX_RESERVED || !LBAToAddress(lba + i, addr) || is_absorbed(i)) {
+			i++;
+			continue;
+		}
+
+		uint32_t run = 1;
+		uint32_t next;
+		while (i + run < blocks && LBAToAddress(lba + i + run, next) && next == addr + run * DISK_BLOCK_SIZE &&
+				!is_absorbed(i + run))
+			run++;
+
+		ok = journal.Write(addr, data + i * DISK_BLOCK_SIZE, run * DISK_BLOCK_SIZE);
+		i += run;
+	}
+	device.EndBatch();
+
+	if (directories != nullptr) {
+		if (ok)
+			directories->Write(lba, data, bufsize);
+		else
+			directories->Clear();
+	}
+
+	return ok ? (int32_t) bufsize : -1;
+}
+
+bool Fat16::CheckWrite(const uint32_t lba, const void* buffer, uint32_t bufsize) const {
+	uint32_t blocks = bufsize / DISK_BLOCK_SIZE;
+
+	// out of space
+	if ( !ready || lba + blocks > DISK_BLOCK_NUM ) return false;
+
+	const uint8_t* data = (const uint8_t*) buffer;
+	for (uint32_t i = 0; i < blocks; i++) {
+		uint32_t addr;
+		if (LBAToIndex(lba + i) == INDEX_RESERVED || LBAToAddress(lba + i, addr))
+			continue;
+
+		for (uint32_t j = 0; j < DISK_BLOCK_SIZE; j++) {
+			if (data[i * DISK_BLOCK_SIZE + j] != 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+const uint8_t* Fat16::MapBlocks(const uint32_t lba, uint32_t blocks) {
+	uint32_t addr;
+	if (blocks == 0 || lba + blocks > DISK_BLOCK_NUM || LBAToIndex(lba) == INDEX_RESERVED || !LBAToAddress(lba, addr))
+		return nullptr;
+
+	for (uint32_t i = 1; i < blocks; i++) {
+		uint32_t next;
+		if (!LBAToAddress(lba + i, next) || next != addr + i * DISK_BLOCK_SIZE)
+			return nullptr;
+	}
+
+	return journal.Map(addr, blocks * DISK_BLOCK_SIZE);
+}
+
+bool Fat16::Flush() {
+	return device.Flush();
+}
+
+bool Fat16::Idle() {
+	// Whatever dates the host bumped while it was busy go out together
+	if (access_times.GetPolicy() == ACCESS_TIMES_LAZY && access_times.GetCount() > 0) {
+		PersistTimes();
+		return true;
+	}
+
+	if (!journal.WantsCompaction())
+		return false;
+
+	journal.Compact();
+	return true;
+}
+
+bool Fat16::PreErase() {
+	while (pre_erase_count > 0) {
+		uint32_t cluster = pre_erase[--pre_erase_count];
+		uint32_t lba = ClusterToLBA(cluster);
+		uint32_t addr, fat_addr;
+		if (!LBAToAddress(lba, addr) || FileMap::Holds(lba, DISK_CLUSTER_SIZE) ||
+				!LBAToAddress(INDEX_FAT_TABLE_1_START + cluster / (DISK_BLOCK_SIZE / 2), fat_addr))
+			continue;
+
+		// The host may have taken it again and not written it yet
+		uint16_t entry;
+		if (!journal.Read(fat_addr + cluster % (DISK_BLOCK_SIZE / 2) * 2, &entry, sizeof(entry)) || entry != 0)
+			continue;
+
+		// Never written since the last erase
+		uint8_t chunk[256];
+		bool blank = true;
+		for (uint32_t offset = 0; blank && offset < CLUSTER_BYTES; offset += sizeof(chunk)) {
+			if (!device.Read(addr + offset, chunk, sizeof(chunk)))
+				break;
+			for (uint32_t j = 0; blank && j < sizeof(chunk); j++)
+				blank = chunk[j] == 0xFF;
+		}
+		if (blank)
+			return true;
+
+		if (device.Erase(addr, CLUSTER_BYTES))
+			pre_erased++;
+		return true;
+	}
+
+	return false;
+}
+
+void Fat16::ForgetPreErase(const uint32_t lba, uint32_t blocks) {
+	uint32_t first = lba < INDEX_DATA_STARTS ? 0 : (lba - INDEX_DATA_STARTS) / DISK_CLUSTER_SIZE;
+	uint32_t last = (lba + blocks - 1 - INDEX_DATA_STARTS) / DISK_CLUSTER_SIZE;
+
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < pre_erase_count; i++) {
+		uint32_t index = pre_erase[i] - FIRST_CLUSTER;
+		if (index < first || index > last)
+			pre_erase[kept++] = pre_erase[i];
+	}
+	pre_erase_count = kept;
+}
+
+bool Fat16::Compact() {
+	bool ok = PersistTimes();
+	return journal.Compact() && ok;
+}
+
+void Fat16::CountFreeChange(uint32_t sector, const uint8_t* data) {
+	static uint8_t old[DISK_BLOCK_SIZE] STORAGE_ARENA;
+	if (GetBlock(INDEX_FAT_TABLE_1_START + sector, old, sizeof(old)) < 0) {
+		free_clusters = -1;
+		return;
+	}
+
+	const uint32_t per_sector = DISK_BLOCK_SIZE / 2;
+	uint32_t first = std::max(sector * per_sector, FIRST_CLUSTER);
+	uint32_t last = std::min((sector + 1) * per_sector - 1, GetLastCluster());
+
+	for (uint32_t cluster = first; cluster <= last; cluster++) {
+		uint32_t offset = (cluster % per_sector) * 2;
+		bool was_free = old[offset] == 0 && old[offset + 1] == 0;
+		bool is_free = data[offset] == 0 && data[offset + 1] == 0;
+		if (free_clusters >= 0)
+			free_clusters += (int32_t) is_free - (int32_t) was_free;
+
+		// Full: the rest get erased the usual way, when they are written
+		if (can_pre_erase && is_free && !was_free && pre_erase_count < PRE_ERASE_CLUSTERS)
+			pre_erase[pre_erase_count++] = (uint16_t) cluster;
+	}
+}
+
+uint32_t Fat16::AbsorbTimes(const uint32_t lba, const uint8_t* data, uint32_t blocks) {
+	if (lba >= INDEX_DATA_STARTS || lba + blocks <= INDEX_ROOT_DIRECTORY)
+		return 0;
+
+	uint32_t absorbed = 0;
+	for (uint32_t b = 0; b < blocks; b++) {
+		uint32_t addr;
+		if (LBAToIndex(lba + b) != INDEX_ROOT_DIRECTORY || !LBAToAddress(lba + b, addr))
+			continue;
+
+		uint32_t sector = lba + b - INDEX_ROOT_DIRECTORY;
+		if (!journal.Read(addr, root_sector, DISK_BLOCK_SIZE))
+			access_times.Forget(sector);
+		else if (access_times.Absorb(sector, root_sector, data + b * DISK_BLOCK_SIZE))
+			absorbed |= 1u << sector;
+	}
+
+	return absorbed;
+}
+
+bool Fat16::PersistTimes() {
+	if (access_times.GetPolicy() != ACCESS_TIMES_LAZY)
+		return true;
+
+	bool ok = true;
+	uint32_t sector;
+	device.BeginBatch();
+	while (ok && access_times.FirstHeld(sector)) {
+		uint32_t addr;
+		ok = LBAToAddress(INDEX_ROOT_DIRECTORY + sector, addr) && journal.Read(addr, root_sector, DISK_BLOCK_SIZE);
+		if (ok) {
+			access_times.Apply(sector, root_sector, DISK_BLOCK_SIZE);
+			ok = journal.Write(addr, root_sector, DISK_BLOCK_SIZE);
+		}
+
+		access_times.Forget(sector);
+		access_times.GetStats().persisted++;
+	}
+	device.EndBatch();
+
+	return ok;
+}
+
+void Fat16::SetDirectoryIndex(DirectoryIndex* index) {
+	directories = index;
+	if (directories != nullptr)
+		directories->Clear();
+}
+
+uint32_t Fat16::GetLastCluster() const {
+	uint32_t volume = (DISK_BLOCK_NUM - INDEX_DATA_STARTS) / DISK_CLUSTER_SIZE;
+	return FIRST_CLUSTER - 1 + std::min(layout.data_blocks / DISK_CLUSTER_SIZE, volume);
+}
+
+bool Fat16::HasLayoutStamp() {
+	// The data address changes with the geometry, so a volume written for
+	// another size of device does not pass either
+	const uint32_t stamp[] = { LAYOUT_MAGIC, LAYOUT_VERSION, layout.data };
+	uint32_t found[3];
+	if (!device.Read(layout.boot + LAYOUT_STAMP_OFFSET, found, LAYOUT_STAMP_SIZE))
+		return false;
+
+	return memcmp(found, stamp, LAYOUT_STAMP_SIZE) == 0;
+}
+
+bool Fat16::Remount() {
+	free_clusters = -1;
+	pre_erase_count = 0;
+	generation++;
+	FileMap::InvalidateAll();
+	access_times.Clear();
+	if (directories != nullptr)
+		directories->Clear();
+
+	if (!ready)
+		return false;
+
+	return journal.Attach(layout.fat, layout.root + ROOT_DIRECTORY_SIZE, layout.journal, layout.journal_size);
 }
 
 /**
@@ -213,28 +564,90 @@ constexpr uint32_t Fat16::LBAToIndex(const uint32_t lba) const {
 	return INDEX_RESERVED;
 }
 
-/**
- * Transform LBA address to flash address, offset included. Return 0 if LBA is
- * not on flash.
- */
-constexpr uint32_t Fat16::LBAToFlash(const uint32_t lba) const {
+bool Fat16::LBAToAddress(const uint32_t lba, uint32_t& addr) const {
+	if (lba >= DISK_BLOCK_NUM)
+		return false;
+
+	if (layout.linear) {
+		addr = lba * DISK_BLOCK_SIZE;
+		return true;
+	}
+
 	uint32_t index = LBAToIndex(lba);
+	uint32_t block = lba - index;
+
+	if (index == INDEX_RESERVED) {
+		addr = layout.boot;
+		return true;
+	}
+
+	if (index == INDEX_FAT_TABLE_1_START) {
+		// FAT #2 shares FAT #1's storage
+		block %= FAT_TABLE_SECTORS;
+		if (block >= layout.fat_blocks)
+			return false;
 
-	// Each block is 512, according to boot sector. Page size on
-	// Pico is 256.
-	uint32_t byte_offset = (lba - index) * FLASH_PAGE_SIZE * 2;
+		addr = layout.fat + block * DISK_BLOCK_SIZE;
+		return true;
+	}
 
-	if (index == INDEX_FAT_TABLE_1_START)
-		return FLASH_FAT + byte_offset;
+	if (index == INDEX_ROOT_DIRECTORY) {
+		addr = layout.root + block * DISK_BLOCK_SIZE;
+		return true;
+	}
 
-	if (index == INDEX_ROOT_DIRECTORY)
-		return FLASH_ROOT_DIRECTORY + byte_offset;
+	if (block >= layout.data_blocks)
+		return false;
 
-	if (index == INDEX_DATA_STARTS)
-		return FLASH_DATA_START + byte_offset;
+	addr = layout.data + block * DISK_BLOCK_SIZE;
+	return true;
+}
 
-	if (index == INDEX_RESERVED)
-		return FLASH_BOOT + byte_offset;
+/**
+ * Sections start on erase unit boundaries, so rewriting one never erases
+ * part of another.
+ */
+Fat16::Layout Fat16::ComputeLayout(const BlockDevice::Geometry& geometry) {
+	Layout layout;
+
+	// The journal only pays off where rewriting means erasing
+	uint32_t unit = std::max<uint32_t>(geometry.erase_size, DISK_BLOCK_SIZE);
+	uint32_t journal_size = 0;
+	if (geometry.erase_before_program && unit <= BlockDevice::MAX_ERASE_SIZE)
+		journal_size = MetadataJournal::LOG_UNITS * unit;
+
+	auto round_up = [unit](uint32_t bytes) {
+		return (bytes + unit - 1) / unit * unit;
+	};
+
+	if (geometry.size >= DISK_BLOCK_NUM * DISK_BLOCK_SIZE) {
+		layout.boot = 0;
+		layout.fat = INDEX_FAT_TABLE_1_START * DISK_BLOCK_SIZE;
+		layout.fat_blocks = FAT_TABLE_SECTORS;
+		layout.root = INDEX_ROOT_DIRECTORY * DISK_BLOCK_SIZE;
+		layout.data = INDEX_DATA_STARTS * DISK_BLOCK_SIZE;
+		layout.data_blocks = DISK_BLOCK_NUM - INDEX_DATA_STARTS;
+		layout.journal = round_up(DISK_BLOCK_NUM * DISK_BLOCK_SIZE);
+		layout.journal_size = geometry.size >= layout.journal + journal_size ? journal_size : 0;
+		layout.linear = true;
+		return layout;
+	}
 
-	return 0;
+	// Two bytes per cluster the device could hold, plus the two reserved
+	// entries at the front.
+	uint32_t cluster_bytes = DISK_CLUSTER_SIZE * DISK_BLOCK_SIZE;
+	uint32_t fat_bytes = round_up((geometry.size / cluster_bytes + 2) * 2);
+
+	layout.boot = 0;
+	layout.fat = round_up(DISK_BLOCK_SIZE);
+	layout.fat_blocks = std::min<uint32_t>(fat_bytes / DISK_BLOCK_SIZE, FAT_TABLE_SECTORS);
+	layout.root = layout.fat + fat_bytes;
+	layout.journal = layout.root + round_up(ROOT_DIRECTORY_SIZE);
+	layout.journal_size = journal_size;
+	layout.data = layout.journal + journal_size;
+
+	uint32_t data_bytes = geometry.size > layout.data ? geometry.size - layout.data : 0;
+	layout.data_blocks = data_bytes / cluster_bytes * DISK_CLUSTER_SIZE;
+	layout.linear = false;
+	return layout;
 }
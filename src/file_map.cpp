@@ -0,0 +1,151 @@
+#include "file_map.h"
+#include "fat.h"
+#include "fat_cursor.hpp"
+#include "msc_disk.h"
+#include <algorithm>
+
+// Shared by every map; nothing is kept in it between calls
+static FatCursor fat_cursor;
+
+bool FileMap::Map(uint16_t first_cluster, uint32_t size)
+{
+	Unmap();
+
+	// Staged FAT sectors go first, so the chain is the one the host last
+	// wrote
+	Fat16* fs = msc_disk_begin_local_read(0, Fat16::INDEX_DATA_STARTS * Fat16::DISK_BLOCK_SIZE);
+	if (!fs->IsReady() || !Register())
+		return false;
+
+	fat_cursor.Forget();
+	this->size = size;
+
+	uint16_t cluster = first_cluster;
+	for (uint32_t offset = 0; offset < size; offset += Fat16::CLUSTER_BYTES) {
+		if (cluster < Fat16::FIRST_CLUSTER || cluster > fs->GetLastCluster()) {
+			Unmap();
+			return false;
+		}
+
+		uint32_t length = std::min<uint32_t>(Fat16::CLUSTER_BYTES, size - offset);
+		uint32_t blocks = (length + Fat16::DISK_BLOCK_SIZE - 1) / Fat16::DISK_BLOCK_SIZE;
+		uint32_t lba = Fat16::ClusterToLBA(cluster);
+
+		msc_disk_begin_local_read(lba, blocks * Fat16::DISK_BLOCK_SIZE);
+		const uint8_t* data = fs->MapBlocks(lba, blocks);
+		if (data == nullptr) {
+			Unmap();
+			return false;
+		}
+
+		// Carries on the span before it, on the volume and on the device
+		Span* last = span_count > 0 ? &spans[span_count - 1] : nullptr;
+		if (last != nullptr && last->data + last->length == data &&
+				span_lbas[span_count - 1] + last->length / Fat16::DISK_BLOCK_SIZE == lba) {
+			last->length += length;
+		}
+		else if (span_count < MAX_SPANS) {
+			spans[span_count] = { data, length };
+			span_lbas[span_count] = lba;
+			span_count++;
+		}
+		else {
+			Unmap();
+			return false;
+		}
+
+		if (offset + length < size && !fat_cursor.Get(*fs, cluster, cluster)) {
+			Unmap();
+			return false;
+		}
+	}
+
+	mapped = true;
+	return true;
+}
+
+void FileMap::Unmap()
+{
+	for (FileMap*& map : maps) {
+		if (map == this)
+			map = nullptr;
+	}
+
+	span_count = 0;
+	size = 0;
+	mapped = false;
+	stale = false;
+	pinned = false;
+}
+
+bool FileMap::Pin()
+{
+	if (!IsValid())
+		return false;
+
+	// A staged write to the file is older than the pin. Committing it goes
+	// through Invalidate() like any other.
+	for (uint32_t i = 0; i < span_count; i++)
+		msc_disk_begin_local_read(span_lbas[i], spans[i].length);
+
+	pinned = IsValid();
+	return pinned;
+}
+
+void FileMap::Invalidate(uint32_t lba, uint32_t blocks)
+{
+	for (FileMap* map : maps) {
+		if (map != nullptr && map->Overlaps(lba, blocks)) {
+			map->stale = true;
+			map->pinned = false;
+		}
+	}
+}
+
+void FileMap::InvalidateAll()
+{
+	for (FileMap* map : maps) {
+		if (map != nullptr) {
+			map->stale = true;
+			map->pinned = false;
+		}
+	}
+}
+
+bool FileMap::Holds(uint32_t lba, uint32_t blocks)
+{
+	for (const FileMap* map : maps) {
+		if (map != nullptr && map->pinned && map->Overlaps(lba, blocks))
+			return true;
+	}
+
+	return false;
+}
+
+bool FileMap::Overlaps(uint32_t lba, uint32_t blocks) const
+{
+	for (uint32_t i = 0; i < span_count; i++) {
+		uint32_t span_blocks = (spans[i].length + Fat16::DISK_BLOCK_SIZE - 1) / Fat16::DISK_BLOCK_SIZE;
+		if (lba < span_lbas[i] + span_blocks && span_lbas[i] < lba + blocks)
+			return true;
+	}
+
+	return false;
+}
+
+bool FileMap::Register()
+{
+	FileMap** free_slot = nullptr;
+	for (FileMap*& map : maps) {
+		if (map == this)
+			return true;
+		if (map == nullptr && free_slot == nullptr)
+			free_slot = &map;
+	}
+
+	if (free_slot == nullptr)
+		return false;
+
+	*free_slot = this;
+	return true;
+}
@@ -0,0 +1,135 @@
+#include "file_writer.h"
+#include "fat_standard.hpp"
+#include "msc_disk.h"
+#include "util.h"
+#include <string.h>
+
+// The directory sector Finish() writes the entry into, used by one writer
+// at a time since they all run from the main loop
+static uint8_t directory_sector[Fat16::DISK_BLOCK_SIZE] STORAGE_ARENA;
+
+bool FileWriter::FindEntry(Fat16& fs, DirectoryIndex::Slot& found, fat::DirectoryEntry& match,
+		DirectoryIndex::Slot& free_slot)
+{
+	DirectoryIndex& directories = msc_disk_directories();
+	free_slot = DirectoryIndex::Slot();
+
+	if (!directories.Find(fs, dir, name, found, match))
+		return false;
+
+	return found.IsValid() || directories.FindFree(fs, dir, free_slot);
+}
+
+FileWriter::Status FileWriter::Begin(uint16_t dir, const char name[11], uint8_t attributes, uint32_t length,
+		uint16_t time, uint16_t date)
+{
+	this->dir = dir;
+	memcpy(this->name, name, sizeof(this->name));
+	this->attributes = attributes;
+	this->length = length;
+	this->time = time;
+	this->date = date;
+	first_cluster = 0;
+	received = 0;
+	fill = 0;
+	slot = DirectoryIndex::Slot();
+
+	if (!fat::IsValidShortName(name))
+		return WRITE_BAD_NAME;
+
+	Fat16* fs = msc_disk_begin_local_write();
+	if (!fs->IsReady())
+		return WRITE_NOT_READY;
+
+	fat_cursor.Forget();
+
+	DirectoryIndex::Slot found, free_slot;
+	fat::DirectoryEntry match;
+	if (!FindEntry(*fs, found, match, free_slot))
+		return WRITE_IO_ERROR;
+
+	if (found.IsValid() && (match.attributes & (fat::DirectoryEntryBuilder::DIRECTORY | fat::DirectoryEntryBuilder::VOLUME_LABEL)))
+		return WRITE_BAD_NAME;
+
+	slot = found.IsValid() ? found : free_slot;
+	if (!slot.IsValid())
+		return WRITE_DIRECTORY_FULL;
+
+	uint32_t clusters = (length + Fat16::CLUSTER_BYTES - 1) / Fat16::CLUSTER_BYTES;
+	if (clusters > 0 && !fat_cursor.FindFreeRun(*fs, clusters, first_cluster))
+		return WRITE_NO_SPACE;
+
+	return WRITE_OK;
+}
+
+bool FileWriter::StoreCluster()
+{
+	memset(buffer + fill, 0, Fat16::CLUSTER_BYTES - fill);
+	fill = 0;
+
+	uint32_t cluster = first_cluster + (received - 1) / Fat16::CLUSTER_BYTES;
+	Fat16* fs = msc_disk_begin_local_write();
+	return fs->WriteBlock(Fat16::ClusterToLBA(cluster), buffer, Fat16::CLUSTER_BYTES) >= 0;
+}
+
+FileWriter::Status FileWriter::Finish()
+{
+	Fat16* fs = msc_disk_begin_local_write();
+	uint32_t clusters = (length + Fat16::CLUSTER_BYTES - 1) / Fat16::CLUSTER_BYTES;
+
+	// The host may have written the FAT and directory since Begin()
+	fat_cursor.Forget();
+
+	DirectoryIndex::Slot found, free_slot;
+	fat::DirectoryEntry match;
+	if (!FindEntry(*fs, found, match, free_slot))
+		return WRITE_IO_ERROR;
+
+	slot = found.IsValid() ? found : free_slot;
+	if (!slot.IsValid())
+		return WRITE_DIRECTORY_FULL;
+
+	for (uint32_t i = 0; i < clusters; i++) {
+		uint16_t value;
+		if (!fat_cursor.Get(*fs, first_cluster + i, value))
+			return WRITE_IO_ERROR;
+		if (value != FatCursor::FREE)
+			return WRITE_CONFLICT;
+	}
+
+	for (uint32_t i = 0; i < clusters; i++) {
+		uint16_t next = i + 1 < clusters ? (uint16_t) (first_cluster + i + 1) : (uint16_t) FatCursor::END_OF_CHAIN;
+		if (!fat_cursor.Set(*fs, first_cluster + i, next))
+			return WRITE_IO_ERROR;
+	}
+
+	if (!fat_cursor.Store(*fs))
+		return WRITE_IO_ERROR;
+
+	if (fs->GetBlock(slot.lba, directory_sector, sizeof(directory_sector)) < 0)
+		return WRITE_IO_ERROR;
+
+	fat::DirectoryEntry* entry = (fat::DirectoryEntry*) directory_sector + slot.index;
+	uint16_t old_cluster = found.IsValid() ? entry->start_cluster : 0;
+
+	memset(entry, 0, sizeof(*entry));
+	memcpy(entry->name, name, 11);
+	entry->attributes = attributes;
+	entry->create_time = time;
+	entry->create_date = date;
+	entry->last_access_date = date;
+	entry->update_time = time;
+	entry->update_date = date;
+	entry->start_cluster = first_cluster;
+	entry->size = length;
+
+	if (fs->WriteBlock(slot.lba, directory_sector, sizeof(directory_sector)) < 0)
+		return WRITE_IO_ERROR;
+
+	// Then whatever the file replaced had
+	if (!fat_cursor.FreeChain(*fs, old_cluster))
+		return WRITE_IO_ERROR;
+
+	msc_disk_media_changed();
+	return WRITE_OK;
+}
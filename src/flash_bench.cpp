@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <string.h>
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+#include "hardware/structs/xip_ctrl.h"
+#include "pico/stdlib.h"
+#include "bench_format.h"
+#include "flash_session.h"
+#include "internal_flash.hpp"
+#include "sniff_crc.h"
+
+/**
+ * Firmware that times the Pico's own flash, so the host simulator's cost
+ * model (sim::CostModel in host/sim.h) can be fitted to a real chip rather
+ * than to the datasheet. Build with -DFLASH_BENCH=ON and flash
+ * flash_bench.uf2; at power on it runs once and prints over the UART (GP0,
+ * 115200 baud), in msc_bench's columns:
+ *
+ *   erase_4k, erase_32k, erase_64k   Sector and block erases (20h, 52h, D8h)
+ *   erase_4k_sliced                  A sector erase through FlashSession
+ *   program_256, program_1k, _4k     flash_range_program of that many bytes
+ *   xip_cold, xip_warm               memcpy through the XIP cache, flushed
+ *                                    first and read a second time
+ *   xip_uncached                     memcpy around the cache
+ *   xip_dma                          sniff_copy, as PicoFlash::Read does
+ *   xip_dma_bytes                    The same into a misaligned buffer, which
+ *                                    goes a byte per transfer; bad if its
+ *                                    CRC differs from the aligned one
+ *   modify_same, _erased, _dirty     BlockDevice::Modify of one disk block:
+ *                                    no change, into erased flash, and over
+ *                                    data, which rewrites the sector
+ *
+ * device_ms is the time the row's REPS operations took in all. Then come
+ * "# cost NAME VALUE" lines for the CostModel fields these figures give,
+ * which `msc_bench --cost FILE` reads from a capture of the output.
+ *
+ * Everything runs in the last BENCH_BYTES of flash, inside the volume, so
+ * the volume is gone afterwards: flash the main firmware again and hold
+ * GPIO17 at power on to format it.
+ */
+
+#define BENCH_BYTES (512 * 1024)
+#define BENCH_START (PICO_FLASH_SIZE_BYTES - BENCH_BYTES)
+#define REPS 8
+
+// Half the XIP cache, so a warm read still finds all of it there
+#define READ_BYTES (8 * 1024)
+
+// One disk block, what a single block WRITE10 asks of the device
+#define MODIFY_BYTES 512
+
+#define FLASH_BLOCK32_ERASE_CMD 0x52
+#define FLASH_BLOCK64_ERASE_CMD 0xD8
+
+static_assert(BENCH_START >= InternalFlash::PARTITION_START, "The bench must stay within the volume");
+static_assert(BENCH_START % (64 * 1024) == 0, "64kb block erases need an aligned start");
+
+struct Row {
+	const char* name;
+	uint32_t commands = 0;
+	uint32_t failed = 0;
+	uint32_t read_bytes = 0;
+	uint32_t write_bytes = 0;
+	uint32_t erases = 0;        // 4kb sectors
+	uint32_t programmed_bytes = 0;
+	uint64_t us = 0;
+	uint32_t bad = 0;           // Did not read back as written or erased
+	uint32_t exits = 0;         // Times XIP was left
+	uint32_t max_irq_us = 0;    // Longest stretch with interrupts off
+	uint32_t suspends = 0;      // Only for the sliced erase
+};
+
+/**
+ * The internal flash partition, counting what BlockDevice::Modify asks of
+ * it.
+ */
+class CountingFlash : public InternalFlash {
+public:
+	bool Read(uint32_t addr, void* buffer, uint32_t bufsize) override {
+		row->read_bytes += bufsize;
+		return InternalFlash::Read(addr, buffer, bufsize);
+	}
+
+	bool Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) override {
+		row->programmed_bytes += bufsize;
+		return InternalFlash::Program(addr, buffer, bufsize);
+	}
+
+	bool Erase(uint32_t addr, uint32_t bytes) override {
+		row->erases += bytes / FLASH_SECTOR_SIZE;
+		return InternalFlash::Erase(addr, bytes);
+	}
+
+	Row* row = nullptr;
+};
+
+static uint8_t pattern[FLASH_SECTOR_SIZE];
+// One word more, for the misaligned DMA read
+static uint8_t buffer[READ_BYTES + 4] __attribute__((aligned(4)));
+static CountingFlash device;
+
+static void fill_pattern(uint32_t seed)
+{
+	uint32_t x = seed * 2654435761u + 1;
+	for (uint8_t& byte : pattern) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		byte = (uint8_t) x;
+	}
+}
+
+static bool is_erased(uint32_t offset, uint32_t bytes)
+{
+	const uint8_t* data = (const uint8_t*) (XIP_BASE + offset);
+	for (uint32_t i = 0; i < bytes; i++) {
+		if (data[i] != 0xFF)
+			return false;
+	}
+
+	return true;
+}
+
+static void flush_xip_cache()
+{
+	// Reading it back holds the bus until the flush is done
+	xip_ctrl_hw->flush = 1;
+	(void) xip_ctrl_hw->flush;
+}
+
+/**
+ * Erase the bench area, and with `written` program the pattern over all
+ * of it, so erases have data to clear as they would on the volume.
+ */
+static void prepare(bool written)
+{
+	uint32_t ints = save_and_disable_interrupts();
+	flash_range_erase(BENCH_START, BENCH_BYTES);
+	if (written) {
+		for (uint32_t offset = 0; offset < BENCH_BYTES; offset += FLASH_SECTOR_SIZE)
+			flash_range_program(BENCH_START + offset, pattern, FLASH_SECTOR_SIZE);
+	}
+	restore_interrupts(ints);
+}
+
+/**
+ * One erase of `bytes` at `offset`, in blocks of `block_size` with
+ * `block_command` where they fit and sectors otherwise. flash_range_erase
+ * never uses 32kb blocks.
+ */
+static void time_erase(Row& row, uint32_t offset, uint32_t bytes, uint32_t block_size, uint8_t block_command)
+{
+	uint32_t ints = save_and_disable_interrupts();
+	uint32_t start = time_us_32();
+	flash_session_erase_blocks(offset, bytes, block_size, block_command);
+	uint32_t elapsed = time_us_32() - start;
+	restore_interrupts(ints);
+
+	row.commands++;
+	row.erases += bytes / FLASH_SECTOR_SIZE;
+	row.us += elapsed;
+	row.exits++;
+	row.max_irq_us = elapsed > row.max_irq_us ? elapsed : row.max_irq_us;
+	row.bad += !is_erased(offset, bytes);
+}
+
+static void time_program(Row& row, uint32_t offset, uint32_t bytes)
+{
+	uint32_t ints = save_and_disable_interrupts();
+	uint32_t start = time_us_32();
+	flash_range_program(offset, pattern, bytes);
+	uint32_t elapsed = time_us_32() - start;
+	restore_interrupts(ints);
+
+	row.commands++;
+	row.write_bytes += bytes;
+	row.programmed_bytes += bytes;
+	row.us += elapsed;
+	row.exits++;
+	row.max_irq_us = elapsed > row.max_irq_us ? elapsed : row.max_irq_us;
+	row.bad += memcmp((const void*) (XIP_BASE + offset), pattern, bytes) != 0;
+}
+
+enum ReadMode {
+	READ_COLD,
+	READ_WARM,
+	READ_UNCACHED,
+	READ_DMA,
+	READ_DMA_BYTES
+};
+
+static void time_read(Row& row, uint32_t offset, ReadMode mode)
+{
+	const uint8_t* cached = (const uint8_t*) (XIP_BASE + offset);
+	const uint8_t* uncached = (const uint8_t*) (XIP_NOCACHE_NOALLOC_BASE + offset);
+
+	if (mode == READ_WARM)
+		memcpy(buffer, cached, READ_BYTES);
+	else
+		flush_xip_cache();
+
+	uint8_t* out = mode == READ_DMA_BYTES ? buffer + 1 : buffer;
+	uint32_t crc = 0;
+	uint32_t start = time_us_32();
+	if (mode == READ_DMA || mode == READ_DMA_BYTES)
+		crc = sniff_copy(out, cached, READ_BYTES);
+	else
+		memcpy(out, mode == READ_UNCACHED ? uncached : cached, READ_BYTES);
+	uint32_t elapsed = time_us_32() - start;
+
+	row.commands++;
+	row.read_bytes += READ_BYTES;
+	row.us += elapsed;
+	row.bad += memcmp(out, uncached, READ_BYTES) != 0;
+
+	// Word and byte transfers have to agree on the checksum
+	if (mode == READ_DMA_BYTES)
+		row.bad += sniff_copy(buffer, cached, READ_BYTES) != crc;
+}
+
+static void time_modify(Row& row, uint32_t addr)
+{
+	FlashSession::Stats& stats = FlashSession::GetStats();
+	stats = FlashSession::Stats();
+	device.row = &row;
+
+	uint32_t start = time_us_32();
+	bool ok = device.Modify(addr, pattern, MODIFY_BYTES) && device.Flush();
+	uint32_t elapsed = time_us_32() - start;
+
+	device.row = nullptr;
+	row.commands++;
+	row.failed += !ok;
+	row.write_bytes += MODIFY_BYTES;
+	row.us += elapsed;
+	row.exits += stats.sessions;
+	row.max_irq_us = stats.max_irq_off_us > row.max_irq_us ? stats.max_irq_off_us : row.max_irq_us;
+	row.bad += memcmp(device.Map(addr, MODIFY_BYTES), pattern, MODIFY_BYTES) != 0;
+}
+
+static void print_row(const Row& row)
+{
+	double seconds = row.us / 1000000.0;
+	double payload_mb = (row.read_bytes + row.write_bytes) / (1024.0 * 1024.0);
+	printf(BENCH_ROW_FORMAT "\n", row.name, (unsigned long long) row.commands, (unsigned long long) row.failed,
+			row.read_bytes / 1024.0, row.write_bytes / 1024.0, (unsigned long long) row.erases,
+			row.programmed_bytes / 1024.0,
+			row.write_bytes > 0 ? (double) row.programmed_bytes / row.write_bytes : 0.0,
+			row.us / 1000.0, 0.0, seconds > 0 ? payload_mb / seconds : 0.0, row.bad,
+			(unsigned long long) row.exits, row.max_irq_us / 1000.0);
+}
+
+static double per_op(const Row& row)
+{
+	return row.commands > 0 ? (double) row.us / row.commands : 0;
+}
+
+int main()
+{
+	stdio_init_all();
+	sleep_ms(2000); // Time to open a terminal
+
+	printf("# flash_bench: %u reps per row, %ukb at 0x%X\n", REPS, BENCH_BYTES / 1024, BENCH_START);
+	printf("%s\n", BENCH_HEADER);
+
+	fill_pattern(1);
+
+	Row erase_4k = { "erase_4k" };
+	prepare(true);
+	for (uint32_t i = 0; i < REPS; i++)
+		time_erase(erase_4k, BENCH_START + i * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE, FLASH_BLOCK_SIZE, FLASH_BLOCK64_ERASE_CMD);
+	print_row(erase_4k);
+
+	Row erase_32k = { "erase_32k" };
+	prepare(true);
+	for (uint32_t i = 0; i < REPS; i++)
+		time_erase(erase_32k, BENCH_START + i * 32 * 1024, 32 * 1024, 32 * 1024, FLASH_BLOCK32_ERASE_CMD);
+	print_row(erase_32k);
+
+	Row erase_64k = { "erase_64k" };
+	prepare(true);
+	for (uint32_t i = 0; i < REPS; i++)
+		time_erase(erase_64k, BENCH_START + i * 64 * 1024, 64 * 1024, 64 * 1024, FLASH_BLOCK64_ERASE_CMD);
+	print_row(erase_64k);
+
+	// What the firmware does: one slice of FLASH_SLICE_US at a time,
+	// suspending the erase in between
+	Row erase_sliced = { "erase_4k_sliced" };
+	prepare(true);
+	for (uint32_t i = 0; i < REPS; i++) {
+		FlashSession::Stats& stats = FlashSession::GetStats();
+		stats = FlashSession::Stats();
+
+		uint32_t start = time_us_32();
+		PicoFlash::Erase(BENCH_START + i * FLASH_SECTOR_SIZE, 1);
+		erase_sliced.us += time_us_32() - start;
+
+		erase_sliced.commands++;
+		erase_sliced.erases++;
+		erase_sliced.exits += stats.sessions;
+		erase_sliced.suspends += stats.suspends;
+		if (stats.max_irq_off_us > erase_sliced.max_irq_us)
+			erase_sliced.max_irq_us = stats.max_irq_off_us;
+		erase_sliced.bad += !is_erased(BENCH_START + i * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+	}
+	print_row(erase_sliced);
+
+	// Each row in a 64kb block of its own
+	prepare(false);
+	Row program_256 = { "program_256" };
+	Row program_1k = { "program_1k" };
+	Row program_4k = { "program_4k" };
+	for (uint32_t i = 0; i < REPS; i++) {
+		time_program(program_256, BENCH_START + i * FLASH_SECTOR_SIZE, FLASH_PAGE_SIZE);
+		time_program(program_1k, BENCH_START + 64 * 1024 + i * FLASH_SECTOR_SIZE, 1024);
+		time_program(program_4k, BENCH_START + 128 * 1024 + i * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+	}
+	print_row(program_256);
+	print_row(program_1k);
+	print_row(program_4k);
+
+	Row xip_cold = { "xip_cold" };
+	Row xip_warm = { "xip_warm" };
+	Row xip_uncached = { "xip_uncached" };
+	Row xip_dma = { "xip_dma" };
+	Row xip_dma_bytes = { "xip_dma_bytes" };
+	prepare(true);
+	for (uint32_t i = 0; i < REPS; i++) {
+		uint32_t offset = BENCH_START + i * READ_BYTES;
+		time_read(xip_cold, offset, READ_COLD);
+		time_read(xip_warm, offset, READ_WARM);
+		time_read(xip_uncached, offset, READ_UNCACHED);
+		time_read(xip_dma, offset, READ_DMA);
+		time_read(xip_dma_bytes, offset, READ_DMA_BYTES);
+	}
+	print_row(xip_cold);
+	print_row(xip_warm);
+	print_row(xip_uncached);
+	print_row(xip_dma);
+	print_row(xip_dma_bytes);
+
+	// Same sectors all three times: first into erased flash, then the
+	// same data again, then other data over it
+	Row modify_erased = { "modify_erased" };
+	Row modify_same = { "modify_same" };
+	Row modify_dirty = { "modify_dirty" };
+	prepare(false);
+	for (uint32_t i = 0; i < REPS; i++)
+		time_modify(modify_erased, BENCH_START - InternalFlash::PARTITION_START + i * FLASH_SECTOR_SIZE);
+	for (uint32_t i = 0; i < REPS; i++)
+		time_modify(modify_same, BENCH_START - InternalFlash::PARTITION_START + i * FLASH_SECTOR_SIZE);
+	fill_pattern(2);
+	for (uint32_t i = 0; i < REPS; i++)
+		time_modify(modify_dirty, BENCH_START - InternalFlash::PARTITION_START + i * FLASH_SECTOR_SIZE);
+	print_row(modify_erased);
+	print_row(modify_same);
+	print_row(modify_dirty);
+
+	// Two program sizes give the per-page time and what each call pays on
+	// top of it: leaving XIP, the cache flush and boot2 on the way back
+	double page_us = (per_op(program_4k) - per_op(program_256)) / (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE - 1);
+	double op_us = per_op(program_256) - page_us;
+	double sector_us = per_op(erase_4k) - op_us;
+
+	printf("# cost %-22s %10.3f\n", "erase_sector_us", sector_us);
+	printf("# cost %-22s %10.3f\n", "program_page_us", page_us);
+	printf("# cost %-22s %10.3f\n", "flash_op_us", op_us);
+	if (erase_sliced.suspends > 0) {
+		double extra_exits = (double) erase_sliced.exits / erase_sliced.commands - 1;
+		double suspends = (double) erase_sliced.suspends / erase_sliced.commands;
+		double suspend_us = (per_op(erase_sliced) - per_op(erase_4k) - extra_exits * op_us) / suspends;
+		printf("# cost %-22s %10.3f\n", "erase_suspend_us", suspend_us);
+	}
+	printf("# cost %-22s %10.3f\n", "xip_read_us_per_byte", per_op(xip_dma) / READ_BYTES);
+	printf("# done\n");
+
+	while (true)
+		tight_loop_contents();
+}
@@ -0,0 +1,334 @@
+#include "flash_session.h"
+#include "sniff_crc.h"
+#include "string.h"
+#include <algorithm>
+#include "pico.h"
+#include "pico/time.h"
+#include <hardware/sync.h>
+
+#if PICO_ON_DEVICE
+#include "pico/bootrom.h"
+#include "hardware/structs/ioqspi.h"
+#include "hardware/structs/ssi.h"
+#endif
+
+static FlashSession::Stats stats;
+static bool batching = true;
+static uint32_t slice_budget_us = FLASH_SLICE_US;
+
+static void count_section(uint32_t elapsed, uint32_t ops) {
+	stats.sessions++;
+	stats.ops += ops;
+	stats.irq_off_us += elapsed;
+	if (elapsed > stats.max_irq_off_us)
+		stats.max_irq_off_us = elapsed;
+
+	uint32_t bucket = 0;
+	while (bucket + 1 < FlashSession::IRQ_OFF_BUCKETS && elapsed >= (1u << bucket))
+		bucket++;
+	stats.irq_off[bucket]++;
+}
+
+void FlashSession::Erase(uint32_t offset, uint32_t count) {
+	// One sector at a time, so interrupts stay off for one erase at most
+	for (uint32_t done = 0; done < count; done += FLASH_SECTOR_SIZE) {
+		if (op_count == MAX_OPS || erase_queued)
+			Run();
+
+		ops[op_count++] = { offset + done, nullptr, FLASH_SECTOR_SIZE };
+		erase_queued = true;
+	}
+}
+
+uint32_t FlashSession::Program(uint32_t offset, const uint8_t* data, uint32_t count) {
+	uint32_t crc = SNIFF_CRC_SEED;
+
+	while (count > 0) {
+		if (op_count == MAX_OPS || arena_used == ARENA_SIZE)
+			Run();
+
+		uint32_t chunk = ARENA_SIZE - arena_used < count ? ARENA_SIZE - arena_used : count;
+		crc = sniff_copy(arena + arena_used, data, chunk, crc);
+		ops[op_count++] = { offset, arena + arena_used, chunk };
+		arena_used += chunk;
+
+		offset += chunk;
+		data += chunk;
+		count -= chunk;
+	}
+
+	return crc;
+}
+
+void FlashSession::Run() {
+	while (Step());
+}
+
+bool FlashSession::Step() {
+	if (next < op_count) {
+		if (!batching) {
+			for (; next < op_count; next++)
+				Execute(ops + next, 1);
+		}
+		else if (slice_budget_us == 0) {
+			Execute(ops + next, op_count - next);
+			next = op_count;
+		}
+		else {
+			Slice();
+		}
+	}
+
+	if (next < op_count)
+		return true;
+
+	Reset();
+	return false;
+}
+
+void FlashSession::Reset() {
+	op_count = 0;
+	arena_used = 0;
+	erase_queued = false;
+	next = 0;
+	suspended = false;
+}
+
+FlashSession::Stats& FlashSession::GetStats() {
+	return stats;
+}
+
+void FlashSession::SetBatching(bool enabled) {
+	batching = enabled;
+}
+
+/**
+ * Only change it with nothing queued, so no op is left halfway.
+ */
+void FlashSession::SetSliceBudget(uint32_t us) {
+	slice_budget_us = us;
+}
+
+uint32_t FlashSession::GetSliceBudget() {
+	return slice_budget_us;
+}
+
+void FlashSession::Execute(const Op* first, size_t count) {
+	uint32_t start = time_us_32();
+	uint32_t ints = save_and_disable_interrupts();
+	flash_session_execute(first, count);
+	restore_interrupts(ints);
+	count_section(time_us_32() - start, count);
+}
+
+void FlashSession::Slice() {
+	uint32_t ops_done = 0;
+	uint32_t start = time_us_32();
+	uint32_t ints = save_and_disable_interrupts();
+
+	// An erase only ever starts a slice, and gets all of it but what
+	// suspending takes
+	uint32_t planned = SUSPEND_US;
+	if (ops[next].data == nullptr) {
+		uint32_t budget = slice_budget_us > SUSPEND_US ? slice_budget_us - SUSPEND_US : 1;
+		suspended = !flash_session_erase_slice(ops[next].offset, suspended, FLASH_ERASE_SUSPEND ? budget : UINT32_MAX);
+		if (suspended) {
+			stats.suspends++;
+		}
+		else {
+			next++;
+			ops_done++;
+		}
+		planned += time_us_32() - start;
+	}
+
+	// Then the programs after it: whole ones while they fit, then the
+	// pages of the next one that do. A slice always gets a page done.
+	uint32_t first = next;
+	uint32_t split = 0;
+	while (!suspended && next < op_count && ops[next].data != nullptr) {
+		uint32_t fit = planned < slice_budget_us ? (slice_budget_us - planned) / PAGE_PROGRAM_US : 0;
+		if (fit == 0 && (next > first || ops_done > 0))
+			break;
+
+		uint32_t pages = ops[next].count / FLASH_PAGE_SIZE;
+		if (pages > std::max<uint32_t>(fit, 1)) {
+			split = std::max<uint32_t>(fit, 1) * FLASH_PAGE_SIZE;
+			break;
+		}
+
+		planned += pages * PAGE_PROGRAM_US;
+		next++;
+		ops_done++;
+	}
+
+	// The op that is split is cut short for the call, and what is left of
+	// it stays queued
+	if (split > 0) {
+		Op& op = ops[next];
+		uint32_t count = op.count;
+		op.count = split;
+		flash_session_execute(ops + first, next - first + 1);
+		op = { op.offset + split, op.data + split, count - split };
+	}
+	else if (next > first) {
+		flash_session_execute(ops + first, next - first);
+	}
+
+	restore_interrupts(ints);
+	count_section(time_us_32() - start, ops_done);
+}
+
+#if PICO_ON_DEVICE
+
+// What flash.c in the SDK does around each call, once per session. The
+// second stage bootloader is copied to RAM while XIP still works, and
+// called again afterwards to put the flash back into fast XIP mode.
+#define BOOT2_SIZE_WORDS 64
+#define FLASH_BLOCK_ERASE_CMD 0xD8
+
+// For erasing a sector in slices, sent to the chip directly
+#define FLASH_WRITE_ENABLE_CMD 0x06
+#define FLASH_SECTOR_ERASE_CMD 0x20
+#define FLASH_READ_STATUS_CMD  0x05
+#define FLASH_SUSPEND_CMD      0x75
+#define FLASH_RESUME_CMD       0x7A
+#define FLASH_STATUS_BUSY      0x01
+
+static uint32_t boot2_copyout[BOOT2_SIZE_WORDS];
+static bool boot2_copyout_valid = false;
+
+static void __no_inline_not_in_flash_func(flash_init_boot2_copyout)() {
+	if (boot2_copyout_valid)
+		return;
+
+	for (int i = 0; i < BOOT2_SIZE_WORDS; i++)
+		boot2_copyout[i] = ((uint32_t*) XIP_BASE)[i];
+	__compiler_memory_barrier();
+	boot2_copyout_valid = true;
+}
+
+static void __no_inline_not_in_flash_func(flash_enable_xip_via_boot2)() {
+	((void (*)(void)) ((intptr_t) boot2_copyout + 1))();
+}
+
+/**
+ * flash_session_execute(), with erases that line up with `block_size`
+ * done a block at a time with `block_command` and the rest a sector at a
+ * time, as the boot ROM does it.
+ */
+static void __no_inline_not_in_flash_func(flash_session_run)(const FlashSession::Op* ops, size_t count,
+		uint32_t block_size, uint8_t block_command) {
+	rom_connect_internal_flash_fn connect_internal_flash = (rom_connect_internal_flash_fn) rom_func_lookup_inline(ROM_FUNC_CONNECT_INTERNAL_FLASH);
+	rom_flash_exit_xip_fn flash_exit_xip = (rom_flash_exit_xip_fn) rom_func_lookup_inline(ROM_FUNC_FLASH_EXIT_XIP);
+	rom_flash_range_erase_fn range_erase = (rom_flash_range_erase_fn) rom_func_lookup_inline(ROM_FUNC_FLASH_RANGE_ERASE);
+	rom_flash_range_program_fn range_program = (rom_flash_range_program_fn) rom_func_lookup_inline(ROM_FUNC_FLASH_RANGE_PROGRAM);
+	rom_flash_flush_cache_fn flash_flush_cache = (rom_flash_flush_cache_fn) rom_func_lookup_inline(ROM_FUNC_FLASH_FLUSH_CACHE);
+
+	flash_init_boot2_copyout();
+	__compiler_memory_barrier();
+
+	connect_internal_flash();
+	flash_exit_xip();
+
+	for (size_t i = 0; i < count; i++) {
+		if (ops[i].data == nullptr)
+			range_erase(ops[i].offset, ops[i].count, block_size, block_command);
+		else
+			range_program(ops[i].offset, ops[i].data, ops[i].count);
+	}
+
+	// Also removes the CSn IO force
+	flash_flush_cache();
+	flash_enable_xip_via_boot2();
+}
+
+void __no_inline_not_in_flash_func(flash_session_execute)(const FlashSession::Op* ops, size_t count) {
+	flash_session_run(ops, count, FLASH_BLOCK_SIZE, FLASH_BLOCK_ERASE_CMD);
+}
+
+void __no_inline_not_in_flash_func(flash_session_erase_blocks)(uint32_t offset, uint32_t count,
+		uint32_t block_size, uint8_t block_command) {
+	FlashSession::Op op = { offset, nullptr, count };
+	flash_session_run(&op, 1, block_size, block_command);
+}
+
+static void __no_inline_not_in_flash_func(flash_cs_force)(bool high) {
+	uint32_t value = high ? IO_QSPI_GPIO_QSPI_SS_CTRL_OUTOVER_VALUE_HIGH : IO_QSPI_GPIO_QSPI_SS_CTRL_OUTOVER_VALUE_LOW;
+	hw_write_masked(&ioqspi_hw->io[1].ctrl, value << IO_QSPI_GPIO_QSPI_SS_CTRL_OUTOVER_LSB, IO_QSPI_GPIO_QSPI_SS_CTRL_OUTOVER_BITS);
+}
+
+/**
+ * One command to the chip through the SSI with XIP off, the way the SDK's
+ * flash_do_cmd() sends it. `rx` may be nullptr.
+ */
+static void __no_inline_not_in_flash_func(flash_command)(const uint8_t* tx, uint8_t* rx, size_t count) {
+	// Never more in flight than the RX FIFO holds
+	const size_t max_in_flight = 16 - 2;
+	size_t tx_left = count;
+	size_t rx_left = count;
+
+	flash_cs_force(false);
+	while (tx_left > 0 || rx_left > 0) {
+		uint32_t flags = ssi_hw->sr;
+		if ((flags & SSI_SR_TFNF_BITS) && tx_left > 0 && rx_left - tx_left < max_in_flight) {
+			ssi_hw->dr0 = *tx++;
+			tx_left--;
+		}
+		if ((flags & SSI_SR_RFNE_BITS) && rx_left > 0) {
+			uint8_t byte = (uint8_t) ssi_hw->dr0;
+			if (rx != nullptr)
+				*rx++ = byte;
+			rx_left--;
+		}
+	}
+	flash_cs_force(true);
+}
+
+static bool __no_inline_not_in_flash_func(flash_busy)() {
+	uint8_t tx[2] = { FLASH_READ_STATUS_CMD, 0 };
+	uint8_t rx[2];
+	flash_command(tx, rx, sizeof(tx));
+	return rx[1] & FLASH_STATUS_BUSY;
+}
+
+bool __no_inline_not_in_flash_func(flash_session_erase_slice)(uint32_t offset, bool resume, uint32_t budget_us) {
+	rom_connect_internal_flash_fn connect_internal_flash = (rom_connect_internal_flash_fn) rom_func_lookup_inline(ROM_FUNC_CONNECT_INTERNAL_FLASH);
+	rom_flash_exit_xip_fn flash_exit_xip = (rom_flash_exit_xip_fn) rom_func_lookup_inline(ROM_FUNC_FLASH_EXIT_XIP);
+	rom_flash_flush_cache_fn flash_flush_cache = (rom_flash_flush_cache_fn) rom_func_lookup_inline(ROM_FUNC_FLASH_FLUSH_CACHE);
+
+	flash_init_boot2_copyout();
+	__compiler_memory_barrier();
+
+	connect_internal_flash();
+	flash_exit_xip();
+
+	if (resume) {
+		uint8_t command = FLASH_RESUME_CMD;
+		flash_command(&command, nullptr, 1);
+	}
+	else {
+		uint8_t enable = FLASH_WRITE_ENABLE_CMD;
+		uint8_t erase[4] = { FLASH_SECTOR_ERASE_CMD, (uint8_t) (offset >> 16), (uint8_t) (offset >> 8), (uint8_t) offset };
+		flash_command(&enable, nullptr, 1);
+		flash_command(erase, nullptr, sizeof(erase));
+	}
+
+	uint32_t start = time_us_32();
+	bool busy;
+	while ((busy = flash_busy()) && time_us_32() - start < budget_us);
+
+	// BUSY clears once the erase has stopped, within tSUS. If it finished
+	// just before, the suspend is ignored and so is the next resume.
+	if (busy) {
+		uint8_t command = FLASH_SUSPEND_CMD;
+		flash_command(&command, nullptr, 1);
+		while (flash_busy());
+	}
+
+	flash_flush_cache();
+	flash_enable_xip_via_boot2();
+	return !busy;
+}
+
+#endif
@@ -0,0 +1,703 @@
+#include "http_server.h"
+#include "append_log.h"
+#include "directory_index.h"
+#include "fat.h"
+#include "fat_standard.hpp"
+#include "fat_cursor.hpp"
+#include "msc_disk.h"
+#include "storage_backend.h"
+#include "util.h"
+#include "lwip/tcp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+
+#define MAX_CONNECTIONS 2
+#define MAX_REQUEST 512   // Request line and headers; anything longer is refused
+#define MAX_HEADER 256
+
+// Most a task call reads before it lets the rest of the main loop run
+#define STEP_BYTES (4 * Fat16::DISK_BLOCK_SIZE)
+
+// lwIP polls every POLL_INTERVAL half seconds; a connection that gets
+// nowhere for MAX_IDLE_POLLS of them has gone away
+#define POLL_INTERVAL 4
+#define MAX_IDLE_POLLS 5
+
+// Everything from the FAT to the end of the root directory
+#define METADATA_BYTES (Fat16::INDEX_DATA_STARTS * Fat16::DISK_BLOCK_SIZE)
+
+// The whole volume, for when a subdirectory could be anywhere in it
+#define VOLUME_BYTES (Fat16::DISK_BLOCK_NUM * Fat16::DISK_BLOCK_SIZE)
+
+enum ConnectionState {
+	STATE_FREE,
+	STATE_REQUEST, // Receiving the request
+	STATE_HEADER,  // Sending the status line and headers
+	STATE_FILE,    // Sending [offset, end) of the file
+	STATE_LISTING, // Sending listing_dir from entry listing_entry on
+	STATE_DONE,    // All queued
+	STATE_CLOSING  // lwIP had no room to close yet
+};
+
+struct Connection {
+	tcp_pcb* pcb;
+	ConnectionState state;
+	ConnectionState body;     // What follows the header
+	uint8_t idle_polls;
+
+	char request[MAX_REQUEST];
+	uint32_t request_bytes;
+	bool request_complete;
+
+	char header[MAX_HEADER];
+	uint32_t header_bytes;
+	uint32_t header_sent;
+
+	// The file as its entry was when the response started
+	char name[11];
+	uint32_t entry_lba;
+	uint32_t entry_index;
+	uint16_t first_cluster;
+
+	uint32_t offset;          // Next byte of the file to send
+	uint32_t end;             // One past the last
+	uint16_t cluster;         // The one holding `offset`
+	uint32_t cluster_offset;  // Where in the file `cluster` starts
+	uint32_t generation;      // Fat16's when the chain was walked
+
+	uint16_t listing_dir;     // First cluster, DirectoryIndex::ROOT for the root
+	uint32_t listing_entry;
+};
+
+static Connection connections[MAX_CONNECTIONS];
+static tcp_pcb* listener = nullptr;
+
+// Shared by every connection; nothing is kept in it between task calls
+static uint8_t sector[Fat16::DISK_BLOCK_SIZE] STORAGE_ARENA;
+
+static FatCursor fat_cursor;
+static uint32_t fat_cursor_generation = 0;
+
+static err_t on_receive(void* arg, tcp_pcb* pcb, pbuf* p, err_t err);
+static err_t on_sent(void* arg, tcp_pcb* pcb, uint16_t len);
+static err_t on_poll(void* arg, tcp_pcb* pcb);
+static void on_error(void* arg, err_t err);
+
+/**
+ * Reset the connection. Done with the callbacks off, so lwIP does not call
+ * back into a slot already given up.
+ */
+static void drop(Connection& c)
+{
+	tcp_pcb* pcb = c.pcb;
+	c.state = STATE_FREE;
+	c.pcb = nullptr;
+
+	if (pcb != nullptr) {
+		tcp_arg(pcb, nullptr);
+		tcp_recv(pcb, nullptr);
+		tcp_sent(pcb, nullptr);
+		tcp_err(pcb, nullptr);
+		tcp_poll(pcb, nullptr, 0);
+		tcp_abort(pcb);
+	}
+}
+
+/**
+ * Close once everything queued is sent. lwIP may have no room for the FIN
+ * yet, in which case the task and the poll callback try again.
+ */
+static void finish(Connection& c)
+{
+	tcp_pcb* pcb = c.pcb;
+	tcp_arg(pcb, nullptr);
+	tcp_recv(pcb, nullptr);
+	tcp_sent(pcb, nullptr);
+	tcp_err(pcb, nullptr);
+	tcp_poll(pcb, nullptr, 0);
+
+	if (tcp_close(pcb) == ERR_OK) {
+		c.state = STATE_FREE;
+		c.pcb = nullptr;
+		return;
+	}
+
+	c.state = STATE_CLOSING;
+	tcp_arg(pcb, &c);
+	tcp_err(pcb, on_error);
+	tcp_poll(pcb, on_poll, POLL_INTERVAL);
+}
+
+static err_t on_accept(void* arg, tcp_pcb* pcb, err_t err)
+{
+	(void) arg;
+	if (err != ERR_OK || pcb == nullptr)
+		return ERR_VAL;
+
+	Connection* c = nullptr;
+	for (Connection& slot : connections) {
+		if (slot.state == STATE_FREE) {
+			c = &slot;
+			break;
+		}
+	}
+
+	// Refused rather than queued: a client retries, and a slot holds
+	// half a kilobyte of request
+	if (c == nullptr) {
+		tcp_abort(pcb);
+		return ERR_ABRT;
+	}
+
+	c->pcb = pcb;
+	c->state = STATE_REQUEST;
+	c->idle_polls = 0;
+	c->request_bytes = 0;
+	c->request_complete = false;
+
+	tcp_arg(pcb, c);
+	tcp_recv(pcb, on_receive);
+	tcp_sent(pcb, on_sent);
+	tcp_err(pcb, on_error);
+	tcp_poll(pcb, on_poll, POLL_INTERVAL);
+	return ERR_OK;
+}
+
+static err_t on_receive(void* arg, tcp_pcb* pcb, pbuf* p, err_t err)
+{
+	Connection* c = (Connection*) arg;
+
+	// The client is done sending. Without a whole request there is nothing
+	// to answer; otherwise the response still goes out.
+	if (p == nullptr) {
+		if (c->state == STATE_REQUEST && !c->request_complete)
+			finish(*c);
+		return ERR_OK;
+	}
+
+	if (err != ERR_OK) {
+		pbuf_free(p);
+		return err;
+	}
+
+	tcp_recved(pcb, p->tot_len);
+	c->idle_polls = 0;
+
+	// Anything after the request is ignored, one request per connection
+	if (c->state == STATE_REQUEST && !c->request_complete) {
+		uint32_t room = MAX_REQUEST - 1 - c->request_bytes;
+		c->request_bytes += pbuf_copy_partial(p, c->request + c->request_bytes, std::min<uint32_t>(room, p->tot_len), 0);
+		c->request[c->request_bytes] = 0;
+		c->request_complete = strstr(c->request, "\r\n\r\n") != nullptr || c->request_bytes == MAX_REQUEST - 1;
+	}
+
+	pbuf_free(p);
+	return ERR_OK;
+}
+
+static err_t on_sent(void* arg, tcp_pcb* pcb, uint16_t len)
+{
+	(void) pcb;
+	(void) len;
+	((Connection*) arg)->idle_polls = 0;
+	return ERR_OK;
+}
+
+static err_t on_poll(void* arg, tcp_pcb* pcb)
+{
+	(void) pcb;
+	Connection& c = *(Connection*) arg;
+
+	if (c.state == STATE_CLOSING) {
+		finish(c);
+		return ERR_OK;
+	}
+
+	if (++c.idle_polls > MAX_IDLE_POLLS) {
+		drop(c);
+		return ERR_ABRT;
+	}
+
+	return ERR_OK;
+}
+
+static void on_error(void* arg, err_t err)
+{
+	(void) err;
+
+	// lwIP has freed the pcb already
+	Connection* c = (Connection*) arg;
+	if (c != nullptr) {
+		c->state = STATE_FREE;
+		c->pcb = nullptr;
+	}
+}
+
+//--------------------------------------------------------------------+
+// Reading the volume
+//--------------------------------------------------------------------+
+
+/**
+ * Read one block as the host would see it, with anything it has staged
+ * for the block committed first.
+ */
+static bool read_block(uint32_t lba, uint8_t* buffer)
+{
+	Fat16* fs = msc_disk_begin_local_read(lba, Fat16::DISK_BLOCK_SIZE);
+	if (fs->GetBlock(lba, buffer, Fat16::DISK_BLOCK_SIZE) < 0)
+		return false;
+
+	append_log_patch(lba, buffer, Fat16::DISK_BLOCK_SIZE);
+	return true;
+}
+
+/**
+ * Look `path` ("NOTES.TXT", "LOGS/DAY1/NOTES.TXT") up from the root
+ * directory, through the directory index, with the entry as it would read
+ * over USB in `found`. With `directory` set the path names a directory
+ * and may end in '/'; "" is the root, which has no entry. False if it is
+ * not there or could not be read.
+ */
+static bool find_path(const char* path, uint32_t length, bool directory, Connection& c, fat::DirectoryEntry& found)
+{
+	if (directory && length > 0 && path[length - 1] == '/')
+		length--;
+
+	// A subdirectory can be in any cluster, so everything staged goes in
+	// before one is looked through
+	bool nested = memchr(path, '/', length) != nullptr;
+	Fat16* fs = msc_disk_begin_local_read(0, directory || nested ? VOLUME_BYTES : METADATA_BYTES);
+	DirectoryIndex& directories = msc_disk_directories();
+
+	uint16_t dir = DirectoryIndex::ROOT;
+	memset(&found, 0, sizeof(found));
+	found.attributes = fat::DirectoryEntryBuilder::DIRECTORY;
+
+	uint32_t start = 0;
+	while (start < length) {
+		const char* slash = (const char*) memchr(path + start, '/', length - start);
+		uint32_t end = slash != nullptr ? (uint32_t) (slash - path) : length;
+
+		DirectoryIndex::Slot slot;
+		if (!(found.attributes & fat::DirectoryEntryBuilder::DIRECTORY) ||
+				!fat::ToShortName(path + start, end - start, c.name) || !directories.Find(*fs, dir, c.name, slot, found) ||
+				!slot.IsValid() || !read_block(slot.lba, sector))
+			return false;
+
+		found = ((const fat::DirectoryEntry*) sector)[slot.index];
+		c.entry_lba = slot.lba;
+		c.entry_index = slot.index;
+		dir = found.start_cluster;
+		start = end + 1;
+	}
+
+	return directory == ((found.attributes & fat::DirectoryEntryBuilder::DIRECTORY) != 0);
+}
+
+/**
+ * Bring c.cluster up to the one holding c.offset. If the volume changed
+ * since the chain was walked, walk it again from the directory entry,
+ * which must still name the same file, at least as long as the response
+ * said. False if it does not, or the chain is broken.
+ */
+static bool locate(Connection& c, Fat16& fs)
+{
+	if (fat_cursor_generation != Fat16::GetGeneration()) {
+		fat_cursor.Forget();
+		fat_cursor_generation = Fat16::GetGeneration();
+	}
+
+	if (c.generation != Fat16::GetGeneration()) {
+		if (!read_block(c.entry_lba, sector))
+			return false;
+
+		const fat::DirectoryEntry& entry = ((const fat::DirectoryEntry*) sector)[c.entry_index];
+		if (memcmp(entry.name, c.name, 11) != 0 || entry.start_cluster != c.first_cluster || entry.size < c.end)
+			return false;
+
+		c.cluster = c.first_cluster;
+		c.cluster_offset = 0;
+		c.generation = Fat16::GetGeneration();
+	}
+
+	while (c.offset >= c.cluster_offset + Fat16::CLUSTER_BYTES) {
+		uint16_t next;
+		if (!fat_cursor.Get(fs, c.cluster, next) || next < Fat16::FIRST_CLUSTER || next > fs.GetLastCluster())
+			return false;
+
+		c.cluster = next;
+		c.cluster_offset += Fat16::CLUSTER_BYTES;
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------+
+// Requests
+//--------------------------------------------------------------------+
+
+enum RangeResult {
+	RANGE_NONE,          // Send the whole file
+	RANGE_OK,
+	RANGE_UNSATISFIABLE
+};
+
+/**
+ * The value of header `name` in the request, or nullptr.
+ */
+static const char* find_header(const char* request, const char* name)
+{
+	uint32_t length = strlen(name);
+	for (const char* line = strstr(request, "\r\n"); line != nullptr; line = strstr(line + 2, "\r\n")) {
+		if (strncasecmp(line + 2, name, length) == 0 && line[2 + length] == ':') {
+			const char* value = line + 3 + length;
+			while (*value == ' ')
+				value++;
+			return value;
+		}
+	}
+
+	return nullptr;
+}
+
+/**
+ * A single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range.
+ * Anything else is ignored and the whole file sent, as RFC 9110 allows.
+ */
+static RangeResult parse_range(const char* value, uint32_t size, uint32_t& first, uint32_t& last)
+{
+	if (value == nullptr || strncmp(value, "bytes=", 6) != 0)
+		return RANGE_NONE;
+
+	const char* p = value + 6;
+	char* stop;
+	bool has_first = *p >= '0' && *p <= '9';
+	unsigned long a = has_first ? strtoul(p, &stop, 10) : 0;
+	if (has_first)
+		p = stop;
+	if (*p++ != '-')
+		return RANGE_NONE;
+
+	bool has_last = *p >= '0' && *p <= '9';
+	unsigned long b = has_last ? strtoul(p, &stop, 10) : 0;
+	if (has_last)
+		p = stop;
+	if (*p != '\r' || (!has_first && !has_last) || (has_first && has_last && b < a))
+		return RANGE_NONE;
+
+	// The last `b` bytes
+	if (!has_first) {
+		if (b == 0 || size == 0)
+			return RANGE_UNSATISFIABLE;
+		first = b >= size ? 0 : size - (uint32_t) b;
+		last = size - 1;
+		return RANGE_OK;
+	}
+
+	if (a >= size)
+		return RANGE_UNSATISFIABLE;
+
+	first = (uint32_t) a;
+	last = has_last && b < size ? (uint32_t) b : size - 1;
+	return RANGE_OK;
+}
+
+static void respond_error(Connection& c, const char* status)
+{
+	c.header_bytes = snprintf(c.header, sizeof(c.header),
+			"HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %u\r\nConnection: close\r\n\r\n%s\n",
+			status, (unsigned) strlen(status) + 1, status);
+	c.header_sent = 0;
+	c.state = STATE_HEADER;
+	c.body = STATE_DONE;
+}
+
+/**
+ * Work out the response to a complete request: its header, and what is
+ * sent after it.
+ */
+static void respond(Connection& c)
+{
+	const char* request = c.request;
+	if (strstr(request, "\r\n\r\n") == nullptr) {
+		respond_error(c, "431 Request Header Fields Too Large");
+		return;
+	}
+
+	bool head = strncmp(request, "HEAD ", 5) == 0;
+	if (!head && strncmp(request, "GET ", 4) != 0) {
+		respond_error(c, "501 Not Implemented");
+		return;
+	}
+
+	const char* path = request + (head ? 5 : 4);
+	const char* path_end = strchr(path, ' ');
+	if (path_end == nullptr || path[0] != '/') {
+		respond_error(c, "400 Bad Request");
+		return;
+	}
+
+	Fat16* fs = msc_disk_begin_local_read(Fat16::INDEX_ROOT_DIRECTORY, Fat16::ROOT_DIRECTORY_SIZE);
+	if (!fs->IsReady()) {
+		respond_error(c, "503 Service Unavailable");
+		return;
+	}
+
+	// "/" and "/DIR/" are listings, anything else a file
+	bool listing = path_end[-1] == '/';
+	fat::DirectoryEntry entry;
+	if (!find_path(path + 1, path_end - path - 1, listing, c, entry)) {
+		respond_error(c, "404 Not Found");
+		return;
+	}
+
+	c.header_sent = 0;
+	c.state = STATE_HEADER;
+
+	if (listing) {
+		c.header_bytes = snprintf(c.header, sizeof(c.header),
+				"HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n");
+		c.body = head ? STATE_DONE : STATE_LISTING;
+		c.listing_dir = entry.start_cluster;
+		c.listing_entry = 0;
+		return;
+	}
+
+	uint32_t first = 0;
+	uint32_t last = entry.size - 1;
+	RangeResult range = parse_range(find_header(request, "Range"), entry.size, first, last);
+	if (range == RANGE_UNSATISFIABLE) {
+		c.header_bytes = snprintf(c.header, sizeof(c.header),
+				"HTTP/1.0 416 Range Not Satisfiable\r\nContent-Range: bytes */%u\r\nContent-Length: 0\r\n"
+				"Connection: close\r\n\r\n", (unsigned) entry.size);
+		c.body = STATE_DONE;
+		return;
+	}
+
+	uint32_t length = entry.size ? last - first + 1 : 0;
+	if (range == RANGE_OK) {
+		c.header_bytes = snprintf(c.header, sizeof(c.header),
+				"HTTP/1.0 206 Partial Content\r\nContent-Type: application/octet-stream\r\nContent-Length: %u\r\n"
+				"Content-Range: bytes %u-%u/%u\r\nAccept-Ranges: bytes\r\nConnection: close\r\n\r\n",
+				(unsigned) length, (unsigned) first, (unsigned) last, (unsigned) entry.size);
+	}
+	else {
+		c.header_bytes = snprintf(c.header, sizeof(c.header),
+				"HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %u\r\n"
+				"Accept-Ranges: bytes\r\nConnection: close\r\n\r\n", (unsigned) length);
+	}
+
+	c.body = head || length == 0 ? STATE_DONE : STATE_FILE;
+	c.first_cluster = entry.start_cluster;
+	c.offset = first;
+	c.end = first + length;
+	c.cluster = entry.start_cluster;
+	c.cluster_offset = 0;
+	c.generation = Fat16::GetGeneration();
+}
+
+//--------------------------------------------------------------------+
+// Responses
+//--------------------------------------------------------------------+
+
+/**
+ * Queue as much of the header as lwIP has room for. The connection is
+ * dropped if it is gone.
+ */
+static bool send_header(Connection& c)
+{
+	uint32_t length = std::min<uint32_t>(c.header_bytes - c.header_sent, tcp_sndbuf(c.pcb));
+	if (length == 0)
+		return false;
+
+	err_t err = tcp_write(c.pcb, c.header + c.header_sent, length, TCP_WRITE_FLAG_COPY);
+	if (err == ERR_MEM)
+		return false;
+	if (err != ERR_OK) {
+		drop(c);
+		return true;
+	}
+
+	c.header_sent += length;
+	if (c.header_sent == c.header_bytes)
+		c.state = c.body;
+	return true;
+}
+
+/**
+ * Queue the next sectors of the file, as many as lwIP has room for up to
+ * STEP_BYTES. Returns false when it could not go on, with why in `broken`.
+ */
+static bool send_file(Connection& c, bool& broken)
+{
+	broken = false;
+	uint32_t queued = 0;
+
+	while (c.offset < c.end && queued < STEP_BYTES) {
+		uint32_t in_sector = c.offset % Fat16::DISK_BLOCK_SIZE;
+		uint32_t length = std::min<uint32_t>(Fat16::DISK_BLOCK_SIZE - in_sector, c.end - c.offset);
+		if (tcp_sndbuf(c.pcb) < length)
+			break;
+
+		// Staged metadata goes first, so a chain walked from here is the
+		// one the host last wrote
+		Fat16* fs = msc_disk_begin_local_read(0, Fat16::INDEX_DATA_STARTS * Fat16::DISK_BLOCK_SIZE);
+		if (!locate(c, *fs)) {
+			broken = true;
+			return false;
+		}
+
+		uint32_t lba = Fat16::ClusterToLBA(c.cluster) + (c.offset - c.cluster_offset) / Fat16::DISK_BLOCK_SIZE;
+		uint32_t corrupt_reads = storage_integrity().GetCorruptReads();
+		if (!read_block(lba, sector) || storage_integrity().GetCorruptReads() != corrupt_reads) {
+			broken = true;
+			return false;
+		}
+
+		err_t err = tcp_write(c.pcb, sector + in_sector, length, TCP_WRITE_FLAG_COPY |
+				(c.offset + length < c.end ? TCP_WRITE_FLAG_MORE : 0));
+		if (err == ERR_MEM)
+			break;
+		if (err != ERR_OK) {
+			broken = true;
+			return false;
+		}
+
+		c.offset += length;
+		queued += length;
+	}
+
+	if (c.offset == c.end)
+		c.state = STATE_DONE;
+	return queued > 0;
+}
+
+/**
+ * Queue lines of the directory listing while they fit.
+ */
+static bool send_listing(Connection& c)
+{
+	bool sent = false;
+
+	while (true) {
+		// A subdirectory's chain comes from the FAT, with the host's staged
+		// writes to it in
+		Fat16* fs = msc_disk_begin_local_read(0, c.listing_dir == DirectoryIndex::ROOT ? 0 : METADATA_BYTES);
+		DirectoryIndex::Slot slot;
+		if (!msc_disk_directories().Locate(*fs, c.listing_dir, c.listing_entry, slot) || !slot.IsValid() ||
+				!read_block(slot.lba, sector))
+			break;
+
+		const fat::DirectoryEntry& entry = ((const fat::DirectoryEntry*) sector)[slot.index];
+		if (entry.name[0] == 0)
+			break;
+
+		if (DirectoryIndex::IsNamed(entry)) {
+			char line[32];
+			uint32_t length = fat::FromShortName(entry.name, line);
+			if (entry.attributes & fat::DirectoryEntryBuilder::DIRECTORY)
+				length += snprintf(line + length, sizeof(line) - length, "/\n");
+			else
+				length += snprintf(line + length, sizeof(line) - length, " %u\n", (unsigned) entry.size);
+
+			if (tcp_sndbuf(c.pcb) < length || tcp_write(c.pcb, line, length, TCP_WRITE_FLAG_COPY) != ERR_OK)
+				return sent;
+			sent = true;
+		}
+
+		c.listing_entry++;
+	}
+
+	c.state = STATE_DONE;
+	return true;
+}
+
+/**
+ * Move one connection along. Returns true if there was work to do.
+ */
+static bool serve(Connection& c)
+{
+	bool did_work = false;
+
+	if (c.state == STATE_REQUEST) {
+		if (!c.request_complete)
+			return false;
+		respond(c);
+		did_work = true;
+	}
+
+	if (c.state == STATE_HEADER) {
+		did_work = send_header(c) || did_work;
+		if (c.state == STATE_FREE)
+			return true;
+	}
+
+	if (c.state == STATE_FILE) {
+		bool broken;
+		did_work = send_file(c, broken) || did_work;
+		if (broken) {
+			safe_print("HTTP: %.11s changed or could not be read, connection reset\n", c.name);
+			drop(c);
+			return true;
+		}
+	}
+
+	if (c.state == STATE_LISTING)
+		did_work = send_listing(c) || did_work;
+
+	if (did_work)
+		tcp_output(c.pcb);
+
+	if (c.state == STATE_DONE || c.state == STATE_CLOSING)
+		finish(c);
+
+	return did_work;
+}
+
+bool http_server_begin()
+{
+	if (listener != nullptr)
+		return true;
+
+	tcp_pcb* pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+	if (pcb == nullptr || tcp_bind(pcb, IP_ANY_TYPE, HTTP_SERVER_PORT) != ERR_OK) {
+		safe_print("HTTP: could not bind port %d\n", HTTP_SERVER_PORT);
+		if (pcb != nullptr)
+			tcp_close(pcb);
+		return false;
+	}
+
+	listener = tcp_listen(pcb);
+	if (listener == nullptr) {
+		tcp_close(pcb);
+		return false;
+	}
+
+	tcp_accept(listener, on_accept);
+	return true;
+}
+
+bool http_server_task()
+{
+	bool did_work = false;
+
+	for (Connection& c : connections) {
+		if (c.state != STATE_FREE)
+			did_work = serve(c) || did_work;
+	}
+
+	return did_work;
+}
+
+bool http_server_is_busy()
+{
+	for (const Connection& c : connections) {
+		if (c.state == STATE_HEADER || c.state == STATE_FILE || c.state == STATE_LISTING)
+			return true;
+	}
+
+	return false;
+}
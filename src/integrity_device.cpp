@@ -0,0 +1,461 @@
+#include "integrity_device.h"
+#include "sniff_crc.h"
+#include "string.h"
+#include "util.h"
+
+// First page of a checkpoint, kept until its header goes in last
+static uint8_t checkpoint_page[IntegrityDevice::MAX_PROGRAM_SIZE] STORAGE_ARENA;
+
+// All 0xFF once filled, see Init() and ClearUnit()
+static uint8_t blank_page[IntegrityDevice::MAX_PROGRAM_SIZE] STORAGE_ARENA;
+
+// CRC32 of a unit of 0xFF, what an erased unit is sealed with
+static constexpr uint32_t ERASED_CRC = sniff_crc_fill(0xFF, IntegrityDevice::UNIT_SIZE);
+
+IntegrityDevice::IntegrityDevice(BlockDevice& inner, bool enabled, bool verify_reads)
+	: inner(inner), requested(enabled), verify_reads(verify_reads) {}
+
+bool IntegrityDevice::Init() {
+	if (!inner.Init())
+		return false;
+
+	geometry = inner.GetGeometry();
+	uint32_t total = geometry.size / UNIT_SIZE;
+
+	enabled = requested
+		&& geometry.erase_size <= UNIT_SIZE && UNIT_SIZE % geometry.erase_size == 0
+		&& geometry.program_size <= MAX_PROGRAM_SIZE && geometry.program_size % sizeof(Record) == 0
+		&& total > META_UNITS && total - META_UNITS <= MAX_UNITS;
+
+	if (!enabled) {
+		if (requested)
+			safe_print("Integrity checks not supported on this device\n");
+		return true;
+	}
+
+	units = total - META_UNITS;
+
+	memset(blank_page, 0xFF, sizeof(blank_page));
+	return Load();
+}
+
+BlockDevice::Geometry IntegrityDevice::GetGeometry() const {
+	if (!enabled)
+		return inner.GetGeometry();
+
+	return { units * UNIT_SIZE, geometry.erase_size, geometry.program_size, geometry.erase_before_program };
+}
+
+bool IntegrityDevice::Read(uint32_t addr, void* buffer, uint32_t bufsize) {
+	if (!enabled)
+		return inner.Read(addr, buffer, bufsize);
+
+	if (addr + bufsize > units * UNIT_SIZE)
+		return false;
+
+	uint8_t* out = (uint8_t*) buffer;
+	while (bufsize > 0) {
+		uint32_t unit = addr / UNIT_SIZE;
+		uint32_t offset = addr % UNIT_SIZE;
+		uint32_t chunk = UNIT_SIZE - offset < bufsize ? UNIT_SIZE - offset : bufsize;
+
+		// Only a read of the whole unit gets a checksum to compare
+		if (verify_reads && chunk == UNIT_SIZE && (flags[unit] & UNIT_SEALED)) {
+			uint32_t crc;
+			if (!inner.ReadChecked(addr, out, chunk, crc))
+				return false;
+
+			stats.verified++;
+			if (crc != crcs[unit] && !(flags[unit] & UNIT_CORRUPT))
+				MarkCorrupt(unit);
+		}
+		else if (!inner.Read(addr, out, chunk)) {
+			return false;
+		}
+
+		if (flags[unit] & UNIT_CORRUPT)
+			corrupt_reads++;
+
+		addr += chunk;
+		out += chunk;
+		bufsize -= chunk;
+	}
+
+	return true;
+}
+
+const uint8_t* IntegrityDevice::Map(uint32_t addr, uint32_t bytes) {
+	if (!enabled)
+		return inner.Map(addr, bytes);
+
+	if (bytes == 0 || addr + bytes > units * UNIT_SIZE)
+		return nullptr;
+
+	for (uint32_t unit = addr / UNIT_SIZE; unit <= (addr + bytes - 1) / UNIT_SIZE; unit++) {
+		if (flags[unit] & UNIT_CORRUPT)
+			return nullptr;
+	}
+
+	return inner.Map(addr, bytes);
+}
+
+bool IntegrityDevice::Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) {
+	if (!enabled)
+		return inner.Program(addr, buffer, bufsize);
+
+	if (addr + bufsize > units * UNIT_SIZE)
+		return false;
+
+	while (bufsize > 0) {
+		uint32_t unit = addr / UNIT_SIZE;
+		uint32_t offset = addr % UNIT_SIZE;
+		uint32_t chunk = UNIT_SIZE - offset < bufsize ? UNIT_SIZE - offset : bufsize;
+
+		if (!Open(unit))
+			return false;
+
+		// All of it, so after an erase the unit is exactly this data
+		if (chunk == UNIT_SIZE) {
+			uint32_t crc;
+			if (!inner.ProgramChecked(addr, buffer, chunk, crc) || !Seal(unit, crc))
+				return false;
+		}
+		else if (!inner.Program(addr, buffer, chunk)) {
+			return false;
+		}
+
+		addr += chunk;
+		buffer += chunk;
+		bufsize -= chunk;
+	}
+
+	return true;
+}
+
+bool IntegrityDevice::Erase(uint32_t addr, uint32_t bytes) {
+	if (!enabled)
+		return inner.Erase(addr, bytes);
+
+	if (addr + bytes > units * UNIT_SIZE)
+		return false;
+
+	while (bytes > 0) {
+		uint32_t unit = addr / UNIT_SIZE;
+		uint32_t offset = addr % UNIT_SIZE;
+		uint32_t chunk = UNIT_SIZE - offset < bytes ? UNIT_SIZE - offset : bytes;
+
+		if (!Open(unit) || !inner.Erase(addr, chunk))
+			return false;
+
+		if (chunk == UNIT_SIZE && geometry.erase_before_program && !Seal(unit, ERASED_CRC))
+			return false;
+
+		addr += chunk;
+		bytes -= chunk;
+	}
+
+	return true;
+}
+
+bool IntegrityDevice::Flush() {
+	if (enabled && !WritePage())
+		return false;
+
+	return inner.Flush();
+}
+
+bool IntegrityDevice::Scrub() {
+	if (!enabled)
+		return false;
+
+	uint32_t unit = scrub_next;
+	scrub_next = (scrub_next + 1) % units;
+
+	uint32_t crc;
+	if (!(flags[unit] & UNIT_CORRUPT) && inner.Checksum(unit * UNIT_SIZE, UNIT_SIZE, crc)) {
+		stats.scrubbed++;
+		if (!(flags[unit] & UNIT_SEALED))
+			Seal(unit, crc);
+		else if (crc != crcs[unit])
+			MarkCorrupt(unit);
+	}
+
+	if (scrub_next != 0)
+		return true;
+
+	// End of a pass: put the seals it made on the medium
+	WritePage();
+	return false;
+}
+
+bool IntegrityDevice::Open(uint32_t unit) {
+	if (!(flags[unit] & UNIT_SEALED))
+		return true;
+
+	bool defer = IsSealPending(unit);
+	stats.opened++;
+	stats.deferred += defer;
+	if (defer)
+		return Append(RECORD_OPEN, unit, 0, true);
+
+	// This costs a page of its own. The units after it are what a copy
+	// writes next, so their open records go on the same page.
+	if (!Append(RECORD_OPEN, unit, 0, true))
+		return false;
+
+	uint32_t per_page = geometry.program_size / sizeof(Record);
+	for (uint32_t next = unit + 1; next < units && next <= unit + OPEN_AHEAD && (meta_slot + 1) % per_page != 0; next++) {
+		if ((flags[next] & UNIT_SEALED) && !IsSealPending(next)) {
+			stats.opened++;
+			stats.deferred++;
+			if (!Append(RECORD_OPEN, next, 0, true))
+				return false;
+		}
+	}
+
+	return WritePage();
+}
+
+bool IntegrityDevice::IsSealPending(uint32_t unit) const {
+	// Append() writes the page before moving on to the next, so whatever is
+	// not on the medium is on this one
+	for (uint32_t slot = written_slot; slot < meta_slot; slot++) {
+		Record record;
+		memcpy(&record, page + slot * sizeof(Record) % geometry.program_size, sizeof(record));
+		if (record.type == RECORD_SEAL && record.unit == unit)
+			return true;
+	}
+
+	return false;
+}
+
+bool IntegrityDevice::Seal(uint32_t unit, uint32_t crc) {
+	flags[unit] &= ~UNIT_CORRUPT;
+	return Append(RECORD_SEAL, unit, crc, true);
+}
+
+void IntegrityDevice::MarkCorrupt(uint32_t unit) {
+	safe_print("Integrity: unit %d does not match its checksum\n", unit);
+	flags[unit] |= UNIT_CORRUPT;
+	stats.corrupt++;
+}
+
+void IntegrityDevice::Apply(const Record& record) {
+	if (record.unit >= units)
+		return;
+
+	switch (record.type) {
+		case RECORD_OPEN:
+			flags[record.unit] &= ~UNIT_SEALED;
+			break;
+
+		case RECORD_SEAL:
+			flags[record.unit] |= UNIT_SEALED;
+			crcs[record.unit] = record.crc;
+			break;
+	}
+}
+
+bool IntegrityDevice::Append(uint8_t type, uint16_t unit, uint32_t crc, bool defer) {
+	if (meta_slot == RECORDS_PER_UNIT && !Checkpoint())
+		return false;
+
+	uint32_t in_page = meta_slot * sizeof(Record) % geometry.program_size;
+	if (in_page == 0)
+		memset(page, 0xFF, geometry.program_size);
+
+	Record record = MakeRecord(type, unit, crc);
+	memcpy(page + in_page, &record, sizeof(record));
+	meta_slot++;
+	page_dirty = true;
+	Apply(record);
+
+	if (defer && meta_slot * sizeof(Record) % geometry.program_size != 0)
+		return true;
+
+	return WritePage();
+}
+
+/**
+ * Program the current log page, and start the next record on a fresh one:
+ * a log page is programmed once, whatever is left of it stays blank.
+ */
+bool IntegrityDevice::WritePage() {
+	if (!page_dirty)
+		return true;
+
+	uint32_t per_page = geometry.program_size / sizeof(Record);
+	page_dirty = false;
+	bool ok = ProgramPage(MetaUnit(meta_index), meta_slot - 1, page);
+	meta_slot = (meta_slot + per_page - 1) / per_page * per_page;
+	written_slot = meta_slot;
+	return ok;
+}
+
+bool IntegrityDevice::ProgramPage(uint32_t meta_unit, uint32_t slot, const uint8_t* data) {
+	uint32_t addr = meta_unit * UNIT_SIZE + slot * sizeof(Record);
+	return inner.Program(addr / geometry.program_size * geometry.program_size, data, geometry.program_size);
+}
+
+/**
+ * Write a seal record for every sealed unit into the other log unit. Its
+ * first page, with the header, goes in last, so until the checkpoint is
+ * complete the old unit stays the one that is loaded.
+ */
+bool IntegrityDevice::Checkpoint() {
+	if (!WritePage())
+		return false;
+
+	uint32_t next = (meta_index + 1) % META_UNITS;
+	uint32_t meta_unit = MetaUnit(next);
+	if (!ClearUnit(meta_unit))
+		return false;
+
+	uint32_t per_page = geometry.program_size / sizeof(Record);
+	uint32_t slot = 1;
+	memset(page, 0xFF, geometry.program_size);
+
+	for (uint32_t unit = 0; unit < units; unit++) {
+		if (!(flags[unit] & UNIT_SEALED))
+			continue;
+
+		Record record = MakeRecord(RECORD_SEAL, unit, crcs[unit]);
+		memcpy(page + slot % per_page * sizeof(Record), &record, sizeof(record));
+		slot++;
+
+		if (slot % per_page == 0) {
+			if (slot == per_page)
+				memcpy(checkpoint_page, page, geometry.program_size);
+			else if (!ProgramPage(meta_unit, slot - 1, page))
+				return false;
+
+			memset(page, 0xFF, geometry.program_size);
+		}
+	}
+
+	if (slot < per_page)
+		memcpy(checkpoint_page, page, geometry.program_size);
+	else if (slot % per_page != 0 && !ProgramPage(meta_unit, slot - 1, page))
+		return false;
+
+	uint32_t next_generation = generation + 1;
+	Record header = MakeRecord(RECORD_HEADER, HEADER_MAGIC, next_generation);
+	memcpy(checkpoint_page, &header, sizeof(header));
+	if (!ProgramPage(meta_unit, 0, checkpoint_page))
+		return false;
+
+	generation = next_generation;
+	meta_index = next;
+	meta_slot = (slot + per_page - 1) / per_page * per_page;
+	written_slot = meta_slot;
+	return true;
+}
+
+/**
+ * Replay the newest log unit. A blank record ends its page, and a page
+ * that starts blank ends the log; a record that is neither blank nor
+ * valid was cut short by a power loss and is skipped.
+ */
+bool IntegrityDevice::Load() {
+	memset(flags, 0, sizeof(flags));
+	page_dirty = false;
+	scrub_next = 0;
+
+	bool found = false;
+	for (uint32_t i = 0; i < META_UNITS; i++) {
+		Record header;
+		if (!inner.Read(MetaUnit(i) * UNIT_SIZE, &header, sizeof(header)))
+			return false;
+
+		if (!IsValid(header) || header.type != RECORD_HEADER || header.unit != HEADER_MAGIC
+				|| (found && header.crc <= generation))
+			continue;
+
+		found = true;
+		meta_index = i;
+		generation = header.crc;
+	}
+
+	if (!found) {
+		// Nothing here yet: start an empty log, every unit open
+		meta_index = 0;
+		generation = 1;
+		meta_slot = geometry.program_size / sizeof(Record);
+		written_slot = meta_slot;
+
+		Record header = MakeRecord(RECORD_HEADER, HEADER_MAGIC, generation);
+		memset(page, 0xFF, geometry.program_size);
+		memcpy(page, &header, sizeof(header));
+		return ClearUnit(MetaUnit(0)) && ProgramPage(MetaUnit(0), 0, page);
+	}
+
+	uint32_t per_page = geometry.program_size / sizeof(Record);
+	uint32_t sealed = 0;
+
+	meta_slot = 1;
+	while (meta_slot < RECORDS_PER_UNIT) {
+		if (meta_slot == 1 || meta_slot % per_page == 0) {
+			uint32_t addr = MetaUnit(meta_index) * UNIT_SIZE + meta_slot / per_page * geometry.program_size;
+			if (!inner.Read(addr, page, geometry.program_size))
+				return false;
+		}
+
+		Record record;
+		memcpy(&record, page + meta_slot % per_page * sizeof(Record), sizeof(record));
+
+		bool blank = true;
+		for (uint32_t i = 0; i < sizeof(record) && blank; i++)
+			blank = ((uint8_t*) &record)[i] == 0xFF;
+		if (blank && meta_slot % per_page == 0)
+			break;
+
+		if (blank) {
+			meta_slot = (meta_slot + per_page - 1) / per_page * per_page;
+			continue;
+		}
+
+		meta_slot++;
+		if (IsValid(record))
+			Apply(record);
+		else
+			safe_print("Integrity log: torn record at %d\n", meta_slot - 1);
+	}
+
+	written_slot = meta_slot;
+	for (uint32_t unit = 0; unit < units; unit++)
+		sealed += flags[unit] & UNIT_SEALED;
+
+	safe_print("Integrity log: %d of %d units sealed\n", sealed, units);
+	return true;
+}
+
+bool IntegrityDevice::ClearUnit(uint32_t unit) {
+	if (geometry.erase_before_program)
+		return inner.Erase(unit * UNIT_SIZE, UNIT_SIZE);
+
+	// Storage without an erase: blank means 0xFF here too
+	for (uint32_t done = 0; done < UNIT_SIZE; done += sizeof(blank_page)) {
+		if (!inner.Program(unit * UNIT_SIZE + done, blank_page, sizeof(blank_page)))
+			return false;
+	}
+
+	return true;
+}
+
+IntegrityDevice::Record IntegrityDevice::MakeRecord(uint8_t type, uint16_t unit, uint32_t crc) {
+	Record record = { type, 0, unit, crc };
+
+	uint8_t sum = 0;
+	for (uint32_t i = 0; i < sizeof(record); i++)
+		sum += ((uint8_t*) &record)[i];
+	record.check = 0xFF - sum;
+	return record;
+}
+
+bool IntegrityDevice::IsValid(const Record& record) {
+	uint8_t sum = 0;
+	for (uint32_t i = 0; i < sizeof(record); i++)
+		sum += ((const uint8_t*) &record)[i];
+
+	return sum == 0xFF && record.type >= RECORD_HEADER && record.type <= RECORD_SEAL;
+}
@@ -1,39 +1,133 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <algorithm>
 #include <hardware/flash.h>
 #include "device/usbd.h"
 #include "tusb.h"
 #include "pico.h"
 #include "fat.h"
+#include "msc_disk.h"
+#include "bulk_ingest.h"
+#include "http_server.h"
+#include "mtp_responder.h"
 #include "pico/stdlib.h"
 #include "bsp/board.h"
 #include "pico/cyw43_arch.h"
 #include "hardware/uart.h"
+#include "scheduler.h"
+#include "startup.h"
 #include "util.h"
+#include "wifi_link.h"
+
+// How long the radio waits after USB comes up, or after the host first
+// asks for the capacity if that is later. By then the host has read the
+// FAT and root directory and mounted the drive.
+#define RADIO_INIT_DELAY_US (1000 * 1000)
+
+static Scheduler scheduler;
+
+// cyw43_arch_init() was tried, and whether it worked. The LED is on the
+// cyw43 too.
+static bool radio_started = false;
+static bool radio_up = false;
+
+static bool usb_task() {
+	tud_task();
+	return false;
+}
+
+/**
+ * Bring the cyw43 up once the host has the drive. Loading its firmware
+ * holds the core long enough that enumeration would stall behind it.
+ * Afterwards, with the file server, service the link.
+ */
+static bool radio_task() {
+	if (!radio_started) {
+		uint64_t since = std::max(startup_time(STARTUP_USB), startup_time(STARTUP_CAPACITY));
+		if (time_us_64() - since < RADIO_INIT_DELAY_US)
+			return false;
+
+		radio_started = true;
+		radio_up = cyw43_arch_init() == 0;
+		startup_mark(STARTUP_RADIO);
+
+		safe_print("--------SYSTEM START--------\n");
+		startup_report();
+		safe_print("Total flash size is: %d\n", PICO_FLASH_SIZE_BYTES);
+		safe_print("Sector Size %d\n", FLASH_SECTOR_SIZE);
+		safe_print("Block Size %d\n", FLASH_BLOCK_SIZE);
+		safe_print("Page Size %d\n", FLASH_PAGE_SIZE);
+
+		if (!radio_up) {
+			safe_print("Wi-Fi init failed\n");
+			return false;
+		}
+
+#if WIFI_FILE_SERVER
+		// Joins in the background; the server listens from the start
+		wifi_link_begin();
+		http_server_begin();
+#endif
+		return true;
+	}
+
+#if WIFI_FILE_SERVER
+	return radio_up && wifi_link_task();
+#else
+	return false;
+#endif
+}
+
+#if WIFI_FILE_SERVER
+static bool http_task() {
+	return radio_up && http_server_task();
+}
+#endif
+
+// Housekeeping waits for the host to leave the drive alone, for any file
+// coming in over the ingest interface or MTP to be complete and for
+// downloads over Wi-Fi to finish
+static bool storage_is_idle() {
+#if WIFI_FILE_SERVER
+	if (http_server_is_busy())
+		return false;
+#endif
+#if USB_MTP
+	if (mtp_responder_is_busy())
+		return false;
+#endif
+#if USB_BULK_INGEST
+	if (bulk_ingest_is_busy())
+		return false;
+#endif
+	return msc_disk_is_idle();
+}
+
+static bool led_task() {
+	if (radio_up)
+		stateless_led_blink();
+	return false;
+}
 
 int main() {
+	startup_begin();
+
     // Initialise UART
 	uart_init(UART_ID, BAUD_RATE);
 	gpio_set_function(UART_TX_PIN, GPIO_FUNC_UART);
     gpio_set_function(UART_RX_PIN, GPIO_FUNC_UART);
 
+	// Mounted before the host can ask about it, so READ CAPACITY is
+	// answered right away. The banner waits for the radio: with
+	// DEBUG_UART safe_print takes 10ms a character.
+	msc_disk_begin();
+
     // Initialize USB Pins and Protocol. This overrides USB communication, so
     // UART must be used.
     board_init();
     tusb_init();
-
-    if (cyw43_arch_init()) {
-        safe_print("Wi-Fi init failed");
-        return -1;
-    }
-
-	safe_print("--------SYSTEM START--------\n");
-	safe_print("Total flash size is: %d\n", PICO_FLASH_SIZE_BYTES);
-	safe_print("Sector Size %d\n", FLASH_SECTOR_SIZE);
-	safe_print("Block Size %d\n", FLASH_BLOCK_SIZE);
-	safe_print("Page Size %d\n", FLASH_PAGE_SIZE);
-
+	startup_mark(STARTUP_USB);
 
 	
     /*while (true) {
@@ -43,10 +137,29 @@ int main() {
         sleep_ms(250);
     }*/
 
-	while (1) {
-		tud_task();
-		stateless_led_blink();
-	}
+	// USB first on every pass, then whatever it staged. Flash maintenance
+	// only once the host has gone quiet, so it never delays a command.
+	scheduler.AddTask("usb", usb_task, Scheduler::PRIORITY_USB);
+	scheduler.AddTask("msc", msc_disk_task, Scheduler::PRIORITY_STORAGE);
+#if USB_BULK_INGEST
+	scheduler.AddTask("ingest", bulk_ingest_task, Scheduler::PRIORITY_STORAGE);
+#endif
+#if USB_MTP
+	scheduler.AddTask("mtp", mtp_responder_task, Scheduler::PRIORITY_STORAGE);
+#endif
+	scheduler.AddTask("radio", radio_task, Scheduler::PRIORITY_USB);
+#if WIFI_FILE_SERVER
+	scheduler.AddTask("http", http_task, Scheduler::PRIORITY_STORAGE);
+#endif
+	// Debounces a jumper that is on at power on as well, 50ms in
+	scheduler.AddTask("reset jumper", msc_disk_reset_task, Scheduler::PRIORITY_BACKGROUND, 50 * 1000);
+	scheduler.AddTask("led", led_task, Scheduler::PRIORITY_BACKGROUND, 1000 * 1000);
+	scheduler.AddIdleHook("msc maintenance", msc_disk_maintenance, 500 * 1000);
+	scheduler.AddIdleHook("scrub", msc_disk_scrub, 60 * 1000 * 1000);
+	scheduler.AddIdleHook("volume check", msc_disk_check, 1000 * 1000);
+	scheduler.SetIdleGate(storage_is_idle);
+
+	scheduler.Run();
 }
 
 
@@ -58,6 +171,7 @@ int main() {
 // Invoked when device is mounted
 void tud_mount_cb(void)
 {
+	startup_mark(STARTUP_MOUNTED);
 }
 
 // Invoked when device is unmounted
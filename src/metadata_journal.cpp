@@ -0,0 +1,371 @@
+#include "metadata_journal.h"
+#include "string.h"
+#include "util.h"
+#include <algorithm>
+
+#define BLOCK_SIZE 512
+
+MetadataJournal::MetadataJournal(BlockDevice& device) : device(device) {
+	memset(page, 0xFF, sizeof(page));
+}
+
+bool MetadataJournal::Attach(uint32_t start, uint32_t end, uint32_t log, uint32_t log_size) {
+	this->start = start;
+	this->end = end;
+	this->log = log;
+	this->log_size = log_size;
+
+	memset(page, 0xFF, sizeof(page));
+	page_used = 0;
+	page_first = 0;
+	write_offset = 0;
+	extent_count = 0;
+
+	if (!IsActive())
+		return true;
+
+	bool ok = Scan();
+	page_first = extent_count;
+	safe_print("Metadata journal: %d bytes used, %d pending extents\n", write_offset, extent_count);
+	return ok;
+}
+
+bool MetadataJournal::Read(uint32_t addr, void* buffer, uint32_t bufsize) {
+	if (!device.Read(addr, buffer, bufsize))
+		return false;
+
+	return Overlay(addr, (uint8_t*) buffer, bufsize);
+}
+
+const uint8_t* MetadataJournal::Map(uint32_t addr, uint32_t bytes) {
+	if (IsActive() && addr < end && start < addr + bytes)
+		return nullptr;
+
+	return device.Map(addr, bytes);
+}
+
+bool MetadataJournal::Write(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) {
+	if (!IsActive() || addr + bufsize <= start || addr >= end)
+		return device.Write(addr, buffer, bufsize);
+
+	// Anything in front of or behind the journaled range goes straight through
+	if (addr < start) {
+		uint32_t head = start - addr;
+		if (!device.Write(addr, buffer, head))
+			return false;
+		addr += head;
+		buffer += head;
+		bufsize -= head;
+	}
+
+	uint32_t tail = addr + bufsize > end ? addr + bufsize - end : 0;
+	if (tail > 0 && !device.Write(end, buffer + bufsize - tail, tail))
+		return false;
+
+	for (uint32_t done = 0; done < bufsize - tail; done += BLOCK_SIZE) {
+		if (LogBlock(addr + done, buffer + done))
+			continue;
+
+		// Out of room: fold the log into the base sectors and go again.
+		// Whatever part of this block made it into the log is simply
+		// not different any more.
+		if (!Compact() || !LogBlock(addr + done, buffer + done))
+			return false;
+	}
+
+	return ProgramPage();
+}
+
+bool MetadataJournal::Compact() {
+	if (!IsActive())
+		return true;
+
+	if (!ProgramPage())
+		return false;
+
+	if (write_offset == 0)
+		return true;
+
+	safe_print("Compacting metadata journal, %d extents\n", extent_count);
+
+	if (!Fold())
+		return false;
+
+	// Only now is the log redundant
+	uint32_t unit = device.GetGeometry().erase_size;
+	uint32_t used_units = (write_offset + unit - 1) / unit;
+	if (!device.Erase(log, used_units * unit))
+		return false;
+
+	write_offset = 0;
+	extent_count = 0;
+	page_first = 0;
+	return true;
+}
+
+bool MetadataJournal::Fold() {
+	uint32_t unit = device.GetGeometry().erase_size;
+	static uint8_t unit_data[BlockDevice::MAX_ERASE_SIZE] STORAGE_ARENA;
+
+	// Rewrite every unit that has pending extents, once
+	for (uint32_t i = 0; i < extent_count; i++) {
+		uint32_t unit_addr = extents[i].addr / unit * unit;
+
+		bool done = false;
+		for (uint32_t j = 0; j < i && !done; j++)
+			done = extents[j].addr / unit * unit == unit_addr;
+		if (done)
+			continue;
+
+		if (!Read(unit_addr, unit_data, unit) || !device.Write(unit_addr, unit_data, unit))
+			return false;
+	}
+
+	return true;
+}
+
+bool MetadataJournal::Reset(uint32_t start, uint32_t end, uint32_t log, uint32_t log_size) {
+	this->start = start;
+	this->end = end;
+	this->log = log;
+	this->log_size = log_size;
+
+	memset(page, 0xFF, sizeof(page));
+	page_used = 0;
+	page_first = 0;
+	write_offset = 0;
+	extent_count = 0;
+
+	// Only the units that are not blank already
+	uint32_t unit = device.GetGeometry().erase_size;
+	uint8_t chunk[RECORD_SIZE];
+	for (uint32_t offset = 0; offset < log_size; offset += unit) {
+		bool blank = true;
+		for (uint32_t at = 0; blank && at < unit; at += sizeof(chunk)) {
+			if (!device.Read(log + offset + at, chunk, sizeof(chunk)))
+				return false;
+			for (uint32_t i = 0; blank && i < sizeof(chunk); i++)
+				blank = chunk[i] == 0xFF;
+		}
+
+		if (!blank && !device.Erase(log + offset, unit))
+			return false;
+	}
+
+	return true;
+}
+
+bool MetadataJournal::Overlay(uint32_t addr, uint8_t* buffer, uint32_t bufsize) {
+	if (extent_count == 0 || addr + bufsize <= start || addr >= end)
+		return true;
+
+	uint32_t page_addr = log + write_offset;
+
+	// In log order, so later records win
+	for (uint32_t i = 0; i < extent_count; i++) {
+		const Pending& e = extents[i];
+		uint32_t from = std::max(e.addr + e.offset, addr);
+		uint32_t to = std::min(e.addr + e.offset + e.length, addr + bufsize);
+		if (from >= to)
+			continue;
+
+		uint32_t skip = from - (e.addr + e.offset);
+		uint8_t* out = buffer + (from - addr);
+
+		// Extents of the page still being built are only in RAM
+		if (e.data >= page_addr)
+			memcpy(out, page + (e.data - page_addr) + skip, to - from);
+		else if (!device.Read(e.data + skip, out, to - from))
+			return false;
+	}
+
+	return true;
+}
+
+bool MetadataJournal::LogBlock(uint32_t addr, const uint8_t* block) {
+	static uint8_t current[BLOCK_SIZE] STORAGE_ARENA;
+	if (!Read(addr, current, BLOCK_SIZE))
+		return false;
+
+	uint32_t i = 0;
+	while (i < BLOCK_SIZE) {
+		if (current[i] == block[i]) {
+			i++;
+			continue;
+		}
+
+		// Stretch the extent over short runs of unchanged bytes, which are
+		// cheaper to repeat than to start a new extent for.
+		uint32_t last = i;
+		for (uint32_t j = i + 1; j < BLOCK_SIZE && j - last <= MERGE_GAP; j++) {
+			if (current[j] != block[j])
+				last = j;
+		}
+
+		if (!Append(addr, (uint16_t) i, block + i, (uint16_t) (last - i + 1)))
+			return false;
+
+		i = last + 1;
+	}
+
+	return true;
+}
+
+bool MetadataJournal::Append(uint32_t addr, uint16_t offset, const uint8_t* data, uint16_t length) {
+	while (length > 0) {
+		uint32_t free = RECORD_SIZE - sizeof(Header) - page_used;
+		if (free <= sizeof(Extent)) {
+			if (!ProgramPage())
+				return false;
+			continue;
+		}
+
+		if (extent_count == MAX_EXTENTS || write_offset + RECORD_SIZE > log_size)
+			return false;
+
+		uint16_t chunk = (uint16_t) std::min<uint32_t>(length, free - sizeof(Extent));
+		uint8_t* at = page + sizeof(Header) + page_used;
+
+		Extent extent = { addr, offset, chunk };
+		memcpy(at, &extent, sizeof(extent));
+		memcpy(at + sizeof(extent), data, chunk);
+
+		Pending& pending = extents[extent_count++];
+		pending.addr = addr;
+		pending.data = log + write_offset + sizeof(Header) + page_used + sizeof(Extent);
+		pending.offset = offset;
+		pending.length = chunk;
+
+		page_used += sizeof(Extent) + chunk;
+		offset += chunk;
+		data += chunk;
+		length -= chunk;
+	}
+
+	return true;
+}
+
+bool MetadataJournal::ProgramPage() {
+	if (page_used == 0)
+		return true;
+
+	Header header;
+	header.magic = RECORD_MAGIC;
+	header.used = (uint16_t) page_used;
+	header.checksum = Checksum(page + sizeof(Header), page_used);
+	memcpy(page, &header, sizeof(header));
+
+	bool ok = device.Program(log + write_offset, page, RECORD_SIZE);
+
+	if (ok) {
+		write_offset += RECORD_SIZE;
+	} else {
+		// The page's bytes never made it, so neither did its extents. The
+		// page may have been left blank, which Scan() would take for the
+		// end of the log, so nothing more goes after it: calling the log
+		// full makes the next write compact first.
+		safe_print("Metadata journal: program failed at 0x%X\n", log + write_offset);
+		extent_count = page_first;
+		write_offset = log_size;
+	}
+
+	memset(page, 0xFF, sizeof(page));
+	page_used = 0;
+	page_first = extent_count;
+	return ok;
+}
+
+/**
+ * Rebuild the extent table from the log. It ends at the first blank page.
+ * A page that is neither blank nor valid was cut short by a power loss and
+ * is skipped; its write never completed, and the records appended after it
+ * since are still good. A valid page with an extent that points outside
+ * the journaled range or past its own bytes was not written by us, so the
+ * log is taken to end there. If the table fills up, what is in it is folded
+ * into the base sectors and the scan goes on, and the log is compacted at
+ * the end, as replaying it again over that is harmless.
+ */
+bool MetadataJournal::Scan() {
+	uint8_t record[RECORD_SIZE];
+	bool folded = false;
+
+	while (write_offset + RECORD_SIZE <= log_size) {
+		if (!device.Read(log + write_offset, record, RECORD_SIZE))
+			return false;
+
+		bool blank = true;
+		for (uint32_t i = 0; i < RECORD_SIZE && blank; i++)
+			blank = record[i] == 0xFF;
+		if (blank)
+			break;
+
+		Header header;
+		memcpy(&header, record, sizeof(header));
+		bool valid = header.magic == RECORD_MAGIC
+			&& header.used <= RECORD_SIZE - sizeof(Header)
+			&& header.checksum == Checksum(record + sizeof(Header), header.used);
+
+		uint32_t page_addr = log + write_offset;
+		write_offset += RECORD_SIZE;
+
+		if (!valid) {
+			safe_print("Metadata journal: torn record at 0x%X\n", page_addr);
+			continue;
+		}
+
+		uint32_t used_end = sizeof(Header) + header.used;
+		uint32_t pos = sizeof(Header);
+		while (pos + sizeof(Extent) <= used_end) {
+			Extent extent;
+			memcpy(&extent, record + pos, sizeof(extent));
+			pos += sizeof(Extent) + extent.length;
+
+			valid = extent.addr >= start && extent.addr < end && extent.addr % BLOCK_SIZE == 0
+				&& extent.offset + extent.length <= BLOCK_SIZE
+				&& pos <= used_end;
+			if (!valid)
+				break;
+		}
+
+		if (!valid) {
+			// Nothing may be programmed over this page, so count the log
+			// as full and let the next write compact it
+			safe_print("Metadata journal: bad extent in record at 0x%X\n", page_addr);
+			write_offset = log_size;
+			break;
+		}
+
+		pos = sizeof(Header);
+		while (pos + sizeof(Extent) <= used_end) {
+			if (extent_count == MAX_EXTENTS) {
+				if (!Fold())
+					return false;
+				extent_count = 0;
+				folded = true;
+			}
+
+			Extent extent;
+			memcpy(&extent, record + pos, sizeof(extent));
+			pos += sizeof(Extent);
+
+			Pending& pending = extents[extent_count++];
+			pending.addr = extent.addr;
+			pending.data = page_addr + pos;
+			pending.offset = extent.offset;
+			pending.length = extent.length;
+			pos += extent.length;
+		}
+	}
+
+	return !folded || Compact();
+}
+
+uint16_t MetadataJournal::Checksum(const uint8_t* data, uint32_t size) {
+	uint16_t sum1 = 0;
+	uint16_t sum2 = 0;
+	for (uint32_t i = 0; i < size; i++) {
+		sum1 = (sum1 + data[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	return (uint16_t) ((sum2 << 8) | sum1);
+}
@@ -1,29 +1,329 @@
 #include "bsp/board.h"
+#include "hardware/gpio.h"
 #include "hardware/watchdog.h"
 #include "tusb.h"
 #include "class/msc/msc.h"
+#include "append_log.h"
+#include "directory_index.h"
 #include "fat.h"
+#include "file_map.h"
+#include "msc_disk.h"
 #include "pico.h"
+#include "pico_flash.hpp"
+#include "pico/time.h"
+#include "read_ahead.h"
+#include "readonly_disk.h"
+#include "startup.h"
+#include "storage_backend.h"
 #include "util.h"
+#include "volume_check.h"
+#include "write_queue.hpp"
 #include <hardware/flash.h>
+#include <new>
+
+// LUN 0 is the writable volume, LUN 1 the image built into the firmware
+#define LUN_VOLUME   0
+#define LUN_READONLY 1
+
+// Not in TinyUSB's list of SCSI commands
+#define SCSI_SYNCHRONIZE_CACHE_10 0x35
+
+// Vendor specific. Byte 1 picks the action; STATUS returns 8 bytes: flags
+// (bit 0 snapshots available, bit 1 snapshot held, bit 2 the last snapshot
+// taken ran out of spare units and was dropped), 3 reserved, then the
+// diverged and free unit counts as big endian 16 bit numbers.
+#define SCSI_VENDOR_SNAPSHOT 0xC0
+#define SNAPSHOT_STATUS   0
+#define SNAPSHOT_TAKE     1
+#define SNAPSHOT_ROLLBACK 2
+#define SNAPSHOT_DROP     3
 
 // whether host does safe-eject
 static bool ejected = false;
 
 Fat16* fat_fs = nullptr;
 
+// Where fat_fs is built, by msc_disk_begin()
+alignas(Fat16) static uint8_t volume_storage[sizeof(Fat16)] STORAGE_ARENA;
+
+// How long the host has to leave the drive alone before housekeeping that
+// erases flash is allowed to run
+#define IDLE_MAINTENANCE_US (2 * 1000 * 1000)
+
+// WRITE10 data waiting to be committed to flash
+static WriteQueue write_queue;
+
+// Time of the last READ10/WRITE10
+static uint64_t last_access_us = 0;
+
+// Firmware changed the volume behind the host's back; the host's cache is
+// stale until it has been told
+static bool media_changed = false;
+
+// The host wrote the volume since power on or its last eject. Its file
+// system may still be partway through an update in its own cache, so what
+// VolumeCheck finds then is only reported, not repaired.
+static bool host_wrote = false;
+
+static VolumeCheck volume_check;
+
+// The cluster READ10 is expected to ask for next
+static uint8_t read_ahead_buffer[ReadAhead::BUFFER_SIZE] STORAGE_ARENA;
+static ReadAhead read_ahead(read_ahead_buffer);
+
+// Kept up to date by Fat16 itself, from every write
+static DirectoryIndex::Tables directory_tables STORAGE_ARENA;
+static DirectoryIndex directory_index(directory_tables);
+
+// The reset jumper has to read low this many polls in a row
+#define RESET_DEBOUNCE_POLLS 2
+
+// The reset jumper's pin, pulled up so it reads low only when shorted
+#define RESET_PIN 17
+
+// Polls GPIO17 has read low in a row. A jumper that is on at power on
+// counts like one put on later, so the volume is formatted once the host
+// can already see it, and is then told.
+static uint32_t reset_pin_low_polls = 0;
+
+/**
+ * Mount the volume if that has not been done yet. Done in place rather
+ * than on the heap, so its size is part of the storage arena.
+ */
+static void open_volume()
+{
+	if (fat_fs == nullptr) {
+		fat_fs = new (volume_storage) Fat16(storage_backend());
+		fat_fs->SetDirectoryIndex(&directory_index);
+		read_ahead.Clear();
+	}
+}
+
+/**
+ * Report UNIT ATTENTION / NOT READY TO READY CHANGE, MEDIUM MAY HAVE CHANGED
+ * once, on whichever command comes first. Hosts then drop their cached FAT
+ * and directory sectors and read them again.
+ */
+static bool report_media_change(uint8_t lun)
+{
+	if (lun != LUN_VOLUME || !media_changed)
+		return false;
+
+	media_changed = false;
+	tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00);
+	return true;
+}
+
+/**
+ * Report a staged write that failed to commit, as MEDIUM ERROR / WRITE
+ * ERROR on whichever command comes next. The host was already told that
+ * write went through.
+ */
+static bool report_write_failure(uint8_t lun)
+{
+	if (lun != LUN_VOLUME || !write_queue.TakeFailure())
+		return false;
+
+	tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+	return true;
+}
+
+void msc_disk_begin()
+{
+	ejected = false;
+	host_wrote = false;
+	media_changed = false;
+	reset_pin_low_polls = 0;
+
+	// Read by msc_disk_reset_task(), long after the pull-up has settled
+	gpio_init(RESET_PIN);
+	gpio_set_dir(RESET_PIN, GPIO_IN);
+	gpio_pull_up(RESET_PIN);
+
+	open_volume();
+	startup_mark(STARTUP_STORAGE);
+}
+
+bool msc_disk_task()
+{
+	if (fat_fs == nullptr)
+		return false;
+
+	// What the last commit left of a sector erase, a slice per pass so
+	// tud_task runs in between
+	if (PicoFlash::Step())
+		return true;
+
+	if (write_queue.CommitOne(*fat_fs))
+		return true;
+
+	// With nothing staged, read ahead while the link is still busy with
+	// the last READ10. A cluster that fails its checksum is left for
+	// READ10 to find.
+	uint32_t corrupt_reads = storage_integrity().GetCorruptReads();
+	bool did_work = read_ahead.Step(*fat_fs);
+	if (storage_integrity().GetCorruptReads() != corrupt_reads)
+		read_ahead.Clear();
+
+	return did_work;
+}
+
+bool msc_disk_is_idle()
+{
+	return fat_fs != nullptr && write_queue.Empty()
+		&& time_us_64() - last_access_us >= IDLE_MAINTENANCE_US;
+}
+
+Fat16* msc_disk_begin_local_write()
+{
+	open_volume();
+
+	write_queue.Drain(*fat_fs);
+	read_ahead.Clear();
+	return fat_fs;
+}
+
+Fat16* msc_disk_begin_local_read(uint32_t lba, uint32_t bytes)
+{
+	open_volume();
+
+	write_queue.CommitOverlapping(*fat_fs, lba, bytes);
+	return fat_fs;
+}
+
+void msc_disk_invalidate(uint32_t lba, uint32_t bytes)
+{
+	read_ahead.Invalidate(lba, bytes);
+	FileMap::Invalidate(lba, (bytes + Fat16::DISK_BLOCK_SIZE - 1) / Fat16::DISK_BLOCK_SIZE);
+}
+
+void msc_disk_media_changed()
+{
+	if (fat_fs != nullptr)
+		fat_fs->Flush();
+
+	read_ahead.Clear();
+	media_changed = true;
+}
+
+ReadAhead& msc_disk_read_ahead()
+{
+	return read_ahead;
+}
+
+WriteQueue& msc_disk_write_queue()
+{
+	return write_queue;
+}
+
+DirectoryIndex& msc_disk_directories()
+{
+	return directory_index;
+}
+
+bool msc_disk_take_snapshot()
+{
+	Fat16* fs = msc_disk_begin_local_write();
+	fs->Flush();
+	return storage_snapshots().Take();
+}
+
+bool msc_disk_rollback_snapshot()
+{
+	Fat16* fs = msc_disk_begin_local_write();
+	if (!storage_snapshots().Rollback())
+		return false;
+
+	fs->Remount();
+	msc_disk_media_changed();
+	return true;
+}
+
+bool msc_disk_drop_snapshot()
+{
+	msc_disk_begin_local_write();
+	return storage_snapshots().Drop();
+}
+
+bool msc_disk_reset_task()
+{
+	// msc_disk_begin() sets the pin up
+	if (fat_fs == nullptr)
+		return false;
+
+	if (gpio_get(RESET_PIN) != 0) {
+		reset_pin_low_polls = 0;
+		startup_mark(STARTUP_JUMPER);
+		return false;
+	}
+
+	if (reset_pin_low_polls >= RESET_DEBOUNCE_POLLS || ++reset_pin_low_polls < RESET_DEBOUNCE_POLLS)
+		return false;
+
+	safe_print("GPIO17 shorted, formatting\n");
+	Fat16* fs = msc_disk_begin_local_write();
+	fs->Format();
+	msc_disk_media_changed();
+	startup_mark(STARTUP_JUMPER);
+	return true;
+}
+
+bool msc_disk_maintenance()
+{
+	if (fat_fs == nullptr)
+		return false;
+
+	if (fat_fs->Idle())
+		return true;
+
+	// Erasing what a held snapshot still has would spend a spare unit on
+	// a cluster the host may never write again
+	if (!write_queue.Empty() || storage_snapshots().HasSnapshot())
+		return false;
+
+	read_ahead.Clear();
+	return fat_fs->PreErase();
+}
+
+bool msc_disk_scrub()
+{
+	if (fat_fs == nullptr)
+		return false;
+
+	return storage_integrity().Scrub();
+}
+
+bool msc_disk_check()
+{
+	if (fat_fs == nullptr)
+		return false;
+
+	uint32_t repaired = volume_check.GetStats().repaired;
+	bool busy = volume_check.Step(*fat_fs, VOLUME_CHECK_REPAIR && !host_wrote);
+
+	if (volume_check.GetStats().repaired != repaired)
+		msc_disk_media_changed();
+
+	return busy && volume_check.IsRunning();
+}
+
+// Invoked when received GET_MAX_LUN request. Despite the name, the
+// number of LUNs.
+uint8_t tud_msc_get_maxlun_cb(void)
+{
+  return ReadOnlyDisk::IsPresent() ? 2 : 1;
+}
+
 // Invoked when received SCSI_CMD_INQUIRY
 // Application fill vendor id, product id and revision with string up to 8, 16, 4 characters respectively
 void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
 {
-  (void) lun;
-
   const char vid[] = "TinyUSB";
-  const char pid[] = "Mass Storage";
+  const char* pid = lun == LUN_READONLY ? "Docs (read-only)" : "Mass Storage";
   const char rev[] = "1.0";
 
   memcpy(vendor_id  , vid, strlen(vid));
-  memcpy(product_id , pid, strlen(pid));
+  memcpy(product_id , pid, strlen(pid) < 16 ? strlen(pid) : 16);
   memcpy(product_rev, rev, strlen(rev));
 }
 
@@ -31,10 +331,15 @@ void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16
 // return true allowing host to read/write this LUN e.g SD card inserted
 bool tud_msc_test_unit_ready_cb(uint8_t lun)
 {
-  (void) lun;
+  // Part of the firmware, so always there
+  if (lun == LUN_READONLY)
+    return true;
 
-  // RAM disk is ready until ejected
-  if (ejected) {
+  if (report_media_change(lun) || report_write_failure(lun))
+    return false;
+
+  // Ready until ejected, if the storage came up at all
+  if (ejected || (fat_fs != nullptr && !fat_fs->IsReady())) {
     // Additional Sense 3A-00 is NOT_FOUND
     tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
     return false;
@@ -47,14 +352,17 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
 // Application update block count and block size
 void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size)
 {
-	(void) lun;
-	if(fat_fs == nullptr)
-		fat_fs = new Fat16();
-
+	if (lun == LUN_READONLY) {
+		*block_count = ReadOnlyDisk::GetBlockCount();
+		*block_size  = ReadOnlyDisk::BLOCK_SIZE;
+		return;
+	}
 
+	open_volume();
 
 	*block_count = fat_fs->GetBlockCount();
 	*block_size  = fat_fs->GetBlockSize();
+	startup_mark(STARTUP_CAPACITY);
 }
 
 // Invoked when received Start Stop Unit command
@@ -62,9 +370,12 @@ void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_siz
 // - Start = 1 : active mode, if load_eject = 1 : load disk storage
 bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
 {
-  (void) lun;
   (void) power_condition;
 
+  // Nothing to flush, and it stays mounted
+  if (lun == LUN_READONLY)
+    return true;
+
   if ( load_eject )
   {
     if (start)
@@ -73,7 +384,17 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
     }else
     {
       // unload disk storage
+      if (fat_fs != nullptr)
+      {
+        write_queue.Drain(*fat_fs);
+        fat_fs->Compact();
+        fat_fs->Flush();
+      }
       ejected = true;
+      host_wrote = false;
+
+      if (report_write_failure(lun))
+        return false;
     }
   }
 
@@ -84,33 +405,115 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
 // Copy disk's data to buffer (up to bufsize) and return number of copied bytes.
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
 {
-	(void) lun;
-	if(fat_fs == nullptr)
-		fat_fs = new Fat16();
+	// TinyUSB moves `lba` on itself, and with a buffer of whole blocks
+	// `offset` is always 0
+	(void) offset;
+
+	// Straight out of XIP, without waiting on anything staged for LUN 0
+	if (lun == LUN_READONLY)
+		return ReadOnlyDisk::GetBlock(lba, buffer, bufsize);
+
+	open_volume();
 
-	return fat_fs->GetBlock(lba, buffer, bufsize);
+	last_access_us = time_us_64();
+
+	if (report_media_change(lun))
+		return -1;
+
+	// Newer data for these blocks is still staged, so commit it first
+	write_queue.CommitOverlapping(*fat_fs, lba, bufsize);
+	if (report_write_failure(lun))
+		return -1;
+
+	// Data that no longer matches its checksum is not handed back as if
+	// it were fine. 11-00 is UNRECOVERED READ ERROR.
+	uint32_t corrupt_reads = storage_integrity().GetCorruptReads();
+	int32_t got = read_ahead.Read(*fat_fs, lba, buffer, bufsize);
+	if (got >= 0 && storage_integrity().GetCorruptReads() != corrupt_reads) {
+		tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x11, 0x00);
+		return -1;
+	}
+
+	if (got >= 0)
+		append_log_patch(lba, buffer, bufsize);
+	return got;
 
 }
 
 bool tud_msc_is_writable_cb (uint8_t lun)
 {
-  (void) lun;
-	if(fat_fs == nullptr)
-		fat_fs = new Fat16();
+  if (lun == LUN_READONLY)
+    return false;
+
+	open_volume();
 
 
   return true;
 }
 
 // Callback invoked when received WRITE10 command.
-// Process data in buffer to disk's storage and return number of written bytes
+// Stage data in buffer and leave it for msc_disk_task(), or without early
+// acknowledgement commit it, and return number of accepted bytes.
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
 {
-	(void) lun;
-	if(fat_fs == nullptr)
-		fat_fs = new Fat16();
+	(void) offset;
+
+	// TinyUSB checks is_writable first, but just in case. 27-00 is WRITE
+	// PROTECTED.
+	if (lun == LUN_READONLY) {
+		tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);
+		return -1;
+	}
+
+	open_volume();
 
-	return fat_fs->WriteBlock(lba, buffer, bufsize);
+	last_access_us = time_us_64();
+
+	// Whatever the host is writing was based on its stale view
+	if (report_media_change(lun))
+		return -1;
+
+	// An earlier chunk the host was told is written did not make it
+	if (report_write_failure(lun))
+		return -1;
+
+	// out of range, or out of space on the device
+	if (!fat_fs->CheckWrite(lba, buffer, bufsize)) {
+		tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);
+		return -1;
+	}
+
+	// Only a write that is going ahead can close the append log
+	host_wrote = true;
+	append_log_host_write(lba, buffer, bufsize);
+
+	// A pinned file cannot hold the host off: TinyUSB asks again from
+	// within the same tud_task, so whoever pinned it would never get to
+	// unpin. The write ends the pin instead, see FileMap.
+	FileMap::Invalidate(lba, bufsize / Fat16::DISK_BLOCK_SIZE);
+
+	// Larger than a staging slot, so it was never taken. 0C-00 is WRITE
+	// ERROR.
+	if (!write_queue.Push(*fat_fs, lba, buffer, bufsize)) {
+		tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+		return -1;
+	}
+	read_ahead.Write(lba, buffer, bufsize);
+
+	// Unless the host may be told early, this chunk and what is left of
+	// the flash work it queued are done before the callback returns. That
+	// runs the slices back to back; acknowledged early, msc_disk_task()
+	// runs them one per pass and tud_task gets in between.
+	if (!write_queue.IsEarlyAck()) {
+		write_queue.Drain(*fat_fs);
+		PicoFlash::Finish();
+		if (report_write_failure(lun)) {
+			read_ahead.Invalidate(lba, bufsize);
+			return -1;
+		}
+	}
+
+	return (int32_t) bufsize;
 }
 
 // Callback invoked when received an SCSI command not in built-in list below
@@ -128,6 +531,55 @@ int32_t tud_msc_scsi_cb (uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
 
   switch (scsi_cmd[0])
   {
+    case SCSI_SYNCHRONIZE_CACHE_10:
+      // Host wants everything it wrote to be on flash before status
+      if (lun == LUN_VOLUME && fat_fs != nullptr)
+      {
+        write_queue.Drain(*fat_fs);
+        fat_fs->Flush();
+      }
+      resplen = report_write_failure(lun) ? -1 : 0;
+    break;
+
+    case SCSI_VENDOR_SNAPSHOT:
+    {
+      // Snapshots are of the writable volume only
+      bool ok = false;
+      switch (lun == LUN_VOLUME ? scsi_cmd[1] : 0xFF)
+      {
+        case SNAPSHOT_STATUS:
+        {
+          SnapshotDevice& snapshots = storage_snapshots();
+          uint16_t diverged = (uint16_t) snapshots.GetDivergedUnits();
+          uint16_t free_units = (uint16_t) snapshots.GetFreeUnits();
+          static uint8_t status[8];
+          status[0] = (snapshots.IsEnabled() ? 0x01 : 0) | (snapshots.HasSnapshot() ? 0x02 : 0) |
+              (snapshots.WasLost() ? 0x04 : 0);
+          status[1] = status[2] = status[3] = 0;
+          status[4] = diverged >> 8;
+          status[5] = diverged & 0xFF;
+          status[6] = free_units >> 8;
+          status[7] = free_units & 0xFF;
+          response = status;
+          resplen = sizeof(status);
+          ok = true;
+        }
+        break;
+
+        case SNAPSHOT_TAKE:     ok = msc_disk_take_snapshot(); break;
+        case SNAPSHOT_ROLLBACK: ok = msc_disk_rollback_snapshot(); break;
+        case SNAPSHOT_DROP:     ok = msc_disk_drop_snapshot(); break;
+      }
+
+      if (!ok)
+      {
+        // Invalid Field in CDB, or nothing to roll back to
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+        resplen = -1;
+      }
+    }
+    break;
+
     default:
       // Set Sense = Invalid Command Operation
       tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
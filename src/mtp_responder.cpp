@@ -0,0 +1,1275 @@
+#include "mtp_responder.h"
+#include "mtp_usb.h"
+#include "append_log.h"
+#include "directory_index.h"
+#include "fat.h"
+#include "fat_standard.hpp"
+#include "fat_cursor.hpp"
+#include "file_writer.h"
+#include "msc_disk.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#define CONTAINER_HEADER 12
+#define MAX_PARAMS 5
+
+// Most a task call reads or writes before it lets the rest of the main
+// loop run
+#define STEP_BYTES (4 * Fat16::DISK_BLOCK_SIZE)
+
+// Deepest GetObjectHandles looks for all objects, root included
+#define MAX_DEPTH 8
+
+// As a storage, every one; as a parent, the root
+#define ALL_STORAGE 0xFFFFFFFF
+#define PARENT_ROOT 0xFFFFFFFF
+
+// What a file gets when the host does not say, as MakeDirectory gives
+#define DEFAULT_DATE ((44 << 9) | (1 << 5) | 1) // 2024-01-01
+
+// Everything from the FAT to the end of the root directory
+#define METADATA_BYTES (Fat16::INDEX_DATA_STARTS * Fat16::DISK_BLOCK_SIZE)
+
+// Where the filename starts in an ObjectInfo dataset
+#define OBJECT_INFO_FILENAME 52
+
+enum ContainerType : uint16_t {
+	CONTAINER_COMMAND = 1,
+	CONTAINER_DATA = 2,
+	CONTAINER_RESPONSE = 3
+};
+
+enum Operation : uint16_t {
+	OP_GET_DEVICE_INFO = 0x1001,
+	OP_OPEN_SESSION = 0x1002,
+	OP_CLOSE_SESSION = 0x1003,
+	OP_GET_STORAGE_IDS = 0x1004,
+	OP_GET_STORAGE_INFO = 0x1005,
+	OP_GET_NUM_OBJECTS = 0x1006,
+	OP_GET_OBJECT_HANDLES = 0x1007,
+	OP_GET_OBJECT_INFO = 0x1008,
+	OP_GET_OBJECT = 0x1009,
+	OP_DELETE_OBJECT = 0x100B,
+	OP_SEND_OBJECT_INFO = 0x100C,
+	OP_SEND_OBJECT = 0x100D,
+
+	// Not offered, but followed by a data phase that has to be taken
+	OP_SET_DEVICE_PROP_VALUE = 0x1016,
+	OP_SET_OBJECT_PROP_VALUE = 0x9804,
+	OP_SET_OBJECT_PROP_LIST = 0x9806,
+	OP_SEND_OBJECT_PROP_LIST = 0x9808,
+	OP_SET_OBJECT_REFERENCES = 0x9811
+};
+
+enum ResponseCode : uint16_t {
+	RESPONSE_OK = 0x2001,
+	RESPONSE_GENERAL_ERROR = 0x2002,
+	RESPONSE_SESSION_NOT_OPEN = 0x2003,
+	RESPONSE_OPERATION_NOT_SUPPORTED = 0x2005,
+	RESPONSE_INCOMPLETE_TRANSFER = 0x2007,
+	RESPONSE_INVALID_STORAGE_ID = 0x2008,
+	RESPONSE_INVALID_OBJECT_HANDLE = 0x2009,
+	RESPONSE_STORE_FULL = 0x200C,
+	RESPONSE_OBJECT_WRITE_PROTECTED = 0x200D,
+	RESPONSE_ACCESS_DENIED = 0x200F,
+	RESPONSE_STORE_NOT_AVAILABLE = 0x2013,
+	RESPONSE_FORMAT_UNSUPPORTED = 0x2014,   // Specification by format
+	RESPONSE_NO_VALID_OBJECT_INFO = 0x2015,
+	RESPONSE_INVALID_PARENT = 0x201A,
+	RESPONSE_INVALID_PARAMETER = 0x201D,
+	RESPONSE_SESSION_ALREADY_OPEN = 0x201E
+};
+
+enum ResponderState {
+	STATE_COMMAND,  // Waiting for (the rest of) a command
+	STATE_RECEIVE,  // Taking the data phase the host sends
+	STATE_SEND,     // Sending the data phase
+	STATE_RESPOND   // Sending the response
+};
+
+enum DataKind {
+	DATA_DATASET,   // Built whole in `dataset`
+	DATA_HANDLES,   // Walked from the directories as it goes out
+	DATA_OBJECT,    // A file, sector by sector
+	DATA_UPLOAD,    // A file coming in, into `writer`
+	DATA_SKIP       // Taken and thrown away
+};
+
+// Laid out as on the wire, with no padding to pack away
+struct Container {
+	uint32_t length;
+	uint16_t type;
+	uint16_t code;
+	uint32_t transaction;
+	uint32_t params[MAX_PARAMS];
+};
+
+static_assert(sizeof(Container) == CONTAINER_HEADER + 4 * MAX_PARAMS, "Container must match the wire format");
+
+static ResponderState state = STATE_COMMAND;
+static Container command;
+static uint32_t command_bytes = 0;
+
+static bool session_open = false;
+static uint32_t session_id = 0;
+
+static Container response;
+
+// The data phase: its header, what follows, and how much of the whole
+// container has gone either way
+static Container data;
+static uint32_t data_header_bytes = 0;
+static DataKind data_kind;
+static uint32_t data_length;
+static uint32_t data_done;
+
+static uint8_t dataset[512];
+static uint32_t dataset_bytes;
+
+// GetObjectHandles walks down into each folder as it comes to it
+struct Walk {
+	uint16_t dirs[MAX_DEPTH];
+	uint32_t numbers[MAX_DEPTH];
+	uint32_t depth;
+	bool recursive;
+	uint16_t format;  // Only objects of this format, 0 for any
+};
+
+static Walk walk;
+
+// The file GetObject is sending: the cluster holding `object_offset`, and
+// where in the file it starts
+static uint16_t object_cluster;
+static uint32_t object_cluster_offset;
+static uint32_t object_offset;
+
+// The file SendObjectInfo announced, for SendObject
+static bool upload_ready = false;
+static bool upload_failed = false;
+static uint8_t upload_cluster[Fat16::CLUSTER_BYTES] STORAGE_ARENA;
+static FileWriter writer(upload_cluster);
+
+// Directory and file sectors are read into here. It holds on to the last
+// one until the volume changes.
+static uint8_t sector[Fat16::DISK_BLOCK_SIZE] STORAGE_ARENA;
+static uint32_t sector_lba = UINT32_MAX;
+static uint32_t sector_generation = 0;
+
+static FatCursor fat_cursor;
+static uint32_t fat_cursor_generation = 0;
+
+// The handle of the folder last asked for as a parent
+static uint16_t parent_dir = DirectoryIndex::ROOT;
+static uint32_t parent_handle = 0;
+static uint32_t parent_generation = UINT32_MAX;
+
+//--------------------------------------------------------------------+
+// Reading the volume
+//--------------------------------------------------------------------+
+
+/**
+ * Block `lba` as the host would see it, in `sector`.
+ */
+static bool read_block(uint32_t lba)
+{
+	Fat16* fs = msc_disk_begin_local_read(lba, Fat16::DISK_BLOCK_SIZE);
+	if (lba == sector_lba && sector_generation == Fat16::GetGeneration())
+		return true;
+
+	sector_lba = UINT32_MAX;
+	if (fs->GetBlock(lba, sector, sizeof(sector)) < 0)
+		return false;
+
+	append_log_patch(lba, sector, sizeof(sector));
+	sector_lba = lba;
+	sector_generation = Fat16::GetGeneration();
+	return true;
+}
+
+static FatCursor& cursor()
+{
+	if (fat_cursor_generation != Fat16::GetGeneration()) {
+		fat_cursor.Forget();
+		fat_cursor_generation = Fat16::GetGeneration();
+	}
+
+	return fat_cursor;
+}
+
+static fat::DirectoryEntry& entry_at(const DirectoryIndex::Slot& slot)
+{
+	return ((fat::DirectoryEntry*) sector)[slot.index];
+}
+
+static uint32_t handle_of(uint16_t dir, uint32_t number)
+{
+	return ((uint32_t) dir << 16 | number) + 1;
+}
+
+static uint16_t format_of(const fat::DirectoryEntry& entry)
+{
+	return entry.attributes & fat::DirectoryEntryBuilder::DIRECTORY ? MTP_FORMAT_ASSOCIATION : MTP_FORMAT_UNDEFINED;
+}
+
+/**
+ * Whether `cluster` is where a subdirectory starts: its first entry is
+ * "." and points back at it.
+ */
+static bool is_directory(Fat16& fs, uint16_t cluster)
+{
+	if (cluster < Fat16::FIRST_CLUSTER || cluster > fs.GetLastCluster() || !read_block(Fat16::ClusterToLBA(cluster)))
+		return false;
+
+	const fat::DirectoryEntry& dot = ((const fat::DirectoryEntry*) sector)[0];
+	return memcmp(dot.name, ".          ", 11) == 0 && (dot.attributes & fat::DirectoryEntryBuilder::DIRECTORY) &&
+		dot.start_cluster == cluster;
+}
+
+/**
+ * The entry `handle` stands for, in `sector` at `slot`, with the directory
+ * holding it in `dir`. False if it is not a file or folder.
+ */
+static bool find_object(uint32_t handle, uint16_t& dir, DirectoryIndex::Slot& slot)
+{
+	if (handle == 0 || handle == PARENT_ROOT)
+		return false;
+
+	dir = (uint16_t) ((handle - 1) >> 16);
+	uint32_t number = (handle - 1) & 0xFFFF;
+
+	Fat16* fs = msc_disk_begin_local_read(0, dir == DirectoryIndex::ROOT ? 0 : METADATA_BYTES);
+	if (!fs->IsReady() || (dir != DirectoryIndex::ROOT && !is_directory(*fs, dir)))
+		return false;
+
+	return msc_disk_directories().Locate(*fs, dir, number, slot) && slot.IsValid() && read_block(slot.lba) &&
+		DirectoryIndex::IsNamed(entry_at(slot));
+}
+
+/**
+ * Entry number of `slot` in `dir`, going along the directory's chain.
+ */
+static bool number_of(Fat16& fs, uint16_t dir, const DirectoryIndex::Slot& slot, uint32_t& number)
+{
+	uint32_t per_sector = DirectoryIndex::ENTRIES_PER_SECTOR;
+	if (dir == DirectoryIndex::ROOT) {
+		number = (slot.lba - Fat16::INDEX_ROOT_DIRECTORY) * per_sector + slot.index;
+		return true;
+	}
+
+	uint32_t last = fs.GetLastCluster();
+	uint16_t cluster = dir;
+	for (uint32_t k = 0; k <= last && cluster >= Fat16::FIRST_CLUSTER && cluster <= last; k++) {
+		uint32_t first = Fat16::ClusterToLBA(cluster);
+		if (slot.lba >= first && slot.lba < first + Fat16::DISK_CLUSTER_SIZE) {
+			number = k * DirectoryIndex::ENTRIES_PER_CLUSTER + (slot.lba - first) * per_sector + slot.index;
+			return true;
+		}
+
+		if (!cursor().Get(fs, cluster, cluster))
+			return false;
+	}
+
+	return false;
+}
+
+/**
+ * The handle of the folder starting at `dir`, 0 for the root, found by
+ * looking through its parent ("..") for the entry that points at it.
+ */
+static uint32_t handle_of_directory(Fat16& fs, uint16_t dir)
+{
+	if (dir == DirectoryIndex::ROOT)
+		return 0;
+
+	if (dir == parent_dir && parent_generation == Fat16::GetGeneration())
+		return parent_handle;
+
+	if (!read_block(Fat16::ClusterToLBA(dir)))
+		return 0;
+
+	uint16_t grandparent = ((const fat::DirectoryEntry*) sector)[1].start_cluster;
+	DirectoryIndex& directories = msc_disk_directories();
+
+	for (uint32_t number = 0; ; number++) {
+		DirectoryIndex::Slot slot;
+		if (!directories.Locate(fs, grandparent, number, slot) || !slot.IsValid() || !read_block(slot.lba))
+			return 0;
+
+		const fat::DirectoryEntry& entry = entry_at(slot);
+		if (entry.name[0] == 0)
+			return 0;
+
+		if (DirectoryIndex::IsNamed(entry) && (entry.attributes & fat::DirectoryEntryBuilder::DIRECTORY) &&
+				entry.start_cluster == dir) {
+			parent_dir = dir;
+			parent_handle = handle_of(grandparent, number);
+			parent_generation = Fat16::GetGeneration();
+			return parent_handle;
+		}
+	}
+}
+
+/**
+ * The folder `handle` names as a parent, in `dir`.
+ */
+static bool find_parent(uint32_t handle, uint16_t& dir)
+{
+	if (handle == PARENT_ROOT || handle == 0) {
+		dir = DirectoryIndex::ROOT;
+		return true;
+	}
+
+	uint16_t holder;
+	DirectoryIndex::Slot slot;
+	if (!find_object(handle, holder, slot) || !(entry_at(slot).attributes & fat::DirectoryEntryBuilder::DIRECTORY))
+		return false;
+
+	dir = entry_at(slot).start_cluster;
+	return true;
+}
+
+//--------------------------------------------------------------------+
+// Walking for GetObjectHandles and GetNumObjects
+//--------------------------------------------------------------------+
+
+static void walk_begin(uint16_t dir, bool recursive, uint16_t format)
+{
+	walk.dirs[0] = dir;
+	walk.numbers[0] = 0;
+	walk.depth = 1;
+	walk.recursive = recursive;
+	walk.format = format;
+}
+
+/**
+ * The next object of the walk in `handle`, or 0 at the end. False if a
+ * directory could not be read.
+ */
+static bool walk_next(uint32_t& handle)
+{
+	handle = 0;
+	DirectoryIndex& directories = msc_disk_directories();
+
+	while (walk.depth > 0) {
+		uint16_t dir = walk.dirs[walk.depth - 1];
+		uint32_t number = walk.numbers[walk.depth - 1];
+
+		Fat16* fs = msc_disk_begin_local_read(0, dir == DirectoryIndex::ROOT ? 0 : METADATA_BYTES);
+		DirectoryIndex::Slot slot;
+		if (!directories.Locate(*fs, dir, number, slot))
+			return false;
+
+		if (!slot.IsValid()) {
+			walk.depth--;
+			continue;
+		}
+
+		if (!read_block(slot.lba))
+			return false;
+
+		const fat::DirectoryEntry& entry = entry_at(slot);
+		if (entry.name[0] == 0) {
+			walk.depth--;
+			continue;
+		}
+
+		walk.numbers[walk.depth - 1]++;
+		if (!DirectoryIndex::IsNamed(entry))
+			continue;
+
+		if (walk.recursive && (entry.attributes & fat::DirectoryEntryBuilder::DIRECTORY) && walk.depth < MAX_DEPTH) {
+			walk.dirs[walk.depth] = entry.start_cluster;
+			walk.numbers[walk.depth] = 0;
+			walk.depth++;
+		}
+
+		if (walk.format == 0 || walk.format == format_of(entry)) {
+			handle = handle_of(dir, number);
+			return true;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Check the storage, format and parent GetObjectHandles and GetNumObjects
+ * take and start the walk over what they ask for.
+ */
+static uint16_t begin_listing(const uint32_t* params)
+{
+	if (params[0] != ALL_STORAGE && params[0] != MTP_STORAGE_ID)
+		return RESPONSE_INVALID_STORAGE_ID;
+
+	uint16_t format = (uint16_t) params[1];
+	if (params[1] > 0xFFFF || (format != 0 && format != MTP_FORMAT_UNDEFINED && format != MTP_FORMAT_ASSOCIATION))
+		return RESPONSE_FORMAT_UNSUPPORTED;
+
+	// 0 is everything in the storage
+	uint16_t dir;
+	if (!find_parent(params[2], dir))
+		return RESPONSE_INVALID_PARENT;
+
+	walk_begin(dir, params[2] == 0, format);
+	return RESPONSE_OK;
+}
+
+/**
+ * How many objects the walk begun will come to, starting it over after.
+ */
+static bool walk_count(uint32_t& count)
+{
+	Walk start = walk;
+	count = 0;
+
+	uint32_t handle;
+	do {
+		if (!walk_next(handle))
+			return false;
+		count += handle != 0;
+	} while (handle != 0);
+
+	walk = start;
+	return true;
+}
+
+//--------------------------------------------------------------------+
+// Datasets
+//--------------------------------------------------------------------+
+
+static void put(const void* value, uint32_t length)
+{
+	if (dataset_bytes + length <= sizeof(dataset))
+		memcpy(dataset + dataset_bytes, value, length);
+	dataset_bytes = std::min<uint32_t>(dataset_bytes + length, sizeof(dataset));
+}
+
+static void put8(uint8_t value)
+{
+	put(&value, 1);
+}
+
+static void put16(uint16_t value)
+{
+	put(&value, 2);
+}
+
+static void put32(uint32_t value)
+{
+	put(&value, 4);
+}
+
+static void put64(uint64_t value)
+{
+	put(&value, 8);
+}
+
+/**
+ * A PTP string: its length in characters with the terminator, then UTF-16.
+ */
+static void put_string(const char* text, uint32_t length)
+{
+	if (length == 0) {
+		put8(0);
+		return;
+	}
+
+	put8((uint8_t) (length + 1));
+	for (uint32_t i = 0; i < length; i++)
+		put16((uint8_t) text[i]);
+	put16(0);
+}
+
+static void put_string(const char* text)
+{
+	put_string(text, strlen(text));
+}
+
+static void put_array16(const uint16_t* values, uint32_t count)
+{
+	put32(count);
+	for (uint32_t i = 0; i < count; i++)
+		put16(values[i]);
+}
+
+/**
+ * A FAT date and time as "YYYYMMDDThhmmss".
+ */
+static void put_date(uint16_t date, uint16_t time)
+{
+	char text[24];
+	int length = snprintf(text, sizeof(text), "%04u%02u%02uT%02u%02u%02u", 1980 + (date >> 9), (date >> 5) & 15,
+			date & 31, time >> 11, (time >> 5) & 63, (time & 31) * 2);
+	put_string(text, (uint32_t) length);
+}
+
+/**
+ * The string at `offset` of what the host sent, as ASCII in `out`, with
+ * anything that is not put as 0 so no name can be made of it. Returns
+ * where the string ends.
+ */
+static uint32_t get_string(uint32_t offset, char* out, uint32_t size, uint32_t& length)
+{
+	length = 0;
+	if (offset >= dataset_bytes)
+		return offset;
+
+	uint32_t count = dataset[offset++];
+	for (uint32_t i = 0; i < count && offset + 2 <= dataset_bytes; i++, offset += 2) {
+		uint16_t c;
+		memcpy(&c, dataset + offset, 2);
+		if (c == 0)
+			continue;
+		if (length < size)
+			out[length] = c < 0x80 ? (char) c : 0;
+		length++;
+	}
+
+	return offset;
+}
+
+/**
+ * "YYYYMMDDThhmmss" as a FAT date and time. False if it is not one.
+ */
+static bool parse_date(const char* text, uint32_t length, uint16_t& date, uint16_t& time)
+{
+	if (length < 15 || text[8] != 'T')
+		return false;
+
+	unsigned v[6];
+	const uint8_t widths[6] = { 4, 2, 2, 2, 2, 2 };
+	const char* p = text;
+	for (int i = 0; i < 6; i++) {
+		if (i == 3)
+			p++;
+		v[i] = 0;
+		for (int d = 0; d < widths[i]; d++, p++) {
+			if (*p < '0' || *p > '9')
+				return false;
+			v[i] = v[i] * 10 + (*p - '0');
+		}
+	}
+
+	if (v[0] < 1980 || v[0] > 2107 || v[1] < 1 || v[1] > 12 || v[2] < 1 || v[2] > 31)
+		return false;
+
+	date = (uint16_t) ((v[0] - 1980) << 9 | v[1] << 5 | v[2]);
+	time = (uint16_t) (v[3] << 11 | v[4] << 5 | v[5] / 2);
+	return true;
+}
+
+static void build_device_info()
+{
+	static const uint16_t operations[] = {
+		OP_GET_DEVICE_INFO, OP_OPEN_SESSION, OP_CLOSE_SESSION, OP_GET_STORAGE_IDS, OP_GET_STORAGE_INFO,
+		OP_GET_NUM_OBJECTS, OP_GET_OBJECT_HANDLES, OP_GET_OBJECT_INFO, OP_GET_OBJECT, OP_DELETE_OBJECT,
+		OP_SEND_OBJECT_INFO, OP_SEND_OBJECT
+	};
+	static const uint16_t formats[] = { MTP_FORMAT_UNDEFINED, MTP_FORMAT_ASSOCIATION };
+
+	dataset_bytes = 0;
+	put16(100);                      // PTP 1.00
+	put32(6);                        // Microsoft's extensions, MTP
+	put16(100);
+	put_string("microsoft.com: 1.0;");
+	put16(0);                        // Functional mode
+	put_array16(operations, sizeof(operations) / sizeof(operations[0]));
+	put_array16(nullptr, 0);         // Events
+	put_array16(nullptr, 0);         // Device properties
+	put_array16(nullptr, 0);         // Capture formats
+	put_array16(formats, 2);         // Playback formats
+	put_string("picowremote");
+	put_string("Pico W flash drive");
+	put_string("1.0");
+	put_string("0001");
+}
+
+static bool build_storage_info()
+{
+	Fat16* fs = msc_disk_begin_local_read(0, METADATA_BYTES);
+	if (!fs->IsReady())
+		return false;
+
+	// Counted by VolumeCheck, if it has had a chance yet
+	int32_t free_clusters = fs->GetFreeClusters();
+	if (free_clusters < 0) {
+		free_clusters = 0;
+		for (uint32_t cluster = Fat16::FIRST_CLUSTER; cluster <= fs->GetLastCluster(); cluster++) {
+			uint16_t value;
+			if (!cursor().Get(*fs, cluster, value))
+				return false;
+			free_clusters += value == FatCursor::FREE;
+		}
+	}
+
+	uint32_t clusters = fs->GetLastCluster() + 1 - Fat16::FIRST_CLUSTER;
+
+	dataset_bytes = 0;
+	put16(0x0003);                   // Fixed RAM
+	put16(0x0002);                   // Generic hierarchical
+	put16(0x0000);                   // Read and write
+	put64((uint64_t) clusters * Fat16::CLUSTER_BYTES);
+	put64((uint64_t) free_clusters * Fat16::CLUSTER_BYTES);
+	put32(0xFFFFFFFF);               // Free space in objects, not used
+	put_string("Flash");
+	put_string("");
+	return true;
+}
+
+static bool build_object_info(uint32_t handle)
+{
+	uint16_t dir;
+	DirectoryIndex::Slot slot;
+	if (!find_object(handle, dir, slot))
+		return false;
+
+	fat::DirectoryEntry entry = entry_at(slot);
+	bool folder = entry.attributes & fat::DirectoryEntryBuilder::DIRECTORY;
+	Fat16* fs = msc_disk_begin_local_read(0, 0);
+	uint32_t parent = handle_of_directory(*fs, dir);
+
+	char name[12];
+	uint32_t name_length = fat::FromShortName(entry.name, name);
+
+	dataset_bytes = 0;
+	put32(MTP_STORAGE_ID);
+	put16(format_of(entry));
+	put16(entry.attributes & fat::DirectoryEntryBuilder::READ_ONLY ? 0x0001 : 0x0000);
+	put32(folder ? 0 : entry.size);
+	put16(0);                        // Thumbnail format
+	put32(0);                        // Thumbnail size
+	put32(0);                        // Thumbnail width
+	put32(0);                        // Thumbnail height
+	put32(0);                        // Image width
+	put32(0);                        // Image height
+	put32(0);                        // Image bit depth
+	put32(parent);
+	put16(folder ? 0x0001 : 0x0000); // Generic folder
+	put32(0);                        // Association description
+	put32(0);                        // Sequence number
+	put_string(name, name_length);
+	put_date(entry.create_date, entry.create_time);
+	put_date(entry.update_date, entry.update_time);
+	put_string("");                  // Keywords
+	return true;
+}
+
+//--------------------------------------------------------------------+
+// Operations
+//--------------------------------------------------------------------+
+
+/**
+ * What the response will be, once the data phase is over if there is one.
+ */
+static void set_response(uint16_t code, uint32_t count = 0, uint32_t p0 = 0, uint32_t p1 = 0, uint32_t p2 = 0)
+{
+	response.length = CONTAINER_HEADER + 4 * count;
+	response.type = CONTAINER_RESPONSE;
+	response.code = code;
+	response.transaction = command.transaction;
+	response.params[0] = p0;
+	response.params[1] = p1;
+	response.params[2] = p2;
+}
+
+static void respond(uint16_t code, uint32_t count = 0, uint32_t p0 = 0, uint32_t p1 = 0, uint32_t p2 = 0)
+{
+	set_response(code, count, p0, p1, p2);
+	state = STATE_RESPOND;
+}
+
+static void begin_send(DataKind kind, uint32_t length)
+{
+	data.length = CONTAINER_HEADER + length;
+	data.type = CONTAINER_DATA;
+	data.code = command.code;
+	data.transaction = command.transaction;
+	data_kind = kind;
+	data_length = length;
+	data_done = 0;
+	state = STATE_SEND;
+}
+
+/**
+ * Take the data phase the host sends next, answering with what
+ * set_response() was given unless `kind` acts on it.
+ */
+static void begin_receive(DataKind kind)
+{
+	data_kind = kind;
+	data_header_bytes = 0;
+	data_done = 0;
+	dataset_bytes = 0;
+	state = STATE_RECEIVE;
+}
+
+static uint16_t to_response(FileWriter::Status status)
+{
+	switch (status) {
+	case FileWriter::WRITE_OK:
+		return RESPONSE_OK;
+	case FileWriter::WRITE_BAD_NAME:
+		return RESPONSE_INVALID_PARAMETER;
+	case FileWriter::WRITE_NO_SPACE:
+	case FileWriter::WRITE_DIRECTORY_FULL:
+		return RESPONSE_STORE_FULL;
+	case FileWriter::WRITE_NOT_READY:
+		return RESPONSE_STORE_NOT_AVAILABLE;
+	default:
+		return RESPONSE_GENERAL_ERROR;
+	}
+}
+
+/**
+ * Mark the entry of `handle` deleted, then free its chain, so power lost
+ * in between leaves clusters nothing points to.
+ */
+static uint16_t delete_object(uint32_t handle)
+{
+	uint16_t dir;
+	DirectoryIndex::Slot slot;
+	if (!find_object(handle, dir, slot))
+		return RESPONSE_INVALID_OBJECT_HANDLE;
+
+	fat::DirectoryEntry entry = entry_at(slot);
+	if (entry.attributes & fat::DirectoryEntryBuilder::READ_ONLY)
+		return RESPONSE_OBJECT_WRITE_PROTECTED;
+
+	Fat16* fs = msc_disk_begin_local_write();
+
+	if (entry.attributes & fat::DirectoryEntryBuilder::DIRECTORY) {
+		DirectoryIndex& directories = msc_disk_directories();
+		for (uint32_t number = 0; ; number++) {
+			DirectoryIndex::Slot inner;
+			if (!directories.Locate(*fs, entry.start_cluster, number, inner) || !inner.IsValid() ||
+					!read_block(inner.lba))
+				return RESPONSE_GENERAL_ERROR;
+
+			const fat::DirectoryEntry& e = entry_at(inner);
+			if (e.name[0] == 0)
+				break;
+			if (DirectoryIndex::IsNamed(e))
+				return RESPONSE_ACCESS_DENIED;
+		}
+	}
+
+	if (!read_block(slot.lba))
+		return RESPONSE_GENERAL_ERROR;
+
+	entry_at(slot).name[0] = (char) 0xE5;
+	sector_lba = UINT32_MAX;
+	if (fs->WriteBlock(slot.lba, sector, sizeof(sector)) < 0 || !cursor().FreeChain(*fs, entry.start_cluster))
+		return RESPONSE_GENERAL_ERROR;
+
+	msc_disk_media_changed();
+	return RESPONSE_OK;
+}
+
+/**
+ * The ObjectInfo SendObjectInfo sent is in `dataset`: make the folder, or
+ * get ready for the file.
+ */
+static void object_info_received()
+{
+	upload_ready = false;
+
+	uint16_t dir;
+	if (!find_parent(command.params[1], dir)) {
+		respond(RESPONSE_INVALID_PARENT);
+		return;
+	}
+
+	uint16_t format;
+	uint32_t size;
+	memcpy(&format, dataset + 4, 2);
+	memcpy(&size, dataset + 8, 4);
+
+	char text[32];
+	uint32_t length;
+	uint32_t offset = get_string(OBJECT_INFO_FILENAME, text, sizeof(text), length);
+
+	char name[11];
+	if (dataset_bytes < OBJECT_INFO_FILENAME || length > sizeof(text) || !fat::ToShortName(text, length, name) ||
+			!fat::IsValidShortName(name)) {
+		respond(RESPONSE_INVALID_PARAMETER);
+		return;
+	}
+
+	// The modification date if there is one, else the capture date
+	uint16_t date = DEFAULT_DATE;
+	uint16_t time = 0;
+	uint32_t captured_length;
+	char captured[32];
+	offset = get_string(offset, captured, sizeof(captured), captured_length);
+	offset = get_string(offset, text, sizeof(text), length);
+	if (!(length <= sizeof(text) && parse_date(text, length, date, time)) &&
+			!(captured_length <= sizeof(captured) && parse_date(captured, captured_length, date, time))) {
+		date = DEFAULT_DATE;
+		time = 0;
+	}
+
+	uint32_t parent = dir == DirectoryIndex::ROOT ? PARENT_ROOT : command.params[1];
+
+	if (format == MTP_FORMAT_ASSOCIATION) {
+		Fat16* fs = msc_disk_begin_local_write();
+		DirectoryIndex& directories = msc_disk_directories();
+		DirectoryIndex::Slot slot;
+		fat::DirectoryEntry entry;
+		uint16_t cluster;
+		uint32_t number;
+		if (!fs->IsReady() || !directories.MakeDirectory(*fs, dir, name, cluster) ||
+				!directories.Find(*fs, dir, name, slot, entry) || !slot.IsValid() || !number_of(*fs, dir, slot, number)) {
+			respond(RESPONSE_ACCESS_DENIED);
+			return;
+		}
+
+		msc_disk_media_changed();
+		respond(RESPONSE_OK, 3, MTP_STORAGE_ID, parent, handle_of(dir, number));
+		return;
+	}
+
+	FileWriter::Status status = writer.Begin(dir, name, fat::DirectoryEntryBuilder::ARCHIVE, size, time, date);
+	uint32_t number;
+	if (status == FileWriter::WRITE_OK && !number_of(*msc_disk_begin_local_write(), dir, writer.GetSlot(), number))
+		status = FileWriter::WRITE_IO_ERROR;
+
+	if (status != FileWriter::WRITE_OK) {
+		respond(to_response(status));
+		return;
+	}
+
+	upload_ready = true;
+	respond(RESPONSE_OK, 3, MTP_STORAGE_ID, parent, handle_of(dir, number));
+}
+
+/**
+ * Work out what to do about a complete command.
+ */
+static void run_command()
+{
+	uint32_t count = (command.length - CONTAINER_HEADER) / 4;
+	for (uint32_t i = count; i < MAX_PARAMS; i++)
+		command.params[i] = 0;
+
+	const uint32_t* params = command.params;
+	uint16_t code = command.code;
+
+	if (code == OP_GET_DEVICE_INFO) {
+		build_device_info();
+		begin_send(DATA_DATASET, dataset_bytes);
+		return;
+	}
+
+	if (code == OP_OPEN_SESSION) {
+		if (params[0] == 0)
+			respond(RESPONSE_INVALID_PARAMETER);
+		else if (session_open)
+			respond(RESPONSE_SESSION_ALREADY_OPEN, 1, session_id);
+		else {
+			session_open = true;
+			session_id = params[0];
+			upload_ready = false;
+			respond(RESPONSE_OK);
+		}
+		return;
+	}
+
+	if (!session_open) {
+		if (code == OP_SEND_OBJECT_INFO || code == OP_SEND_OBJECT) {
+			set_response(RESPONSE_SESSION_NOT_OPEN);
+			begin_receive(DATA_SKIP);
+		}
+		else
+			respond(RESPONSE_SESSION_NOT_OPEN);
+		return;
+	}
+
+	switch (code) {
+	case OP_CLOSE_SESSION:
+		session_open = false;
+		upload_ready = false;
+		respond(RESPONSE_OK);
+		return;
+
+	case OP_GET_STORAGE_IDS:
+		dataset_bytes = 0;
+		put32(1);
+		put32(MTP_STORAGE_ID);
+		begin_send(DATA_DATASET, dataset_bytes);
+		return;
+
+	case OP_GET_STORAGE_INFO:
+		if (params[0] != MTP_STORAGE_ID)
+			respond(RESPONSE_INVALID_STORAGE_ID);
+		else if (!build_storage_info())
+			respond(RESPONSE_STORE_NOT_AVAILABLE);
+		else
+			begin_send(DATA_DATASET, dataset_bytes);
+		return;
+
+	case OP_GET_NUM_OBJECTS:
+	case OP_GET_OBJECT_HANDLES: {
+		uint16_t status = begin_listing(params);
+		uint32_t objects;
+		if (status == RESPONSE_OK && !walk_count(objects))
+			status = RESPONSE_GENERAL_ERROR;
+
+		if (status != RESPONSE_OK)
+			respond(status);
+		else if (code == OP_GET_NUM_OBJECTS)
+			respond(RESPONSE_OK, 1, objects);
+		else {
+			// The count goes ahead of the handles
+			dataset_bytes = 0;
+			put32(objects);
+			begin_send(DATA_HANDLES, 4 + 4 * objects);
+		}
+		return;
+	}
+
+	case OP_GET_OBJECT_INFO:
+		if (!build_object_info(params[0]))
+			respond(RESPONSE_INVALID_OBJECT_HANDLE);
+		else
+			begin_send(DATA_DATASET, dataset_bytes);
+		return;
+
+	case OP_GET_OBJECT: {
+		uint16_t dir;
+		DirectoryIndex::Slot slot;
+		if (!find_object(params[0], dir, slot) || (entry_at(slot).attributes & fat::DirectoryEntryBuilder::DIRECTORY)) {
+			respond(RESPONSE_INVALID_OBJECT_HANDLE);
+			return;
+		}
+
+		object_cluster = entry_at(slot).start_cluster;
+		object_cluster_offset = 0;
+		object_offset = 0;
+		begin_send(DATA_OBJECT, entry_at(slot).size);
+		return;
+	}
+
+	case OP_DELETE_OBJECT:
+		respond(params[1] != 0 ? (uint16_t) RESPONSE_FORMAT_UNSUPPORTED : delete_object(params[0]));
+		return;
+
+	case OP_SEND_OBJECT_INFO:
+		if (params[0] != 0 && params[0] != MTP_STORAGE_ID) {
+			set_response(RESPONSE_INVALID_STORAGE_ID);
+			begin_receive(DATA_SKIP);
+			return;
+		}
+		begin_receive(DATA_DATASET);
+		return;
+
+	case OP_SEND_OBJECT:
+		upload_failed = false;
+		set_response(RESPONSE_NO_VALID_OBJECT_INFO);
+		begin_receive(upload_ready ? DATA_UPLOAD : DATA_SKIP);
+		return;
+
+	case OP_SET_DEVICE_PROP_VALUE:
+	case OP_SET_OBJECT_PROP_VALUE:
+	case OP_SET_OBJECT_PROP_LIST:
+	case OP_SEND_OBJECT_PROP_LIST:
+	case OP_SET_OBJECT_REFERENCES:
+		set_response(RESPONSE_OPERATION_NOT_SUPPORTED);
+		begin_receive(DATA_SKIP);
+		return;
+
+	default:
+		respond(RESPONSE_OPERATION_NOT_SUPPORTED);
+		return;
+	}
+}
+
+//--------------------------------------------------------------------+
+// Moving data
+//--------------------------------------------------------------------+
+
+/**
+ * The file could not be read to the end: cut the data phase short, which
+ * the host sees as a short transfer, and say so.
+ */
+static bool send_broken()
+{
+	safe_print("MTP download broken at byte %u\n", (unsigned) object_offset);
+	mtp_usb_end_container();
+	respond(RESPONSE_INCOMPLETE_TRANSFER);
+	return true;
+}
+
+/**
+ * Send what fits of the data phase. Returns true if anything went.
+ */
+static bool send_data()
+{
+	bool sent = false;
+	uint32_t total = CONTAINER_HEADER + data_length;
+	uint32_t step = 0;
+
+	while (data_done < total && step < STEP_BYTES) {
+		uint32_t room = mtp_usb_write_available();
+
+		if (data_done < CONTAINER_HEADER) {
+			if (room < CONTAINER_HEADER)
+				break;
+			mtp_usb_write(&data, CONTAINER_HEADER);
+			data_done = CONTAINER_HEADER;
+			sent = true;
+			continue;
+		}
+
+		uint32_t offset = data_done - CONTAINER_HEADER;
+		uint32_t length = 0;
+
+		if (data_kind == DATA_DATASET) {
+			length = mtp_usb_write(dataset + offset, std::min(room, dataset_bytes - offset));
+		}
+		else if (data_kind == DATA_HANDLES) {
+			if (room < 4)
+				break;
+
+			uint32_t handle = 0;
+			if (offset == 0)
+				memcpy(&handle, dataset, 4);
+			else if (!walk_next(handle) || handle == 0) {
+				// The volume changed under the walk: what is left is padded
+				// out, and the host asks again after the media change
+				handle = 0;
+			}
+			length = mtp_usb_write(&handle, 4);
+		}
+		else {
+			if (room == 0)
+				break;
+
+			Fat16* fs = msc_disk_begin_local_read(0, METADATA_BYTES);
+			while (object_offset >= object_cluster_offset + Fat16::CLUSTER_BYTES) {
+				uint16_t next;
+				if (!cursor().Get(*fs, object_cluster, next) || next < Fat16::FIRST_CLUSTER || next > fs->GetLastCluster())
+					return send_broken();
+				object_cluster = next;
+				object_cluster_offset += Fat16::CLUSTER_BYTES;
+			}
+
+			uint32_t lba = Fat16::ClusterToLBA(object_cluster) +
+				(object_offset - object_cluster_offset) / Fat16::DISK_BLOCK_SIZE;
+			if (!read_block(lba))
+				return send_broken();
+
+			uint32_t in_sector = object_offset % Fat16::DISK_BLOCK_SIZE;
+			length = std::min(room, std::min(Fat16::DISK_BLOCK_SIZE - in_sector, data_length - offset));
+			length = mtp_usb_write(sector + in_sector, length);
+			object_offset += length;
+		}
+
+		if (length == 0)
+			break;
+
+		data_done += length;
+		step += length;
+		sent = true;
+	}
+
+	if (data_done == total) {
+		mtp_usb_end_container();
+		respond(RESPONSE_OK);
+	}
+
+	return sent;
+}
+
+/**
+ * The data phase is all in: act on it.
+ */
+static void received()
+{
+	if (data_kind == DATA_DATASET) {
+		object_info_received();
+		return;
+	}
+
+	if (data_kind == DATA_UPLOAD) {
+		upload_ready = false;
+		respond(upload_failed ? (uint16_t) RESPONSE_GENERAL_ERROR : to_response(writer.Finish()));
+		return;
+	}
+
+	// Answered with what set_response() was given
+	state = STATE_RESPOND;
+}
+
+/**
+ * Take what has come of the data phase. Returns true if anything did.
+ */
+static bool receive_data()
+{
+	// A cluster completed on the last pass is written on this one, so the
+	// FIFO it was taken from refills meanwhile
+	if (data_kind == DATA_UPLOAD && writer.IsClusterReady()) {
+		if (!upload_failed && !writer.StoreCluster()) {
+			safe_print("MTP upload failed writing at byte %u\n", (unsigned) writer.GetReceived());
+			upload_failed = true;
+		}
+		writer.DropCluster();
+		if (data_header_bytes == CONTAINER_HEADER && data_done == data_length)
+			received();
+		return true;
+	}
+
+	if (mtp_usb_available() == 0)
+		return false;
+
+	if (data_header_bytes < CONTAINER_HEADER) {
+		data_header_bytes += mtp_usb_read((uint8_t*) &data + data_header_bytes, CONTAINER_HEADER - data_header_bytes);
+		if (data_header_bytes < CONTAINER_HEADER)
+			return true;
+
+		data_length = data.length >= CONTAINER_HEADER ? data.length - CONTAINER_HEADER : 0;
+		if (data.type != CONTAINER_DATA || data.code != command.code) {
+			if (data_kind != DATA_SKIP)
+				set_response(RESPONSE_GENERAL_ERROR);
+			data_kind = DATA_SKIP;
+		}
+
+		// A file longer or shorter than announced is taken and thrown away
+		if (data_kind == DATA_UPLOAD && data_length != writer.GetLength()) {
+			set_response(RESPONSE_INCOMPLETE_TRANSFER);
+			upload_ready = false;
+			data_kind = DATA_SKIP;
+		}
+	}
+
+	uint32_t step = 0;
+	while (data_done < data_length && step < STEP_BYTES && mtp_usb_available() > 0) {
+		uint32_t want = data_length - data_done;
+		uint32_t got;
+
+		if (data_kind == DATA_UPLOAD) {
+			uint32_t room;
+			uint8_t* space = writer.Space(room);
+			got = mtp_usb_read(space, std::min(room, want));
+			writer.Filled(got);
+			data_done += got;
+			// One cluster per pass
+			if (writer.IsClusterReady())
+				return true;
+			continue;
+		}
+
+		if (data_kind == DATA_DATASET && dataset_bytes < sizeof(dataset)) {
+			got = mtp_usb_read(dataset + dataset_bytes, std::min<uint32_t>(want, sizeof(dataset) - dataset_bytes));
+			dataset_bytes += got;
+		}
+		else {
+			uint8_t scratch[64];
+			got = mtp_usb_read(scratch, std::min<uint32_t>(want, sizeof(scratch)));
+		}
+
+		data_done += got;
+		step += got;
+	}
+
+	if (data_done == data_length)
+		received();
+	return true;
+}
+
+/**
+ * Take what has come of a command. Returns true if anything did.
+ */
+static bool receive_command()
+{
+	if (mtp_usb_available() == 0)
+		return false;
+
+	if (command_bytes < CONTAINER_HEADER) {
+		command_bytes += mtp_usb_read((uint8_t*) &command + command_bytes, CONTAINER_HEADER - command_bytes);
+		if (command_bytes < CONTAINER_HEADER)
+			return true;
+
+		// A data phase for a command that was already answered, or junk
+		if (command.type != CONTAINER_COMMAND || command.length < CONTAINER_HEADER ||
+				command.length > sizeof(command)) {
+			command_bytes = 0;
+			if (command.type == CONTAINER_DATA && command.length > CONTAINER_HEADER) {
+				memcpy(&data, &command, CONTAINER_HEADER);
+				data_kind = DATA_SKIP;
+				data_header_bytes = CONTAINER_HEADER;
+				data_length = command.length - CONTAINER_HEADER;
+				data_done = 0;
+				state = STATE_RECEIVE;
+				response.length = 0;
+			}
+			return true;
+		}
+	}
+
+	if (command_bytes < command.length)
+		command_bytes += mtp_usb_read((uint8_t*) &command + command_bytes, command.length - command_bytes);
+	if (command_bytes < command.length)
+		return true;
+
+	command_bytes = 0;
+	run_command();
+	return true;
+}
+
+static void reset()
+{
+	state = STATE_COMMAND;
+	command_bytes = 0;
+	writer.DropCluster();
+	upload_ready = false;
+}
+
+bool mtp_responder_task()
+{
+	if (!mtp_usb_mounted()) {
+		if (session_open || state != STATE_COMMAND)
+			reset();
+		session_open = false;
+		return false;
+	}
+
+	if (mtp_usb_take_reset()) {
+		reset();
+		return true;
+	}
+
+	switch (state) {
+	case STATE_COMMAND:
+		return receive_command();
+
+	case STATE_RECEIVE:
+		return receive_data();
+
+	case STATE_SEND:
+		return send_data();
+
+	case STATE_RESPOND:
+		// A stray data phase has nothing to answer
+		if (response.length == 0) {
+			state = STATE_COMMAND;
+			return true;
+		}
+
+		if (mtp_usb_write_available() < response.length)
+			return false;
+
+		mtp_usb_write(&response, response.length);
+		mtp_usb_end_container();
+		state = STATE_COMMAND;
+		return true;
+	}
+
+	return false;
+}
+
+bool mtp_responder_is_busy()
+{
+	return state != STATE_COMMAND || command_bytes > 0;
+}
@@ -0,0 +1,258 @@
+#include "mtp_usb.h"
+#include "tusb.h"
+#include "device/usbd_pvt.h"
+#include "common/tusb_fifo.h"
+
+#define PACKET_SIZE 64
+
+// Still image class requests, PIMA 15740 annex D
+#define REQUEST_CANCEL       0x64
+#define REQUEST_DEVICE_RESET 0x66
+#define REQUEST_GET_STATUS   0x67
+
+#define RESPONSE_OK 0x2001
+
+#define NO_INTERFACE 0xFF
+
+static uint8_t itf_num = NO_INTERFACE;
+static uint8_t ep_out = 0;
+static uint8_t ep_in = 0;
+static uint8_t ep_event = 0;
+
+static uint8_t rx_buffer[MTP_USB_RX_BUFSIZE];
+static uint8_t tx_buffer[MTP_USB_TX_BUFSIZE];
+static tu_fifo_t rx_fifo;
+static tu_fifo_t tx_fifo;
+
+CFG_TUSB_MEM_ALIGN static uint8_t rx_packet[PACKET_SIZE];
+CFG_TUSB_MEM_ALIGN static uint8_t tx_packet[PACKET_SIZE];
+CFG_TUSB_MEM_ALIGN static uint8_t control_data[6];
+
+// A container was ended and has not all gone out; `last_queued` once the
+// packet that ends it, short or zero length, is on its way
+static bool ending = false;
+static bool last_queued = false;
+
+static bool reset_seen = false;
+
+/**
+ * Take the next packet from the host, if the FIFO has room for a whole one.
+ */
+static void receive_next()
+{
+	if (itf_num == NO_INTERFACE || tu_fifo_remaining(&rx_fifo) < PACKET_SIZE)
+		return;
+
+	if (!usbd_edpt_claim(0, ep_out))
+		return;
+
+	if (!usbd_edpt_xfer(0, ep_out, rx_packet, PACKET_SIZE))
+		usbd_edpt_release(0, ep_out);
+}
+
+/**
+ * Send the next packet: a full one, or what is left of a container that
+ * was ended, followed by a zero length packet if that was full too.
+ */
+static void send_next()
+{
+	if (itf_num == NO_INTERFACE || last_queued)
+		return;
+
+	uint16_t count = tu_fifo_count(&tx_fifo);
+	if (count < PACKET_SIZE && !ending)
+		return;
+
+	if (!usbd_edpt_claim(0, ep_in))
+		return;
+
+	uint16_t length = tu_fifo_read_n(&tx_fifo, tx_packet, PACKET_SIZE);
+	if (ending && tu_fifo_count(&tx_fifo) == 0 && length < PACKET_SIZE)
+		last_queued = true;
+
+	if (!usbd_edpt_xfer(0, ep_in, tx_packet, length))
+		usbd_edpt_release(0, ep_in);
+}
+
+/**
+ * Throw away whatever either pipe holds, for a cancel or a reset.
+ */
+static void abort_transfers()
+{
+	tu_fifo_clear(&rx_fifo);
+	tu_fifo_clear(&tx_fifo);
+	ending = false;
+	last_queued = false;
+	reset_seen = true;
+	receive_next();
+}
+
+//--------------------------------------------------------------------+
+// Class driver
+//--------------------------------------------------------------------+
+
+static void mtp_init(void)
+{
+	tu_fifo_config(&rx_fifo, rx_buffer, sizeof(rx_buffer), 1, false);
+	tu_fifo_config(&tx_fifo, tx_buffer, sizeof(tx_buffer), 1, false);
+}
+
+static void mtp_reset(uint8_t rhport)
+{
+	(void) rhport;
+	itf_num = NO_INTERFACE;
+	tu_fifo_clear(&rx_fifo);
+	tu_fifo_clear(&tx_fifo);
+	ending = false;
+	last_queued = false;
+	reset_seen = true;
+}
+
+static uint16_t mtp_open(uint8_t rhport, tusb_desc_interface_t const* itf_desc, uint16_t max_len)
+{
+	TU_VERIFY(itf_desc->bInterfaceClass == TUSB_CLASS_IMAGE && itf_desc->bInterfaceSubClass == 1 &&
+			itf_desc->bInterfaceProtocol == 1, 0);
+
+	uint16_t const length = sizeof(tusb_desc_interface_t) + 3 * sizeof(tusb_desc_endpoint_t);
+	TU_VERIFY(max_len >= length, 0);
+
+	uint8_t const* p_desc = tu_desc_next(itf_desc);
+	TU_ASSERT(usbd_open_edpt_pair(rhport, p_desc, 2, TUSB_XFER_BULK, &ep_out, &ep_in), 0);
+
+	tusb_desc_endpoint_t const* event_desc = (tusb_desc_endpoint_t const*) tu_desc_next(tu_desc_next(p_desc));
+	TU_ASSERT(usbd_edpt_open(rhport, event_desc), 0);
+	ep_event = event_desc->bEndpointAddress;
+
+	itf_num = itf_desc->bInterfaceNumber;
+	tu_fifo_clear(&rx_fifo);
+	tu_fifo_clear(&tx_fifo);
+	ending = false;
+	last_queued = false;
+	receive_next();
+
+	return length;
+}
+
+static bool mtp_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const* request)
+{
+	if (request->bmRequestType_bit.type != TUSB_REQ_TYPE_CLASS ||
+			request->bmRequestType_bit.recipient != TUSB_REQ_RCPT_INTERFACE || request->wIndex != itf_num)
+		return false;
+
+	switch (request->bRequest) {
+	case REQUEST_CANCEL:
+		// The transaction being cancelled comes in the data stage
+		if (stage == CONTROL_STAGE_SETUP)
+			return tud_control_xfer(rhport, request, control_data, sizeof(control_data));
+		if (stage == CONTROL_STAGE_DATA)
+			abort_transfers();
+		return true;
+
+	case REQUEST_DEVICE_RESET:
+		if (stage == CONTROL_STAGE_SETUP) {
+			abort_transfers();
+			return tud_control_status(rhport, request);
+		}
+		return true;
+
+	case REQUEST_GET_STATUS:
+		if (stage == CONTROL_STAGE_SETUP) {
+			control_data[0] = 4;
+			control_data[1] = 0;
+			control_data[2] = (uint8_t) RESPONSE_OK;
+			control_data[3] = (uint8_t) (RESPONSE_OK >> 8);
+			return tud_control_xfer(rhport, request, control_data, 4);
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool mtp_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+	(void) rhport;
+	(void) result;
+
+	if (ep_addr == ep_out) {
+		tu_fifo_write_n(&rx_fifo, rx_packet, (uint16_t) xferred_bytes);
+		receive_next();
+	}
+	else if (ep_addr == ep_in) {
+		if (last_queued) {
+			ending = false;
+			last_queued = false;
+		}
+		send_next();
+	}
+
+	return true;
+}
+
+static usbd_class_driver_t const mtp_driver = {
+#if CFG_TUSB_DEBUG >= 2
+	.name = "MTP",
+#endif
+	.init = mtp_init,
+	.reset = mtp_reset,
+	.open = mtp_open,
+	.control_xfer_cb = mtp_control_xfer_cb,
+	.xfer_cb = mtp_xfer_cb,
+	.sof = NULL
+};
+
+usbd_class_driver_t const* usbd_app_driver_get_cb(uint8_t* driver_count)
+{
+	*driver_count = 1;
+	return &mtp_driver;
+}
+
+//--------------------------------------------------------------------+
+// API
+//--------------------------------------------------------------------+
+
+bool mtp_usb_mounted()
+{
+	return tud_mounted() && itf_num != NO_INTERFACE;
+}
+
+uint32_t mtp_usb_available()
+{
+	return tu_fifo_count(&rx_fifo);
+}
+
+uint32_t mtp_usb_read(void* buffer, uint32_t bufsize)
+{
+	uint32_t count = tu_fifo_read_n(&rx_fifo, buffer, (uint16_t) TU_MIN(bufsize, UINT16_MAX));
+	receive_next();
+	return count;
+}
+
+uint32_t mtp_usb_write_available()
+{
+	return ending ? 0 : tu_fifo_remaining(&tx_fifo);
+}
+
+uint32_t mtp_usb_write(const void* buffer, uint32_t bufsize)
+{
+	if (ending)
+		return 0;
+
+	uint32_t count = tu_fifo_write_n(&tx_fifo, buffer, (uint16_t) TU_MIN(bufsize, UINT16_MAX));
+	send_next();
+	return count;
+}
+
+void mtp_usb_end_container()
+{
+	ending = true;
+	send_next();
+}
+
+bool mtp_usb_take_reset()
+{
+	bool value = reset_seen;
+	reset_seen = false;
+	return value;
+}
@@ -0,0 +1,153 @@
+#include "read_ahead.h"
+#include "fat_cursor.hpp"
+#include <string.h>
+#include <algorithm>
+
+int32_t ReadAhead::Read(Fat16& fs, uint32_t lba, void* out, uint32_t bufsize) {
+	uint32_t blocks = (bufsize + Fat16::DISK_BLOCK_SIZE - 1) / Fat16::DISK_BLOCK_SIZE;
+
+	if (lba < Fat16::INDEX_DATA_STARTS || blocks == 0) {
+		int32_t got = fs.GetBlock(lba, out, bufsize);
+		if (got >= 0 && mode == MODE_CHAIN && lba < Fat16::INDEX_FAT_TABLE_2_START && lba + blocks > Fat16::INDEX_FAT_TABLE_1_START) {
+			uint32_t first = std::max(lba, Fat16::INDEX_FAT_TABLE_1_START);
+			uint32_t skip = (first - lba) * Fat16::DISK_BLOCK_SIZE;
+			Learn(first - Fat16::INDEX_FAT_TABLE_1_START, (const uint8_t*) out + skip, bufsize - skip);
+		}
+		return got;
+	}
+
+	stats.reads++;
+	if (mode == MODE_OFF)
+		return fs.GetBlock(lba, out, bufsize);
+
+	uint32_t cluster = ClusterOf(lba);
+	uint32_t last = ClusterOf(lba + blocks - 1);
+
+	int32_t got;
+	if (buffered != 0 && cluster == buffered && last == cluster) {
+		memcpy(out, buffer + (lba - Fat16::ClusterToLBA(cluster)) * Fat16::DISK_BLOCK_SIZE, bufsize);
+		stats.hits++;
+		used = true;
+		got = (int32_t) bufsize;
+	}
+	else {
+		got = fs.GetBlock(lba, out, bufsize);
+		if (got < 0)
+			return got;
+	}
+
+	// A read that stops partway into a cluster is followed by the rest of
+	// it, one that reaches the end by the next cluster of the file
+	rest = (lba + blocks - Fat16::INDEX_DATA_STARTS) % Fat16::DISK_CLUSTER_SIZE != 0;
+	after = rest && last == buffered ? 0 : last;
+	return got;
+}
+
+void ReadAhead::Write(uint32_t lba, const void* data, uint32_t bufsize) {
+	uint32_t blocks = bufsize / Fat16::DISK_BLOCK_SIZE;
+	Invalidate(lba, bufsize);
+
+	if (mode == MODE_CHAIN && lba < Fat16::INDEX_FAT_TABLE_2_START && lba + blocks > Fat16::INDEX_FAT_TABLE_1_START) {
+		uint32_t first = std::max(lba, Fat16::INDEX_FAT_TABLE_1_START);
+		uint32_t skip = (first - lba) * Fat16::DISK_BLOCK_SIZE;
+		Learn(first - Fat16::INDEX_FAT_TABLE_1_START, (const uint8_t*) data + skip, bufsize - skip);
+	}
+}
+
+void ReadAhead::Invalidate(uint32_t lba, uint32_t bufsize) {
+	uint32_t blocks = (bufsize + Fat16::DISK_BLOCK_SIZE - 1) / Fat16::DISK_BLOCK_SIZE;
+	if (buffered == 0)
+		return;
+
+	uint32_t start = Fat16::ClusterToLBA(buffered);
+	if (lba < start + Fat16::DISK_CLUSTER_SIZE && start < lba + blocks)
+		Discard();
+}
+
+bool ReadAhead::Step(Fat16& fs) {
+	if (after == 0 || mode == MODE_OFF)
+		return false;
+
+	uint32_t target = after;
+	bool did_work = false;
+	if (!rest && mode == MODE_SEQUENTIAL) {
+		target = after + 1;
+	}
+	else if (!rest) {
+		uint16_t next;
+		if (!Lookup(after, next)) {
+			// The buffer is about to be replaced anyway
+			Discard();
+			stats.fat_reads++;
+			did_work = true;
+
+			uint32_t sector = after / FatCursor::ENTRIES_PER_SECTOR;
+			if (fs.GetBlock(Fat16::INDEX_FAT_TABLE_1_START + sector, buffer, Fat16::DISK_BLOCK_SIZE) < 0) {
+				after = 0;
+				return true;
+			}
+			Learn(sector, buffer, Fat16::DISK_BLOCK_SIZE);
+		}
+
+		if (!Lookup(after, next) || FatCursor::IsEnd(next)) {
+			after = 0;
+			return did_work;
+		}
+		target = next;
+	}
+
+	after = 0;
+	if (target == buffered || target < Fat16::FIRST_CLUSTER || target > fs.GetLastCluster())
+		return did_work;
+
+	Discard();
+	if (fs.GetBlock(Fat16::ClusterToLBA(target), buffer, BUFFER_SIZE) < 0)
+		return true;
+
+	buffered = target;
+	used = false;
+	stats.prefetches++;
+	return true;
+}
+
+void ReadAhead::Clear() {
+	Discard();
+	after = 0;
+	memset(links, 0, sizeof(links));
+}
+
+void ReadAhead::Discard() {
+	if (buffered != 0 && !used)
+		stats.wasted++;
+	buffered = 0;
+}
+
+void ReadAhead::Learn(uint32_t sector, const uint8_t* data, uint32_t bufsize) {
+	uint32_t first = sector * FatCursor::ENTRIES_PER_SECTOR;
+	uint32_t count = std::min(bufsize / 2, (Fat16::FAT_TABLE_SECTORS - sector) * FatCursor::ENTRIES_PER_SECTOR);
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t cluster = first + i;
+		if (cluster < Fat16::FIRST_CLUSTER)
+			continue;
+
+		uint16_t value;
+		memcpy(&value, data + i * 2, 2);
+		Link& link = links[cluster % NEXT_ENTRIES];
+
+		// Free and bad clusters lead nowhere
+		if ((value < Fat16::FIRST_CLUSTER || value == FatCursor::BAD) && link.cluster == cluster)
+			link.cluster = 0;
+		else if (value >= Fat16::FIRST_CLUSTER && value != FatCursor::BAD)
+			link = { (uint16_t) cluster, value };
+	}
+}
+
+bool ReadAhead::Lookup(uint32_t cluster, uint16_t& next) const {
+	const Link& link = links[cluster % NEXT_ENTRIES];
+	if (link.cluster != cluster || cluster == 0)
+		return false;
+
+	next = link.next;
+	return true;
+}
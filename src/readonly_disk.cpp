@@ -0,0 +1,64 @@
+#include "readonly_disk.h"
+#include "string.h"
+
+#if READONLY_LUN
+
+// From src/readonly_image.S
+extern "C" const uint8_t readonly_image_start[];
+extern "C" const uint8_t readonly_image_end[];
+
+static uint32_t image_size() {
+	return (uint32_t) (readonly_image_end - readonly_image_start);
+}
+
+bool ReadOnlyDisk::IsPresent() {
+	return image_size() >= BLOCK_SIZE
+		&& readonly_image_start[510] == 0x55 && readonly_image_start[511] == 0xAA;
+}
+
+uint32_t ReadOnlyDisk::GetBlockCount() {
+	if (!IsPresent())
+		return 0;
+
+	// Total sectors: the 16 bit field, or the 32 bit one if that is 0
+	const uint8_t* boot = readonly_image_start;
+	uint32_t total = boot[19] | (boot[20] << 8);
+	if (total == 0)
+		total = boot[32] | (boot[33] << 8) | (boot[34] << 16) | ((uint32_t) boot[35] << 24);
+
+	return total;
+}
+
+int32_t ReadOnlyDisk::GetBlock(uint32_t lba, void* buffer, uint32_t bufsize) {
+	uint32_t blocks = (bufsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (lba + blocks > GetBlockCount())
+		return -1;
+
+	uint32_t offset = lba * BLOCK_SIZE;
+	uint32_t stored = offset < image_size() ? image_size() - offset : 0;
+	if (stored > bufsize)
+		stored = bufsize;
+
+	memcpy(buffer, readonly_image_start + offset, stored);
+	memset((uint8_t*) buffer + stored, 0, bufsize - stored);
+	return (int32_t) bufsize;
+}
+
+#else
+
+bool ReadOnlyDisk::IsPresent() {
+	return false;
+}
+
+uint32_t ReadOnlyDisk::GetBlockCount() {
+	return 0;
+}
+
+int32_t ReadOnlyDisk::GetBlock(uint32_t lba, void* buffer, uint32_t bufsize) {
+	(void) lba;
+	(void) buffer;
+	(void) bufsize;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include "scheduler.h"
+#include "pico/time.h"
+#include "util.h"
+
+bool Scheduler::AddTask(const char* name, TaskFunction run, Priority priority, uint32_t period_us) {
+	if (task_count == MAX_TASKS) {
+		safe_print("No room to schedule %s\n", name);
+		return false;
+	}
+
+	// Keep the table sorted by priority, first come first served within one
+	uint32_t i = task_count;
+	while (i > 0 && tasks[i - 1].priority > priority) {
+		tasks[i] = tasks[i - 1];
+		i--;
+	}
+
+	tasks[i] = { name, run, priority, period_us, 0 };
+	task_count++;
+	return true;
+}
+
+bool Scheduler::AddIdleHook(const char* name, TaskFunction run, uint32_t period_us) {
+	return AddTask(name, run, PRIORITY_IDLE, period_us);
+}
+
+bool Scheduler::RunOnce() {
+	bool busy = false;
+
+	for (uint32_t i = 0; i < task_count; i++) {
+		Task& task = tasks[i];
+		uint64_t now = time_us_64();
+		if (now < task.next_us)
+			continue;
+
+		if (task.priority == PRIORITY_IDLE) {
+			// The rest of the pass is still busy, try again on the next one
+			if (busy)
+				continue;
+
+			if (idle_gate && !idle_gate()) {
+				task.next_us = now + task.period_us;
+				continue;
+			}
+		}
+
+		if (task.run()) {
+			busy = true;
+			task.next_us = 0;
+		}
+		else {
+			task.next_us = task.period_us ? time_us_64() + task.period_us : 0;
+		}
+	}
+
+	return busy;
+}
+
+void Scheduler::Run() {
+	while (true) {
+		if (RunOnce())
+			continue;
+
+		// Interrupts that arrive between here and the WFE set the event
+		// flag, so nothing slips through.
+		best_effort_wfe_or_timeout(from_us_since_boot(NextDeadline()));
+	}
+}
+
+uint64_t Scheduler::NextDeadline() const {
+	uint64_t deadline = time_us_64() + MAX_SLEEP_US;
+
+	for (uint32_t i = 0; i < task_count; i++) {
+		if (tasks[i].period_us && tasks[i].next_us < deadline)
+			deadline = tasks[i].next_us;
+	}
+
+	return deadline;
+}
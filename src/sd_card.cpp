@@ -0,0 +1,226 @@
+#include "sd_card.h"
+#include "hardware/gpio.h"
+#include "pico/time.h"
+#include "util.h"
+
+// Thanks to http://elm-chan.org/docs/mmc/mmc_e.html
+#define CMD_GO_IDLE_STATE      0
+#define CMD_SEND_IF_COND       8
+#define CMD_SEND_CSD           9
+#define CMD_SET_BLOCKLEN       16
+#define CMD_READ_SINGLE_BLOCK  17
+#define CMD_WRITE_BLOCK        24
+#define CMD_APP_CMD            55
+#define CMD_READ_OCR           58
+#define ACMD_SD_SEND_OP_COND   41
+
+#define R1_IDLE 0x01
+#define TOKEN_START_BLOCK 0xFE
+#define DATA_ACCEPTED 0x05
+
+#define INIT_TIMEOUT_MS 1000
+#define READ_TIMEOUT_MS 100
+#define WRITE_TIMEOUT_MS 500
+
+SdCard::SdCard(spi_inst_t* spi, Pins pins, uint baudrate)
+	: spi(spi), pins(pins), baudrate(baudrate) {}
+
+bool SdCard::Init() {
+	spi_init(spi, INIT_BAUDRATE);
+	gpio_set_function(pins.sck, GPIO_FUNC_SPI);
+	gpio_set_function(pins.mosi, GPIO_FUNC_SPI);
+	gpio_set_function(pins.miso, GPIO_FUNC_SPI);
+	gpio_pull_up(pins.miso);
+
+	gpio_init(pins.cs);
+	gpio_set_dir(pins.cs, GPIO_OUT);
+	gpio_put(pins.cs, 1);
+
+	// At least 74 clocks with CS high to enter native mode
+	for (int i = 0; i < 10; i++)
+		Transfer(0xFF);
+
+	if (Command(CMD_GO_IDLE_STATE, 0) != R1_IDLE) {
+		safe_print("SD card not found\n");
+		Deselect();
+		return false;
+	}
+
+	// Version 2 cards echo the check pattern back
+	bool v2 = false;
+	if (Command(CMD_SEND_IF_COND, 0x1AA) == R1_IDLE) {
+		uint8_t r7[4];
+		for (uint8_t& b : r7)
+			b = Transfer(0xFF);
+		v2 = r7[2] == 0x01 && r7[3] == 0xAA;
+	}
+
+	uint64_t deadline = time_us_64() + INIT_TIMEOUT_MS * 1000ull;
+	while (AppCommand(ACMD_SD_SEND_OP_COND, v2 ? 0x40000000 : 0) != 0) {
+		if (time_us_64() > deadline) {
+			safe_print("SD card did not leave idle state\n");
+			Deselect();
+			return false;
+		}
+	}
+
+	if (v2 && Command(CMD_READ_OCR, 0) == 0) {
+		uint8_t ocr[4];
+		for (uint8_t& b : ocr)
+			b = Transfer(0xFF);
+		block_addressing = (ocr[0] & 0x40) != 0;
+	}
+
+	if (!block_addressing)
+		Command(CMD_SET_BLOCKLEN, SECTOR_SIZE);
+
+	uint8_t csd[16];
+	if (Command(CMD_SEND_CSD, 0) != 0 || !ReadData(csd, sizeof(csd))) {
+		Deselect();
+		return false;
+	}
+	Deselect();
+
+	if ((csd[0] >> 6) == 1) {
+		// CSD v2: (C_SIZE + 1) * 512kb
+		uint32_t c_size = ((uint32_t) (csd[7] & 0x3F) << 16) | ((uint32_t) csd[8] << 8) | csd[9];
+		uint64_t bytes = (uint64_t) (c_size + 1) * 512 * 1024;
+		size = bytes > 0xFFFFFE00ull ? 0xFFFFFE00u : (uint32_t) bytes;
+	}
+	else {
+		// CSD v1: (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) * 2^READ_BL_LEN
+		uint32_t read_bl_len = csd[5] & 0x0F;
+		uint32_t c_size = ((uint32_t) (csd[6] & 0x03) << 10) | ((uint32_t) csd[7] << 2) | (csd[8] >> 6);
+		uint32_t c_size_mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+		size = (c_size + 1) << (c_size_mult + 2 + read_bl_len);
+	}
+
+	spi_set_baudrate(spi, baudrate);
+	safe_print("SD card, %d bytes\n", size);
+	return true;
+}
+
+bool SdCard::Read(uint32_t addr, void* buffer, uint32_t bufsize) {
+	uint8_t* out = (uint8_t*) buffer;
+
+	for (uint32_t done = 0; done < bufsize; done += SECTOR_SIZE) {
+		uint32_t sector = (addr + done) / SECTOR_SIZE;
+		if (Command(CMD_READ_SINGLE_BLOCK, block_addressing ? sector : sector * SECTOR_SIZE) != 0
+				|| !ReadData(out + done, SECTOR_SIZE)) {
+			Deselect();
+			return false;
+		}
+		Deselect();
+	}
+
+	return true;
+}
+
+bool SdCard::Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) {
+	for (uint32_t done = 0; done < bufsize; done += SECTOR_SIZE) {
+		uint32_t sector = (addr + done) / SECTOR_SIZE;
+		if (Command(CMD_WRITE_BLOCK, block_addressing ? sector : sector * SECTOR_SIZE) != 0) {
+			Deselect();
+			return false;
+		}
+
+		Transfer(0xFF);
+		Transfer(TOKEN_START_BLOCK);
+		spi_write_blocking(spi, buffer + done, SECTOR_SIZE);
+		Transfer(0xFF); // CRC, ignored in SPI mode
+		Transfer(0xFF);
+
+		uint8_t response = Transfer(0xFF) & 0x1F;
+		Deselect();
+		if (response != DATA_ACCEPTED)
+			return false;
+
+		// The card is now busy programming; Command() waits for it.
+	}
+
+	return true;
+}
+
+bool SdCard::Flush() {
+	Select();
+	bool ready = WaitReady(WRITE_TIMEOUT_MS);
+	Deselect();
+	return ready;
+}
+
+uint8_t SdCard::Command(uint8_t cmd, uint32_t arg) {
+	Deselect();
+	Select();
+	if (cmd != CMD_GO_IDLE_STATE && !WaitReady(WRITE_TIMEOUT_MS))
+		return 0xFF;
+
+	// Only these two are CRC checked in SPI mode
+	uint8_t crc = 0x01;
+	if (cmd == CMD_GO_IDLE_STATE)
+		crc = 0x95;
+	else if (cmd == CMD_SEND_IF_COND)
+		crc = 0x87;
+
+	uint8_t frame[6] = {
+		(uint8_t) (0x40 | cmd),
+		(uint8_t) (arg >> 24), (uint8_t) (arg >> 16), (uint8_t) (arg >> 8), (uint8_t) arg,
+		crc
+	};
+	spi_write_blocking(spi, frame, sizeof(frame));
+
+	// R1 arrives within 8 bytes and has its top bit clear
+	uint8_t r1 = 0xFF;
+	for (int i = 0; i < 10 && (r1 & 0x80); i++)
+		r1 = Transfer(0xFF);
+
+	return r1;
+}
+
+uint8_t SdCard::AppCommand(uint8_t cmd, uint32_t arg) {
+	Command(CMD_APP_CMD, 0);
+	return Command(cmd, arg);
+}
+
+bool SdCard::ReadData(uint8_t* buffer, uint32_t bufsize) {
+	uint64_t deadline = time_us_64() + READ_TIMEOUT_MS * 1000ull;
+	uint8_t token;
+	while ((token = Transfer(0xFF)) == 0xFF) {
+		if (time_us_64() > deadline)
+			return false;
+	}
+
+	if (token != TOKEN_START_BLOCK)
+		return false;
+
+	spi_read_blocking(spi, 0xFF, buffer, bufsize);
+	Transfer(0xFF); // CRC
+	Transfer(0xFF);
+	return true;
+}
+
+/**
+ * A busy card holds MISO low.
+ */
+bool SdCard::WaitReady(uint32_t timeout_ms) {
+	uint64_t deadline = time_us_64() + timeout_ms * 1000ull;
+	while (Transfer(0xFF) != 0xFF) {
+		if (time_us_64() > deadline)
+			return false;
+	}
+	return true;
+}
+
+void SdCard::Select() {
+	gpio_put(pins.cs, 0);
+}
+
+void SdCard::Deselect() {
+	gpio_put(pins.cs, 1);
+	Transfer(0xFF); // Let the card release MISO
+}
+
+uint8_t SdCard::Transfer(uint8_t byte) {
+	uint8_t in;
+	spi_write_read_blocking(spi, &byte, &in, 1);
+	return in;
+}
@@ -0,0 +1,485 @@
+#include "snapshot_device.h"
+#include "string.h"
+#include "util.h"
+#include <initializer_list>
+
+// One unit's worth of scratch for copy-on-write and loading the map log
+static uint8_t unit_buffer[SnapshotDevice::UNIT_SIZE] STORAGE_ARENA;
+
+// For WriteRecord() and ClearUnit(), which never nest
+static uint8_t page_buffer[SnapshotDevice::MAX_PROGRAM_SIZE] STORAGE_ARENA;
+
+SnapshotDevice::SnapshotDevice(BlockDevice& inner, uint32_t spare_units)
+	: inner(inner), spare_units(spare_units) {}
+
+bool SnapshotDevice::Init() {
+	if (!inner.Init())
+		return false;
+
+	geometry = inner.GetGeometry();
+	uint32_t units = geometry.size / UNIT_SIZE;
+
+	enabled = spare_units > 0
+		&& geometry.erase_size <= UNIT_SIZE && UNIT_SIZE % geometry.erase_size == 0
+		&& geometry.program_size <= MAX_PROGRAM_SIZE
+		&& units > spare_units + META_UNITS && units <= 0xFFFF;
+
+	if (!enabled) {
+		if (spare_units > 0)
+			safe_print("Snapshots not supported on this device\n");
+		return true;
+	}
+
+	logical_units = units - spare_units - META_UNITS;
+	return Load();
+}
+
+BlockDevice::Geometry SnapshotDevice::GetGeometry() const {
+	if (!enabled)
+		return inner.GetGeometry();
+
+	return { logical_units * UNIT_SIZE, UNIT_SIZE, geometry.program_size, geometry.erase_before_program };
+}
+
+bool SnapshotDevice::Read(uint32_t addr, void* buffer, uint32_t bufsize) {
+	if (!enabled)
+		return inner.Read(addr, buffer, bufsize);
+
+	if (addr + bufsize > logical_units * UNIT_SIZE)
+		return false;
+
+	uint8_t* out = (uint8_t*) buffer;
+	while (bufsize > 0) {
+		uint16_t logical = addr / UNIT_SIZE;
+		uint32_t offset = addr % UNIT_SIZE;
+		uint32_t chunk = UNIT_SIZE - offset < bufsize ? UNIT_SIZE - offset : bufsize;
+
+		if (!inner.Read(live.Lookup(logical) * UNIT_SIZE + offset, out, chunk))
+			return false;
+
+		addr += chunk;
+		out += chunk;
+		bufsize -= chunk;
+	}
+
+	return true;
+}
+
+bool SnapshotDevice::Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) {
+	if (!enabled)
+		return inner.Program(addr, buffer, bufsize);
+
+	if (addr + bufsize > logical_units * UNIT_SIZE)
+		return false;
+
+	// A copy-on-write, its log record and the data itself go out together
+	bool ok = true;
+	inner.BeginBatch();
+	while (ok && bufsize > 0) {
+		uint16_t logical = addr / UNIT_SIZE;
+		uint32_t offset = addr % UNIT_SIZE;
+		uint32_t chunk = UNIT_SIZE - offset < bufsize ? UNIT_SIZE - offset : bufsize;
+
+		uint16_t physical;
+		ok = Writable(logical, true, physical) && inner.Program(physical * UNIT_SIZE + offset, buffer, chunk);
+
+		addr += chunk;
+		buffer += chunk;
+		bufsize -= chunk;
+	}
+	inner.EndBatch();
+
+	return ok;
+}
+
+bool SnapshotDevice::Erase(uint32_t addr, uint32_t bytes) {
+	if (!enabled)
+		return inner.Erase(addr, bytes);
+
+	if (addr % UNIT_SIZE != 0 || bytes % UNIT_SIZE != 0 || addr + bytes > logical_units * UNIT_SIZE)
+		return false;
+
+	bool ok = true;
+	inner.BeginBatch();
+	for (uint32_t done = 0; ok && done < bytes; done += UNIT_SIZE) {
+		uint16_t physical;
+		ok = Writable((addr + done) / UNIT_SIZE, false, physical) && inner.Erase(physical * UNIT_SIZE, UNIT_SIZE);
+	}
+	inner.EndBatch();
+
+	return ok;
+}
+
+const uint8_t* SnapshotDevice::Map(uint32_t addr, uint32_t bytes) {
+	if (!enabled)
+		return inner.Map(addr, bytes);
+
+	if (bytes == 0 || addr + bytes > logical_units * UNIT_SIZE)
+		return nullptr;
+
+	uint32_t first = addr / UNIT_SIZE;
+	uint32_t physical = live.Lookup(first);
+	for (uint32_t unit = first + 1; unit <= (addr + bytes - 1) / UNIT_SIZE; unit++) {
+		if (live.Lookup(unit) != physical + (unit - first))
+			return nullptr;
+	}
+
+	return inner.Map(physical * UNIT_SIZE + addr % UNIT_SIZE, bytes);
+}
+
+bool SnapshotDevice::Take() {
+	if (!enabled)
+		return false;
+
+	safe_print("Taking snapshot\n");
+	return Append(RECORD_SNAPSHOT, 0, 0);
+}
+
+bool SnapshotDevice::Rollback() {
+	if (!has_snapshot)
+		return false;
+
+	safe_print("Rolling back %d units to the snapshot\n", GetDivergedUnits());
+	return Append(RECORD_ROLLBACK, 0, 0);
+}
+
+bool SnapshotDevice::Drop() {
+	if (!has_snapshot)
+		return true;
+
+	safe_print("Dropping snapshot\n");
+	return Append(RECORD_DROP, 0, 0);
+}
+
+uint32_t SnapshotDevice::GetDivergedUnits() const {
+	if (!has_snapshot)
+		return 0;
+
+	uint32_t diverged = 0;
+	for (uint32_t i = 0; i < live.count; i++) {
+		if (frozen.Lookup(live.entries[i].logical) != live.entries[i].physical)
+			diverged++;
+	}
+
+	// Units the snapshot has remapped but the live table has not
+	for (uint32_t i = 0; i < frozen.count; i++) {
+		uint16_t logical = frozen.entries[i].logical;
+		if (live.Lookup(logical) == logical)
+			diverged++;
+	}
+
+	return diverged;
+}
+
+uint32_t SnapshotDevice::GetFreeUnits() const {
+	if (!enabled)
+		return 0;
+
+	uint32_t count = 0;
+	for (uint32_t unit = 0; unit < logical_units + spare_units; unit++) {
+		if (!live.Uses(unit, logical_units) && !(has_snapshot && frozen.Uses(unit, logical_units)))
+			count++;
+	}
+
+	return count;
+}
+
+uint16_t SnapshotDevice::Table::Lookup(uint16_t logical) const {
+	for (uint32_t i = 0; i < count; i++) {
+		if (entries[i].logical == logical)
+			return entries[i].physical;
+	}
+
+	return logical;
+}
+
+bool SnapshotDevice::Table::Set(uint16_t logical, uint16_t physical) {
+	for (uint32_t i = 0; i < count; i++) {
+		if (entries[i].logical != logical)
+			continue;
+
+		// Back home, no entry needed
+		if (physical == logical)
+			entries[i] = entries[--count];
+		else
+			entries[i].physical = physical;
+		return true;
+	}
+
+	if (physical == logical)
+		return true;
+
+	if (count == MAX_REMAPS)
+		return false;
+
+	entries[count++] = { logical, physical };
+	return true;
+}
+
+bool SnapshotDevice::Table::Uses(uint16_t physical, uint32_t logical_units) const {
+	if (physical < logical_units && Lookup(physical) == physical)
+		return true;
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (entries[i].physical == physical)
+			return true;
+	}
+
+	return false;
+}
+
+bool SnapshotDevice::Writable(uint16_t logical, bool copy, uint16_t& physical) {
+	physical = live.Lookup(logical);
+	if (!has_snapshot || frozen.Lookup(logical) != physical)
+		return true;
+
+	// Shared with the snapshot: move the live copy somewhere else
+	uint16_t target;
+	bool has_room = live.count < MAX_REMAPS || live.Lookup(logical) != logical;
+	if (!has_room || !Allocate(target)) {
+		safe_print("Snapshot has run out of room, dropping it\n");
+		return Append(RECORD_DROP, DROP_LOST, 0) && Writable(logical, copy, physical);
+	}
+
+	// An erase of the whole unit is left to the caller
+	if (copy) {
+		// Read before erasing so a batched erase is not flushed early
+		if (!inner.Read(physical * UNIT_SIZE, unit_buffer, UNIT_SIZE) || !inner.Erase(target * UNIT_SIZE, UNIT_SIZE))
+			return false;
+
+		// Pages that are still blank on NOR need no programming
+		for (uint32_t page = 0; page < UNIT_SIZE; page += geometry.program_size) {
+			bool blank = geometry.erase_before_program;
+			for (uint32_t i = page; i < page + geometry.program_size && blank; i++)
+				blank = unit_buffer[i] == 0xFF;
+
+			if (!blank && !inner.Program(target * UNIT_SIZE + page, unit_buffer + page, geometry.program_size))
+				return false;
+		}
+	}
+
+	// The copy is complete before the log points at it
+	if (!Append(RECORD_LIVE, logical, target))
+		return false;
+
+	physical = target;
+	return true;
+}
+
+/**
+ * Any unit neither table uses: a spare, or the home of a logical unit
+ * that lives elsewhere.
+ */
+bool SnapshotDevice::Allocate(uint16_t& physical) const {
+	auto is_free = [this](uint16_t unit) {
+		return !live.Uses(unit, logical_units) && !(has_snapshot && frozen.Uses(unit, logical_units));
+	};
+
+	for (uint32_t unit = logical_units; unit < logical_units + spare_units; unit++) {
+		if (is_free(unit)) {
+			physical = unit;
+			return true;
+		}
+	}
+
+	for (const Table* map : { &live, &frozen }) {
+		for (uint32_t i = 0; i < map->count; i++) {
+			if (is_free(map->entries[i].logical)) {
+				physical = map->entries[i].logical;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void SnapshotDevice::Apply(const Record& record) {
+	switch (record.type) {
+		case RECORD_LIVE:
+			live.Set(record.logical, record.physical);
+			break;
+
+		case RECORD_FROZEN:
+			frozen.Set(record.logical, record.physical);
+			break;
+
+		case RECORD_SNAPSHOT:
+			frozen = live;
+			has_snapshot = true;
+			lost = false;
+			break;
+
+		case RECORD_ROLLBACK:
+			live = frozen;
+			break;
+
+		case RECORD_DROP:
+			frozen.count = 0;
+			has_snapshot = false;
+			lost = record.logical == DROP_LOST;
+			break;
+	}
+}
+
+bool SnapshotDevice::Append(uint8_t type, uint16_t logical, uint16_t physical) {
+	if (meta_slot == RECORDS_PER_UNIT && !Checkpoint())
+		return false;
+
+	Record record = MakeRecord(type, logical, physical);
+	if (!WriteRecord(MetaUnit(meta_index), meta_slot, record))
+		return false;
+
+	meta_slot++;
+	Apply(record);
+	return true;
+}
+
+/**
+ * Program the page the record lands in. On NOR the rest of the page is
+ * left as 0xFF, which leaves the records already there alone.
+ */
+bool SnapshotDevice::WriteRecord(uint32_t unit, uint32_t slot, const Record& record) {
+	uint32_t addr = unit * UNIT_SIZE + slot * sizeof(Record);
+	uint32_t page_addr = addr / geometry.program_size * geometry.program_size;
+
+	uint8_t* page = page_buffer;
+	if (geometry.erase_before_program)
+		memset(page, 0xFF, geometry.program_size);
+	else if (!inner.Read(page_addr, page, geometry.program_size))
+		return false;
+
+	memcpy(page + (addr - page_addr), &record, sizeof(record));
+	return inner.Program(page_addr, page, geometry.program_size);
+}
+
+/**
+ * Write the current tables into the other log unit. Its header goes in
+ * last, so until the checkpoint is complete the old unit stays the one
+ * that is loaded.
+ */
+bool SnapshotDevice::Checkpoint() {
+	uint32_t next = (meta_index + 1) % META_UNITS;
+	uint32_t unit = MetaUnit(next);
+	if (!ClearUnit(unit))
+		return false;
+
+	uint32_t slot = 1;
+	if (lost && !WriteRecord(unit, slot++, MakeRecord(RECORD_DROP, DROP_LOST, 0)))
+		return false;
+
+	if (has_snapshot) {
+		if (!WriteRecord(unit, slot++, MakeRecord(RECORD_SNAPSHOT, 0, 0)))
+			return false;
+
+		for (uint32_t i = 0; i < frozen.count; i++) {
+			if (!WriteRecord(unit, slot++, MakeRecord(RECORD_FROZEN, frozen.entries[i].logical, frozen.entries[i].physical)))
+				return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < live.count; i++) {
+		if (!WriteRecord(unit, slot++, MakeRecord(RECORD_LIVE, live.entries[i].logical, live.entries[i].physical)))
+			return false;
+	}
+
+	uint32_t next_generation = generation + 1;
+	if (!WriteRecord(unit, 0, MakeRecord(RECORD_HEADER, next_generation & 0xFFFF, next_generation >> 16)))
+		return false;
+
+	generation = next_generation;
+	meta_index = next;
+	meta_slot = slot;
+	return true;
+}
+
+/**
+ * Replay the newest log unit. It ends at the first blank record; one that
+ * is neither blank nor valid was cut short by a power loss and is skipped.
+ */
+bool SnapshotDevice::Load() {
+	live.count = 0;
+	frozen.count = 0;
+	has_snapshot = false;
+	lost = false;
+
+	bool found = false;
+	for (uint32_t i = 0; i < META_UNITS; i++) {
+		Record header;
+		if (!inner.Read(MetaUnit(i) * UNIT_SIZE, &header, sizeof(header)))
+			return false;
+
+		uint32_t header_generation = header.logical | ((uint32_t) header.physical << 16);
+		if (!IsValid(header) || header.type != RECORD_HEADER || (found && header_generation <= generation))
+			continue;
+
+		found = true;
+		meta_index = i;
+		generation = header_generation;
+	}
+
+	if (!found) {
+		// Nothing here yet: start an empty log
+		meta_index = 0;
+		generation = 1;
+		meta_slot = 1;
+		return ClearUnit(MetaUnit(0)) && WriteRecord(MetaUnit(0), 0, MakeRecord(RECORD_HEADER, 1, 0));
+	}
+
+	if (!inner.Read(MetaUnit(meta_index) * UNIT_SIZE, unit_buffer, UNIT_SIZE))
+		return false;
+
+	meta_slot = 1;
+	while (meta_slot < RECORDS_PER_UNIT) {
+		Record record;
+		memcpy(&record, unit_buffer + meta_slot * sizeof(Record), sizeof(record));
+
+		bool blank = true;
+		for (uint32_t i = 0; i < sizeof(record) && blank; i++)
+			blank = ((uint8_t*) &record)[i] == 0xFF;
+		if (blank)
+			break;
+
+		meta_slot++;
+		if (IsValid(record))
+			Apply(record);
+		else
+			safe_print("Snapshot log: torn record at %d\n", meta_slot - 1);
+	}
+
+	safe_print("Snapshot log: %d remapped units, snapshot %s\n", live.count, has_snapshot ? "held" : "none");
+	return true;
+}
+
+bool SnapshotDevice::ClearUnit(uint32_t unit) {
+	if (geometry.erase_before_program)
+		return inner.Erase(unit * UNIT_SIZE, UNIT_SIZE);
+
+	// Storage without an erase: blank means 0xFF here too
+	memset(page_buffer, 0xFF, sizeof(page_buffer));
+	for (uint32_t done = 0; done < UNIT_SIZE; done += sizeof(page_buffer)) {
+		if (!inner.Program(unit * UNIT_SIZE + done, page_buffer, sizeof(page_buffer)))
+			return false;
+	}
+
+	return true;
+}
+
+SnapshotDevice::Record SnapshotDevice::MakeRecord(uint8_t type, uint16_t logical, uint16_t physical) {
+	Record record = { RECORD_MAGIC, type, 0, logical, physical };
+
+	uint8_t sum = 0;
+	for (uint32_t i = 0; i < sizeof(record); i++)
+		sum += ((uint8_t*) &record)[i];
+	record.check = 0xFF - sum;
+	return record;
+}
+
+bool SnapshotDevice::IsValid(const Record& record) {
+	uint8_t sum = 0;
+	for (uint32_t i = 0; i < sizeof(record); i++)
+		sum += ((const uint8_t*) &record)[i];
+
+	return record.magic == RECORD_MAGIC && sum == 0xFF
+		&& record.type >= RECORD_HEADER && record.type <= RECORD_DROP;
+}
@@ -0,0 +1,76 @@
+#include "sniff_crc.h"
+#include "pico.h"
+
+// The host simulator has its own, in host/sim.cpp
+#if PICO_ON_DEVICE
+#include "hardware/dma.h"
+
+static int sniff_channel = -1;
+
+// Where sniff_crc sends the data it only wants the checksum of
+static uint32_t sniff_sink;
+
+static uint32_t sniff_run(void* dst, bool write_increment, const void* src, uint32_t count,
+		dma_channel_transfer_size size, uint32_t crc) {
+	if (count == 0)
+		return crc;
+
+	dma_channel_config config = dma_channel_get_default_config(sniff_channel);
+	channel_config_set_transfer_data_size(&config, size);
+	channel_config_set_read_increment(&config, true);
+	channel_config_set_write_increment(&config, write_increment);
+	channel_config_set_sniff_enable(&config, true);
+
+	dma_sniffer_enable(sniff_channel, DMA_SNIFF_CTRL_CALC_VALUE_CRC32R, true);
+	dma_hw->sniff_data = crc;
+
+	dma_channel_configure(sniff_channel, &config, dst, src, count, true);
+	dma_channel_wait_for_finish_blocking(sniff_channel);
+	return dma_hw->sniff_data;
+}
+
+/**
+ * Word transfers for the aligned body, bytes for the ends. CRC32R takes a
+ * word least significant byte first, which is memory order, so the
+ * checksum is the same however a range is split up and whatever its
+ * alignment: a sector programmed in pages and read back in one go agrees
+ * with itself. Copies between differently aligned buffers go by bytes.
+ */
+static uint32_t sniff_transfer(void* dst, bool write_increment, const void* src, uint32_t bytes, uint32_t crc) {
+	if (bytes == 0)
+		return crc;
+
+	if (sniff_channel < 0)
+		sniff_channel = dma_claim_unused_channel(true);
+
+	uint32_t head = (4 - (uintptr_t) src % 4) % 4;
+	if (write_increment && ((uintptr_t) src ^ (uintptr_t) dst) % 4 != 0)
+		head = bytes;
+	head = head < bytes ? head : bytes;
+	uint32_t body = (bytes - head) / 4 * 4;
+	uint32_t tail = bytes - head - body;
+
+	uint8_t* out = (uint8_t*) dst;
+	const uint8_t* in = (const uint8_t*) src;
+	crc = sniff_run(out, write_increment, in, head, DMA_SIZE_8, crc);
+	if (write_increment)
+		out += head;
+	in += head;
+
+	crc = sniff_run(out, write_increment, in, body / 4, DMA_SIZE_32, crc);
+	if (write_increment)
+		out += body;
+	in += body;
+
+	return sniff_run(out, write_increment, in, tail, DMA_SIZE_8, crc);
+}
+
+uint32_t sniff_copy(void* dst, const void* src, uint32_t bytes, uint32_t crc) {
+	return sniff_transfer(dst, true, src, bytes, crc);
+}
+
+uint32_t sniff_crc(const void* src, uint32_t bytes, uint32_t crc) {
+	return sniff_transfer(&sniff_sink, false, src, bytes, crc);
+}
+
+#endif
@@ -0,0 +1,190 @@
+#include "spi_flash.h"
+#include "hardware/gpio.h"
+#include "pico/time.h"
+#include "util.h"
+
+// Standard SPI NOR opcodes
+#define CMD_WRITE_ENABLE    0x06
+#define CMD_READ_STATUS     0x05
+#define CMD_READ_DATA       0x03
+#define CMD_READ_DATA_4B    0x13
+#define CMD_PAGE_PROGRAM    0x02
+#define CMD_PAGE_PROGRAM_4B 0x12
+#define CMD_SECTOR_ERASE    0x20
+#define CMD_SECTOR_ERASE_4B 0x21
+#define CMD_BLOCK_ERASE     0xD8
+#define CMD_BLOCK_ERASE_4B  0xDC
+#define CMD_JEDEC_ID        0x9F
+#define CMD_ENTER_4B        0xB7
+#define CMD_RESET_ENABLE    0x66
+#define CMD_RESET           0x99
+
+#define STATUS_BUSY 0x01
+
+// Worst case from the W25Q01JV datasheet
+#define PROGRAM_TIMEOUT_MS 3
+#define SECTOR_ERASE_TIMEOUT_MS 400
+#define BLOCK_ERASE_TIMEOUT_MS 2000
+
+SpiFlash::SpiFlash(spi_inst_t* spi, Pins pins, uint baudrate)
+	: spi(spi), pins(pins), baudrate(baudrate) {}
+
+bool SpiFlash::Init() {
+	spi_init(spi, baudrate);
+	gpio_set_function(pins.sck, GPIO_FUNC_SPI);
+	gpio_set_function(pins.mosi, GPIO_FUNC_SPI);
+	gpio_set_function(pins.miso, GPIO_FUNC_SPI);
+
+	gpio_init(pins.cs);
+	gpio_set_dir(pins.cs, GPIO_OUT);
+	Deselect();
+
+	// Software reset in case a previous run left it mid-operation or in
+	// 4-byte mode.
+	uint8_t cmd = CMD_RESET_ENABLE;
+	Select();
+	spi_write_blocking(spi, &cmd, 1);
+	Deselect();
+	cmd = CMD_RESET;
+	Select();
+	spi_write_blocking(spi, &cmd, 1);
+	Deselect();
+	sleep_us(50);
+
+	uint8_t id[3];
+	cmd = CMD_JEDEC_ID;
+	Select();
+	spi_write_blocking(spi, &cmd, 1);
+	spi_read_blocking(spi, 0xFF, id, sizeof(id));
+	Deselect();
+
+	// Third byte is log2 of the capacity in bytes
+	if (id[0] == 0x00 || id[0] == 0xFF || id[2] < 16 || id[2] > 27) {
+		safe_print("SPI flash not found (JEDEC %02X %02X %02X)\n", id[0], id[1], id[2]);
+		return false;
+	}
+
+	size = 1u << id[2];
+	safe_print("SPI flash %02X %02X, %d bytes\n", id[0], id[1], size);
+
+	if (size > (1u << 24)) {
+		cmd = CMD_ENTER_4B;
+		Select();
+		spi_write_blocking(spi, &cmd, 1);
+		Deselect();
+		four_byte = true;
+	}
+
+	return true;
+}
+
+bool SpiFlash::Read(uint32_t addr, void* buffer, uint32_t bufsize) {
+	if (addr + bufsize > size || !WaitReady(BLOCK_ERASE_TIMEOUT_MS))
+		return false;
+
+	Select();
+	SendCommand(four_byte ? CMD_READ_DATA_4B : CMD_READ_DATA, addr);
+	spi_read_blocking(spi, 0xFF, (uint8_t*) buffer, bufsize);
+	Deselect();
+	return true;
+}
+
+bool SpiFlash::Program(uint32_t addr, const uint8_t* buffer, uint32_t bufsize) {
+	if (addr + bufsize > size)
+		return false;
+
+	// A page program wraps around inside its page, so never cross one.
+	while (bufsize > 0) {
+		uint32_t chunk = PAGE_SIZE - addr % PAGE_SIZE;
+		if (chunk > bufsize)
+			chunk = bufsize;
+
+		if (!WaitReady(PROGRAM_TIMEOUT_MS))
+			return false;
+
+		WriteEnable();
+		Select();
+		SendCommand(four_byte ? CMD_PAGE_PROGRAM_4B : CMD_PAGE_PROGRAM, addr);
+		spi_write_blocking(spi, buffer, chunk);
+		Deselect();
+
+		addr += chunk;
+		buffer += chunk;
+		bufsize -= chunk;
+	}
+
+	return WaitReady(PROGRAM_TIMEOUT_MS);
+}
+
+bool SpiFlash::Erase(uint32_t addr, uint32_t bytes) {
+	if (addr % SECTOR_SIZE != 0 || bytes % SECTOR_SIZE != 0 || addr + bytes > size)
+		return false;
+
+	while (bytes > 0) {
+		// 64kb block erase is far quicker than 16 sector erases
+		bool block = addr % BLOCK_SIZE == 0 && bytes >= BLOCK_SIZE;
+		uint8_t cmd = block ? (four_byte ? CMD_BLOCK_ERASE_4B : CMD_BLOCK_ERASE)
+			: (four_byte ? CMD_SECTOR_ERASE_4B : CMD_SECTOR_ERASE);
+
+		if (!WaitReady(BLOCK_ERASE_TIMEOUT_MS))
+			return false;
+
+		WriteEnable();
+		Select();
+		SendCommand(cmd, addr);
+		Deselect();
+
+		uint32_t erased = block ? BLOCK_SIZE : SECTOR_SIZE;
+		addr += erased;
+		bytes -= erased;
+	}
+
+	return WaitReady(BLOCK_ERASE_TIMEOUT_MS);
+}
+
+void SpiFlash::Select() {
+	gpio_put(pins.cs, 0);
+}
+
+void SpiFlash::Deselect() {
+	gpio_put(pins.cs, 1);
+}
+
+void SpiFlash::SendCommand(uint8_t cmd, uint32_t addr) {
+	uint8_t frame[5] = { cmd };
+	size_t len = 1;
+
+	if (four_byte)
+		frame[len++] = (uint8_t) (addr >> 24);
+	frame[len++] = (uint8_t) (addr >> 16);
+	frame[len++] = (uint8_t) (addr >> 8);
+	frame[len++] = (uint8_t) addr;
+
+	spi_write_blocking(spi, frame, len);
+}
+
+void SpiFlash::WriteEnable() {
+	uint8_t cmd = CMD_WRITE_ENABLE;
+	Select();
+	spi_write_blocking(spi, &cmd, 1);
+	Deselect();
+}
+
+bool SpiFlash::WaitReady(uint32_t timeout_ms) {
+	uint64_t deadline = time_us_64() + timeout_ms * 1000ull;
+	uint8_t cmd = CMD_READ_STATUS;
+	uint8_t status;
+
+	do {
+		Select();
+		spi_write_blocking(spi, &cmd, 1);
+		spi_read_blocking(spi, 0xFF, &status, 1);
+		Deselect();
+
+		if (!(status & STATUS_BUSY))
+			return true;
+	} while (time_us_64() < deadline);
+
+	safe_print("SPI flash timed out\n");
+	return false;
+}
@@ -0,0 +1,48 @@
+#include "startup.h"
+#include "pico/time.h"
+#include "util.h"
+
+static uint64_t began_us = 0;
+static uint64_t reached_us[STARTUP_PHASES];
+
+void startup_begin()
+{
+	began_us = time_us_64();
+	for (uint64_t& reached : reached_us)
+		reached = 0;
+}
+
+void startup_mark(StartupPhase phase)
+{
+	if (reached_us[phase] != 0)
+		return;
+
+	// 0 means not yet, so a phase reached in the very first microsecond
+	// is taken as the next one
+	uint64_t now = time_us_64();
+	reached_us[phase] = now > 0 ? now : 1;
+}
+
+uint64_t startup_time(StartupPhase phase)
+{
+	return reached_us[phase];
+}
+
+int64_t startup_elapsed_us(StartupPhase phase)
+{
+	if (reached_us[phase] == 0)
+		return -1;
+
+	return (int64_t) (reached_us[phase] - began_us);
+}
+
+void startup_report()
+{
+	int64_t us[STARTUP_PHASES];
+	for (int i = 0; i < STARTUP_PHASES; i++)
+		us[i] = startup_elapsed_us((StartupPhase) i);
+
+	safe_print("Startup (us after main): storage %lld, usb %lld, capacity %lld, mounted %lld, jumper %lld, radio %lld\n",
+			us[STARTUP_STORAGE], us[STARTUP_USB], us[STARTUP_CAPACITY],
+			us[STARTUP_MOUNTED], us[STARTUP_JUMPER], us[STARTUP_RADIO]);
+}
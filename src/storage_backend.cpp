@@ -0,0 +1,67 @@
+#include "storage_backend.h"
+
+#ifndef RAM_DISK_SIZE
+#define RAM_DISK_SIZE (96 * 1024)
+#endif
+
+// spi0 on the pins next to GPIO17, which is taken by the reset jumper
+#ifndef STORAGE_SPI
+#define STORAGE_SPI spi0
+#endif
+#ifndef STORAGE_SPI_SCK_PIN
+#define STORAGE_SPI_SCK_PIN 18
+#endif
+#ifndef STORAGE_SPI_MOSI_PIN
+#define STORAGE_SPI_MOSI_PIN 19
+#endif
+#ifndef STORAGE_SPI_MISO_PIN
+#define STORAGE_SPI_MISO_PIN 16
+#endif
+#ifndef STORAGE_SPI_CS_PIN
+#define STORAGE_SPI_CS_PIN 22
+#endif
+#ifndef STORAGE_SPI_BAUDRATE
+#define STORAGE_SPI_BAUDRATE (24 * 1000 * 1000)
+#endif
+
+#if defined(STORAGE_BACKEND_RAM)
+#include "ram_disk.hpp"
+
+static uint8_t ram_disk_memory[RAM_DISK_SIZE];
+static RamDisk device(ram_disk_memory, sizeof(ram_disk_memory));
+
+#elif defined(STORAGE_BACKEND_SPI_FLASH)
+#include "spi_flash.h"
+
+static SpiFlash device(STORAGE_SPI,
+		{ STORAGE_SPI_SCK_PIN, STORAGE_SPI_MOSI_PIN, STORAGE_SPI_MISO_PIN, STORAGE_SPI_CS_PIN },
+		STORAGE_SPI_BAUDRATE);
+
+#elif defined(STORAGE_BACKEND_SD_CARD)
+#include "sd_card.h"
+
+static SdCard device(STORAGE_SPI,
+		{ STORAGE_SPI_SCK_PIN, STORAGE_SPI_MOSI_PIN, STORAGE_SPI_MISO_PIN, STORAGE_SPI_CS_PIN },
+		STORAGE_SPI_BAUDRATE);
+
+#else
+#include "internal_flash.hpp"
+
+static InternalFlash device;
+
+#endif
+
+static IntegrityDevice integrity(device, INTEGRITY_CHECKS, INTEGRITY_VERIFY_READS);
+static SnapshotDevice snapshots(integrity, SNAPSHOT_SPARE_UNITS);
+
+BlockDevice& storage_backend() {
+	return snapshots;
+}
+
+SnapshotDevice& storage_snapshots() {
+	return snapshots;
+}
+
+IntegrityDevice& storage_integrity() {
+	return integrity;
+}
@@ -1,15 +1,20 @@
 #include "tusb.h"
 #include "class/msc/msc.h"
 #include "device/usbd.h"
+
+#ifndef USB_MTP
+#define USB_MTP 0
+#endif
+
 /* A combination of interfaces must have a unique product id, since PC will save device driver after the first plug.
  * Same VID/PID with different interface e.g MSC (first), then CDC (later) will possibly cause system error on PC.
  *
  * Auto ProductID layout's Bitmap:
- *   [MSB]         HID | MSC | CDC          [LSB]
+ *   [MSB]         MTP | VENDOR | MIDI | HID | MSC | CDC          [LSB]
  */
 #define _PID_MAP(itf, n)  ( (CFG_TUD_##itf) << (n) )
 #define USB_PID           (0x4000 | _PID_MAP(CDC, 0) | _PID_MAP(MSC, 1) | _PID_MAP(HID, 2) | \
-                           _PID_MAP(MIDI, 3) | _PID_MAP(VENDOR, 4) )
+                           _PID_MAP(MIDI, 3) | _PID_MAP(VENDOR, 4) | (USB_MTP << 5) )
 
 #define USB_VID   0xCafe
 #define USB_BCD   0x0200
@@ -55,7 +60,14 @@ uint8_t const * tud_descriptor_device_cb(void)
 
 enum
 {
+#if USB_MTP
+  ITF_NUM_MTP,
+#else
   ITF_NUM_MSC,
+#endif
+#if USB_BULK_INGEST
+  ITF_NUM_VENDOR,
+#endif
   ITF_NUM_TOTAL
 };
 
@@ -63,8 +75,45 @@ enum
 #define EPNUM_MSC_OUT     0x01
 #define EPNUM_MSC_IN      0x81
 
+// MTP, see mtp_usb.h
+#define EPNUM_MTP_OUT     0x03
+#define EPNUM_MTP_IN      0x83
+#define EPNUM_MTP_EVENT   0x84
+
+// Bulk ingest, see bulk_ingest.h
+#define EPNUM_VENDOR_OUT  0x02
+#define EPNUM_VENDOR_IN   0x82
+
+#if USB_MTP
+// Still image class, PTP protocol: interface, bulk OUT, bulk IN and the
+// interrupt endpoint for events. TinyUSB has no macro for it.
+#define MTP_DESC_LEN (9 + 7 + 7 + 7)
+
+#define MTP_DESCRIPTOR(_itfnum, _stridx, _epout, _epin, _epevent, _epsize) \
+  9, TUSB_DESC_INTERFACE, _itfnum, 0, 3, TUSB_CLASS_IMAGE, 1, 1, _stridx, \
+  7, TUSB_DESC_ENDPOINT, _epout, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0, \
+  7, TUSB_DESC_ENDPOINT, _epin, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0, \
+  7, TUSB_DESC_ENDPOINT, _epevent, TUSB_XFER_INTERRUPT, U16_TO_U8S_LE(28), 6
+
+#define STORAGE_DESC_LEN MTP_DESC_LEN
+#define STORAGE_DESCRIPTOR(_epsize) \
+  MTP_DESCRIPTOR(ITF_NUM_MTP, 3, EPNUM_MTP_OUT, EPNUM_MTP_IN, EPNUM_MTP_EVENT, _epsize)
+#else
+#define STORAGE_DESC_LEN TUD_MSC_DESC_LEN
+#define STORAGE_DESCRIPTOR(_epsize) \
+  TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 3, EPNUM_MSC_OUT, EPNUM_MSC_IN, _epsize)
+#endif
 
-#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN  + TUD_MSC_DESC_LEN)
+#if USB_BULK_INGEST
+#define INGEST_DESC_LEN TUD_VENDOR_DESC_LEN
+#define INGEST_DESCRIPTOR(_epsize) \
+  , TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 4, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, _epsize)
+#else
+#define INGEST_DESC_LEN 0
+#define INGEST_DESCRIPTOR(_epsize)
+#endif
+
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN  + STORAGE_DESC_LEN + INGEST_DESC_LEN)
 
 // full speed configuration
 uint8_t const desc_fs_configuration[] =
@@ -72,8 +121,11 @@ uint8_t const desc_fs_configuration[] =
   // Config number, interface count, string index, total length, attribute, power in mA
   TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x00, 100),
 
-  // Interface number, string index, EP Out & EP In address, EP size
-  TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 3 , EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
+  // EP size; the interface number, string index and endpoints are above
+  STORAGE_DESCRIPTOR(64)
+
+  // The same for bulk ingest, if it is built in
+  INGEST_DESCRIPTOR(64)
 };
 
 #if TUD_OPT_HIGH_SPEED
@@ -84,8 +136,10 @@ uint8_t const desc_hs_configuration[] =
 {
   // Config number, interface count, string index, total length, attribute, power in mA
   TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x00, 100),
-  // Interface number, string index, EP Out & EP In address, EP size
-  TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 3, EPNUM_MSC_OUT, EPNUM_MSC_IN, 512),
+  // EP size; the interface number, string index and endpoints are above
+  STORAGE_DESCRIPTOR(512)
+  // The same for bulk ingest, if it is built in
+  INGEST_DESCRIPTOR(512)
 };
 
 // other speed configuration
@@ -162,7 +216,14 @@ char const* string_desc_arr [] =
   (const char[]) { 0x09, 0x04 }, // 0: is supported language is English (0x0409)
   "TinyUSB",                     // 1: Manufacturer
   "TinyUSB Device",              // 2: Product
+#if USB_MTP
+  "MTP",                        // 3: MTP Interface, the name Windows looks for
+#else
   "picowremote",                // 3: MSC Interface
+#endif
+#if USB_BULK_INGEST
+  "picowremote ingest",         // 4: Vendor Interface
+#endif
 };
 
 static uint16_t _desc_str[32];
@@ -1,6 +1,7 @@
 #include "util.h"
 #include "device/usbd.h"
 #include <stdarg.h>
+#include <stdio.h>
 #include "string.h"
 #include "pico/cyw43_arch.h"
 #include "hardware/uart.h"
@@ -12,26 +13,20 @@
  */
 void safe_print(const char* format, ...) {
 #ifdef DEBUG_UART
-    va_list args;
-    va_start(args, format);
+	// Only ever called from the main loop, so one buffer will do
+	static char buffer[SAFE_PRINT_MAX];
 
-    // Calculate the size of the buffer needed
-    int size = vsnprintf(nullptr, 0, format, args);
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
 
-    // Allocate memory for the buffer
-    char* buffer = new char[size + 1];
-
-    // Fill the buffer with the formatted string
-    vsnprintf(buffer, size + 1, format, args);
-
-    va_end(args);
-
-	for (int i = 0;  i < strlen(buffer); i++) {
+	for (int i = 0; buffer[i] != 0; i++) {
 		uart_putc(UART_ID, buffer[i]);
 		sleep_ms(10);
 	}
-
-    delete[] buffer;
+#else
+	(void) format;
 #endif
 }
 
@@ -0,0 +1,296 @@
+#include "volume_check.h"
+#include "fat_standard.hpp"
+#include "pico/time.h"
+#include "util.h"
+#include <string.h>
+#include <algorithm>
+
+#define DIR_ENTRIES_PER_SECTOR (Fat16::DISK_BLOCK_SIZE / sizeof(fat::DirectoryEntry))
+#define DIR_ENTRIES_PER_CLUSTER (Fat16::CLUSTER_BYTES / sizeof(fat::DirectoryEntry))
+#define ROOT_ENTRIES (Fat16::ROOT_DIRECTORY_SIZE / sizeof(fat::DirectoryEntry))
+
+bool VolumeCheck::Step(Fat16& fs, bool allow_repair, uint32_t budget_us) {
+	if (!fs.IsReady())
+		return false;
+
+	if (phase == PHASE_IDLE) {
+		// Unless what was only reported may now be repaired
+		bool unrepaired = !repair && (stats.lost_clusters || stats.cross_links || stats.broken_chains || stats.size_mismatches);
+		if (checked && Fat16::GetGeneration() == checked_generation && !(allow_repair && unrepaired))
+			return false;
+		repair = allow_repair;
+		Begin(fs);
+	}
+	else if (Fat16::GetGeneration() != generation || allow_repair != repair) {
+		stats.restarts++;
+		repair = allow_repair;
+		Begin(fs);
+	}
+
+	uint64_t start = time_us_64();
+	bool ok = true;
+	do {
+		if (phase == PHASE_DIRECTORIES)
+			ok = NextEntry(fs);
+		else if (phase == PHASE_CHAIN)
+			ok = NextLink(fs);
+		else
+			ok = NextFatSector(fs);
+	} while (ok && phase != PHASE_IDLE && time_us_64() - start < budget_us);
+
+	ok = ok && fat.Store(fs);
+
+	if (ok && phase == PHASE_IDLE) {
+		// Fat16 adjusts a known count as the FAT is written, so it is only
+		// handed over once this pass's own changes are in
+		fs.SetFreeClusters((int32_t) free_count);
+
+		found.passes = stats.passes + 1;
+		found.restarts = stats.restarts;
+		found.repaired = stats.repaired;
+		stats = found;
+
+		if (found.lost_clusters || found.cross_links || found.broken_chains || found.size_mismatches) {
+			safe_print("Volume check: %u lost clusters, %u cross-links, %u broken chains, %u size mismatches%s\n",
+					(unsigned) found.lost_clusters, (unsigned) found.cross_links, (unsigned) found.broken_chains,
+					(unsigned) found.size_mismatches, repair ? ", repaired" : "");
+		}
+	}
+
+	if (!ok) {
+		// Try again once the volume has changed
+		safe_print("Volume check could not get through the volume\n");
+		phase = PHASE_IDLE;
+	}
+
+	// What this step wrote itself is not a reason to start over
+	generation = Fat16::GetGeneration();
+	if (phase == PHASE_IDLE) {
+		checked = true;
+		checked_generation = generation;
+	}
+
+	return true;
+}
+
+void VolumeCheck::Begin(Fat16& fs) {
+	phase = PHASE_DIRECTORIES;
+	generation = Fat16::GetGeneration();
+	last = fs.GetLastCluster();
+
+	memset(owned, 0, sizeof(owned));
+	complete = true;
+
+	stack[0] = { 0, 0, 0 };
+	depth = 1;
+	dir_sector_lba = UINT32_MAX;
+
+	fat.Forget();
+	fat_next = Fat16::FIRST_CLUSTER;
+	free_count = 0;
+
+	found = Stats();
+}
+
+bool VolumeCheck::NextEntry(Fat16& fs) {
+	Position& pos = stack[depth - 1];
+	uint32_t lba;
+
+	if (pos.cluster == 0) {
+		if (pos.entry >= ROOT_ENTRIES) {
+			depth--;
+			if (depth == 0)
+				phase = PHASE_FAT;
+			return true;
+		}
+
+		lba = Fat16::INDEX_ROOT_DIRECTORY + pos.entry / DIR_ENTRIES_PER_SECTOR;
+	}
+	else {
+		if (pos.entry >= DIR_ENTRIES_PER_CLUSTER) {
+			uint16_t next;
+			if (!fat.Get(fs, pos.cluster, next))
+				return false;
+
+			// The chain was claimed already, and cut if it had to be
+			if (--pos.remaining == 0 || next < Fat16::FIRST_CLUSTER || next > last) {
+				depth--;
+				return true;
+			}
+
+			pos.cluster = next;
+			pos.entry = 0;
+		}
+
+		lba = Fat16::ClusterToLBA(pos.cluster) + pos.entry / DIR_ENTRIES_PER_SECTOR;
+	}
+
+	if (!LoadDirSector(fs, lba))
+		return false;
+
+	uint32_t index = pos.entry % DIR_ENTRIES_PER_SECTOR;
+	const fat::DirectoryEntry& entry = ((const fat::DirectoryEntry*) dir_sector)[index];
+	pos.entry++;
+
+	// Nothing is in use after the first never-used entry
+	if (entry.name[0] == 0) {
+		depth--;
+		if (depth == 0)
+			phase = PHASE_FAT;
+		return true;
+	}
+
+	// Deleted, "." and "..", labels and long name parts (which have the
+	// label bit set) own no clusters
+	if ((uint8_t) entry.name[0] == 0xE5 || entry.name[0] == '.' ||
+			(entry.attributes & fat::DirectoryEntryBuilder::VOLUME_LABEL))
+		return true;
+
+	chain.entry_lba = lba;
+	chain.entry_index = index;
+	chain.directory = entry.attributes & fat::DirectoryEntryBuilder::DIRECTORY;
+	chain.size = entry.size;
+	chain.first = entry.start_cluster;
+	chain.previous = 0;
+	chain.current = entry.start_cluster;
+	chain.length = 0;
+	phase = PHASE_CHAIN;
+	return true;
+}
+
+bool VolumeCheck::NextLink(Fat16& fs) {
+	uint16_t cluster = chain.current;
+
+	// An empty file or directory
+	if (cluster == 0 && chain.previous == 0)
+		return EndChain(fs);
+
+	if (cluster < Fat16::FIRST_CLUSTER || cluster > last) {
+		found.broken_chains++;
+		return Cut(fs) && EndChain(fs);
+	}
+
+	if (IsOwned(cluster)) {
+		found.cross_links++;
+		return Cut(fs) && EndChain(fs);
+	}
+
+	// Longer than the file: with repair on, cut it where the file ends and
+	// let the FAT pass free the rest
+	if (repair && !chain.directory && chain.length == ClustersFor(chain.size)) {
+		found.size_mismatches++;
+		phase = PHASE_DIRECTORIES;
+		return chain.previous ? Cut(fs) : WriteEntry(fs, 0, chain.size);
+	}
+
+	Claim(cluster);
+	chain.length++;
+
+	uint16_t next;
+	if (!fat.Get(fs, cluster, next))
+		return false;
+
+	if (FatCursor::IsEnd(next))
+		return EndChain(fs);
+
+	chain.previous = cluster;
+	chain.current = next;
+	return true;
+}
+
+bool VolumeCheck::EndChain(Fat16& fs) {
+	phase = PHASE_DIRECTORIES;
+
+	if (chain.directory) {
+		if (chain.length == 0)
+			return true;
+
+		// Clusters further down would look lost
+		if (depth == MAX_DEPTH) {
+			complete = false;
+			return true;
+		}
+
+		stack[depth++] = { chain.first, 0, chain.length };
+		return true;
+	}
+
+	// A file with no clusters has no start cluster either
+	if (chain.length == ClustersFor(chain.size) && (chain.length > 0 || chain.first == 0))
+		return true;
+
+	found.size_mismatches++;
+	if (!repair)
+		return true;
+
+	// Keep whatever the chain holds
+	return WriteEntry(fs, chain.length ? chain.first : 0, chain.length * Fat16::CLUSTER_BYTES);
+}
+
+bool VolumeCheck::Cut(Fat16& fs) {
+	// Before the first cluster, the entry is fixed by EndChain()
+	if (!repair || chain.previous == 0)
+		return true;
+
+	stats.repaired++;
+	return fat.Set(fs, chain.previous, FatCursor::END_OF_CHAIN);
+}
+
+bool VolumeCheck::NextFatSector(Fat16& fs) {
+	uint32_t end = std::min(last, (fat_next / FatCursor::ENTRIES_PER_SECTOR + 1) * FatCursor::ENTRIES_PER_SECTOR - 1);
+
+	for (uint32_t cluster = fat_next; cluster <= end; cluster++) {
+		uint16_t value;
+		if (!fat.Get(fs, cluster, value))
+			return false;
+
+		if (value == FatCursor::FREE) {
+			free_count++;
+			continue;
+		}
+
+		// Bad clusters belong to no chain. Nor may a cluster in a
+		// directory too deep to walk, so nothing counts as lost then.
+		if (IsOwned(cluster) || value == FatCursor::BAD || !complete)
+			continue;
+
+		found.lost_clusters++;
+		if (repair) {
+			if (!fat.Set(fs, cluster, FatCursor::FREE))
+				return false;
+			stats.repaired++;
+			free_count++;
+		}
+	}
+
+	fat_next = end + 1;
+	if (fat_next > last)
+		phase = PHASE_IDLE;
+
+	return true;
+}
+
+bool VolumeCheck::LoadDirSector(Fat16& fs, uint32_t lba) {
+	if (lba == dir_sector_lba)
+		return true;
+
+	dir_sector_lba = lba;
+	if (fs.GetBlock(lba, dir_sector, sizeof(dir_sector)) < 0) {
+		dir_sector_lba = UINT32_MAX;
+		return false;
+	}
+
+	return true;
+}
+
+bool VolumeCheck::WriteEntry(Fat16& fs, uint16_t start_cluster, uint32_t size) {
+	if (!LoadDirSector(fs, chain.entry_lba))
+		return false;
+
+	fat::DirectoryEntry* entry = (fat::DirectoryEntry*) dir_sector + chain.entry_index;
+	entry->start_cluster = start_cluster;
+	entry->size = size;
+
+	stats.repaired++;
+	return fs.WriteBlock(chain.entry_lba, dir_sector, sizeof(dir_sector)) >= 0;
+}
@@ -0,0 +1,62 @@
+#include "wifi_link.h"
+#include "pico/cyw43_arch.h"
+#include "pico/time.h"
+#include "lwip/netif.h"
+#include "lwip/ip4_addr.h"
+#include "util.h"
+
+static bool up = false;
+static uint64_t next_check_us = 0;
+static uint64_t join_started_us = 0;
+
+static bool join()
+{
+	join_started_us = time_us_64();
+	if (cyw43_arch_wifi_connect_async(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK) != 0) {
+		safe_print("Wi-Fi: could not start joining %s\n", WIFI_SSID);
+		return false;
+	}
+
+	return true;
+}
+
+bool wifi_link_begin()
+{
+	cyw43_arch_enable_sta_mode();
+	return join();
+}
+
+bool wifi_link_task()
+{
+	cyw43_arch_poll();
+
+	uint64_t now = time_us_64();
+	if (now < next_check_us)
+		return false;
+	next_check_us = now + WIFI_CHECK_US;
+
+	int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+	if (status == CYW43_LINK_UP) {
+		if (!up)
+			safe_print("Wi-Fi: up as %s\n", ip4addr_ntoa(netif_ip4_addr(&cyw43_state.netif[CYW43_ITF_STA])));
+		up = true;
+		return false;
+	}
+
+	if (up)
+		safe_print("Wi-Fi: link lost (%d)\n", status);
+	up = false;
+
+	// Failed, or stuck partway: start over
+	bool failed = status == CYW43_LINK_FAIL || status == CYW43_LINK_NONET || status == CYW43_LINK_BADAUTH ||
+		status == CYW43_LINK_DOWN;
+	if (failed || now - join_started_us > WIFI_JOIN_TIMEOUT_US)
+		join();
+
+	return false;
+}
+
+bool wifi_link_is_up()
+{
+	return up;
+}
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+Upload files to the Pico over its bulk ingest interface, without going
+through the mass storage drive.
+
+    tools/ingest.py firmware.bin samples.csv
+
+Each file lands in the root directory of the drive under its 8.3 name,
+replacing a file of the same name. The firmware puts it in one run of free
+clusters and writes the FAT and directory once, when the whole file is
+there; see include/bulk_ingest.h for the protocol. The drive may stay
+mounted, the host is told to read it again afterwards.
+
+The interface is only there in a firmware built with -DUSB_BULK_INGEST=ON.
+Needs pyusb (pip install pyusb) and access to the device: a udev rule on
+Linux, or the WinUSB driver bound to the "picowremote ingest" interface on
+Windows (e.g. with Zadig).
+"""
+
+import os
+import struct
+import sys
+import time
+
+import usb.core
+import usb.util
+
+from mkimage import short_name
+
+VID = 0xCAFE
+PID = 0x4012  # MSC + vendor, see _PID_MAP in src/usb_descriptors.cpp
+
+HEADER_MAGIC = 0x4E495750  # "PWIN"
+REPLY_MAGIC = 0x52495750   # "PWIR"
+ATTR_ARCHIVE = 0x20
+
+STATUS = {
+    0: "ok",
+    1: "accepted",
+    2: "bad header",
+    3: "bad name",
+    4: "no run of free clusters large enough",
+    5: "root directory full",
+    6: "clusters taken by the host meanwhile",
+    7: "write failed",
+    8: "volume not ready",
+}
+
+CHUNK = 64 * 1024
+REPLY_TIMEOUT_MS = 30 * 1000  # Covers a FAT scan and erases on the device
+
+
+def fat_timestamp(mtime):
+    t = time.localtime(mtime)
+    date = (max(t.tm_year - 1980, 0) << 9) | (t.tm_mon << 5) | t.tm_mday
+    clock = (t.tm_hour << 11) | (t.tm_min << 5) | (t.tm_sec // 2)
+    return clock, date
+
+
+def open_device():
+    dev = usb.core.find(idVendor=VID, idProduct=PID)
+    if dev is None:
+        sys.exit("No Pico found (%04x:%04x)" % (VID, PID))
+
+    for intf in dev.get_active_configuration():
+        if intf.bInterfaceClass == 0xFF:
+            break
+    else:
+        sys.exit("The firmware has no ingest interface")
+
+    # No kernel driver binds a vendor interface, but a stale one may
+    try:
+        if dev.is_kernel_driver_active(intf.bInterfaceNumber):
+            dev.detach_kernel_driver(intf.bInterfaceNumber)
+    except (NotImplementedError, usb.core.USBError):
+        pass
+    usb.util.claim_interface(dev, intf.bInterfaceNumber)
+
+    out_ep = usb.util.find_descriptor(intf, custom_match=lambda e:
+                                      usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_OUT)
+    in_ep = usb.util.find_descriptor(intf, custom_match=lambda e:
+                                     usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+    return out_ep, in_ep
+
+
+def read_reply(in_ep):
+    data = bytes(in_ep.read(8, timeout=REPLY_TIMEOUT_MS))
+    magic, status, _, cluster = struct.unpack("<IBBH", data)
+    if magic != REPLY_MAGIC:
+        raise IOError("unexpected reply %s" % data.hex())
+    return status, cluster
+
+
+def upload(out_ep, in_ep, path):
+    with open(path, "rb") as f:
+        contents = f.read()
+
+    name = short_name(os.path.basename(path))
+    clock, date = fat_timestamp(os.path.getmtime(path))
+    out_ep.write(struct.pack("<I11sBIHH", HEADER_MAGIC, name, ATTR_ARCHIVE, len(contents), clock, date))
+
+    status, cluster = read_reply(in_ep)
+    if status != 1:
+        raise IOError("%s refused: %s" % (path, STATUS.get(status, status)))
+
+    start = time.monotonic()
+    for offset in range(0, len(contents), CHUNK):
+        out_ep.write(contents[offset:offset + CHUNK], timeout=REPLY_TIMEOUT_MS)
+
+    status, cluster = read_reply(in_ep)
+    elapsed = time.monotonic() - start
+    if status != 0:
+        raise IOError("%s failed: %s" % (path, STATUS.get(status, status)))
+
+    base, ext = name[:8].decode().rstrip(), name[8:].decode().rstrip()
+    rate = len(contents) / elapsed / 1e6 if elapsed > 0 else 0
+    print("%-12s %8d bytes at cluster %5d, %.3f mb/s" % (base + "." + ext if ext else base, len(contents), cluster, rate))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: %s FILE..." % sys.argv[0])
+
+    out_ep, in_ep = open_device()
+    for path in sys.argv[1:]:
+        try:
+            upload(out_ep, in_ep, path)
+        except (IOError, ValueError) as e:
+            sys.exit(str(e))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,270 @@
+#!/usr/bin/env python3
+"""
+Report the storage path's static RAM and the worst-case stack of each MSC
+callback, from a build compiled with -fstack-usage -fcallgraph-info=su.
+
+    tools/memory_report.py --objdump arm-none-eabi-objdump build
+
+The static part totals every buffer placed with STORAGE_ARENA (see
+include/util.h), read from the object files. The stack part walks GCC's
+call graph (.ci files) from each tud_msc_*_cb: a function's worst case is
+its own frame plus that of its deepest callee. Calls through a pointer are
+taken to reach any method of a device below the caller in STORAGE_LAYERS,
+which is what they are on the storage path: each device only calls the one
+it wraps. Anything the bound cannot cover is flagged:
+
+    +  calls a function the build has no frame size for (libc, the SDK
+       when it was built without -fstack-usage)
+    ~  a dynamic frame (alloca, variable length array)
+    @  recursion
+
+With --max-stack BYTES it fails if any callback may use more.
+"""
+
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+
+ARENA_SECTION = ".uninitialized_data.storage"
+ROOT_PATTERN = re.compile(r"^tud_msc_\w+_cb$")
+
+# The BlockDevice stack, outermost first; an indirect call may land in any
+# layer below its caller's. BlockDevice's own methods call the overrides of
+# whichever device they run on, and each other.
+STORAGE_LAYERS = (
+    ("BlockDevice",),
+    ("SnapshotDevice",),
+    ("IntegrityDevice",),
+    ("InternalFlash", "SpiFlash", "SdCard", "RamDisk", "FileBlockDevice"),
+)
+
+# BlockDevice's virtual methods. A device calls these only on the device
+# it wraps, never on its own class.
+INTERFACE = ("Init", "GetGeometry", "Read", "Program", "Erase", "ReadChecked", "ProgramChecked",
+             "Checksum", "Flush", "BeginBatch", "EndBatch", "Modify")
+
+# Complete object constructors and destructors are often emitted as aliases
+# of the base object ones, which hold the frame size
+ALIASES = (("C1E", "C2E"), ("D1E", "D2E"))
+
+NODE = re.compile(r'node: \{ title: "([^"]+)" label: "([^"]*)"')
+EDGE = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+IDENTIFIER = re.compile(r"^[A-Za-z_~][\w:~]*$")
+FRAME = re.compile(r"(\d+) bytes \(([\w,]+)\)")
+
+
+def function_name(label):
+    """ "bool Fat16::Idle()" -> "Fat16::Idle" """
+    return label.split("(")[0].split(" ")[-1]
+
+
+def layer_of(name):
+    owner = name.rpartition("::")[0]
+    for rank, classes in enumerate(STORAGE_LAYERS):
+        if owner in classes:
+            return rank
+    return -1
+
+
+def load_graph(build_dir):
+    names = {}
+    frames = {}
+    dynamic = set()
+    calls = {}
+
+    for path in glob.glob(os.path.join(build_dir, "**", "*.ci"), recursive=True):
+        with open(path) as f:
+            text = f.read()
+
+        for title, label in NODE.findall(text):
+            names.setdefault(title, function_name(label.split("\\n")[0]))
+            match = FRAME.search(label)
+            if match:
+                frames[title] = int(match.group(1))
+                if match.group(2) != "static":
+                    dynamic.add(title)
+
+        for source, target in EDGE.findall(text):
+            calls.setdefault(source, set()).add(target)
+
+    # GCC labels clones (foo.part.0, foo.isra.0) badly; name them after
+    # the function they were split from
+    for title, name in names.items():
+        original = title.rsplit(":", 1)[-1].split(".")[0]
+        if not IDENTIFIER.match(name) and original in names:
+            names[title] = names[original]
+
+    return names, frames, dynamic, calls
+
+
+def worst_case(names, frames, dynamic, calls):
+    """
+    Worst-case stack from each function, as a dict of (bytes, flags, the
+    callee it goes through). A cycle among BlockDevice's own methods only
+    comes from not knowing which one a virtual call picks; no chain holds
+    any of them twice, so the cycle costs all their frames together. Any
+    other cycle is recursion: it counts once, at its largest frame, and
+    flags everything that reaches it.
+    """
+    devices = [(layer_of(names[title]), title) for title in frames]
+    devices = [(rank, title) for rank, title in devices if rank >= 0]
+
+    def resolve(target):
+        for alias, actual in ALIASES:
+            if target not in frames and target.replace(alias, actual, 1) in frames:
+                return target.replace(alias, actual, 1)
+        return target
+
+    def targets(title):
+        rank = layer_of(names[title])
+        found = set(resolve(target) for target in calls.get(title, ()))
+
+        # Speculative devirtualization guesses a virtual call lands in the
+        # caller's own class, but no device wraps one of its own kind
+        if rank >= 1:
+            owner = names[title].rpartition("::")[0]
+            found = set(target for target in found
+                        if names.get(target, "").rpartition("::")[0] != owner
+                        or names[target].rpartition("::")[2] not in INTERFACE)
+
+        if "__indirect_call" in found:
+            found.discard("__indirect_call")
+            found.update(target for layer, target in devices
+                         if layer > rank or (rank == 0 and layer == 0 and target != title))
+        return found
+
+    graph = {title: targets(title) for title in frames}
+
+    # Tarjan's strongly connected components, without recursion. Each
+    # component comes out after every component it calls into.
+    index = {}
+    low = {}
+    stack = []
+    on_stack = set()
+    components = []
+    for start in graph:
+        if start in index:
+            continue
+        work = [(start, iter(graph[start]))]
+        index[start] = low[start] = len(index)
+        stack.append(start)
+        on_stack.add(start)
+        while work:
+            title, pending = work[-1]
+            advanced = False
+            for target in pending:
+                if target not in graph:
+                    continue
+                if target not in index:
+                    index[target] = low[target] = len(index)
+                    stack.append(target)
+                    on_stack.add(target)
+                    work.append((target, iter(graph[target])))
+                    advanced = True
+                    break
+                if target in on_stack:
+                    low[title] = min(low[title], index[target])
+            if advanced:
+                continue
+            work.pop()
+            if work:
+                low[work[-1][0]] = min(low[work[-1][0]], low[title])
+            if low[title] == index[title]:
+                component = []
+                while True:
+                    member = stack.pop()
+                    on_stack.discard(member)
+                    component.append(member)
+                    if member == title:
+                        break
+                components.append(component)
+
+    result = {}
+    for component in components:
+        members = set(component)
+        flags = set()
+        deepest = 0
+        via = None
+        recursive = len(component) > 1 or component[0] in graph[component[0]]
+        base_only = all(layer_of(names[title]) == 0 for title in component)
+        if recursive and not base_only:
+            flags.add("@")
+        for title in component:
+            if title in dynamic:
+                flags.add("~")
+            for target in graph[title]:
+                if target in members:
+                    continue
+                if target not in result:
+                    flags.add("+" if target not in frames else "@")
+                    continue
+                depth, more, _ = result[target]
+                if depth > deepest:
+                    deepest, via = depth, target
+                flags.update(more)
+        if recursive and base_only:
+            depth = sum(frames[title] for title in component) + deepest
+        else:
+            depth = max(frames[title] for title in component) + deepest
+        for title in component:
+            result[title] = (depth, "".join(sorted(flags)), via)
+
+    return result
+
+
+def arena(objdump, build_dir):
+    symbols = []
+    for path in glob.glob(os.path.join(build_dir, "**", "*.o*"), recursive=True):
+        if not path.endswith((".o", ".obj")):
+            continue
+        output = subprocess.run([objdump, "-t", "-C", path], capture_output=True, text=True, check=True).stdout
+        for line in output.splitlines():
+            # address, flags, section, size, name; the section's own symbol
+            # (flag d) is not a buffer
+            if ARENA_SECTION not in line or " d " in line.split(ARENA_SECTION)[0]:
+                continue
+            size, name = line.split(ARENA_SECTION, 1)[1].split(None, 1)
+            symbols.append((int(size, 16), name.strip(), os.path.basename(path)))
+
+    return sorted(symbols, reverse=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("build_dir")
+    parser.add_argument("--objdump", default="objdump")
+    parser.add_argument("--max-stack", type=int, default=0)
+    parser.add_argument("--verbose", action="store_true", help="show the deepest call chain of each callback")
+    args = parser.parse_args()
+
+    symbols = arena(args.objdump, args.build_dir)
+    print("Storage arena (%s):" % ARENA_SECTION)
+    for size, name, obj in symbols:
+        print("  %6d  %s  (%s)" % (size, name, obj))
+    print("  %6d  total" % sum(size for size, _, _ in symbols))
+
+    names, frames, dynamic, calls = load_graph(args.build_dir)
+    worst = worst_case(names, frames, dynamic, calls)
+    roots = sorted((title for title in frames if ROOT_PATTERN.match(names[title])), key=names.get)
+    if not roots:
+        sys.exit("No MSC callbacks in %s; built with -fcallgraph-info=su?" % args.build_dir)
+
+    print("Worst-case stack per MSC callback:")
+    over = False
+    for title in roots:
+        depth, flags, via = worst[title]
+        print("  %6d%-3s %s" % (depth, flags, names[title]))
+        while args.verbose and via is not None:
+            print("          %6d  %s" % (frames[via], names[via]))
+            via = worst[via][2]
+        over = over or (args.max_stack and depth > args.max_stack)
+
+    if over:
+        sys.exit("A callback may use more than %d bytes of stack" % args.max_stack)
+
+
+if __name__ == "__main__":
+    main()
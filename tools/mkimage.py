@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""
+Build the FAT16 image behind the read-only LUN from a directory of files.
+
+    tools/mkimage.py assets build/readonly.img
+
+Files go in the root directory, in name order, each in one contiguous run
+of clusters, with 8.3 names (anything else is refused). The volume is made
+large enough to count as FAT16, but the image stops after the last sector
+in use: the firmware reads everything past the end as zeros, so the empty
+part of the volume costs no flash.
+
+Dates are fixed, so the same assets always give the same image.
+"""
+
+import os
+import struct
+import sys
+
+SECTOR = 512
+ROOT_ENTRIES = 512
+RESERVED_SECTORS = 1
+FAT_COPIES = 2
+MIN_FAT16_CLUSTERS = 4085 + 16  # Some margin over where FAT12 ends
+MAX_FAT16_CLUSTERS = 65524
+LABEL = b"PICOW DOCS "
+
+# 2020-01-01 00:00:00
+FAT_DATE = ((2020 - 1980) << 9) | (1 << 5) | 1
+FAT_TIME = 0
+
+ATTR_READ_ONLY = 0x01
+ATTR_VOLUME_LABEL = 0x08
+ATTR_ARCHIVE = 0x20
+
+
+def short_name(filename):
+    base, dot, ext = filename.upper().rpartition(".")
+    if not dot:
+        base, ext = ext, ""
+
+    allowed = set("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789$%'-_@~`!(){}^#&")
+    if not 0 < len(base) <= 8 or len(ext) > 3 or not set(base + ext) <= allowed:
+        raise ValueError("%s is not an 8.3 name" % filename)
+
+    return base.ljust(8).encode() + ext.ljust(3).encode()
+
+
+def dir_entry(name, attr, cluster, size):
+    return struct.pack("<11sBBBHHHHHHHI", name, attr, 0, 0, FAT_TIME, FAT_DATE, FAT_DATE,
+                       0, FAT_TIME, FAT_DATE, cluster, size)
+
+
+def build(files):
+    cluster_sectors = 1
+    while True:
+        cluster_bytes = cluster_sectors * SECTOR
+        used = sum((len(data) + cluster_bytes - 1) // cluster_bytes for _, data in files)
+        if used + 2 <= MAX_FAT16_CLUSTERS:
+            break
+        cluster_sectors *= 2
+        if cluster_sectors > 64:
+            raise ValueError("assets do not fit a FAT16 volume")
+
+    clusters = max(used, MIN_FAT16_CLUSTERS)
+    fat_sectors = ((clusters + 2) * 2 + SECTOR - 1) // SECTOR
+    root_sectors = ROOT_ENTRIES * 32 // SECTOR
+    data_start = RESERVED_SECTORS + FAT_COPIES * fat_sectors + root_sectors
+    total = data_start + clusters * cluster_sectors
+
+    boot = bytearray(SECTOR)
+    struct.pack_into("<3s8sHBHBHHBHHHII", boot, 0, b"\xEB\x3C\x90", b"MSWIN4.1",
+                     SECTOR, cluster_sectors, RESERVED_SECTORS, FAT_COPIES, ROOT_ENTRIES,
+                     total if total < 0x10000 else 0, 0xF8, fat_sectors, 63, 255, 0,
+                     total if total >= 0x10000 else 0)
+    struct.pack_into("<BBBI11s8s", boot, 36, 0x80, 0, 0x29, 0x50494357, LABEL, b"FAT16   ")
+    boot[510:512] = b"\x55\xAA"
+
+    fat = bytearray(fat_sectors * SECTOR)
+    struct.pack_into("<HH", fat, 0, 0xFFF8, 0xFFFF)
+
+    root = bytearray(root_sectors * SECTOR)
+    root[0:32] = dir_entry(LABEL, ATTR_VOLUME_LABEL | ATTR_ARCHIVE, 0, 0)
+
+    if len(files) + 1 > ROOT_ENTRIES:
+        raise ValueError("more than %d files" % (ROOT_ENTRIES - 1))
+
+    data = bytearray()
+    next_cluster = 2
+    for i, (name, contents) in enumerate(files):
+        count = (len(contents) + cluster_bytes - 1) // cluster_bytes
+        first = next_cluster if count else 0
+        for c in range(next_cluster, next_cluster + count):
+            struct.pack_into("<H", fat, c * 2, c + 1 if c + 1 < next_cluster + count else 0xFFFF)
+        next_cluster += count
+
+        root[(i + 1) * 32:(i + 2) * 32] = dir_entry(name, ATTR_READ_ONLY | ATTR_ARCHIVE, first, len(contents))
+        data += contents + bytes(count * cluster_bytes - len(contents))
+
+    image = boot + fat * FAT_COPIES + root + data
+    return image.rstrip(b"\x00") if data else image
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s ASSET_DIR IMAGE" % sys.argv[0])
+
+    src, out = sys.argv[1], sys.argv[2]
+    files = []
+    for filename in sorted(os.listdir(src)):
+        path = os.path.join(src, filename)
+        if os.path.isfile(path):
+            with open(path, "rb") as f:
+                files.append((short_name(filename), f.read()))
+
+    image = build(files)
+    with open(out, "wb") as f:
+        f.write(image)
+
+
+if __name__ == "__main__":
+    main()